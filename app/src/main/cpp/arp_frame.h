@@ -0,0 +1,91 @@
+#ifndef ARP_FRAME_H
+#define ARP_FRAME_H
+
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+/**
+ * Ethernet + ARP frame laid out byte-for-byte as it goes on the wire.
+ * Every field is a byte array, so the type has no padding or alignment
+ * requirements and templates can be built at compile time.
+ */
+struct ArpFrame {
+    uint8_t eth_dst[6];
+    uint8_t eth_src[6];
+    uint8_t eth_type[2];
+    uint8_t htype[2];
+    uint8_t ptype[2];
+    uint8_t hlen;
+    uint8_t plen;
+    uint8_t oper[2];
+    uint8_t sha[6];
+    uint8_t spa[4];
+    uint8_t tha[6];
+    uint8_t tpa[4];
+};
+
+static_assert(sizeof(ArpFrame) == 42, "ArpFrame must match the 42-byte wire layout");
+
+/**
+ * Build a frame with the constant header fields filled in and the
+ * addresses left for the caller to patch
+ * @param oper ARP opcode (1=request, 2=reply)
+ */
+constexpr ArpFrame arp_frame_template(uint16_t oper) {
+    return ArpFrame{
+        {0xff, 0xff, 0xff, 0xff, 0xff, 0xff},   // Broadcast unless patched
+        {0, 0, 0, 0, 0, 0},
+        {0x08, 0x06},                           // ETH_P_ARP
+        {0x00, 0x01},                           // ARPHRD_ETHER
+        {0x08, 0x00},                           // ETH_P_IP
+        6,
+        4,
+        {(uint8_t)(oper >> 8), (uint8_t)(oper & 0xff)},
+        {0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0},
+    };
+}
+
+static constexpr ArpFrame kArpRequestTemplate = arp_frame_template(1);
+static constexpr ArpFrame kArpReplyTemplate = arp_frame_template(2);
+
+/**
+ * Patch the variable fields of a frame copied from a template
+ * @param src_mac Ethernet source and ARP sender hardware address
+ * @param src_ip ARP sender protocol address, network byte order
+ * @param tgt_mac Ethernet destination and ARP target hardware address
+ * @param tgt_ip ARP target protocol address, network byte order
+ */
+inline void arp_frame_patch(ArpFrame *frame,
+                            const uint8_t *src_mac, uint32_t src_ip,
+                            const uint8_t *tgt_mac, uint32_t tgt_ip) {
+    memcpy(frame->eth_dst, tgt_mac, 6);
+    memcpy(frame->eth_src, src_mac, 6);
+    memcpy(frame->sha, src_mac, 6);
+    memcpy(frame->spa, &src_ip, 4);
+    memcpy(frame->tha, tgt_mac, 6);
+    memcpy(frame->tpa, &tgt_ip, 4);
+}
+
+// Largest batch handed to a single sendmmsg
+static const int kArpBatchMax = 64;
+
+/**
+ * A set of prepared frames sent together with one sendmmsg call.
+ * The message headers point into the batch itself, so it must not be
+ * copied or moved after arp_batch_init.
+ */
+struct ArpSendBatch {
+    int count;
+    int ifindex;
+    ArpFrame frames[kArpBatchMax];
+    struct sockaddr_ll addrs[kArpBatchMax];
+    struct iovec iovs[kArpBatchMax];
+    struct mmsghdr msgs[kArpBatchMax];
+};
+
+#endif // ARP_FRAME_H
@@ -0,0 +1,430 @@
+#include "arp_monitor.h"
+#include "reactor.h"
+#include "packet_io.h"
+#include "harpy_log.h"
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include <netinet/if_ether.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#define LOG_TAG "ARPMonitor"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGI(...) HARPY_LOG(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+// ARP packet structure as captured from the wire
+struct arp_packet {
+    struct ethhdr eth;
+    struct ether_arp arp;
+} __attribute__((packed));
+
+// Per-IP state table: fixed size, so memory stays bounded however long we run
+static const uint32_t kTableSize = 1024;          // Must be a power of two
+static const uint32_t kMaxProbe = 16;             // Slots scanned before evicting
+// Recent requests for IPs that have not replied yet, kept apart so a sweep
+// cannot push real hosts out of the table
+static const uint32_t kSolicitTableSize = 2048;   // Must be a power of two
+
+// Detection thresholds
+static const int64_t kConflictWindowMs = 5000;    // Two MACs active within this = conflict
+static const int64_t kFlapWindowMs = 60000;       // Gateway returning to old MAC within this = flip
+static const uint32_t kFlapThreshold = 2;         // Flips before reporting GATEWAY_FLAP
+static const int64_t kSolicitWindowMs = 3000;     // Reply counts as solicited if asked within this
+static const int64_t kFloodWindowMs = 10000;
+static const uint32_t kFloodThreshold = 30;       // Unsolicited replies per window
+static const int64_t kEventHoldoffMs = 5000;      // Minimum gap between events for one IP
+
+// Frames are truncated to the ARP payload in the kernel
+static const unsigned kSnapLen = sizeof(struct arp_packet);
+
+struct arp_host_entry {
+    uint32_t ip;                    // 0 marks an empty slot
+    uint8_t mac[ETH_ALEN];
+    uint8_t prev_mac[ETH_ALEN];
+    int64_t last_seen_ms;           // Last time any MAC claimed this IP
+    int64_t mac_since_ms;           // When the current MAC took over
+    int64_t last_request_ms;        // Last time someone asked who has this IP
+    int64_t last_event_ms;
+    uint32_t flips;
+};
+
+struct arp_solicitation {
+    uint32_t ip;                    // 0 marks an empty slot
+    int64_t asked_ms;
+};
+
+// Global variables for the monitor
+static arp_host_entry g_hosts[kTableSize];
+static arp_solicitation g_solicitations[kSolicitTableSize];
+static uint32_t g_gateway_ip = 0;
+static ArpMonitorCallback g_callback = nullptr;
+static std::atomic<bool> g_monitor_active(false);
+static std::thread *g_monitor_thread = nullptr;    // Runs g_monitor_reactor unless the host's is used
+static Reactor *g_monitor_reactor = nullptr;
+static Reactor *g_host_reactor = nullptr;
+static PacketIo *g_monitor_io = nullptr;            // TPACKET_V3 ring where the kernel has one
+
+// Unsolicited reply accounting, global across all senders
+static int64_t g_flood_window_start_ms = 0;
+static uint32_t g_flood_count = 0;
+static bool g_flood_reported = false;
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint32_t host_slot(uint32_t ip) {
+    return (ip * 2654435761u) & (kTableSize - 1);
+}
+
+// The entry for ip, or nullptr if it has never sent a mapping
+static arp_host_entry *find_host(uint32_t ip) {
+    uint32_t slot = host_slot(ip);
+    for (uint32_t i = 0; i < kMaxProbe; i++) {
+        arp_host_entry *entry = &g_hosts[(slot + i) & (kTableSize - 1)];
+        if (entry->ip == ip) return entry;
+        if (entry->ip == 0) return nullptr;
+    }
+    return nullptr;
+}
+
+// Find the entry for ip, or claim an empty or least recently seen slot for it
+static arp_host_entry *lookup_host(uint32_t ip, bool *created) {
+    uint32_t slot = host_slot(ip);
+    arp_host_entry *oldest = nullptr;
+    for (uint32_t i = 0; i < kMaxProbe; i++) {
+        arp_host_entry *entry = &g_hosts[(slot + i) & (kTableSize - 1)];
+        if (entry->ip == ip) {
+            *created = false;
+            return entry;
+        }
+        if (entry->ip == 0) {
+            oldest = entry;
+            break;
+        }
+        if (!oldest || entry->last_seen_ms < oldest->last_seen_ms) {
+            oldest = entry;
+        }
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->ip = ip;
+    *created = true;
+    return oldest;
+}
+
+// Remember that someone asked for an IP we hold no entry for, replacing
+// the oldest request nearby when the table is full
+static void note_solicitation(uint32_t ip, int64_t now) {
+    uint32_t slot = host_slot(ip) & (kSolicitTableSize - 1);
+    arp_solicitation *oldest = nullptr;
+    for (uint32_t i = 0; i < kMaxProbe; i++) {
+        arp_solicitation *entry = &g_solicitations[(slot + i) & (kSolicitTableSize - 1)];
+        if (entry->ip == ip || entry->ip == 0) {
+            oldest = entry;
+            break;
+        }
+        if (!oldest || entry->asked_ms < oldest->asked_ms) oldest = entry;
+    }
+    oldest->ip = ip;
+    oldest->asked_ms = now;
+}
+
+// When ip was last asked for while it had no entry, or 0; the request is
+// moved into its new host entry
+static int64_t take_solicitation(uint32_t ip) {
+    uint32_t slot = host_slot(ip) & (kSolicitTableSize - 1);
+    for (uint32_t i = 0; i < kMaxProbe; i++) {
+        arp_solicitation *entry = &g_solicitations[(slot + i) & (kSolicitTableSize - 1)];
+        if (entry->ip == ip) {
+            int64_t asked_ms = entry->asked_ms;
+            // Keep the probe chain intact for entries further along
+            entry->asked_ms = 0;
+            return asked_ms;
+        }
+        if (entry->ip == 0) return 0;
+    }
+    return 0;
+}
+
+static void emit_event(ArpEventType type, uint32_t ip, const uint8_t *mac,
+                       const uint8_t *prev_mac, uint32_t count, int64_t now) {
+    ArpMonitorEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.ip = ip;
+    if (mac) memcpy(event.mac, mac, ETH_ALEN);
+    if (prev_mac) memcpy(event.prev_mac, prev_mac, ETH_ALEN);
+    event.count = count;
+    event.timestamp_ms = now;
+
+    HARPY_EVENT_STR(ANDROID_LOG_INFO, 100, "ARP event %s for %I (count=%u)", arp_monitor_event_name(type), ip, count);
+
+    if (g_callback) g_callback(event);
+}
+
+static void note_unsolicited_reply(const uint8_t *mac, uint32_t ip, int64_t now) {
+    if (now - g_flood_window_start_ms > kFloodWindowMs) {
+        g_flood_window_start_ms = now;
+        g_flood_count = 0;
+        g_flood_reported = false;
+    }
+    if (++g_flood_count >= kFloodThreshold && !g_flood_reported) {
+        g_flood_reported = true;
+        emit_event(ArpEventType::REPLY_FLOOD, ip, mac, nullptr, g_flood_count, now);
+    }
+}
+
+static void process_frame(const uint8_t *frame, uint32_t len, int64_t now) {
+    if (len < sizeof(struct arp_packet)) return;
+    const struct arp_packet *pkt = (const struct arp_packet *)frame;
+
+    uint16_t op = ntohs(pkt->arp.ea_hdr.ar_op);
+    uint32_t sender_ip, target_ip;
+    memcpy(&sender_ip, pkt->arp.arp_spa, 4);
+    memcpy(&target_ip, pkt->arp.arp_tpa, 4);
+    const uint8_t *sender_mac = pkt->arp.arp_sha;
+
+    if (op == ARPOP_REQUEST && target_ip != 0 && target_ip != sender_ip) {
+        arp_host_entry *asked = find_host(target_ip);
+        if (asked) {
+            asked->last_request_ms = now;
+        } else {
+            note_solicitation(target_ip, now);
+        }
+    }
+
+    // ARP probes (sender 0.0.0.0) carry no mapping
+    if (sender_ip == 0 || sender_ip == 0xFFFFFFFF) return;
+
+    bool created;
+    arp_host_entry *host = lookup_host(sender_ip, &created);
+    if (created) host->last_request_ms = take_solicitation(sender_ip);
+
+    if (op == ARPOP_REPLY &&
+        (sender_ip == target_ip || now - host->last_request_ms > kSolicitWindowMs)) {
+        note_unsolicited_reply(sender_mac, sender_ip, now);
+    }
+
+    bool is_gateway = g_gateway_ip != 0 && sender_ip == g_gateway_ip;
+
+    if (created || host->mac_since_ms == 0) {
+        memcpy(host->mac, sender_mac, ETH_ALEN);
+        host->mac_since_ms = now;
+        host->last_seen_ms = now;
+        emit_event(ArpEventType::NEW_HOST, sender_ip, sender_mac, nullptr, 0, now);
+        return;
+    }
+
+    if (memcmp(host->mac, sender_mac, ETH_ALEN) != 0) {
+        bool returning = memcmp(host->prev_mac, sender_mac, ETH_ALEN) == 0 &&
+                         now - host->mac_since_ms < kFlapWindowMs;
+        bool concurrent = now - host->last_seen_ms < kConflictWindowMs;
+        host->flips = returning ? host->flips + 1 : 0;
+
+        ArpEventType type;
+        if (is_gateway) {
+            type = host->flips >= kFlapThreshold ? ArpEventType::GATEWAY_FLAP
+                                                 : ArpEventType::GATEWAY_CHANGED;
+        } else {
+            type = concurrent || returning ? ArpEventType::IP_CONFLICT
+                                           : ArpEventType::MAC_CHANGED;
+        }
+
+        uint8_t old_mac[ETH_ALEN];
+        memcpy(old_mac, host->mac, ETH_ALEN);
+        memcpy(host->prev_mac, host->mac, ETH_ALEN);
+        memcpy(host->mac, sender_mac, ETH_ALEN);
+        host->mac_since_ms = now;
+
+        // Hold off repeats while two stations keep fighting over one IP, but
+        // always report the first change of a quiet mapping
+        if (!concurrent || now - host->last_event_ms >= kEventHoldoffMs) {
+            host->last_event_ms = now;
+            emit_event(type, sender_ip, sender_mac, old_mac, host->flips, now);
+        }
+    } else if (now - host->mac_since_ms > kFlapWindowMs) {
+        host->flips = 0;
+    }
+
+    host->last_seen_ms = now;
+}
+
+// Accept only Ethernet/IPv4 ARP requests and replies, truncated to the ARP
+// payload, so everything else is dropped in the kernel without waking us.
+static struct sock_filter g_arp_filter_code[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                    // ethertype
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 0, 10),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 14),                    // hardware type
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPHRD_ETHER, 0, 8),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 16),                    // protocol type
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 6),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 18),                    // hlen, plen
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (ETH_ALEN << 8) | 4, 0, 4),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                    // opcode
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REQUEST, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, kSnapLen),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+static const struct sock_fprog kArpFilter = {
+    sizeof(g_arp_filter_code) / sizeof(g_arp_filter_code[0]), g_arp_filter_code
+};
+
+// Stop monitoring after a socket error; the socket stays open until arp_monitor_stop
+static void fail_monitor(void * /*ctx*/) {
+    g_monitor_active = false;
+    if (g_monitor_reactor != g_host_reactor) {
+        reactor_stop(g_monitor_reactor);
+    }
+}
+
+static void on_arp_frames(void * /*ctx*/, PacketIo * /*io*/, const Packet *batch, int count) {
+    int64_t now = monotonic_ms();
+    for (int i = 0; i < count; i++) {
+        process_frame(batch[i].data, (uint32_t)batch[i].len, now);
+    }
+}
+
+// Run on the monitor's reactor thread
+static void attach_monitor(void *ctx) {
+    bool *attached = (bool *)ctx;
+    *attached = packet_io_start(g_monitor_io, g_monitor_reactor, on_arp_frames, nullptr);
+}
+
+static void detach_monitor(void *ctx) {
+    (void)ctx;
+    packet_io_stop(g_monitor_io);
+}
+
+static void release_monitor_resources() {
+    if (g_monitor_reactor) {
+        if (g_monitor_reactor != g_host_reactor) {
+            reactor_stop(g_monitor_reactor);
+            if (g_monitor_thread) {
+                g_monitor_thread->join();
+                delete g_monitor_thread;
+                g_monitor_thread = nullptr;
+            }
+        }
+        reactor_call(g_monitor_reactor, detach_monitor, nullptr);
+        if (g_monitor_reactor != g_host_reactor) {
+            reactor_destroy(g_monitor_reactor);
+        }
+        g_monitor_reactor = nullptr;
+    }
+    packet_io_close(g_monitor_io);
+    g_monitor_io = nullptr;
+}
+
+// Main monitor thread function
+void arp_monitor_thread_func(Reactor *reactor) {
+    LOGD("ARP monitor thread started (%s)", packet_io_kind_name(packet_io_kind(g_monitor_io)));
+    reactor_run(reactor);
+    LOGD("ARP monitor thread stopped");
+}
+
+bool arp_monitor_init() {
+    LOGD("Initializing ARP monitor operations");
+    return true;
+}
+
+bool arp_monitor_start(const char *interface, const char *gateway_ip,
+                       ArpMonitorCallback callback) {
+    LOGD("Starting ARP monitor on interface: %s", interface);
+
+    if (g_monitor_active.load()) {
+        LOGE("ARP monitor is already active");
+        return false;
+    }
+    if (g_monitor_reactor) {
+        arp_monitor_stop(); // Reap a monitor that stopped on a socket error
+    }
+
+    g_gateway_ip = 0;
+    if (gateway_ip) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, gateway_ip, &addr) == 1) {
+            g_gateway_ip = addr.s_addr;
+        }
+    }
+    g_callback = callback;
+    memset(g_hosts, 0, sizeof(g_hosts));
+    memset(g_solicitations, 0, sizeof(g_solicitations));
+    g_flood_window_start_ms = 0;
+    g_flood_count = 0;
+    g_flood_reported = false;
+
+    g_monitor_io = packet_io_open_tpacket_ring(interface, ETH_P_ARP, kSnapLen, &kArpFilter);
+    if (!g_monitor_io) {
+        LOGD("TPACKET_V3 ring unavailable, falling back to recvmmsg");
+        g_monitor_io = packet_io_open_af_packet(interface, ETH_P_ARP, kSnapLen, &kArpFilter);
+        if (!g_monitor_io) return false;
+    }
+    packet_io_set_end_handler(g_monitor_io, fail_monitor, nullptr);
+
+    g_monitor_reactor = g_host_reactor ? g_host_reactor : reactor_create();
+    bool attached = false;
+    if (g_monitor_reactor) {
+        reactor_call(g_monitor_reactor, attach_monitor, &attached);
+    }
+    if (!attached) {
+        release_monitor_resources();
+        return false;
+    }
+
+    try {
+        g_monitor_active = true;
+        if (g_monitor_reactor != g_host_reactor) {
+            g_monitor_thread = new std::thread(arp_monitor_thread_func, g_monitor_reactor);
+        }
+        LOGD("ARP monitor started successfully");
+        return true;
+    } catch (const std::exception &e) {
+        LOGE("Failed to start ARP monitor thread: %s", e.what());
+        g_monitor_active = false;
+        release_monitor_resources();
+        return false;
+    }
+}
+
+void arp_monitor_stop() {
+    LOGD("Stopping ARP monitor");
+
+    // Wakes our reactor at once, or unhooks the socket from the host's
+    release_monitor_resources();
+    g_monitor_active = false;
+    LOGD("ARP monitor stopped");
+}
+
+void arp_monitor_set_reactor(Reactor *reactor) {
+    g_host_reactor = reactor;
+}
+
+bool arp_monitor_is_active() {
+    return g_monitor_active.load();
+}
+
+const char *arp_monitor_event_name(ArpEventType type) {
+    switch (type) {
+        case ArpEventType::NEW_HOST: return "NEW_HOST";
+        case ArpEventType::MAC_CHANGED: return "MAC_CHANGED";
+        case ArpEventType::IP_CONFLICT: return "IP_CONFLICT";
+        case ArpEventType::GATEWAY_CHANGED: return "GATEWAY_CHANGED";
+        case ArpEventType::GATEWAY_FLAP: return "GATEWAY_FLAP";
+        case ArpEventType::REPLY_FLOOD: return "REPLY_FLOOD";
+    }
+    return "UNKNOWN";
+}
+
+void arp_monitor_cleanup() {
+    LOGD("Cleaning up ARP monitor operations");
+    arp_monitor_stop();
+    g_callback = nullptr;
+}
@@ -0,0 +1,79 @@
+#ifndef ARP_MONITOR_H
+#define ARP_MONITOR_H
+
+#include <cstdint>
+
+/**
+ * Kinds of anomaly reported by the passive ARP monitor
+ */
+enum class ArpEventType {
+    NEW_HOST,         // First time this IP has been seen
+    MAC_CHANGED,      // IP moved to a new MAC after a quiet period
+    IP_CONFLICT,      // Two MACs claimed the same IP within the conflict window
+    GATEWAY_CHANGED,  // Gateway IP moved to a new MAC
+    GATEWAY_FLAP,     // Gateway IP keeps alternating between MACs
+    REPLY_FLOOD       // Too many unsolicited replies within the flood window
+};
+
+/**
+ * A single event emitted by the monitor
+ */
+struct ArpMonitorEvent {
+    ArpEventType type;
+    uint32_t ip;            // Sender protocol address, network byte order
+    uint8_t mac[6];         // MAC currently claiming the IP
+    uint8_t prev_mac[6];    // MAC that held the IP before (zero if none)
+    uint32_t count;         // Flip count or unsolicited replies in window
+    int64_t timestamp_ms;   // CLOCK_MONOTONIC milliseconds
+};
+
+struct Reactor;
+
+/**
+ * Callback invoked on the monitor thread for every event
+ */
+typedef void (*ArpMonitorCallback)(const ArpMonitorEvent &event);
+
+/**
+ * Initialize ARP monitor operations
+ */
+bool arp_monitor_init();
+
+/**
+ * Start passively monitoring ARP traffic on an interface
+ * @param interface The network interface to listen on (e.g., "wlan0")
+ * @param gateway_ip Gateway IP to watch for flapping, or nullptr
+ * @param callback Receives anomaly events on the monitor thread
+ * @return true if the capture socket was set up and the thread started
+ */
+bool arp_monitor_start(const char *interface, const char *gateway_ip,
+                       ArpMonitorCallback callback);
+
+/**
+ * Stop the monitor and join its thread, if it has one
+ */
+void arp_monitor_stop();
+
+/**
+ * Monitor from reactor, run by the caller, instead of a thread of our own
+ * (nullptr for the thread). Events are then delivered on the reactor's
+ * thread. Takes effect on the next start.
+ */
+void arp_monitor_set_reactor(Reactor *reactor);
+
+/**
+ * Check if the monitor is currently running
+ */
+bool arp_monitor_is_active();
+
+/**
+ * Name of an event type, as printed by the root helper
+ */
+const char *arp_monitor_event_name(ArpEventType type);
+
+/**
+ * Cleanup ARP monitor operations
+ */
+void arp_monitor_cleanup();
+
+#endif // ARP_MONITOR_H
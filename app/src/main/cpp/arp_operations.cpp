@@ -1,5 +1,8 @@
 #include "arp_operations.h"
-#include <android/log.h>
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
+#include "packet_capture.h"
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
@@ -13,8 +16,8 @@
 #include <chrono>
 
 #define LOG_TAG "ARPOperations"
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
 struct arp_packet {
     struct ethhdr eth;
@@ -46,6 +49,7 @@ bool arp_spoof(const char *target_ip, const char *target_mac,
 
 std::string arp_get_mac(const char *ip, const char *interface) {
     LOGD("Robust MAC lookup (Manual Raw) for %s on %s", ip, interface);
+    HarpyTraceScope trace("arp", "resolve");
     
     int sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
     if (sock < 0) {
@@ -74,24 +78,17 @@ std::string arp_get_mac(const char *ip, const char *interface) {
         return "";
     }
     struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
-    char our_ip[16];
-    strcpy(our_ip, inet_ntoa(sin->sin_addr));
 
     // Build ARP request
-    struct arp_packet pkt;
-    memset(&pkt, 0, sizeof(pkt));
-    memset(pkt.eth.h_dest, 0xff, ETH_ALEN);
-    memcpy(pkt.eth.h_source, our_mac, ETH_ALEN);
-    pkt.eth.h_proto = htons(ETH_P_ARP);
-    
-    pkt.arp.ea_hdr.ar_hrd = htons(ARPHRD_ETHER);
-    pkt.arp.ea_hdr.ar_pro = htons(ETH_P_IP);
-    pkt.arp.ea_hdr.ar_hln = ETH_ALEN;
-    pkt.arp.ea_hdr.ar_pln = 4;
-    pkt.arp.ea_hdr.ar_op = htons(ARPOP_REQUEST);
-    memcpy(pkt.arp.arp_sha, our_mac, ETH_ALEN);
-    inet_aton(our_ip, (struct in_addr *)pkt.arp.arp_spa);
-    inet_aton(ip, (struct in_addr *)pkt.arp.arp_tpa);
+    ArpFrame pkt = kArpRequestTemplate;
+    static const uint8_t kZeroMac[ETH_ALEN] = {0};
+    struct in_addr target_addr;
+    if (inet_aton(ip, &target_addr) == 0) {
+        close(sock);
+        return "";
+    }
+    arp_frame_patch(&pkt, our_mac, sin->sin_addr.s_addr, kZeroMac, target_addr.s_addr);
+    memset(pkt.eth_dst, 0xff, ETH_ALEN);
 
     struct sockaddr_ll dest_addr;
     memset(&dest_addr, 0, sizeof(dest_addr));
@@ -101,6 +98,7 @@ std::string arp_get_mac(const char *ip, const char *interface) {
     memset(dest_addr.sll_addr, 0xff, ETH_ALEN);
 
     // Send request
+    packet_capture_frame(CaptureDirection::SENT, (const uint8_t *)&pkt, sizeof(pkt));
     if (sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
         LOGE("Failed to send ARP request: %s", strerror(errno));
         close(sock);
@@ -113,6 +111,7 @@ std::string arp_get_mac(const char *ip, const char *interface) {
     while (true) {
         ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0, NULL, NULL);
         if (n < 0) break; // Timeout or error
+        packet_capture_frame(CaptureDirection::RECEIVED, buffer, (size_t)n);
 
         if (n < (ssize_t)sizeof(struct arp_packet)) continue;
         struct arp_packet *reply = (struct arp_packet *)buffer;
@@ -128,6 +127,7 @@ std::string arp_get_mac(const char *ip, const char *interface) {
                 snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
                          reply->arp.arp_sha[0], reply->arp.arp_sha[1], reply->arp.arp_sha[2],
                          reply->arp.arp_sha[3], reply->arp.arp_sha[4], reply->arp.arp_sha[5]);
+                trace.set_arg("resolved", 1);
                 close(sock);
                 return std::string(mac);
             }
@@ -141,7 +141,7 @@ std::string arp_get_mac(const char *ip, const char *interface) {
     return "";
 }
 
-static bool parse_mac(const char *mac_str, unsigned char *mac_bin) {
+bool arp_parse_mac(const char *mac_str, unsigned char *mac_bin) {
     if (sscanf(mac_str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
                &mac_bin[0], &mac_bin[1], &mac_bin[2],
                &mac_bin[3], &mac_bin[4], &mac_bin[5]) == 6) {
@@ -150,66 +150,119 @@ static bool parse_mac(const char *mac_str, unsigned char *mac_bin) {
     return false;
 }
 
-bool arp_send_packet(const char *interface,
-                     const char *src_ip, const char *src_mac,
-                     const char *tgt_ip, const char *tgt_mac,
-                     bool is_request) {
-    LOGD("Sending manual raw ARP packet on %s: %s -> %s (request=%d)", 
-         interface, src_ip, tgt_ip, is_request);
-    
+int arp_open_socket(const char *interface, int *ifindex) {
     int sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
-    if (sock < 0) return false;
+    if (sock < 0) {
+        LOGE("Failed to create ARP send socket: %s (errno=%d)", strerror(errno), errno);
+        return -1;
+    }
 
-    // Get interface info
     struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
     strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
     if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+        LOGE("Failed to get index of %s: %s", interface, strerror(errno));
         close(sock);
-        return false;
+        return -1;
+    }
+    *ifindex = ifr.ifr_ifindex;
+    return sock;
+}
+
+void arp_batch_init(ArpSendBatch *batch, int ifindex) {
+    batch->count = 0;
+    batch->ifindex = ifindex;
+}
+
+bool arp_batch_add_reply(ArpSendBatch *batch,
+                         const unsigned char *src_mac, uint32_t src_ip,
+                         const unsigned char *tgt_mac, uint32_t tgt_ip) {
+    if (batch->count >= kArpBatchMax) return false;
+    int i = batch->count++;
+
+    batch->frames[i] = kArpReplyTemplate;
+    arp_frame_patch(&batch->frames[i], src_mac, src_ip, tgt_mac, tgt_ip);
+
+    struct sockaddr_ll *addr = &batch->addrs[i];
+    memset(addr, 0, sizeof(*addr));
+    addr->sll_family = AF_PACKET;
+    addr->sll_ifindex = batch->ifindex;
+    addr->sll_halen = ETH_ALEN;
+    memcpy(addr->sll_addr, tgt_mac, ETH_ALEN);
+
+    batch->iovs[i].iov_base = &batch->frames[i];
+    batch->iovs[i].iov_len = sizeof(ArpFrame);
+
+    struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = addr;
+    hdr->msg_namelen = sizeof(*addr);
+    hdr->msg_iov = &batch->iovs[i];
+    hdr->msg_iovlen = 1;
+    return true;
+}
+
+int arp_batch_send(int sock, ArpSendBatch *batch) {
+    packet_capture_messages(CaptureDirection::SENT, batch->msgs, batch->count, nullptr);
+    int sent = 0;
+    while (sent < batch->count) {
+        int n = sendmmsg(sock, &batch->msgs[sent], batch->count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "sendmmsg failed after %d/%d frames: %s", strerror(errno),
+                            sent, batch->count);
+            return sent > 0 ? sent : -1;
+        }
+        sent += n;
     }
-    int ifindex = ifr.ifr_ifindex;
+    return sent;
+}
+
+bool arp_send_packet(const char *interface,
+                     const char *src_ip, const char *src_mac,
+                     const char *tgt_ip, const char *tgt_mac,
+                     bool is_request) {
+    int ifindex;
+    int sock = arp_open_socket(interface, &ifindex);
+    if (sock < 0) return false;
 
     unsigned char src_mac_bin[ETH_ALEN];
     unsigned char tgt_mac_bin[ETH_ALEN];
-    if (!parse_mac(src_mac, src_mac_bin)) { close(sock); return false; }
-    if (!parse_mac(tgt_mac, tgt_mac_bin)) { 
+    if (!arp_parse_mac(src_mac, src_mac_bin)) { close(sock); return false; }
+    if (!arp_parse_mac(tgt_mac, tgt_mac_bin)) { 
         if (is_request) memset(tgt_mac_bin, 0, ETH_ALEN); // Broadcast request
         else { close(sock); return false; }
     }
 
-    struct arp_packet pkt;
-    memset(&pkt, 0, sizeof(pkt));
-    
-    // Ethernet Header
-    if (is_request && strcmp(tgt_mac, "ff:ff:ff:ff:ff:ff") == 0) {
-        memset(pkt.eth.h_dest, 0xff, ETH_ALEN);
-    } else {
-        memcpy(pkt.eth.h_dest, tgt_mac_bin, ETH_ALEN);
+    struct in_addr src_addr, tgt_addr;
+    if (inet_aton(src_ip, &src_addr) == 0 || inet_aton(tgt_ip, &tgt_addr) == 0) {
+        close(sock);
+        return false;
     }
-    memcpy(pkt.eth.h_source, src_mac_bin, ETH_ALEN);
-    pkt.eth.h_proto = htons(ETH_P_ARP);
 
-    // ARP Header
-    pkt.arp.ea_hdr.ar_hrd = htons(ARPHRD_ETHER);
-    pkt.arp.ea_hdr.ar_pro = htons(ETH_P_IP);
-    pkt.arp.ea_hdr.ar_hln = ETH_ALEN;
-    pkt.arp.ea_hdr.ar_pln = 4;
-    pkt.arp.ea_hdr.ar_op = htons(is_request ? ARPOP_REQUEST : ARPOP_REPLY);
+    HARPY_EVENT_STR(ANDROID_LOG_DEBUG, 50, "Sending manual raw ARP packet on %s: %I -> %I (request=%d)",
+                    interface, src_addr.s_addr, tgt_addr.s_addr, is_request);
 
-    memcpy(pkt.arp.arp_sha, src_mac_bin, ETH_ALEN);
-    inet_aton(src_ip, (struct in_addr *)pkt.arp.arp_spa);
-    memcpy(pkt.arp.arp_tha, tgt_mac_bin, ETH_ALEN);
-    inet_aton(tgt_ip, (struct in_addr *)pkt.arp.arp_tpa);
+    ArpFrame frame = is_request ? kArpRequestTemplate : kArpReplyTemplate;
+    arp_frame_patch(&frame, src_mac_bin, src_addr.s_addr, tgt_mac_bin, tgt_addr.s_addr);
+
+    // Requests for an unknown MAC still go to the broadcast address
+    if (is_request && (strcmp(tgt_mac, "ff:ff:ff:ff:ff:ff") == 0 ||
+                       memcmp(tgt_mac_bin, "\0\0\0\0\0\0", ETH_ALEN) == 0)) {
+        memset(frame.eth_dst, 0xff, ETH_ALEN);
+    }
 
     struct sockaddr_ll dest_addr;
     memset(&dest_addr, 0, sizeof(dest_addr));
     dest_addr.sll_family = AF_PACKET;
     dest_addr.sll_ifindex = ifindex;
     dest_addr.sll_halen = ETH_ALEN;
-    memcpy(dest_addr.sll_addr, pkt.eth.h_dest, ETH_ALEN);
+    memcpy(dest_addr.sll_addr, frame.eth_dst, ETH_ALEN);
 
-    ssize_t sent = sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    packet_capture_frame(CaptureDirection::SENT, (const uint8_t *)&frame, sizeof(frame));
+    ssize_t sent = sendto(sock, &frame, sizeof(frame), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
     close(sock);
+    harpy_metrics_add(sent > 0 ? HarpyCounter::ARP_FRAMES_SENT : HarpyCounter::ARP_SEND_ERRORS);
     
     return sent > 0;
 }
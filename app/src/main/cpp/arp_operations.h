@@ -2,6 +2,8 @@
 #define ARP_OPERATIONS_H
 
 #include <string>
+#include <cstdint>
+#include "arp_frame.h"
 
 /**
  * Initialize ARP operations
@@ -27,6 +29,40 @@ bool arp_send_packet(const char *interface,
                      const char *tgt_ip, const char *tgt_mac,
                      bool is_request);
 
+/**
+ * Parse a colon-separated MAC address ("aa:bb:cc:dd:ee:ff") into bytes
+ */
+bool arp_parse_mac(const char *mac_str, unsigned char *mac_bin);
+
+/**
+ * Open a raw ARP socket for sending on an interface
+ * @param interface The network interface to send on (e.g., "wlan0")
+ * @param ifindex Receives the interface index
+ * @return Socket descriptor, or -1 on failure
+ */
+int arp_open_socket(const char *interface, int *ifindex);
+
+/**
+ * Prepare an empty send batch for an interface
+ */
+void arp_batch_init(ArpSendBatch *batch, int ifindex);
+
+/**
+ * Append an ARP reply built from the reply template to a batch
+ * @param src_ip Sender protocol address, network byte order
+ * @param tgt_ip Target protocol address, network byte order
+ * @return false if the batch is full
+ */
+bool arp_batch_add_reply(ArpSendBatch *batch,
+                         const unsigned char *src_mac, uint32_t src_ip,
+                         const unsigned char *tgt_mac, uint32_t tgt_ip);
+
+/**
+ * Send every frame in a batch with a single sendmmsg call
+ * @return Number of frames sent, or -1 if nothing could be sent
+ */
+int arp_batch_send(int sock, ArpSendBatch *batch);
+
 /**
  * Cleanup ARP operations
  */
@@ -0,0 +1,670 @@
+#include "dhcp_lease_pool.h"
+#include "harpy_log.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define LOG_TAG "DHCPLeasePool"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+static const uint32_t kNone = UINT32_MAX;
+
+// Timer wheel: 256 one-second slots, then three levels of 64 slots, each
+// slot spanning the whole level below. Covers 2^26 seconds (about two
+// years); later expiries are parked at the top and rescheduled.
+static const int kWheelBits0 = 8;
+static const int kWheelBits = 6;
+static const int kWheelLevels = 4;
+static const uint32_t kWheelSlots0 = 1u << kWheelBits0;
+static const uint32_t kWheelSlots = 1u << kWheelBits;
+static const uint32_t kWheelHeads = kWheelSlots0 + (kWheelLevels - 1) * kWheelSlots;
+static const uint64_t kWheelSpan = 1ULL << (kWheelBits0 + (kWheelLevels - 1) * kWheelBits);
+
+// MACs are stored with this bit set so an all-zero key marks an empty slot
+static const uint64_t kKeyPresent = 1ULL << 48;
+
+// Journal: a header, then fixed-size records appended in place
+static const char kJournalMagic[4] = {'H', 'D', 'L', 'J'};
+static const uint32_t kJournalVersion = 1;
+static const size_t kJournalMinRecords = 4096;
+static const uint8_t kRecordBind = 1;
+static const uint8_t kRecordRelease = 2;
+
+enum class lease_state : uint8_t { FREE, OFFERED, BOUND, DECLINED, RESERVED };
+
+struct lease {
+    uint64_t mac;               // 0 when no client holds the address
+    uint64_t expires;           // Monotonic seconds
+    uint32_t addr;              // Host byte order
+    uint32_t prev;              // Timer slot list, kNone at the ends
+    uint32_t next;
+    uint16_t slot;              // Wheel slot holding the lease
+    bool scheduled;
+    lease_state state;
+};
+
+struct journal_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t first;             // Range the journal belongs to, host byte order
+    uint32_t last;
+    uint8_t reserved[48];
+};
+
+struct journal_record {
+    uint32_t check;             // Checksum of the rest; never 0, so 0 ends the journal
+    uint8_t type;
+    uint8_t reserved;
+    uint8_t mac[6];
+    uint32_t addr;              // Network byte order
+    int64_t expires;            // Wall clock seconds
+    uint8_t padding[8];
+};
+
+static_assert(sizeof(journal_header) == 64, "journal header layout");
+static_assert(sizeof(journal_record) == 32, "journal record layout");
+
+struct DhcpLeasePool {
+    uint32_t first;             // Host byte order
+    uint32_t size;
+    uint32_t lease_seconds;
+
+    std::vector<lease> leases;          // One per range offset, then reservations outside it
+    std::vector<uint64_t> used;         // Bit per address, set when taken
+    std::vector<uint64_t> full;         // Bit per word of used, set when the word is all ones
+    size_t in_use;                      // Set bits within the range
+
+    std::vector<uint64_t> keys;         // MAC hash, linear probing
+    std::vector<uint32_t> values;       // Lease index per key
+    uint32_t hash_mask;
+    size_t hash_count;
+
+    uint32_t heads[kWheelHeads];
+    uint64_t clock;                     // Next second the wheel processes
+    size_t scheduled;
+
+    size_t offered;
+    size_t bound;
+    size_t declined;
+    size_t reserved;
+
+    std::string journal_path;
+    int journal_fd;
+    uint8_t *journal;
+    size_t journal_size;
+    size_t journal_capacity;            // Records
+    size_t journal_next;
+};
+
+static int64_t wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t hash_home(const DhcpLeasePool *pool, uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & pool->hash_mask;
+}
+
+static uint32_t hash_find(const DhcpLeasePool *pool, uint64_t mac) {
+    uint64_t key = mac | kKeyPresent;
+    for (uint32_t i = hash_home(pool, key);; i = (i + 1) & pool->hash_mask) {
+        if (pool->keys[i] == key) return pool->values[i];
+        if (pool->keys[i] == 0) return kNone;
+    }
+}
+
+static void hash_resize(DhcpLeasePool *pool, size_t capacity) {
+    std::vector<uint64_t> keys(capacity, 0);
+    std::vector<uint32_t> values(capacity, kNone);
+    keys.swap(pool->keys);
+    values.swap(pool->values);
+    pool->hash_mask = (uint32_t)capacity - 1;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == 0) continue;
+        uint32_t j = hash_home(pool, keys[i]);
+        while (pool->keys[j] != 0) j = (j + 1) & pool->hash_mask;
+        pool->keys[j] = keys[i];
+        pool->values[j] = values[i];
+    }
+}
+
+static void hash_insert(DhcpLeasePool *pool, uint64_t mac, uint32_t index) {
+    // Kept at most half full so probes stay short
+    if ((pool->hash_count + 1) * 2 > pool->keys.size()) {
+        hash_resize(pool, pool->keys.size() * 2);
+    }
+    uint64_t key = mac | kKeyPresent;
+    uint32_t i = hash_home(pool, key);
+    while (pool->keys[i] != 0) i = (i + 1) & pool->hash_mask;
+    pool->keys[i] = key;
+    pool->values[i] = index;
+    pool->hash_count++;
+}
+
+// Backward-shift deletion, so lookups never need tombstones
+static void hash_erase(DhcpLeasePool *pool, uint64_t mac) {
+    uint64_t key = mac | kKeyPresent;
+    uint32_t i = hash_home(pool, key);
+    while (pool->keys[i] != key) {
+        if (pool->keys[i] == 0) return;
+        i = (i + 1) & pool->hash_mask;
+    }
+    pool->keys[i] = 0;
+    pool->hash_count--;
+    for (uint32_t j = (i + 1) & pool->hash_mask; pool->keys[j] != 0; j = (j + 1) & pool->hash_mask) {
+        uint32_t home = hash_home(pool, pool->keys[j]);
+        // Move the entry back unless its home lies cyclically in (i, j]
+        bool stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (stays) continue;
+        pool->keys[i] = pool->keys[j];
+        pool->values[i] = pool->values[j];
+        pool->keys[j] = 0;
+        i = j;
+    }
+}
+
+static bool is_used(const DhcpLeasePool *pool, uint32_t offset) {
+    return (pool->used[offset >> 6] >> (offset & 63)) & 1;
+}
+
+static void set_used(DhcpLeasePool *pool, uint32_t offset) {
+    uint32_t word = offset >> 6;
+    if (!is_used(pool, offset)) pool->in_use++;
+    pool->used[word] |= 1ULL << (offset & 63);
+    if (pool->used[word] == ~0ULL) pool->full[word >> 6] |= 1ULL << (word & 63);
+}
+
+static void clear_used(DhcpLeasePool *pool, uint32_t offset) {
+    uint32_t word = offset >> 6;
+    if (is_used(pool, offset)) pool->in_use--;
+    pool->used[word] &= ~(1ULL << (offset & 63));
+    pool->full[word >> 6] &= ~(1ULL << (word & 63));
+}
+
+// Lowest free offset: one summary word per 4096 addresses, so at most 16 scans
+static uint32_t find_free(const DhcpLeasePool *pool) {
+    for (size_t s = 0; s < pool->full.size(); s++) {
+        if (pool->full[s] == ~0ULL) continue;
+        uint32_t word = (uint32_t)(s * 64 + __builtin_ctzll(~pool->full[s]));
+        return word * 64 + __builtin_ctzll(~pool->used[word]);
+    }
+    return kNone;
+}
+
+static void timer_unlink(DhcpLeasePool *pool, uint32_t index) {
+    lease& l = pool->leases[index];
+    if (!l.scheduled) return;
+    if (l.prev != kNone) {
+        pool->leases[l.prev].next = l.next;
+    } else {
+        pool->heads[l.slot] = l.next;
+    }
+    if (l.next != kNone) pool->leases[l.next].prev = l.prev;
+    l.scheduled = false;
+    pool->scheduled--;
+}
+
+static void timer_schedule(DhcpLeasePool *pool, uint32_t index, uint64_t expires) {
+    timer_unlink(pool, index);
+    lease& l = pool->leases[index];
+    l.expires = expires;
+
+    uint64_t when = std::max(expires, pool->clock);
+    uint64_t delta = when - pool->clock;
+    if (delta >= kWheelSpan) {
+        delta = kWheelSpan - 1;
+        when = pool->clock + delta;
+    }
+    uint32_t slot;
+    if (delta < kWheelSlots0) {
+        slot = (uint32_t)(when & (kWheelSlots0 - 1));
+    } else {
+        int level = 1;
+        while (delta >= 1ULL << (kWheelBits0 + level * kWheelBits)) level++;
+        int shift = kWheelBits0 + (level - 1) * kWheelBits;
+        slot = kWheelSlots0 + (level - 1) * kWheelSlots + (uint32_t)((when >> shift) & (kWheelSlots - 1));
+    }
+
+    l.slot = (uint16_t)slot;
+    l.prev = kNone;
+    l.next = pool->heads[slot];
+    if (l.next != kNone) pool->leases[l.next].prev = index;
+    pool->heads[slot] = index;
+    l.scheduled = true;
+    pool->scheduled++;
+}
+
+// Detach a slot's list; entries are re-linked or expired by the caller
+static uint32_t take_slot(DhcpLeasePool *pool, uint32_t slot) {
+    uint32_t head = pool->heads[slot];
+    pool->heads[slot] = kNone;
+    for (uint32_t i = head; i != kNone; i = pool->leases[i].next) {
+        pool->leases[i].scheduled = false;
+        pool->scheduled--;
+    }
+    return head;
+}
+
+static uint32_t record_check(const journal_record *record) {
+    const uint8_t *p = (const uint8_t *)record + sizeof(record->check);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(*record) - sizeof(record->check); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash | 1;
+}
+
+static void close_journal(DhcpLeasePool *pool) {
+    if (pool->journal) {
+        msync(pool->journal, pool->journal_size, MS_SYNC);
+        munmap(pool->journal, pool->journal_size);
+        pool->journal = nullptr;
+    }
+    if (pool->journal_fd >= 0) {
+        close(pool->journal_fd);
+        pool->journal_fd = -1;
+    }
+}
+
+static void put_record(DhcpLeasePool *pool, uint8_t type, uint64_t mac, uint32_t addr, int64_t expires) {
+    journal_record *record = (journal_record *)(pool->journal + sizeof(journal_header)) + pool->journal_next++;
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    for (int i = 0; i < 6; i++) {
+        record->mac[i] = (uint8_t)(mac >> (40 - 8 * i));
+    }
+    record->addr = htonl(addr);
+    record->expires = expires;
+    record->check = record_check(record);
+}
+
+// Rewrite the journal as one record per bound lease, with room to grow,
+// and swap it in with a rename so a crash leaves either file intact
+static bool write_snapshot(DhcpLeasePool *pool, uint64_t now) {
+    size_t capacity = std::max(kJournalMinRecords, pool->bound * 4);
+    size_t size = sizeof(journal_header) + capacity * sizeof(journal_record);
+    std::string tmp_path = pool->journal_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Cannot create lease journal %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        LOGE("Cannot map lease journal %s: %s", tmp_path.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    journal_header *header = (journal_header *)base;
+    memcpy(header->magic, kJournalMagic, sizeof(kJournalMagic));
+    header->version = kJournalVersion;
+    header->first = pool->first;
+    header->last = pool->first + pool->size - 1;
+
+    close_journal(pool);
+    pool->journal_fd = fd;
+    pool->journal = (uint8_t *)base;
+    pool->journal_size = size;
+    pool->journal_capacity = capacity;
+    pool->journal_next = 0;
+
+    int64_t wall = wall_seconds();
+    for (uint32_t i = 0; i < pool->size; i++) {
+        const lease& l = pool->leases[i];
+        if (l.state == lease_state::BOUND) {
+            put_record(pool, kRecordBind, l.mac, l.addr, wall + (int64_t)(l.expires - now));
+        }
+    }
+    if (msync(base, size, MS_SYNC) != 0 || rename(tmp_path.c_str(), pool->journal_path.c_str()) != 0) {
+        LOGE("Failed to replace lease journal %s: %s", pool->journal_path.c_str(), strerror(errno));
+        close_journal(pool);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void journal_append(DhcpLeasePool *pool, uint8_t type, uint64_t mac, uint32_t addr,
+                           uint64_t expires, uint64_t now) {
+    if (!pool->journal) return;
+    if (pool->journal_next == pool->journal_capacity && !write_snapshot(pool, now)) {
+        LOGE("Lease journal disabled");
+        return;
+    }
+    // A fresh snapshot already holds the lease; appending again is harmless
+    put_record(pool, type, mac, addr, wall_seconds() + (int64_t)(expires - now));
+}
+
+static void count_state(DhcpLeasePool *pool, lease_state state, int delta) {
+    switch (state) {
+        case lease_state::OFFERED: pool->offered += delta; break;
+        case lease_state::BOUND: pool->bound += delta; break;
+        case lease_state::DECLINED: pool->declined += delta; break;
+        case lease_state::RESERVED: pool->reserved += delta; break;
+        case lease_state::FREE: break;
+    }
+}
+
+static void set_state(DhcpLeasePool *pool, lease& l, lease_state state) {
+    count_state(pool, l.state, -1);
+    l.state = state;
+    count_state(pool, state, 1);
+}
+
+// Give a range address to a client
+static void take(DhcpLeasePool *pool, uint32_t offset, uint64_t mac, lease_state state, uint64_t expires) {
+    lease& l = pool->leases[offset];
+    set_used(pool, offset);
+    l.mac = mac;
+    set_state(pool, l, state);
+    hash_insert(pool, mac, offset);
+    timer_schedule(pool, offset, expires);
+}
+
+// Return a dynamic lease's address to the free bitmap
+static void free_lease(DhcpLeasePool *pool, uint32_t index) {
+    lease& l = pool->leases[index];
+    timer_unlink(pool, index);
+    if (l.state != lease_state::DECLINED) hash_erase(pool, l.mac);
+    l.mac = 0;
+    set_state(pool, l, lease_state::FREE);
+    clear_used(pool, index);
+}
+
+static bool offset_of(const DhcpLeasePool *pool, uint32_t addr, uint32_t *offset) {
+    uint32_t host = ntohl(addr) - pool->first;
+    if (host >= pool->size) return false;
+    *offset = host;
+    return true;
+}
+
+DhcpLeasePool *dhcp_pool_create(uint32_t first, uint32_t last, uint32_t lease_seconds, uint64_t now) {
+    uint32_t first_host = ntohl(first);
+    uint32_t last_host = ntohl(last);
+    if (last_host < first_host || (uint64_t)last_host - first_host + 1 > kDhcpPoolMaxAddresses) {
+        LOGE("Invalid DHCP pool range");
+        return nullptr;
+    }
+    DhcpLeasePool *pool = new DhcpLeasePool();
+    pool->first = first_host;
+    pool->size = last_host - first_host + 1;
+    pool->lease_seconds = std::max(lease_seconds, 60u);
+
+    pool->leases.resize(pool->size);
+    for (uint32_t i = 0; i < pool->size; i++) {
+        lease& l = pool->leases[i];
+        memset(&l, 0, sizeof(l));
+        l.addr = first_host + i;
+        l.prev = l.next = kNone;
+        l.state = lease_state::FREE;
+    }
+
+    // Bits past the end of the range count as used, so find_free never returns them
+    size_t words = (pool->size + 63) / 64;
+    pool->used.assign((words + 63) / 64 * 64, ~0ULL);
+    pool->full.assign(pool->used.size() / 64, ~0ULL);
+    pool->in_use = pool->size;
+    for (uint32_t i = 0; i < pool->size; i++) {
+        clear_used(pool, i);
+    }
+
+    size_t capacity = 16;
+    while (capacity < (size_t)pool->size * 2) capacity *= 2;
+    pool->keys.assign(capacity, 0);
+    pool->values.assign(capacity, kNone);
+    pool->hash_mask = (uint32_t)capacity - 1;
+    pool->hash_count = 0;
+
+    std::fill(pool->heads, pool->heads + kWheelHeads, kNone);
+    pool->clock = now;
+    pool->scheduled = 0;
+    pool->offered = pool->bound = pool->declined = pool->reserved = 0;
+    pool->journal_fd = -1;
+    pool->journal = nullptr;
+    pool->journal_size = pool->journal_capacity = pool->journal_next = 0;
+    return pool;
+}
+
+void dhcp_pool_destroy(DhcpLeasePool *pool) {
+    if (!pool) return;
+    close_journal(pool);
+    delete pool;
+}
+
+// Free a dynamic lease a reservation takes over, journaling its release
+// like dhcp_pool_release so a replay cannot bring it back
+static void revoke_lease(DhcpLeasePool *pool, uint32_t index) {
+    const lease& l = pool->leases[index];
+    if (l.state == lease_state::BOUND) {
+        journal_append(pool, kRecordRelease, l.mac, l.addr, pool->clock, pool->clock);
+    }
+    free_lease(pool, index);
+}
+
+bool dhcp_pool_reserve(DhcpLeasePool *pool, uint64_t mac, uint32_t addr) {
+    uint32_t existing = hash_find(pool, mac);
+    if (existing != kNone) {
+        lease& l = pool->leases[existing];
+        if (l.state == lease_state::RESERVED && l.addr == ntohl(addr)) return true;
+        if (l.state == lease_state::RESERVED) {
+            LOGE("MAC already has a reservation");
+            return false;
+        }
+        revoke_lease(pool, existing);
+    }
+
+    uint32_t offset;
+    if (!offset_of(pool, addr, &offset)) {
+        // Outside the range: a lease slot of its own, with no bitmap bit
+        lease l;
+        memset(&l, 0, sizeof(l));
+        l.mac = mac;
+        l.addr = ntohl(addr);
+        l.prev = l.next = kNone;
+        l.state = lease_state::RESERVED;
+        pool->leases.push_back(l);
+        pool->reserved++;
+        hash_insert(pool, mac, (uint32_t)pool->leases.size() - 1);
+        return true;
+    }
+
+    lease& l = pool->leases[offset];
+    if (l.state == lease_state::RESERVED) {
+        LOGE("Address already reserved for another MAC");
+        return false;
+    }
+    if (l.state != lease_state::FREE) revoke_lease(pool, offset);
+    set_used(pool, offset);
+    l.mac = mac;
+    set_state(pool, l, lease_state::RESERVED);
+    hash_insert(pool, mac, offset);
+    return true;
+}
+
+void dhcp_pool_unreserve(DhcpLeasePool *pool, uint64_t mac) {
+    uint32_t index = hash_find(pool, mac);
+    if (index == kNone || pool->leases[index].state != lease_state::RESERVED) return;
+    lease& l = pool->leases[index];
+    hash_erase(pool, mac);
+    l.mac = 0;
+    set_state(pool, l, lease_state::FREE);
+    if (index < pool->size) clear_used(pool, index);   // Slots outside the range are left unused
+}
+
+bool dhcp_pool_open_journal(DhcpLeasePool *pool, const char *path) {
+    pool->journal_path = path;
+    uint64_t now = pool->clock;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(journal_header)) {
+        void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+            const journal_header *header = (const journal_header *)base;
+            bool same_range = memcmp(header->magic, kJournalMagic, sizeof(kJournalMagic)) == 0 &&
+                              header->version == kJournalVersion && header->first == pool->first &&
+                              header->last == pool->first + pool->size - 1;
+            if (!same_range) {
+                LOGE("Lease journal %s belongs to another range; starting empty", path);
+            }
+            size_t count = same_range ? (st.st_size - sizeof(journal_header)) / sizeof(journal_record) : 0;
+            const journal_record *records = (const journal_record *)((const uint8_t *)base + sizeof(journal_header));
+            int64_t wall = wall_seconds();
+            // Later records win; a torn or unwritten record ends the replay
+            for (size_t i = 0; i < count && records[i].check == record_check(&records[i]); i++) {
+                const journal_record& record = records[i];
+                uint64_t mac = dhcp_mac_key(record.mac);
+                uint32_t index = hash_find(pool, mac);
+                if (index != kNone && pool->leases[index].state == lease_state::RESERVED) continue;
+                if (index != kNone) free_lease(pool, index);
+
+                uint32_t offset;
+                if (record.type != kRecordBind || record.expires <= wall ||
+                    !offset_of(pool, record.addr, &offset) || is_used(pool, offset)) {
+                    continue;
+                }
+                take(pool, offset, mac, lease_state::BOUND, now + (uint64_t)(record.expires - wall));
+            }
+            munmap(base, st.st_size);
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    if (!write_snapshot(pool, now)) return false;
+    LOGD("Lease journal %s: %zu live leases restored", path, pool->bound);
+    return true;
+}
+
+uint32_t dhcp_pool_offer(DhcpLeasePool *pool, uint64_t mac, uint32_t requested, uint64_t now) {
+    uint32_t index = hash_find(pool, mac);
+    if (index != kNone) {
+        lease& l = pool->leases[index];
+        if (l.state == lease_state::OFFERED) timer_schedule(pool, index, now + kDhcpOfferSeconds);
+        return htonl(l.addr);
+    }
+
+    uint32_t offset;
+    if (!requested || !offset_of(pool, requested, &offset) || is_used(pool, offset)) {
+        offset = find_free(pool);
+        if (offset == kNone) return 0;
+    }
+    take(pool, offset, mac, lease_state::OFFERED, now + kDhcpOfferSeconds);
+    return htonl(pool->leases[offset].addr);
+}
+
+bool dhcp_pool_commit(DhcpLeasePool *pool, uint64_t mac, uint32_t addr, uint64_t now) {
+    uint32_t index = hash_find(pool, mac);
+    if (index == kNone) {
+        uint32_t offset;
+        if (!offset_of(pool, addr, &offset) || is_used(pool, offset)) return false;
+        take(pool, offset, mac, lease_state::OFFERED, now);
+        index = offset;
+    }
+
+    lease& l = pool->leases[index];
+    if (l.addr != ntohl(addr)) return false;
+    if (l.state == lease_state::RESERVED) return true;
+    set_state(pool, l, lease_state::BOUND);
+    uint64_t expires = now + pool->lease_seconds;
+    timer_schedule(pool, index, expires);
+    journal_append(pool, kRecordBind, mac, l.addr, expires, now);
+    return true;
+}
+
+void dhcp_pool_release(DhcpLeasePool *pool, uint64_t mac, uint32_t addr) {
+    uint32_t index = hash_find(pool, mac);
+    if (index == kNone) return;
+    lease& l = pool->leases[index];
+    if (l.state == lease_state::RESERVED || l.addr != ntohl(addr)) return;
+    bool was_bound = l.state == lease_state::BOUND;
+    free_lease(pool, index);
+    if (was_bound) journal_append(pool, kRecordRelease, mac, ntohl(addr), pool->clock, pool->clock);
+}
+
+void dhcp_pool_decline(DhcpLeasePool *pool, uint64_t mac, uint32_t addr, uint64_t now) {
+    uint32_t offset;
+    if (!offset_of(pool, addr, &offset)) return;
+    lease& l = pool->leases[offset];
+    if (l.state == lease_state::RESERVED) return;
+    if (l.state != lease_state::FREE && l.mac != mac) return;   // Not the decliner's address
+
+    if (l.state == lease_state::BOUND) {
+        journal_append(pool, kRecordRelease, mac, l.addr, now, now);
+    }
+    if (l.state != lease_state::FREE) hash_erase(pool, l.mac);
+    set_used(pool, offset);
+    l.mac = 0;
+    set_state(pool, l, lease_state::DECLINED);
+    timer_schedule(pool, offset, now + pool->lease_seconds);
+}
+
+size_t dhcp_pool_advance(DhcpLeasePool *pool, uint64_t now) {
+    size_t expired = 0;
+    while (pool->clock <= now) {
+        if (pool->scheduled == 0) {
+            pool->clock = now + 1;
+            break;
+        }
+        uint64_t t = pool->clock;
+        uint32_t slot0 = (uint32_t)(t & (kWheelSlots0 - 1));
+        if (slot0 == 0) {
+            // Pull the next span of each level down, stopping at the first level that did not wrap
+            for (int level = 1; level < kWheelLevels; level++) {
+                int shift = kWheelBits0 + (level - 1) * kWheelBits;
+                uint32_t index = (uint32_t)((t >> shift) & (kWheelSlots - 1));
+                uint32_t i = take_slot(pool, kWheelSlots0 + (level - 1) * kWheelSlots + index);
+                while (i != kNone) {
+                    uint32_t next = pool->leases[i].next;
+                    timer_schedule(pool, i, pool->leases[i].expires);
+                    i = next;
+                }
+                if (index != 0) break;
+            }
+        }
+
+        uint32_t i = take_slot(pool, slot0);
+        while (i != kNone) {
+            uint32_t next = pool->leases[i].next;
+            if (pool->leases[i].expires > t) {
+                timer_schedule(pool, i, pool->leases[i].expires);   // Parked past the wheel's span
+            } else {
+                free_lease(pool, i);
+                expired++;
+            }
+            i = next;
+        }
+        pool->clock++;
+    }
+    return expired;
+}
+
+bool dhcp_pool_contains(const DhcpLeasePool *pool, uint32_t addr) {
+    uint32_t offset;
+    return offset_of(pool, addr, &offset);
+}
+
+DhcpPoolStats dhcp_pool_stats(const DhcpLeasePool *pool) {
+    DhcpPoolStats stats;
+    stats.capacity = pool->size;
+    stats.offered = pool->offered;
+    stats.bound = pool->bound;
+    stats.declined = pool->declined;
+    stats.reserved = pool->reserved;
+    stats.free = pool->size - pool->in_use;
+    return stats;
+}
@@ -0,0 +1,121 @@
+#ifndef DHCP_LEASE_POOL_H
+#define DHCP_LEASE_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Dynamic DHCP leases over a contiguous address range. Free addresses
+ * live in a two-level bitmap, so finding one is a couple of count-
+ * trailing-zeros whatever the pool size. Leases are found by client MAC
+ * through an open-addressing hash keyed on the 48-bit MAC. Expiry is
+ * driven by a hierarchical timer wheel with one-second resolution, so
+ * granting, renewing and expiring a lease are all O(1).
+ *
+ * Static reservations sit in the same hash and are never handed to
+ * anyone else. Bound leases can be persisted to an append-only journal
+ * that is memory-mapped and replayed when the pool is reopened.
+ *
+ * Not thread safe: the DHCP thread owns the pool. Addresses are IPv4 in
+ * network byte order; times are monotonic seconds chosen by the caller.
+ */
+struct DhcpLeasePool;
+
+// Largest range a pool manages (a /16)
+static const uint32_t kDhcpPoolMaxAddresses = 65536;
+
+// How long an offered address is held for the client's REQUEST
+static const uint32_t kDhcpOfferSeconds = 60;
+
+struct DhcpPoolStats {
+    size_t capacity;        // Addresses in the range
+    size_t free;
+    size_t offered;
+    size_t bound;
+    size_t declined;        // Held back after a client reported a conflict
+    size_t reserved;        // Static reservations, in or out of the range
+};
+
+/**
+ * The 48-bit integer key of a MAC address
+ */
+inline uint64_t dhcp_mac_key(const uint8_t *mac) {
+    return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24) |
+           ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | mac[5];
+}
+
+/**
+ * Create a pool handing out first..last inclusive
+ * @param now Current monotonic time in seconds
+ * @return The pool, or nullptr if the range is empty or larger than
+ *         kDhcpPoolMaxAddresses
+ */
+DhcpLeasePool *dhcp_pool_create(uint32_t first, uint32_t last, uint32_t lease_seconds, uint64_t now);
+
+/**
+ * Flush the journal and free the pool
+ */
+void dhcp_pool_destroy(DhcpLeasePool *pool);
+
+/**
+ * Persist bound leases to path, first replaying whatever an earlier run
+ * left there. Leases that expired meanwhile are dropped, and the journal
+ * is compacted to the live leases. Call after adding reservations.
+ * @return false if the journal could not be opened; the pool keeps
+ *         working in memory
+ */
+bool dhcp_pool_open_journal(DhcpLeasePool *pool, const char *path);
+
+/**
+ * Reserve addr for mac; addresses outside the range are allowed. A
+ * dynamic lease already holding addr is revoked.
+ */
+bool dhcp_pool_reserve(DhcpLeasePool *pool, uint64_t mac, uint32_t addr);
+
+/**
+ * Drop mac's reservation, returning its address to the pool
+ */
+void dhcp_pool_unreserve(DhcpLeasePool *pool, uint64_t mac);
+
+/**
+ * Pick an address for a DISCOVER: the client's current lease, else the
+ * address it asked for if free, else any free address. The address is
+ * held for kDhcpOfferSeconds.
+ * @param requested Requested IP option, 0 if absent
+ * @return The address, or 0 if the pool is exhausted
+ */
+uint32_t dhcp_pool_offer(DhcpLeasePool *pool, uint64_t mac, uint32_t requested, uint64_t now);
+
+/**
+ * Bind or renew mac's lease on addr for a REQUEST. A client the pool has
+ * no record of (after a restart without a journal, say) is granted addr
+ * if it is in the range and free.
+ * @return false if addr is not the client's to take; answer with a NAK
+ */
+bool dhcp_pool_commit(DhcpLeasePool *pool, uint64_t mac, uint32_t addr, uint64_t now);
+
+/**
+ * The client gave its address back (DHCPRELEASE)
+ */
+void dhcp_pool_release(DhcpLeasePool *pool, uint64_t mac, uint32_t addr);
+
+/**
+ * The client found addr already in use (DHCPDECLINE); the address is
+ * kept out of circulation for one lease time
+ */
+void dhcp_pool_decline(DhcpLeasePool *pool, uint64_t mac, uint32_t addr, uint64_t now);
+
+/**
+ * Expire every lease and offer that ran out by now
+ * @return Number of leases expired
+ */
+size_t dhcp_pool_advance(DhcpLeasePool *pool, uint64_t now);
+
+/**
+ * Whether addr is inside the pool's range
+ */
+bool dhcp_pool_contains(const DhcpLeasePool *pool, uint32_t addr);
+
+DhcpPoolStats dhcp_pool_stats(const DhcpLeasePool *pool);
+
+#endif // DHCP_LEASE_POOL_H
@@ -0,0 +1,374 @@
+// DHCP load generator and latency benchmark, in the spirit of perfdhcp.
+//
+// Simulates up to 65536 clients with distinct MACs. Each one runs the full
+// DISCOVER/OFFER/REQUEST/ACK exchange in turn, with at most `window`
+// exchanges in flight. The report gives exchanges per second, latency
+// percentiles of both halves of the exchange, and how many of each timed
+// out.
+//
+// By default the engine runs in-process on loopback on a high port pair,
+// serving every client from a lease pool. Given a server address, the
+// generator drives a server that is already running instead, e.g. the root
+// helper inside a network namespace on the far end of a veth pair:
+//
+//   ip netns add dhcp && ip link add veth0 type veth peer name veth1
+//   ip link set veth1 netns dhcp
+//   ip addr add 10.77.0.2/16 dev veth0 && ip link set veth0 up
+//   ip netns exec dhcp ip addr add 10.77.0.1/16 dev veth1
+//   ip netns exec dhcp ip link set veth1 up
+//   ip netns exec dhcp libharpy_root_helper.so dhcp_pool veth1 10.77.1.0-10.77.255.254 10.77.0.1
+//   harpy_dhcp_bench 10 10000 256 67 10.77.0.1
+//
+// Replies come back to server_port + 1, which is 68 for a real server.
+//
+// Usage: harpy_dhcp_bench [seconds] [clients] [window] [server_port] [server_ip]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include "dhcp_spoofing.h"
+#include "dhcp_wire.h"
+
+static const uint32_t kMaxClients = 65536;  // Client index lives in the low half of the xid
+static const int kBatchSize = 32;           // Datagrams per sendmmsg/recvmmsg call
+static const int kExchangeTimeoutMs = 1000;
+static const int kTimeoutSweepMs = 10;
+static const int kReceiveBuffer = 4 << 20;
+static const size_t kMaxReply = 576;
+
+enum class ClientState : uint8_t { IDLE, SELECTING, REQUESTING };
+
+struct bench_client {
+    uint8_t mac[6];
+    ClientState state;
+    uint16_t generation;        // Bumped per exchange so late replies are ignored
+    int64_t discover_us;
+    int64_t request_us;
+    uint32_t offered;
+    uint32_t server_id;
+};
+
+struct bench_counters {
+    uint64_t discovers = 0;
+    uint64_t offers = 0;
+    uint64_t offer_drops = 0;
+    uint64_t requests = 0;
+    uint64_t acks = 0;
+    uint64_t naks = 0;
+    uint64_t ack_drops = 0;
+    uint64_t stray = 0;         // Late, duplicate or unexpected replies
+};
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t client_xid(uint32_t index, const bench_client& client) {
+    return ((uint32_t)client.generation << 16) | index;
+}
+
+static size_t put_addr_option(uint8_t *out, size_t pos, uint8_t code, uint32_t addr) {
+    out[pos] = code;
+    out[pos + 1] = 4;
+    memcpy(out + pos + 2, &addr, 4);
+    return pos + 6;
+}
+
+// A DISCOVER, or a SELECTING REQUEST for the client's offer
+static size_t build_message(uint8_t *out, uint32_t index, const bench_client& client, uint8_t type) {
+    memset(out, 0, kDhcpMinPacketSize);
+    out[0] = kDhcpOpRequest;
+    out[1] = 1;     // Ethernet
+    out[2] = 6;
+    uint32_t xid = client_xid(index, client);
+    memcpy(out + 4, &xid, 4);
+    out[10] = (uint8_t)(kDhcpFlagBroadcast >> 8);
+    memcpy(out + 28, client.mac, 6);
+    uint32_t cookie = htonl(kDhcpMagicCookie);
+    memcpy(out + kDhcpHeaderSize, &cookie, 4);
+
+    uint8_t *opts = out + kDhcpOptionsOffset;
+    size_t pos = 0;
+    opts[pos++] = kDhcpOptMessageType;
+    opts[pos++] = 1;
+    opts[pos++] = type;
+    if (type == kDhcpRequest) {
+        pos = put_addr_option(opts, pos, kDhcpOptRequestedIp, client.offered);
+        pos = put_addr_option(opts, pos, kDhcpOptServerId, client.server_id);
+    }
+    const uint8_t params[] = {kDhcpOptParamList, 4, kDhcpOptSubnetMask, kDhcpOptRouter,
+                              kDhcpOptDnsServer, kDhcpOptLeaseTime};
+    memcpy(opts + pos, params, sizeof(params));
+    pos += sizeof(params);
+    opts[pos] = kDhcpOptEnd;
+    return kDhcpMinPacketSize;
+}
+
+// Message type and server ID of a reply; false if it is not a DHCP reply
+static bool parse_reply(const uint8_t *p, size_t len, uint32_t *xid, uint32_t *yiaddr,
+                        uint8_t *type, uint32_t *server_id) {
+    if (len < kDhcpOptionsOffset || p[0] != kDhcpOpReply) return false;
+    uint32_t cookie;
+    memcpy(&cookie, p + kDhcpHeaderSize, 4);
+    if (ntohl(cookie) != kDhcpMagicCookie) return false;
+    memcpy(xid, p + 4, 4);
+    memcpy(yiaddr, p + 16, 4);
+    *type = 0;
+    *server_id = 0;
+    size_t pos = kDhcpOptionsOffset;
+    while (pos < len && p[pos] != kDhcpOptEnd) {
+        if (p[pos] == kDhcpOptPad) {
+            pos++;
+            continue;
+        }
+        if (pos + 2 > len || pos + 2 + p[pos + 1] > len) break;
+        if (p[pos] == kDhcpOptMessageType && p[pos + 1] == 1) *type = p[pos + 2];
+        if (p[pos] == kDhcpOptServerId && p[pos + 1] == 4) memcpy(server_id, p + pos + 2, 4);
+        pos += 2 + p[pos + 1];
+    }
+    return *type != 0;
+}
+
+// Outgoing messages, sent a batch at a time
+struct send_queue {
+    int sockfd;
+    struct sockaddr_in server;
+    uint8_t packets[kBatchSize][kDhcpMinPacketSize];
+    struct iovec iovs[kBatchSize];
+    struct mmsghdr msgs[kBatchSize];
+    int count = 0;
+};
+
+static void flush_queue(send_queue *queue) {
+    int sent = 0;
+    while (sent < queue->count) {
+        int n = sendmmsg(queue->sockfd, queue->msgs + sent, queue->count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("sendmmsg");
+            break;      // The exchanges time out and are counted as drops
+        }
+        sent += n;
+    }
+    queue->count = 0;
+}
+
+static void queue_message(send_queue *queue, uint32_t index, const bench_client& client, uint8_t type) {
+    int slot = queue->count;
+    queue->iovs[slot].iov_base = queue->packets[slot];
+    queue->iovs[slot].iov_len = build_message(queue->packets[slot], index, client, type);
+    memset(&queue->msgs[slot], 0, sizeof(queue->msgs[slot]));
+    queue->msgs[slot].msg_hdr.msg_name = &queue->server;
+    queue->msgs[slot].msg_hdr.msg_namelen = sizeof(queue->server);
+    queue->msgs[slot].msg_hdr.msg_iov = &queue->iovs[slot];
+    queue->msgs[slot].msg_hdr.msg_iovlen = 1;
+    if (++queue->count == kBatchSize) flush_queue(queue);
+}
+
+static void print_latency(const char *label, std::vector<uint32_t>& samples) {
+    if (samples.empty()) {
+        printf("%-16s %10s\n", label, "-");
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](double q) { return samples[(size_t)(q * (samples.size() - 1))]; };
+    printf("%-16s %10u %10u %10u %10u %10u %10u\n", label, samples.front(), at(0.50), at(0.90),
+           at(0.99), at(0.999), samples.back());
+}
+
+static bool start_engine(uint16_t port, uint32_t clients) {
+    // One address per client, so the pool never runs dry
+    uint32_t first = ntohl(inet_addr("10.77.0.10"));
+    struct in_addr last;
+    last.s_addr = htonl(first + clients - 1);
+    DHCPPoolConfig config;
+    config.first_ip = "10.77.0.10";
+    config.last_ip = inet_ntoa(last);
+    config.gateway_ip = "10.77.0.1";
+    config.dns_server = "10.77.0.1";
+    dhcp_set_ports(port, port + 1);
+    return dhcp_set_pool(config) && dhcp_start_spoofing("lo", {});
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    uint32_t clients = argc > 2 ? (uint32_t)atoi(argv[2]) : 1000;
+    int window = argc > 3 ? atoi(argv[3]) : 64;
+    uint16_t port = (uint16_t)(argc > 4 ? atoi(argv[4]) : 16767);
+    const char *server_ip = argc > 5 ? argv[5] : nullptr;
+    if (seconds <= 0) seconds = 5;
+    if (clients == 0) clients = 1000;
+    if (clients > kMaxClients) clients = kMaxClients;
+    if (window <= 0) window = 64;
+
+    if (!server_ip && !start_engine(port, clients)) {
+        fprintf(stderr, "Failed to start DHCP engine on port %u\n", port);
+        return 1;
+    }
+
+    send_queue *queue = new send_queue();
+    queue->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    int opt = 1;
+    setsockopt(queue->sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int bufsize = kReceiveBuffer;
+    setsockopt(queue->sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port + 1);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind(queue->sockfd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("bind client port");
+        return 1;
+    }
+    memset(&queue->server, 0, sizeof(queue->server));
+    queue->server.sin_family = AF_INET;
+    queue->server.sin_port = htons(port);
+    queue->server.sin_addr.s_addr = server_ip ? inet_addr(server_ip) : htonl(INADDR_LOOPBACK);
+
+    // Locally administered MACs, unique per client
+    std::vector<bench_client> pool(clients);
+    std::deque<uint32_t> idle;
+    for (uint32_t i = 0; i < clients; i++) {
+        bench_client& client = pool[i];
+        const uint8_t mac[6] = {0x02, 0x00, 0x5e, (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i};
+        memcpy(client.mac, mac, 6);
+        client.state = ClientState::IDLE;
+        client.generation = 0;
+        idle.push_back(i);
+    }
+
+    bench_counters counters;
+    std::vector<uint32_t> offer_us, ack_us, exchange_us;
+    uint8_t rx[kBatchSize][kMaxReply];
+    struct iovec rx_iovs[kBatchSize];
+    struct mmsghdr rx_msgs[kBatchSize];
+    for (int i = 0; i < kBatchSize; i++) {
+        rx_iovs[i].iov_base = rx[i];
+        rx_iovs[i].iov_len = sizeof(rx[i]);
+        memset(&rx_msgs[i], 0, sizeof(rx_msgs[i]));
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int in_flight = 0;
+    int64_t start = now_us();
+    int64_t deadline = start + (int64_t)seconds * 1000000;
+    int64_t next_sweep = start + kTimeoutSweepMs * 1000;
+    int64_t now = start;
+    while (now < deadline) {
+        // Keep the window full
+        while (in_flight < window && !idle.empty()) {
+            uint32_t index = idle.front();
+            idle.pop_front();
+            bench_client& client = pool[index];
+            client.generation++;
+            client.state = ClientState::SELECTING;
+            client.discover_us = now;
+            queue_message(queue, index, client, kDhcpDiscover);
+            counters.discovers++;
+            in_flight++;
+        }
+        flush_queue(queue);
+
+        struct pollfd pfd = {queue->sockfd, POLLIN, 0};
+        poll(&pfd, 1, kTimeoutSweepMs);
+        int received;
+        while ((received = recvmmsg(queue->sockfd, rx_msgs, kBatchSize, MSG_DONTWAIT, nullptr)) > 0) {
+            now = now_us();
+            for (int i = 0; i < received; i++) {
+                uint32_t xid, yiaddr, server_id;
+                uint8_t type;
+                if (!parse_reply(rx[i], rx_msgs[i].msg_len, &xid, &yiaddr, &type, &server_id) ||
+                    (xid & 0xffff) >= clients) {
+                    counters.stray++;
+                    continue;
+                }
+                uint32_t index = xid & 0xffff;
+                bench_client& client = pool[index];
+                if (xid != client_xid(index, client)) {
+                    counters.stray++;
+                } else if (client.state == ClientState::SELECTING && type == kDhcpOffer) {
+                    counters.offers++;
+                    offer_us.push_back((uint32_t)(now - client.discover_us));
+                    client.offered = yiaddr;
+                    client.server_id = server_id;
+                    client.state = ClientState::REQUESTING;
+                    client.request_us = now;
+                    queue_message(queue, index, client, kDhcpRequest);
+                    counters.requests++;
+                } else if (client.state == ClientState::REQUESTING && (type == kDhcpAck || type == kDhcpNak)) {
+                    if (type == kDhcpAck) {
+                        counters.acks++;
+                        ack_us.push_back((uint32_t)(now - client.request_us));
+                        exchange_us.push_back((uint32_t)(now - client.discover_us));
+                    } else {
+                        counters.naks++;
+                    }
+                    client.state = ClientState::IDLE;
+                    idle.push_back(index);
+                    in_flight--;
+                } else {
+                    counters.stray++;
+                }
+            }
+            flush_queue(queue);
+        }
+
+        now = now_us();
+        if (now >= next_sweep) {
+            // Lost packets: give the client up and start it over later
+            int64_t expired = now - (int64_t)kExchangeTimeoutMs * 1000;
+            for (uint32_t i = 0; i < clients; i++) {
+                bench_client& client = pool[i];
+                if (client.state == ClientState::SELECTING && client.discover_us < expired) {
+                    counters.offer_drops++;
+                } else if (client.state == ClientState::REQUESTING && client.request_us < expired) {
+                    counters.ack_drops++;
+                } else {
+                    continue;
+                }
+                client.state = ClientState::IDLE;
+                idle.push_back(i);
+                in_flight--;
+            }
+            next_sweep = now + kTimeoutSweepMs * 1000;
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    printf("%u clients, window %d, %.1f s against %s:%u\n", clients, window, elapsed,
+           inet_ntoa(queue->server.sin_addr), port);
+    printf("exchanges %14llu %12.0f/s\n", (unsigned long long)counters.acks, counters.acks / elapsed);
+    printf("discovers %14llu  offers %llu  dropped %llu\n", (unsigned long long)counters.discovers,
+           (unsigned long long)counters.offers, (unsigned long long)counters.offer_drops);
+    printf("requests  %14llu  acks %llu  naks %llu  dropped %llu\n", (unsigned long long)counters.requests,
+           (unsigned long long)counters.acks, (unsigned long long)counters.naks,
+           (unsigned long long)counters.ack_drops);
+    printf("stray replies %10llu  still in flight %d\n", (unsigned long long)counters.stray, in_flight);
+    printf("%-16s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "min", "p50", "p90", "p99", "p99.9", "max");
+    print_latency("DISCOVER-OFFER", offer_us);
+    print_latency("REQUEST-ACK", ack_us);
+    print_latency("DORA", exchange_us);
+
+    if (!server_ip) {
+        DhcpPoolStats stats;
+        if (dhcp_get_pool_stats(&stats)) {
+            printf("pool: %zu bound, %zu offered, %zu free\n", stats.bound, stats.offered, stats.free);
+        }
+        dhcp_stop_spoofing();
+    }
+    close(queue->sockfd);
+    delete queue;
+    return 0;
+}
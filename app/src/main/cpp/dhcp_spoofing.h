@@ -3,6 +3,10 @@
 
 #include <string>
 #include <vector>
+#include "dhcp_lease_pool.h"
+
+struct Reactor;
+struct PacketIo;
 
 /**
  * Structure to represent a DHCP spoofing rule
@@ -15,6 +19,19 @@ struct DHCPSpoofRule {
     std::string dns_server;      // DNS server to provide
 };
 
+/**
+ * Address pool for clients that have no rule
+ */
+struct DHCPPoolConfig {
+    std::string first_ip;        // First address handed out
+    std::string last_ip;         // Last address handed out, at most a /16 after first_ip
+    std::string gateway_ip;      // Gateway IP to provide
+    std::string subnet_mask;     // Subnet mask to provide, empty for the interface's
+    std::string dns_server;      // DNS server to provide
+    uint32_t lease_seconds = 3600;
+    std::string journal_path = "";   // Lease journal, or empty to keep leases in memory only
+};
+
 /**
  * Initialize DHCP spoofing operations
  */
@@ -28,6 +45,39 @@ bool dhcp_spoof_init();
  */
 bool dhcp_start_spoofing(const char *interface, const std::vector<DHCPSpoofRule>& rules);
 
+/**
+ * Serve clients without a rule from a dynamic lease pool; rules become
+ * static reservations on top of it. Call before dhcp_start_spoofing.
+ * @return false if spoofing is active or the range is invalid
+ */
+bool dhcp_set_pool(const DHCPPoolConfig& config);
+
+/**
+ * Serve from reactor, run by the caller, instead of a thread of our own
+ * (nullptr for the thread). Takes effect on the next start.
+ */
+void dhcp_set_reactor(Reactor *reactor);
+
+/**
+ * Take client messages from io, a DATAGRAMS backend such as a loopback or
+ * a capture replay, instead of a socket bound to the server port (nullptr
+ * for the socket). Stays owned by the caller. Takes effect on the next start.
+ */
+void dhcp_set_packet_io(PacketIo *io);
+
+/**
+ * UDP ports the server listens on and answers clients on (default 67 and
+ * 68), for load generators and tests that cannot take the real ones.
+ * Replies to relay agents go to the server port. Takes effect on the next start.
+ */
+void dhcp_set_ports(uint16_t server_port, uint16_t client_port);
+
+/**
+ * Lease counts of the running pool
+ * @return false if no pool is running
+ */
+bool dhcp_get_pool_stats(DhcpPoolStats *stats);
+
 /**
  * Stop DHCP spoofing
  */
@@ -60,4 +110,9 @@ bool dhcp_is_active();
  */
 void dhcp_spoof_cleanup();
 
+/**
+ * Format a hardware address as lowercase aa:bb:cc:dd:ee:ff
+ */
+std::string mac_to_string(const uint8_t *mac);
+
 #endif // DHCP_SPOOFING_H
\ No newline at end of file
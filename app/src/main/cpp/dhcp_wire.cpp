@@ -0,0 +1,142 @@
+#include "dhcp_wire.h"
+#include <cstring>
+#include <arpa/inet.h>
+
+static uint32_t read_addr(const uint8_t *p) {
+    uint32_t addr;
+    memcpy(&addr, p, 4);
+    return addr;
+}
+
+// Walk one options area; returns false if an option runs off its end.
+// The first instance of each option wins. overload is nullptr when
+// walking the file and sname fields, which cannot overload again.
+static bool parse_options(const uint8_t *p, size_t len, DhcpMessage *msg, uint8_t *overload) {
+    size_t pos = 0;
+    while (pos < len) {
+        uint8_t code = p[pos];
+        if (code == kDhcpOptEnd) return true;
+        if (code == kDhcpOptPad) {
+            pos++;
+            continue;
+        }
+        if (pos + 2 > len || pos + 2 + p[pos + 1] > len) return false;
+        uint8_t opt_len = p[pos + 1];
+        const uint8_t *value = p + pos + 2;
+        switch (code) {
+            case kDhcpOptMessageType:
+                if (opt_len == 1 && msg->type == 0) msg->type = value[0];
+                break;
+            case kDhcpOptRequestedIp:
+                if (opt_len == 4 && !msg->has_requested_ip) {
+                    msg->has_requested_ip = true;
+                    msg->requested_ip = read_addr(value);
+                }
+                break;
+            case kDhcpOptServerId:
+                if (opt_len == 4 && !msg->has_server_id) {
+                    msg->has_server_id = true;
+                    msg->server_id = read_addr(value);
+                }
+                break;
+            case kDhcpOptClientId:
+                if (opt_len >= 2 && !msg->client_id) {
+                    msg->client_id = value;
+                    msg->client_id_len = opt_len;
+                }
+                break;
+            case kDhcpOptOverload:
+                if (opt_len == 1 && overload) *overload = value[0];
+                break;
+        }
+        pos += 2 + opt_len;
+    }
+    return true;    // Tolerate a missing END, as most servers do
+}
+
+bool dhcp_parse_message(const uint8_t *packet, size_t len, DhcpMessage *msg) {
+    if (len < kDhcpOptionsOffset || packet[0] != kDhcpOpRequest) return false;
+    uint32_t cookie;
+    memcpy(&cookie, packet + kDhcpHeaderSize, 4);
+    if (ntohl(cookie) != kDhcpMagicCookie) return false;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->htype = packet[1];
+    msg->hlen = packet[2];
+    memcpy(&msg->xid, packet + 4, 4);
+    msg->flags = (uint16_t)((packet[10] << 8) | packet[11]);
+    msg->ciaddr = read_addr(packet + 12);
+    msg->giaddr = read_addr(packet + 24);
+    msg->chaddr = packet + 28;
+
+    uint8_t overload = 0;
+    if (!parse_options(packet + kDhcpOptionsOffset, len - kDhcpOptionsOffset, msg, &overload)) {
+        return false;
+    }
+    if ((overload & 1) && !parse_options(packet + kDhcpFileOffset, 128, msg, nullptr)) return false;
+    if ((overload & 2) && !parse_options(packet + kDhcpSnameOffset, 64, msg, nullptr)) return false;
+    return true;
+}
+
+static size_t put_option(uint8_t *out, size_t pos, uint8_t code, const void *value, uint8_t len) {
+    out[pos] = code;
+    out[pos + 1] = len;
+    memcpy(out + pos + 2, value, len);
+    return pos + 2 + len;
+}
+
+void dhcp_build_options_template(DhcpOptionsTemplate *tpl, uint32_t server_id, uint32_t subnet_mask,
+                                 uint32_t router, uint32_t dns_server, uint32_t lease_seconds) {
+    uint8_t *p = tpl->data;
+    uint8_t type = kDhcpAck;
+    size_t pos = put_option(p, 0, kDhcpOptMessageType, &type, 1);
+    pos = put_option(p, pos, kDhcpOptServerId, &server_id, 4);
+    tpl->nak_len = pos;
+
+    pos = put_option(p, pos, kDhcpOptSubnetMask, &subnet_mask, 4);
+    if (router) pos = put_option(p, pos, kDhcpOptRouter, &router, 4);
+    if (dns_server) pos = put_option(p, pos, kDhcpOptDnsServer, &dns_server, 4);
+    tpl->inform_len = pos;
+
+    // T1 and T2 at the RFC 2131 defaults of 50% and 87.5%
+    uint32_t lease = htonl(lease_seconds);
+    uint32_t renewal = htonl(lease_seconds / 2);
+    uint32_t rebinding = htonl((uint32_t)((uint64_t)lease_seconds * 7 / 8));
+    pos = put_option(p, pos, kDhcpOptLeaseTime, &lease, 4);
+    pos = put_option(p, pos, kDhcpOptRenewalTime, &renewal, 4);
+    pos = put_option(p, pos, kDhcpOptRebindingTime, &rebinding, 4);
+    tpl->len = pos;
+}
+
+size_t dhcp_build_reply(const DhcpMessage *msg, uint8_t type, uint32_t yiaddr,
+                        const DhcpOptionsTemplate *tpl, uint8_t *out, size_t cap) {
+    size_t options_len = type == kDhcpNak ? tpl->nak_len
+                       : msg->type == kDhcpInform ? tpl->inform_len : tpl->len;
+    size_t client_id_len = msg->client_id ? 2 + msg->client_id_len : 0;
+    size_t len = kDhcpOptionsOffset + options_len + client_id_len + 1;
+    if (len < kDhcpMinPacketSize) len = kDhcpMinPacketSize;
+    if (len > cap) return 0;
+
+    memset(out, 0, len);
+    out[0] = kDhcpOpReply;
+    out[1] = msg->htype;
+    out[2] = msg->hlen;
+    memcpy(out + 4, &msg->xid, 4);
+    out[10] = (uint8_t)(msg->flags >> 8);
+    out[11] = (uint8_t)(msg->flags & 0xff);
+    // ciaddr is echoed in ACKs to renewals and INFORMs, zero otherwise
+    if (type == kDhcpAck) memcpy(out + 12, &msg->ciaddr, 4);
+    if (type != kDhcpNak) memcpy(out + 16, &yiaddr, 4);
+    memcpy(out + 24, &msg->giaddr, 4);
+    memcpy(out + 28, msg->chaddr, 16);
+    uint32_t cookie = htonl(kDhcpMagicCookie);
+    memcpy(out + kDhcpHeaderSize, &cookie, 4);
+
+    uint8_t *opts = out + kDhcpOptionsOffset;
+    memcpy(opts, tpl->data, options_len);
+    opts[2] = type;
+    size_t pos = options_len;
+    if (msg->client_id) pos = put_option(opts, pos, kDhcpOptClientId, msg->client_id, msg->client_id_len);
+    opts[pos] = kDhcpOptEnd;
+    return len;
+}
@@ -0,0 +1,113 @@
+#ifndef DHCP_WIRE_H
+#define DHCP_WIRE_H
+
+#include <cstddef>
+#include <cstdint>
+
+static const uint16_t kDhcpServerPort = 67;
+static const uint16_t kDhcpClientPort = 68;
+
+// BOOTP header (RFC 2131 section 2), the magic cookie and the options after it
+static const uint32_t kDhcpMagicCookie = 0x63825363;
+static const size_t kDhcpHeaderSize = 236;
+static const size_t kDhcpOptionsOffset = 240;
+static const size_t kDhcpSnameOffset = 44;
+static const size_t kDhcpFileOffset = 108;
+// Some clients drop replies shorter than a BOOTP packet (RFC 1542 section 2.1)
+static const size_t kDhcpMinPacketSize = 300;
+static const uint16_t kDhcpFlagBroadcast = 0x8000;
+
+static const uint8_t kDhcpOpRequest = 1;
+static const uint8_t kDhcpOpReply = 2;
+
+// Option codes (RFC 2132)
+static const uint8_t kDhcpOptPad = 0;
+static const uint8_t kDhcpOptSubnetMask = 1;
+static const uint8_t kDhcpOptRouter = 3;
+static const uint8_t kDhcpOptDnsServer = 6;
+static const uint8_t kDhcpOptRequestedIp = 50;
+static const uint8_t kDhcpOptLeaseTime = 51;
+static const uint8_t kDhcpOptOverload = 52;
+static const uint8_t kDhcpOptMessageType = 53;
+static const uint8_t kDhcpOptServerId = 54;
+static const uint8_t kDhcpOptParamList = 55;
+static const uint8_t kDhcpOptMaxMessageSize = 57;
+static const uint8_t kDhcpOptRenewalTime = 58;
+static const uint8_t kDhcpOptRebindingTime = 59;
+static const uint8_t kDhcpOptClientId = 61;
+static const uint8_t kDhcpOptEnd = 255;
+
+// Message types (option 53)
+static const uint8_t kDhcpDiscover = 1;
+static const uint8_t kDhcpOffer = 2;
+static const uint8_t kDhcpRequest = 3;
+static const uint8_t kDhcpDecline = 4;
+static const uint8_t kDhcpAck = 5;
+static const uint8_t kDhcpNak = 6;
+static const uint8_t kDhcpRelease = 7;
+static const uint8_t kDhcpInform = 8;
+
+/**
+ * A client message, validated in place. Addresses stay in network byte
+ * order; pointers refer into the packet, so it must outlive the message.
+ */
+struct DhcpMessage {
+    uint8_t htype;
+    uint8_t hlen;
+    uint32_t xid;                   // Copied verbatim, never byte-swapped
+    uint16_t flags;                 // Host byte order
+    uint32_t ciaddr;
+    uint32_t giaddr;
+    const uint8_t *chaddr;          // 16 bytes
+    uint8_t type;                   // Option 53, 0 for plain BOOTP
+    bool has_requested_ip;
+    uint32_t requested_ip;
+    bool has_server_id;
+    uint32_t server_id;
+    const uint8_t *client_id;       // Option 61, nullptr if absent
+    uint8_t client_id_len;
+};
+
+/**
+ * Parse a BOOTREQUEST and the options the server acts on, without
+ * allocating. Options overloaded into the file and sname fields
+ * (option 52) are followed.
+ * @return false for replies, a missing cookie or truncated options
+ */
+bool dhcp_parse_message(const uint8_t *packet, size_t len, DhcpMessage *msg);
+
+// Longest options template: type, server ID, mask, router, DNS, lease, T1, T2
+static const size_t kDhcpTemplateCap = 48;
+
+/**
+ * The options a rule answers with, serialized once when the rule is
+ * added. Replies memcpy a prefix of it and patch the message type:
+ * NAKs carry only the type and server ID, INFORM ACKs stop before the
+ * lease times.
+ */
+struct DhcpOptionsTemplate {
+    uint8_t data[kDhcpTemplateCap];
+    size_t len;                     // Full lease options
+    size_t nak_len;                 // Type and server ID
+    size_t inform_len;              // Everything but the lease times
+};
+
+/**
+ * Serialize a rule's options; every address is in network byte order
+ * and router or dns may be 0 to leave the option out
+ */
+void dhcp_build_options_template(DhcpOptionsTemplate *tpl, uint32_t server_id, uint32_t subnet_mask,
+                                 uint32_t router, uint32_t dns_server, uint32_t lease_seconds);
+
+/**
+ * Build a reply to msg in out, padded to kDhcpMinPacketSize. The client
+ * identifier is echoed (RFC 6842).
+ * @param type kDhcpOffer, kDhcpAck or kDhcpNak; an ACK to an INFORM
+ *             leaves out the lease times
+ * @param yiaddr Address handed to the client, network byte order
+ * @return Size of the reply, or 0 if it does not fit in cap
+ */
+size_t dhcp_build_reply(const DhcpMessage *msg, uint8_t type, uint32_t yiaddr,
+                        const DhcpOptionsTemplate *tpl, uint8_t *out, size_t cap);
+
+#endif // DHCP_WIRE_H
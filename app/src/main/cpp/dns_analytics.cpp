@@ -0,0 +1,332 @@
+#include "dns_analytics.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <time.h>
+
+// Counters per bucket summary; more counters, tighter error bounds
+static const int kPairCounters = 32;
+static const int kDomainCounters = 32;
+static const int kClientCounters = 16;
+static const int kRecentQueries = 128;      // Per shard
+static const size_t kNameLen = 64;          // Stored name including NUL
+
+/**
+ * Space-Saving summary with N counters. Keys sit in their own array so
+ * the per-query search scans a few cache lines.
+ */
+template <int N, bool kNamed>
+struct ss_summary {
+    int used;
+    uint64_t keys[N];
+    uint32_t counts[N];
+    uint32_t errors[N];
+    uint32_t clients[N];
+    char names[kNamed ? N : 1][kNameLen];
+
+    void clear() {
+        used = 0;
+    }
+
+    void add(uint64_t key, uint32_t client, const char *name) {
+        for (int i = 0; i < used; i++) {
+            if (keys[i] == key) {
+                counts[i]++;
+                return;
+            }
+        }
+        int slot;
+        uint32_t floor = 0;
+        if (used < N) {
+            slot = used++;
+        } else {
+            // Replace the smallest counter; the newcomer inherits its count as error
+            slot = 0;
+            for (int i = 1; i < N; i++) {
+                if (counts[i] < counts[slot]) slot = i;
+            }
+            floor = counts[slot];
+        }
+        keys[slot] = key;
+        counts[slot] = floor + 1;
+        errors[slot] = floor;
+        clients[slot] = client;
+        if constexpr (kNamed) {
+            memcpy(names[slot], name, kNameLen);
+        }
+    }
+};
+
+struct minute_bucket {
+    int64_t minute;             // Monotonic minute the bucket holds, -1 if unused
+    uint64_t queries;
+    uint64_t outcomes[kDnsOutcomeCount];
+    ss_summary<kPairCounters, true> pairs;      // (client, domain)
+    ss_summary<kDomainCounters, true> domains;
+    ss_summary<kClientCounters, false> clients;
+};
+
+struct recent_entry {
+    int64_t time_ms;
+    uint32_t client;
+    uint16_t qtype;
+    uint8_t outcome;
+    char name[kNameLen];
+};
+
+struct analytics_shard {
+    std::mutex mutex;           // Taken by the owning worker and by readers
+    minute_bucket buckets[kDnsAnalyticsMaxMinutes];
+    recent_entry recent[kRecentQueries];
+    uint64_t recent_count;
+};
+
+struct DnsAnalytics {
+    int shard_count;
+    std::atomic<analytics_shard*> *shards;
+};
+
+static int64_t monotonic_minute() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec / 60;
+}
+
+static int64_t wall_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t name_hash(const char *name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t pair_key(uint64_t domain_key, uint32_t client) {
+    uint64_t key = domain_key ^ ((uint64_t)client * 0x9e3779b97f4a7c15ULL);
+    key ^= key >> 33;
+    return key * 0xff51afd7ed558ccdULL;
+}
+
+// Keep the tail of long names: the registrable domain is at the end
+static void copy_name(char *out, const char *name, size_t len) {
+    if (len >= kNameLen) {
+        name += len - (kNameLen - 1);
+        len = kNameLen - 1;
+    }
+    memcpy(out, name, len);
+    memset(out + len, 0, kNameLen - len);
+}
+
+static void clear_shard(analytics_shard *shard) {
+    for (auto& bucket : shard->buckets) {
+        bucket.minute = -1;
+    }
+    shard->recent_count = 0;
+}
+
+DnsAnalytics *dns_analytics_create(int shard_count) {
+    DnsAnalytics *analytics = new DnsAnalytics();
+    analytics->shard_count = shard_count;
+    analytics->shards = new std::atomic<analytics_shard*>[shard_count];
+    for (int i = 0; i < shard_count; i++) {
+        analytics->shards[i].store(nullptr);
+    }
+    return analytics;
+}
+
+void dns_analytics_destroy(DnsAnalytics *analytics) {
+    if (!analytics) return;
+    for (int i = 0; i < analytics->shard_count; i++) {
+        delete analytics->shards[i].load();
+    }
+    delete[] analytics->shards;
+    delete analytics;
+}
+
+void dns_analytics_record(DnsAnalytics *analytics, int shard_index, uint32_t client,
+                          const char *domain, size_t domain_len, uint16_t qtype,
+                          DnsQueryOutcome outcome) {
+    if (!analytics || shard_index < 0 || shard_index >= analytics->shard_count) return;
+    analytics_shard *shard = analytics->shards[shard_index].load(std::memory_order_acquire);
+    if (!shard) {
+        // Only this shard's writer allocates it
+        shard = new analytics_shard();
+        clear_shard(shard);
+        analytics->shards[shard_index].store(shard, std::memory_order_release);
+    }
+
+    char name[kNameLen];
+    uint64_t domain_key = 0;
+    if (domain) {
+        copy_name(name, domain, domain_len);
+        domain_key = name_hash(domain, domain_len);
+    } else {
+        memset(name, 0, sizeof(name));
+    }
+    int64_t minute = monotonic_minute();
+    int64_t now_ms = wall_clock_ms();
+
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    minute_bucket *bucket = &shard->buckets[minute % kDnsAnalyticsMaxMinutes];
+    if (bucket->minute != minute) {
+        bucket->minute = minute;
+        bucket->queries = 0;
+        memset(bucket->outcomes, 0, sizeof(bucket->outcomes));
+        bucket->pairs.clear();
+        bucket->domains.clear();
+        bucket->clients.clear();
+    }
+    bucket->queries++;
+    bucket->outcomes[(int)outcome]++;
+    bucket->clients.add(client, client, nullptr);
+    if (domain) {
+        bucket->domains.add(domain_key, 0, name);
+        bucket->pairs.add(pair_key(domain_key, client), client, name);
+    }
+
+    recent_entry *entry = &shard->recent[shard->recent_count++ % kRecentQueries];
+    entry->time_ms = now_ms;
+    entry->client = client;
+    entry->qtype = qtype;
+    entry->outcome = (uint8_t)outcome;
+    memcpy(entry->name, name, kNameLen);
+}
+
+struct merged_counter {
+    uint64_t count;
+    uint64_t error;
+    uint32_t client;
+    std::string name;           // Copied, since the shard is unlocked after merging
+};
+
+// Sum one summary's counters into the merged map
+template <int N, bool kNamed>
+static void merge_summary(const ss_summary<N, kNamed>& summary, uint32_t client_filter,
+                          std::unordered_map<uint64_t, merged_counter> *merged) {
+    for (int i = 0; i < summary.used; i++) {
+        if (client_filter && summary.clients[i] != client_filter) continue;
+        merged_counter& counter = (*merged)[summary.keys[i]];
+        if (counter.count == 0) {
+            counter.client = summary.clients[i];
+            if constexpr (kNamed) counter.name = summary.names[i];
+        }
+        counter.count += summary.counts[i];
+        counter.error += summary.errors[i];
+    }
+}
+
+// Walk every bucket of the window across all shards, with each shard locked
+template <typename Fn>
+static void for_each_bucket(DnsAnalytics *analytics, int minutes, Fn fn) {
+    if (!analytics) return;
+    minutes = std::max(1, std::min(minutes, kDnsAnalyticsMaxMinutes));
+    int64_t now = monotonic_minute();
+    for (int i = 0; i < analytics->shard_count; i++) {
+        analytics_shard *shard = analytics->shards[i].load(std::memory_order_acquire);
+        if (!shard) continue;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for (const auto& bucket : shard->buckets) {
+            if (bucket.minute >= 0 && bucket.minute > now - minutes && bucket.minute <= now) {
+                fn(bucket);
+            }
+        }
+    }
+}
+
+static std::vector<DnsTopEntry> rank(std::unordered_map<uint64_t, merged_counter>& merged, size_t limit) {
+    std::vector<DnsTopEntry> entries;
+    entries.reserve(merged.size());
+    for (auto& item : merged) {
+        merged_counter& counter = item.second;
+        entries.push_back({std::move(counter.name), counter.client, counter.count, counter.error});
+    }
+    std::sort(entries.begin(), entries.end(), [](const DnsTopEntry& a, const DnsTopEntry& b) {
+        if (a.count != b.count) return a.count > b.count;
+        return a.domain != b.domain ? a.domain < b.domain : a.client < b.client;
+    });
+    if (entries.size() > limit) entries.resize(limit);
+    return entries;
+}
+
+std::vector<DnsTopEntry> dns_analytics_top_domains(DnsAnalytics *analytics, int minutes,
+                                                   uint32_t client, size_t limit) {
+    std::unordered_map<uint64_t, merged_counter> merged;
+    for_each_bucket(analytics, minutes, [&](const minute_bucket& bucket) {
+        // Per-client rankings come from the pair summaries
+        if (client) {
+            merge_summary(bucket.pairs, client, &merged);
+        } else {
+            merge_summary(bucket.domains, 0, &merged);
+        }
+    });
+    return rank(merged, limit);
+}
+
+std::vector<DnsTopEntry> dns_analytics_top_clients(DnsAnalytics *analytics, int minutes, size_t limit) {
+    std::unordered_map<uint64_t, merged_counter> merged;
+    for_each_bucket(analytics, minutes, [&](const minute_bucket& bucket) {
+        merge_summary(bucket.clients, 0, &merged);
+    });
+    return rank(merged, limit);
+}
+
+std::vector<DnsRecentQuery> dns_analytics_recent(DnsAnalytics *analytics, size_t limit) {
+    std::vector<DnsRecentQuery> queries;
+    if (!analytics) return queries;
+    for (int i = 0; i < analytics->shard_count; i++) {
+        analytics_shard *shard = analytics->shards[i].load(std::memory_order_acquire);
+        if (!shard) continue;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        uint64_t count = std::min<uint64_t>(shard->recent_count, kRecentQueries);
+        for (uint64_t n = 0; n < count; n++) {
+            const recent_entry& entry = shard->recent[(shard->recent_count - 1 - n) % kRecentQueries];
+            queries.push_back({entry.time_ms, entry.client, entry.qtype, (DnsQueryOutcome)entry.outcome,
+                               std::string(entry.name)});
+        }
+    }
+    std::stable_sort(queries.begin(), queries.end(), [](const DnsRecentQuery& a, const DnsRecentQuery& b) {
+        return a.time_ms > b.time_ms;
+    });
+    if (queries.size() > limit) queries.resize(limit);
+    return queries;
+}
+
+DnsAnalyticsTotals dns_analytics_totals(DnsAnalytics *analytics, int minutes) {
+    DnsAnalyticsTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    for_each_bucket(analytics, minutes, [&](const minute_bucket& bucket) {
+        totals.queries += bucket.queries;
+        for (int i = 0; i < kDnsOutcomeCount; i++) {
+            totals.outcomes[i] += bucket.outcomes[i];
+        }
+    });
+    return totals;
+}
+
+void dns_analytics_reset(DnsAnalytics *analytics) {
+    if (!analytics) return;
+    for (int i = 0; i < analytics->shard_count; i++) {
+        analytics_shard *shard = analytics->shards[i].load(std::memory_order_acquire);
+        if (!shard) continue;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        clear_shard(shard);
+    }
+}
+
+const char *dns_analytics_outcome_name(DnsQueryOutcome outcome) {
+    switch (outcome) {
+        case DnsQueryOutcome::SPOOFED: return "spoofed";
+        case DnsQueryOutcome::BLOCKED: return "blocked";
+        case DnsQueryOutcome::CACHED: return "cached";
+        case DnsQueryOutcome::FORWARDED: return "forwarded";
+        case DnsQueryOutcome::DROPPED: return "dropped";
+    }
+    return "unknown";
+}
@@ -0,0 +1,113 @@
+#ifndef DNS_ANALYTICS_H
+#define DNS_ANALYTICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * How the engine disposed of a query
+ */
+enum class DnsQueryOutcome {
+    SPOOFED,    // Answered from a rule
+    BLOCKED,    // Sinkholed by the blocklist
+    CACHED,     // Answered from the upstream answer cache
+    FORWARDED,  // Sent to an upstream resolver
+    DROPPED     // Malformed, or no upstream could take it
+};
+
+static const int kDnsOutcomeCount = 5;
+
+/**
+ * Bounded-memory query analytics for the DNS engine. Each worker records
+ * into its own shard, so the packet path only ever takes an uncontended
+ * lock. A shard keeps one-minute buckets for the last hour. Each bucket
+ * holds Space-Saving summaries of the heaviest (client, domain) pairs,
+ * domains and clients, plus per-outcome totals. The shard also keeps a
+ * ring of its most recent queries. Reads merge every shard and the
+ * buckets of the requested window. Memory is fixed when the shard is
+ * created, however long the engine runs.
+ *
+ * Counts are Space-Saving estimates: never below the true count and at
+ * most error above it.
+ */
+struct DnsAnalytics;
+
+// Longest window a query can cover
+static const int kDnsAnalyticsMaxMinutes = 60;
+
+struct DnsTopEntry {
+    std::string domain;     // Empty for client rankings
+    uint32_t client;        // Network byte order, 0 for domain rankings over all clients
+    uint64_t count;
+    uint64_t error;         // Upper bound on the overestimate in count
+};
+
+struct DnsRecentQuery {
+    int64_t time_ms;        // Wall clock, milliseconds since the epoch
+    uint32_t client;        // Network byte order
+    uint16_t qtype;
+    DnsQueryOutcome outcome;
+    std::string domain;     // Empty if the query could not be parsed
+};
+
+struct DnsAnalyticsTotals {
+    uint64_t queries;
+    uint64_t outcomes[kDnsOutcomeCount];
+};
+
+/**
+ * Create analytics with room for shard_count writers. A shard's memory is
+ * allocated on its first dns_analytics_record.
+ */
+DnsAnalytics *dns_analytics_create(int shard_count);
+
+/**
+ * Free the analytics; no writer or reader may still be using them
+ */
+void dns_analytics_destroy(DnsAnalytics *analytics);
+
+/**
+ * Record one query. Only one thread may write a given shard.
+ * @param client Client IPv4 address in network byte order
+ * @param domain Lowercased query name, or nullptr if it could not be parsed.
+ *               Names longer than 63 characters are kept by their last 63.
+ */
+void dns_analytics_record(DnsAnalytics *analytics, int shard, uint32_t client,
+                          const char *domain, size_t domain_len, uint16_t qtype,
+                          DnsQueryOutcome outcome);
+
+/**
+ * Heaviest domains over the last minutes (1 to kDnsAnalyticsMaxMinutes)
+ * @param client Only queries from this client (network byte order), or 0 for everyone
+ */
+std::vector<DnsTopEntry> dns_analytics_top_domains(DnsAnalytics *analytics, int minutes,
+                                                   uint32_t client, size_t limit);
+
+/**
+ * Busiest clients over the last minutes
+ */
+std::vector<DnsTopEntry> dns_analytics_top_clients(DnsAnalytics *analytics, int minutes, size_t limit);
+
+/**
+ * Most recent queries, newest first
+ */
+std::vector<DnsRecentQuery> dns_analytics_recent(DnsAnalytics *analytics, size_t limit);
+
+/**
+ * Exact query and outcome counts over the last minutes
+ */
+DnsAnalyticsTotals dns_analytics_totals(DnsAnalytics *analytics, int minutes);
+
+/**
+ * Forget everything recorded so far
+ */
+void dns_analytics_reset(DnsAnalytics *analytics);
+
+/**
+ * Printable name of an outcome ("spoofed", "blocked", ...)
+ */
+const char *dns_analytics_outcome_name(DnsQueryOutcome outcome);
+
+#endif // DNS_ANALYTICS_H
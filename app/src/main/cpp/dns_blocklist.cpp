@@ -0,0 +1,338 @@
+#include "dns_blocklist.h"
+#include "harpy_log.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+#define LOG_TAG "DNSBlocklist"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// File layout: header, Bloom blocks, fingerprint table. All fields are
+// little-endian, which every supported ABI is.
+static const char kMagic[8] = {'H', 'A', 'R', 'P', 'Y', 'B', 'L', '1'};
+static const uint32_t kFormatVersion = 1;
+static const uint32_t kBloomBitsPerEntry = 10;   // About 1% false positives with k = 7
+static const uint32_t kBloomHashes = 7;
+static const uint32_t kBloomBlockBits = 512;     // One cache line per name
+static const uint64_t kWildcardTweak = 0x9e3779b97f4a7c15ULL;
+
+struct blocklist_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t table_slots;        // Open addressing, at most 75% full
+    uint32_t bloom_blocks;       // Power of two
+    uint64_t seed;
+    uint64_t bloom_offset;
+    uint64_t table_offset;
+};
+static_assert(sizeof(blocklist_header) == 48, "blocklist header layout");
+
+struct DnsBlocklist {
+    void *base;
+    size_t size;
+    const blocklist_header *header;
+    const uint64_t *bloom;       // bloom_blocks * 8 words
+    const uint64_t *table;       // table_slots fingerprints, 0 = empty
+};
+
+static int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FNV-1a followed by a MurmurHash3 finalizer so every bit of the
+// fingerprint is usable for the Bloom filter and the table index
+static uint64_t fingerprint(const char *name, size_t len, bool wildcard, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed ^ (wildcard ? kWildcardTweak : 0);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;   // 0 marks an empty table slot
+}
+
+static inline uint32_t table_start(uint64_t fp, uint32_t slots) {
+    return (uint32_t)(((fp >> 32) * (uint64_t)slots) >> 32);
+}
+
+static inline const uint64_t *bloom_block(const uint64_t *bloom, uint32_t blocks, uint64_t fp) {
+    return bloom + (size_t)(fp & (blocks - 1)) * (kBloomBlockBits / 64);
+}
+
+// k bit positions within the block, nine bits each. fp is remixed so the
+// positions do not depend on the low bits that already picked the block.
+static inline uint64_t bloom_bits(uint64_t fp) {
+    uint64_t bits = (fp ^ (fp >> 31)) * 0x94d049bb133111ebULL;
+    return bits ^ (bits >> 29);
+}
+
+static bool bloom_test(const DnsBlocklist *list, uint64_t fp) {
+    const uint64_t *block = bloom_block(list->bloom, list->header->bloom_blocks, fp);
+    uint64_t bits = bloom_bits(fp);
+    for (uint32_t i = 0; i < kBloomHashes; i++) {
+        uint32_t bit = (bits >> (i * 9)) & (kBloomBlockBits - 1);
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) return false;
+    }
+    return true;
+}
+
+static bool table_contains(const DnsBlocklist *list, uint64_t fp) {
+    uint32_t slots = list->header->table_slots;
+    for (uint32_t i = table_start(fp, slots);; i = (i + 1 == slots) ? 0 : i + 1) {
+        uint64_t entry = list->table[i];
+        if (entry == fp) return true;
+        if (entry == 0) return false;
+    }
+}
+
+static bool lookup(const DnsBlocklist *list, const char *name, size_t len, bool wildcard) {
+    uint64_t fp = fingerprint(name, len, wildcard, list->header->seed);
+    return bloom_test(list, fp) && table_contains(list, fp);
+}
+
+// Hosts-file entries that name the machine itself rather than a blocked host
+static bool is_hosts_builtin(const std::string& name) {
+    return name == "localhost" || name == "localhost.localdomain" || name == "local" ||
+           name == "broadcasthost" || name == "0.0.0.0" || name.compare(0, 4, "ip6-") == 0;
+}
+
+static bool looks_like_address(const std::string& token) {
+    uint8_t addr[16];
+    return inet_pton(AF_INET, token.c_str(), addr) == 1 || inet_pton(AF_INET6, token.c_str(), addr) == 1;
+}
+
+// Normalize one entry; returns false if it is not a usable domain.
+// "||name^" blocks the name and everything below it, "*.name" only below.
+static bool normalize_entry(std::string token, std::string *name, bool *wildcard, bool *exact) {
+    *wildcard = false;
+    *exact = true;
+    if (token.size() > 3 && token.compare(0, 2, "||") == 0 && token.back() == '^') {
+        token = token.substr(2, token.size() - 3);
+        *wildcard = true;
+    } else if (token.size() > 2 && token.compare(0, 2, "*.") == 0) {
+        token = token.substr(2);
+        *wildcard = true;
+        *exact = false;
+    }
+    if (!token.empty() && token.back() == '.') token.pop_back();
+    if (token.empty() || token.size() > 253 || token[0] == '.') return false;
+
+    for (auto& c : token) {
+        c = (char)tolower((unsigned char)c);
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') return false;
+    }
+    if (token.find("..") != std::string::npos || is_hosts_builtin(token)) return false;
+    *name = token;
+    return true;
+}
+
+static void collect_file(const std::string& path, uint64_t seed, std::vector<uint64_t> *fps,
+                         size_t *skipped) {
+    std::ifstream in(path);
+    if (!in) {
+        LOGE("Cannot read blocklist source %s", path.c_str());
+        return;
+    }
+    std::string line;
+    std::string name;
+    while (std::getline(in, line)) {
+        size_t hash_pos = line.find('#');
+        if (hash_pos != std::string::npos) line.resize(hash_pos);
+        if (!line.empty() && line[0] == '!') continue;   // Adblock comment
+
+        // "0.0.0.0 a.com b.com" in hosts files, a bare domain otherwise
+        size_t pos = 0;
+        bool first = true;
+        while (pos < line.size()) {
+            size_t start = line.find_first_not_of(" \t\r", pos);
+            if (start == std::string::npos) break;
+            size_t end = line.find_first_of(" \t\r", start);
+            if (end == std::string::npos) end = line.size();
+            std::string token = line.substr(start, end - start);
+            pos = end;
+
+            if (first && looks_like_address(token)) {
+                first = false;
+                continue;
+            }
+            first = false;
+            bool wildcard, exact;
+            if (normalize_entry(token, &name, &wildcard, &exact)) {
+                if (exact) fps->push_back(fingerprint(name.data(), name.size(), false, seed));
+                if (wildcard) fps->push_back(fingerprint(name.data(), name.size(), true, seed));
+            } else {
+                (*skipped)++;
+            }
+        }
+    }
+}
+
+bool dns_blocklist_compile(const std::vector<std::string>& inputs, const char *output_path,
+                           size_t *domain_count) {
+    int64_t start_us = monotonic_us();
+    uint64_t seed = 0x68617270796200ULL;   // Fixed so identical sources give identical files
+
+    std::vector<uint64_t> fps;
+    size_t skipped = 0;
+    for (const auto& path : inputs) {
+        collect_file(path, seed, &fps, &skipped);
+    }
+    std::sort(fps.begin(), fps.end());
+    fps.erase(std::unique(fps.begin(), fps.end()), fps.end());
+    if (fps.size() > UINT32_MAX / 2) {
+        LOGE("Blocklist too large: %zu entries", fps.size());
+        return false;
+    }
+
+    blocklist_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kFormatVersion;
+    header.count = (uint32_t)fps.size();
+    header.table_slots = header.count + header.count / 3 + 16;
+    header.bloom_blocks = 1;
+    while ((uint64_t)header.bloom_blocks * kBloomBlockBits < (uint64_t)header.count * kBloomBitsPerEntry) {
+        header.bloom_blocks <<= 1;
+    }
+    header.seed = seed;
+    header.bloom_offset = sizeof(header);
+    header.table_offset = header.bloom_offset + (uint64_t)header.bloom_blocks * (kBloomBlockBits / 8);
+
+    std::vector<uint64_t> bloom((size_t)header.bloom_blocks * (kBloomBlockBits / 64), 0);
+    std::vector<uint64_t> table(header.table_slots, 0);
+    for (uint64_t fp : fps) {
+        uint64_t *block = &bloom[(size_t)(fp & (header.bloom_blocks - 1)) * (kBloomBlockBits / 64)];
+        uint64_t bits = bloom_bits(fp);
+        for (uint32_t i = 0; i < kBloomHashes; i++) {
+            uint32_t bit = (bits >> (i * 9)) & (kBloomBlockBits - 1);
+            block[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        uint32_t slot = table_start(fp, header.table_slots);
+        while (table[slot] != 0) {
+            slot = (slot + 1 == header.table_slots) ? 0 : slot + 1;
+        }
+        table[slot] = fp;
+    }
+
+    std::string tmp_path = std::string(output_path) + ".tmp";
+    FILE *out = fopen(tmp_path.c_str(), "wb");
+    if (!out) {
+        LOGE("Cannot create %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(bloom.data(), sizeof(uint64_t), bloom.size(), out) == bloom.size() &&
+              fwrite(table.data(), sizeof(uint64_t), table.size(), out) == table.size();
+    ok = (fflush(out) == 0) && ok && (fsync(fileno(out)) == 0);
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), output_path) != 0) {
+        LOGE("Failed to write blocklist %s: %s", output_path, strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    if (domain_count) *domain_count = fps.size();
+    LOGD("Compiled %zu blocklist entries (%zu skipped) into %s in %lld ms", fps.size(), skipped,
+         output_path, (long long)((monotonic_us() - start_us) / 1000));
+    return true;
+}
+
+// madvise() wants a page-aligned start, so widen the range to whole pages;
+// the page shared by the filter and the table gets both hints, which is fine
+static void advise_range(void *base, uint64_t offset, uint64_t len, int advice, const char *path) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+    if (madvise((uint8_t *)base + start, offset + len - start, advice) < 0) {
+        LOGE("madvise(%d) on blocklist %s failed: %s", advice, path, strerror(errno));
+    }
+}
+
+DnsBlocklist *dns_blocklist_open(const char *path) {
+    int64_t start_us = monotonic_us();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Cannot open blocklist %s: %s", path, strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(blocklist_header)) {
+        LOGE("Blocklist %s is truncated", path);
+        close(fd);
+        return nullptr;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);   // The mapping keeps the file alive
+    if (base == MAP_FAILED) {
+        LOGE("Cannot map blocklist %s: %s", path, strerror(errno));
+        return nullptr;
+    }
+
+    const blocklist_header *header = (const blocklist_header *)base;
+    uint64_t bloom_bytes = (uint64_t)header->bloom_blocks * (kBloomBlockBits / 8);
+    uint64_t table_bytes = (uint64_t)header->table_slots * sizeof(uint64_t);
+    bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+                 header->version == kFormatVersion &&
+                 header->bloom_blocks != 0 && (header->bloom_blocks & (header->bloom_blocks - 1)) == 0 &&
+                 header->table_slots > header->count &&
+                 header->bloom_offset == sizeof(blocklist_header) &&
+                 header->table_offset == header->bloom_offset + bloom_bytes &&
+                 header->table_offset + table_bytes <= (uint64_t)st.st_size;
+    if (!valid) {
+        LOGE("Blocklist %s is not a valid index", path);
+        munmap(base, st.st_size);
+        return nullptr;
+    }
+
+    // The filter is hit on every query; the table only on likely matches
+    advise_range(base, header->bloom_offset, bloom_bytes, MADV_WILLNEED, path);
+    advise_range(base, header->table_offset, table_bytes, MADV_RANDOM, path);
+
+    DnsBlocklist *list = new DnsBlocklist();
+    list->base = base;
+    list->size = st.st_size;
+    list->header = header;
+    list->bloom = (const uint64_t *)((const uint8_t *)base + header->bloom_offset);
+    list->table = (const uint64_t *)((const uint8_t *)base + header->table_offset);
+    LOGD("Mapped blocklist %s: %u entries, %zu bytes in %lld us", path, header->count,
+         list->size, (long long)(monotonic_us() - start_us));
+    return list;
+}
+
+void dns_blocklist_close(const DnsBlocklist *blocklist) {
+    if (!blocklist) return;
+    munmap(blocklist->base, blocklist->size);
+    delete blocklist;
+}
+
+bool dns_blocklist_contains(const DnsBlocklist *blocklist, const char *name, size_t len) {
+    if (!blocklist || len == 0 || blocklist->header->count == 0) return false;
+    if (lookup(blocklist, name, len, false)) return true;
+
+    // Wildcard entries for every parent: "a.b.example.com" checks
+    // "*.b.example.com", "*.example.com", "*.com"
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.' && lookup(blocklist, name + i + 1, len - i - 1, true)) return true;
+    }
+    return false;
+}
+
+size_t dns_blocklist_size(const DnsBlocklist *blocklist) {
+    return blocklist ? blocklist->header->count : 0;
+}
@@ -0,0 +1,67 @@
+#ifndef DNS_BLOCKLIST_H
+#define DNS_BLOCKLIST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Immutable, memory-mapped domain blocklist.
+ *
+ * dns_blocklist_compile turns hosts files or plain domain lists into a
+ * binary index: a blocked Bloom filter (one cache line per name) in front
+ * of an open-addressing table of 64-bit name fingerprints. The engine maps
+ * the file read-only, so loading is O(1), the pages are shared with every
+ * other process using the same file and survive in the page cache across
+ * restarts. Only the filter is touched for most names that are not listed.
+ *
+ * Entries written as "*.example.com" block every name below the domain,
+ * "||example.com^" the domain and every name below it; all other entries
+ * match exactly.
+ */
+struct DnsBlocklist;
+
+/**
+ * How the engine answers a blocked name
+ */
+enum class DnsBlockMode {
+    NXDOMAIN,   // Name does not exist
+    ZERO_IP     // 0.0.0.0 or :: for A/AAAA queries, empty NOERROR otherwise
+};
+
+/**
+ * Compile blocklist sources into an index file. The output is written to a
+ * temporary file and renamed over output_path, so engines that have the
+ * old index mapped keep working.
+ * @param inputs Paths of hosts-format or one-domain-per-line files
+ * @param output_path Where to write the index
+ * @param domain_count Set to the number of distinct fingerprints (may be nullptr)
+ * @return true on success
+ */
+bool dns_blocklist_compile(const std::vector<std::string>& inputs, const char *output_path,
+                           size_t *domain_count);
+
+/**
+ * Map a compiled index
+ * @return The blocklist, or nullptr if the file is missing or invalid
+ */
+DnsBlocklist *dns_blocklist_open(const char *path);
+
+/**
+ * Unmap the index
+ */
+void dns_blocklist_close(const DnsBlocklist *blocklist);
+
+/**
+ * Check a lowercased name (no trailing dot) against the index, including
+ * wildcard entries for each of its parent domains
+ */
+bool dns_blocklist_contains(const DnsBlocklist *blocklist, const char *name, size_t len);
+
+/**
+ * Number of fingerprints in the index (an "||" entry counts twice)
+ */
+size_t dns_blocklist_size(const DnsBlocklist *blocklist);
+
+#endif // DNS_BLOCKLIST_H
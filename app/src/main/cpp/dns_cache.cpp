@@ -0,0 +1,344 @@
+#include "dns_cache.h"
+#include "dns_wire.h"
+#include "harpy_log.h"
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+
+#define LOG_TAG "DNSCache"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+
+static const size_t kCacheShards = 16;              // Power of two
+static const size_t kMaxKeyLen = 255 + 4;           // Wire name + QTYPE + QCLASS
+static const size_t kMaxCachedAnswer = 4096;
+static const uint32_t kMaxPositiveTtl = 86400;
+static const uint32_t kMaxNegativeTtl = 10800;      // RFC 2308 section 5
+static const size_t kEntryOverhead = 96;            // Entry, map node and vector headers
+
+struct cache_entry {
+    bool used;
+    bool referenced;                // CLOCK bit, set on every hit
+    uint64_t hash;
+    uint16_t key_len;
+    uint16_t answer_len;
+    uint16_t opt_offset;            // Start of a trailing OPT record, 0 if none
+    int64_t stored_ms;
+    int64_t expires_ms;
+    std::vector<uint8_t> data;      // Key, then the answer
+    std::vector<uint16_t> ttl_offsets;
+    size_t cost;
+};
+
+struct cache_shard {
+    std::mutex mutex;
+    std::vector<cache_entry> entries;
+    std::vector<uint32_t> free_entries;
+    std::unordered_map<uint64_t, uint32_t> index;
+    size_t clock_hand;
+    size_t bytes;
+    size_t max_bytes;
+};
+
+struct DnsCache {
+    cache_shard shards[kCacheShards];
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> inserts;
+    std::atomic<uint64_t> evictions;
+};
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a over the normalized key
+static uint64_t hash_key(const uint8_t *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copy the first question into key with the name lowercased. Questions are
+// never compressed, so a pointer means the packet is not usable as a key.
+// Returns the key length and sets *qend, or returns 0.
+static size_t build_key(const uint8_t *packet, size_t len, uint8_t *key, size_t *qend) {
+    size_t pos = kDnsHeaderSize;
+    size_t key_len = 0;
+    while (pos < len) {
+        uint8_t label = packet[pos];
+        if (label & 0xC0) return 0;
+        if (pos + label + 1 > len || key_len + label + 1 > kMaxKeyLen - 4) return 0;
+        key[key_len++] = label;
+        pos++;
+        if (label == 0) break;
+        for (uint8_t i = 0; i < label; i++) {
+            uint8_t c = packet[pos++];
+            key[key_len++] = (c >= 'A' && c <= 'Z') ? (uint8_t)(c + 32) : c;
+        }
+    }
+    if (key_len == 0 || key[key_len - 1] != 0 || pos + 4 > len) return 0;
+    memcpy(key + key_len, packet + pos, 4);
+    *qend = pos + 4;
+    return key_len + 4;
+}
+
+static void release_entry(DnsCache *cache, cache_shard *shard, uint32_t slot) {
+    cache_entry *entry = &shard->entries[slot];
+    shard->index.erase(entry->hash);
+    shard->bytes -= entry->cost;
+    entry->used = false;
+    entry->data.clear();
+    entry->data.shrink_to_fit();
+    entry->ttl_offsets.clear();
+    entry->ttl_offsets.shrink_to_fit();
+    shard->free_entries.push_back(slot);
+    cache->evictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+// CLOCK sweep: expired or unreferenced entries go, referenced ones get a
+// second chance. Two full turns always free something if anything is stored.
+static void make_room(DnsCache *cache, cache_shard *shard, size_t needed, int64_t now) {
+    size_t budget = shard->entries.size() * 2;
+    while (shard->bytes + needed > shard->max_bytes && !shard->index.empty() && budget-- > 0) {
+        if (shard->clock_hand >= shard->entries.size()) shard->clock_hand = 0;
+        uint32_t slot = (uint32_t)shard->clock_hand++;
+        cache_entry *entry = &shard->entries[slot];
+        if (!entry->used) continue;
+        if (entry->referenced && entry->expires_ms > now) {
+            entry->referenced = false;
+            continue;
+        }
+        release_entry(cache, shard, slot);
+    }
+}
+
+DnsCache *dns_cache_create(size_t max_bytes) {
+    DnsCache *cache = new DnsCache();
+    for (auto& shard : cache->shards) {
+        shard.clock_hand = 0;
+        shard.bytes = 0;
+        shard.max_bytes = max_bytes / kCacheShards;
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->inserts = 0;
+    cache->evictions = 0;
+    LOGD("DNS cache created with a %zu byte cap", max_bytes);
+    return cache;
+}
+
+void dns_cache_destroy(DnsCache *cache) {
+    delete cache;
+}
+
+size_t dns_cache_lookup(DnsCache *cache, const uint8_t *query, size_t query_len, bool over_tcp,
+                        uint8_t *out, size_t out_cap) {
+    uint8_t key[kMaxKeyLen];
+    size_t qend;
+    size_t key_len = build_key(query, query_len, key, &qend);
+    if (key_len == 0 || dns_read_u16(query + 4) != 1) {
+        cache->misses.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // Clients without EDNS0 get neither the OPT record nor, over UDP, more
+    // than 512 bytes
+    bool client_edns = dns_read_u16(query + 10) != 0 &&
+                       qend + 11 <= query_len && query[qend] == 0 &&
+                       dns_read_u16(query + qend + 1) == kDnsTypeOPT;
+    size_t limit = over_tcp ? out_cap : dns_client_udp_limit(query, query_len, qend);
+    if (limit > out_cap) limit = out_cap;
+
+    uint64_t hash = hash_key(key, key_len);
+    cache_shard *shard = &cache->shards[hash & (kCacheShards - 1)];
+    int64_t now = monotonic_ms();
+    size_t len = 0;
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        auto it = shard->index.find(hash);
+        if (it != shard->index.end()) {
+            uint32_t slot = it->second;
+            cache_entry *entry = &shard->entries[slot];
+            if (entry->expires_ms <= now) {
+                release_entry(cache, shard, slot);
+            } else if (entry->key_len == key_len && memcmp(entry->data.data(), key, key_len) == 0) {
+                len = (!client_edns && entry->opt_offset) ? entry->opt_offset : entry->answer_len;
+                if (len > limit) {
+                    len = 0;    // Let the forwarder fetch a fitting answer
+                } else {
+                    entry->referenced = true;
+                    memcpy(out, entry->data.data() + key_len, len);
+
+                    // Age every TTL, never past the entry's own lifetime
+                    uint32_t elapsed = (uint32_t)((now - entry->stored_ms) / 1000);
+                    uint32_t remaining = (uint32_t)((entry->expires_ms - now + 999) / 1000);
+                    for (uint16_t offset : entry->ttl_offsets) {
+                        if (offset + 4u > len) break;
+                        uint32_t ttl = dns_read_u32(out + offset);
+                        ttl = ttl > elapsed ? ttl - elapsed : 0;
+                        dns_write_u32(out + offset, ttl < remaining ? ttl : remaining);
+                    }
+                    if (len == entry->opt_offset) {
+                        dns_write_u16(out + 10, (uint16_t)(dns_read_u16(out + 10) - 1));
+                    }
+                }
+            }
+        }
+    }
+
+    if (len == 0) {
+        cache->misses.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // Same question length as the query, so its bytes (and 0x20 casing)
+    // can be copied straight over; keep the client's ID and RD bit
+    memcpy(out, query, 2);
+    memcpy(out + kDnsHeaderSize, query + kDnsHeaderSize, qend - kDnsHeaderSize);
+    uint16_t flags = dns_read_u16(out + 2);
+    flags = (uint16_t)((flags & ~kDnsFlagRD) | (dns_read_u16(query + 2) & kDnsFlagRD));
+    dns_write_u16(out + 2, flags);
+    cache->hits.fetch_add(1, std::memory_order_relaxed);
+    return len;
+}
+
+bool dns_cache_store(DnsCache *cache, const uint8_t *answer, size_t len) {
+    if (len < kDnsHeaderSize || len > kMaxCachedAnswer) return false;
+    uint16_t flags = dns_read_u16(answer + 2);
+    uint16_t rcode = flags & kDnsRcodeMask;
+    if (!(flags & kDnsFlagQR) || (flags & kDnsFlagTC) || (flags & 0x7800) != 0) return false;
+    if (rcode != kDnsRcodeNoError && rcode != kDnsRcodeNxDomain) return false;
+    if (dns_read_u16(answer + 4) != 1) return false;
+
+    uint8_t key[kMaxKeyLen];
+    size_t qend;
+    size_t key_len = build_key(answer, len, key, &qend);
+    if (key_len == 0) return false;
+
+    uint16_t ancount = dns_read_u16(answer + 6);
+    uint16_t nscount = dns_read_u16(answer + 8);
+    uint16_t arcount = dns_read_u16(answer + 10);
+    uint32_t total = (uint32_t)ancount + nscount + arcount;
+
+    std::vector<uint16_t> ttl_offsets;
+    ttl_offsets.reserve(total);
+    uint32_t min_ttl = UINT32_MAX;
+    uint32_t negative_ttl = 0;
+    bool have_soa = false;
+    size_t opt_offset = 0;
+
+    size_t pos = qend;
+    for (uint32_t i = 0; i < total; i++) {
+        size_t rr_start = pos;
+        pos = dns_skip_name(answer, len, pos);
+        if (pos == 0 || pos + 10 > len) return false;
+        uint16_t type = dns_read_u16(answer + pos);
+        uint32_t ttl = dns_read_u32(answer + pos + 4);
+        uint16_t rdlen = dns_read_u16(answer + pos + 8);
+        size_t rdata = pos + 10;
+        if (rdata + rdlen > len) return false;
+
+        if (type == kDnsTypeOPT) {
+            // Its TTL field holds EDNS flags; it must be last so it can be cut
+            if (i != total - 1) return false;
+            opt_offset = rr_start;
+        } else {
+            ttl_offsets.push_back((uint16_t)(pos + 4));
+            if (ttl < min_ttl) min_ttl = ttl;
+            if (type == kDnsTypeSOA && i >= ancount && i < (uint32_t)ancount + nscount && rdlen >= 20) {
+                // Negative TTL is the smaller of the SOA TTL and its MINIMUM
+                uint32_t minimum = dns_read_u32(answer + rdata + rdlen - 4);
+                negative_ttl = ttl < minimum ? ttl : minimum;
+                have_soa = true;
+            }
+        }
+        pos = rdata + rdlen;
+    }
+
+    uint32_t ttl;
+    if (rcode == kDnsRcodeNxDomain || ancount == 0) {
+        if (!have_soa) return false;
+        ttl = negative_ttl < kMaxNegativeTtl ? negative_ttl : kMaxNegativeTtl;
+    } else {
+        ttl = min_ttl < kMaxPositiveTtl ? min_ttl : kMaxPositiveTtl;
+    }
+    if (ttl == 0) return false;
+
+    uint64_t hash = hash_key(key, key_len);
+    cache_shard *shard = &cache->shards[hash & (kCacheShards - 1)];
+    size_t cost = kEntryOverhead + key_len + pos + ttl_offsets.size() * sizeof(uint16_t);
+    int64_t now = monotonic_ms();
+
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    if (cost > shard->max_bytes) return false;
+    auto it = shard->index.find(hash);
+    if (it != shard->index.end()) {
+        release_entry(cache, shard, it->second);
+    }
+    make_room(cache, shard, cost, now);
+    if (shard->bytes + cost > shard->max_bytes) return false;
+
+    uint32_t slot;
+    if (!shard->free_entries.empty()) {
+        slot = shard->free_entries.back();
+        shard->free_entries.pop_back();
+    } else {
+        slot = (uint32_t)shard->entries.size();
+        shard->entries.emplace_back();
+    }
+
+    cache_entry *entry = &shard->entries[slot];
+    entry->used = true;
+    entry->referenced = false;
+    entry->hash = hash;
+    entry->key_len = (uint16_t)key_len;
+    entry->answer_len = (uint16_t)pos;     // Anything after the last record is dropped
+    entry->opt_offset = (uint16_t)opt_offset;
+    entry->stored_ms = now;
+    entry->expires_ms = now + (int64_t)ttl * 1000;
+    entry->data.resize(key_len + pos);
+    memcpy(entry->data.data(), key, key_len);
+    memcpy(entry->data.data() + key_len, answer, pos);
+    entry->ttl_offsets = std::move(ttl_offsets);
+    entry->cost = cost;
+
+    shard->index[hash] = slot;
+    shard->bytes += cost;
+    cache->inserts.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void dns_cache_clear(DnsCache *cache) {
+    for (auto& shard : cache->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.free_entries.clear();
+        shard.index.clear();
+        shard.clock_hand = 0;
+        shard.bytes = 0;
+    }
+}
+
+DnsCacheStats dns_cache_get_stats(DnsCache *cache) {
+    DnsCacheStats stats;
+    stats.hits = cache->hits.load(std::memory_order_relaxed);
+    stats.misses = cache->misses.load(std::memory_order_relaxed);
+    stats.inserts = cache->inserts.load(std::memory_order_relaxed);
+    stats.evictions = cache->evictions.load(std::memory_order_relaxed);
+    stats.entries = 0;
+    stats.bytes = 0;
+    for (auto& shard : cache->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.entries += shard.index.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
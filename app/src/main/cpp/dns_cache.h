@@ -0,0 +1,69 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Bounded cache of upstream DNS answers keyed on (qname, qtype, qclass),
+ * with the name case-folded. Answers keep their wire bytes plus the offsets
+ * of every TTL field, so a hit is a copy with the TTLs aged, the query ID
+ * patched in and the client's question casing restored. NXDOMAIN and
+ * NODATA answers are cached for their SOA minimum (RFC 2308). When the
+ * memory cap is reached entries are evicted with the CLOCK algorithm.
+ * The cache is sharded and safe to share between threads.
+ */
+struct DnsCache;
+
+struct DnsCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+// Memory cap used by the DNS engine and the root helper
+static const size_t kDnsCacheDefaultBytes = 4 * 1024 * 1024;
+
+/**
+ * Create a cache
+ * @param max_bytes Approximate memory cap for stored answers and bookkeeping
+ */
+DnsCache *dns_cache_create(size_t max_bytes);
+
+/**
+ * Free the cache and every stored answer
+ */
+void dns_cache_destroy(DnsCache *cache);
+
+/**
+ * Answer a client query from the cache
+ * @param query The query exactly as received from the client
+ * @param over_tcp The client asked over TCP, so the UDP size limit does not apply
+ * @param out Buffer for the answer
+ * @param out_cap Size of out
+ * @return Length of the answer written to out, or 0 on a miss
+ */
+size_t dns_cache_lookup(DnsCache *cache, const uint8_t *query, size_t query_len, bool over_tcp,
+                        uint8_t *out, size_t out_cap);
+
+/**
+ * Store an upstream answer. Truncated answers, errors other than NXDOMAIN,
+ * negative answers without an SOA and zero TTLs are not cached.
+ * @return true if the answer was stored
+ */
+bool dns_cache_store(DnsCache *cache, const uint8_t *answer, size_t len);
+
+/**
+ * Drop every entry
+ */
+void dns_cache_clear(DnsCache *cache);
+
+/**
+ * Snapshot of the hit/miss counters and current size
+ */
+DnsCacheStats dns_cache_get_stats(DnsCache *cache);
+
+#endif // DNS_CACHE_H
@@ -0,0 +1,616 @@
+#include "dns_forwarder.h"
+#include "dns_cache.h"
+#include "dns_wire.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
+#include "packet_capture.h"
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#define LOG_TAG "DNSForwarder"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// In-flight table. Upstream query IDs are fully random and map to their
+// slot through a table indexed by ID, so an off-path attacker has all 16
+// bits to guess.
+static const uint32_t kInflightSlots = 4096;        // Power of two, below kNoSlot
+static const uint16_t kSlotMask = kInflightSlots - 1;
+static const uint16_t kNoSlot = 0xFFFF;
+// Each upstream is queried from a pool of connected sockets picked at
+// random per query, so the source port has to be guessed too. A socket
+// that has sent its share of queries is replaced by one on a fresh
+// ephemeral port at once and closed when its last query is settled, so
+// the ports keep changing under sustained load.
+static const uint32_t kSocketsPerUpstream = 8;
+static const uint32_t kSlotsPerUpstream = 2 * kSocketsPerUpstream;   // Room for the ones draining
+static const uint32_t kQueriesPerSocket = 256;
+static const size_t kHeaderReplySize = 512;         // Header and question of a SERVFAIL or TC reply
+static const int kQueryTimeoutMs = 2000;            // Per upstream attempt
+static const int kExpiryIntervalMs = 100;
+static const size_t kMaxTcpFallbacks = 32;
+static const size_t kMaxUpstreams = 4;               // kMaxUpstreams * kSlotsPerUpstream <= 64
+static const size_t kRandomPool = 64;
+static const size_t kMaxUdpResponse = 4096;
+
+struct dns_upstream {
+    struct sockaddr_in addr;
+    uint8_t first_socket;           // Its kSlotsPerUpstream slots in DnsForwarder::sockets
+    uint8_t active_count;
+    uint8_t active[kSocketsPerUpstream];    // Slots new queries are sent from
+};
+
+struct upstream_socket {
+    int fd;                         // -1 for a free slot
+    uint8_t upstream;
+    bool draining;                  // Replaced; closed once inflight reaches 0
+    uint32_t inflight;              // Queries that may still be answered on it
+    uint32_t queries;               // Sent since it was opened
+};
+
+struct inflight_entry {
+    bool used;
+    bool via_tcp;
+    uint16_t upstream_id;
+    uint16_t client_id;
+    uint16_t client_udp_limit;     // Largest answer the client accepts over UDP
+    uint8_t upstream_index;
+    uint8_t attempts;
+    uint64_t sockets;               // Bit per upstream socket the query was sent on
+    int reply_sock;
+    struct sockaddr_in client;
+    DnsForwarderReply reply;        // Set for callback clients instead of reply_sock
+    void *reply_ctx;
+    uint64_t reply_tag;
+    int64_t deadline_ms;
+    int64_t submitted_ns;           // When the client's query came in, for the latency histogram
+    uint16_t query_len;
+    std::vector<uint8_t> query;     // Kept for retries and TCP, carrying the upstream ID; its
+                                    // capacity stays with the slot, so EDNS queries of any
+                                    // size fit without an allocation per query
+};
+
+struct tcp_fallback {
+    int fd;
+    uint32_t slot;
+    bool writing;
+    size_t done;                    // Bytes written or read so far
+    std::vector<uint8_t> buffer;    // Length-prefixed query, then the answer
+};
+
+struct DnsForwarder {
+    std::vector<dns_upstream> upstreams;
+    std::vector<upstream_socket> sockets;
+    int polled_sockets;             // Upstream sockets in the last dns_forwarder_fill_pollfds
+    std::vector<inflight_entry> slots;
+    std::vector<uint16_t> id_slots;     // Upstream ID to slot, kNoSlot if unused
+    std::vector<tcp_fallback> tcp;
+    uint32_t next_slot;
+    size_t inflight;
+    int64_t next_expiry_ms;
+    std::minstd_rand rng;           // Only if getrandom fails
+    uint32_t random_pool[kRandomPool];
+    size_t random_left;
+    DnsCache *cache;                // Optional, fed with every relayed answer
+    uint8_t response[kMaxUdpResponse];
+};
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool parse_upstream(const std::string& spec, struct sockaddr_in *addr) {
+    std::string host = spec;
+    int port = 53;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        host = spec.substr(0, colon);
+        port = atoi(spec.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, host.c_str(), &addr->sin_addr) == 1;
+}
+
+// Unpredictable bits for query IDs and socket choice, fetched from the
+// kernel in batches
+static uint32_t random_u32(DnsForwarder *fwd) {
+    if (fwd->random_left == 0) {
+        long got = syscall(SYS_getrandom, fwd->random_pool, sizeof(fwd->random_pool), 0);
+        if (got != (long)sizeof(fwd->random_pool)) {
+            for (size_t i = 0; i < kRandomPool; i++) fwd->random_pool[i] = (uint32_t)fwd->rng();
+        }
+        fwd->random_left = kRandomPool;
+    }
+    return fwd->random_pool[--fwd->random_left];
+}
+
+// Connected sockets only deliver datagrams from that upstream
+static int open_upstream_socket(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void close_socket(upstream_socket *sock) {
+    close(sock->fd);
+    sock->fd = -1;
+    sock->draining = false;
+}
+
+// A random active socket of the upstream. One that has served its share of
+// queries is swapped for a new socket first and drains in the background;
+// if no slot is free or the new socket fails, the old one carries on.
+static uint32_t pick_socket(DnsForwarder *fwd, dns_upstream *upstream) {
+    uint8_t& active = upstream->active[random_u32(fwd) % upstream->active_count];
+    upstream_socket *sock = &fwd->sockets[active];
+    if (sock->queries < kQueriesPerSocket) return active;
+
+    for (uint32_t i = upstream->first_socket; i < upstream->first_socket + kSlotsPerUpstream; i++) {
+        upstream_socket *replacement = &fwd->sockets[i];
+        if (replacement->fd >= 0) continue;
+        replacement->fd = open_upstream_socket(&upstream->addr);
+        if (replacement->fd < 0) break;
+        replacement->inflight = 0;
+        replacement->queries = 0;
+        if (sock->inflight == 0) {
+            close_socket(sock);
+        } else {
+            sock->draining = true;
+        }
+        active = (uint8_t)i;
+        break;
+    }
+    return active;
+}
+
+static void free_slot(DnsForwarder *fwd, inflight_entry *entry) {
+    for (uint32_t i = 0; entry->sockets; i++, entry->sockets >>= 1) {
+        if (!(entry->sockets & 1)) continue;
+        upstream_socket *sock = &fwd->sockets[i];
+        if (--sock->inflight == 0 && sock->draining) close_socket(sock);
+    }
+    fwd->id_slots[entry->upstream_id] = kNoSlot;
+    entry->used = false;
+    entry->via_tcp = false;
+    fwd->inflight--;
+}
+
+static void relay_to_client(inflight_entry *entry, uint8_t *answer, size_t len) {
+    harpy_metrics_record(HarpyHistogram::DNS_UPSTREAM, harpy_metrics_now_ns() - entry->submitted_ns);
+    harpy_trace_span("dns", "upstream", entry->submitted_ns);
+    dns_write_u16(answer, entry->client_id);
+    if (entry->reply) {
+        entry->reply(entry->reply_ctx, entry->reply_tag, answer, len);
+        return;
+    }
+    packet_capture_socket(CaptureDirection::SENT, entry->reply_sock, answer, len, &entry->client);
+    ssize_t sent = sendto(entry->reply_sock, answer, len, MSG_DONTWAIT,
+                          (struct sockaddr *)&entry->client, sizeof(entry->client));
+    if (sent < 0) {
+        HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "Failed to relay DNS answer to client: %s", strerror(errno));
+    }
+}
+
+// Answer the client with just the header and question, e.g. SERVFAIL after
+// every upstream timed out, or TC when a TCP answer is too big for UDP
+static void reply_header_only(inflight_entry *entry, uint16_t flags, uint16_t rcode) {
+    size_t qend = dns_question_end(entry->query.data(), entry->query_len);
+    if (qend == 0 || qend > kHeaderReplySize) return;
+
+    if (rcode == kDnsRcodeServFail) harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_FAILURES);
+    uint8_t reply[kHeaderReplySize];
+    memcpy(reply, entry->query.data(), qend);
+    uint16_t query_flags = dns_read_u16(reply + 2);
+    dns_write_u16(reply + 2, (uint16_t)((query_flags & 0x7900) | kDnsFlagQR | kDnsFlagRA | flags | rcode));
+    dns_write_u16(reply + 4, 1);
+    dns_write_u16(reply + 6, 0);
+    dns_write_u16(reply + 8, 0);
+    dns_write_u16(reply + 10, 0);
+    relay_to_client(entry, reply, qend);
+}
+
+static bool send_udp(DnsForwarder *fwd, inflight_entry *entry) {
+    dns_upstream *upstream = &fwd->upstreams[entry->upstream_index];
+    uint32_t index = pick_socket(fwd, upstream);
+    upstream_socket *sock = &fwd->sockets[index];
+    packet_capture_socket(CaptureDirection::SENT, sock->fd, entry->query.data(), entry->query_len, &upstream->addr);
+    ssize_t sent = send(sock->fd, entry->query.data(), entry->query_len, MSG_DONTWAIT);
+    if (sent < 0) {
+        HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "Failed to send query upstream: %s", strerror(errno));
+        harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_SEND_ERRORS);
+        return false;
+    }
+    sock->queries++;
+    if (!(entry->sockets & (1ull << index))) {
+        entry->sockets |= 1ull << index;
+        sock->inflight++;
+    }
+    entry->deadline_ms = monotonic_ms() + kQueryTimeoutMs;
+    return true;
+}
+
+static bool start_tcp(DnsForwarder *fwd, uint32_t slot) {
+    if (fwd->tcp.size() >= kMaxTcpFallbacks) return false;
+    inflight_entry *entry = &fwd->slots[slot];
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) return false;
+    const struct sockaddr_in *addr = &fwd->upstreams[entry->upstream_index].addr;
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+
+    tcp_fallback conn;
+    conn.fd = fd;
+    conn.slot = slot;
+    conn.writing = true;
+    conn.done = 0;
+    conn.buffer.resize(entry->query_len + 2);
+    dns_write_u16(conn.buffer.data(), entry->query_len);
+    memcpy(conn.buffer.data() + 2, entry->query.data(), entry->query_len);
+    fwd->tcp.push_back(std::move(conn));
+
+    harpy_metrics_add(HarpyCounter::DNS_TCP_FALLBACKS);
+    entry->via_tcp = true;
+    entry->deadline_ms = monotonic_ms() + kQueryTimeoutMs;
+    return true;
+}
+
+static void process_udp_answer(DnsForwarder *fwd, uint32_t socket_index, uint8_t *answer, size_t len) {
+    if (len < 12) return;
+    uint16_t slot = fwd->id_slots[dns_read_u16(answer)];
+    inflight_entry *entry = slot != kNoSlot ? &fwd->slots[slot] : nullptr;
+
+    // Late answers from an earlier upstream are still good, as long as they
+    // come back on a socket the query went out on and answer what we asked
+    if (!entry || entry->via_tcp || !(entry->sockets & (1ull << socket_index)) ||
+        !dns_question_matches(entry->query.data(), entry->query_len, answer, len)) {
+        harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_MISMATCHES);
+        return;
+    }
+
+    if ((dns_read_u16(answer + 2) & kDnsFlagTC) && start_tcp(fwd, slot)) {
+        return;
+    }
+    if (fwd->cache) dns_cache_store(fwd->cache, answer, len);
+    harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_ANSWERS);
+    relay_to_client(entry, answer, len);
+    free_slot(fwd, entry);
+}
+
+// Advance one TCP fallback; returns false once the connection is finished
+static bool process_tcp(DnsForwarder *fwd, tcp_fallback *conn, short revents) {
+    inflight_entry *entry = &fwd->slots[conn->slot];
+
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        if (!(revents & POLLIN)) {
+            reply_header_only(entry, 0, kDnsRcodeServFail);
+            free_slot(fwd, entry);
+            return false;
+        }
+    }
+
+    if (conn->writing && (revents & POLLOUT)) {
+        ssize_t n = send(conn->fd, conn->buffer.data() + conn->done,
+                         conn->buffer.size() - conn->done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+            reply_header_only(entry, 0, kDnsRcodeServFail);
+            free_slot(fwd, entry);
+            return false;
+        }
+        conn->done += n;
+        if (conn->done == conn->buffer.size()) {
+            conn->writing = false;
+            conn->done = 0;
+            conn->buffer.assign(2, 0);
+        }
+        return true;
+    }
+
+    if (!conn->writing && (revents & POLLIN)) {
+        ssize_t n = recv(conn->fd, conn->buffer.data() + conn->done,
+                         conn->buffer.size() - conn->done, MSG_DONTWAIT);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+            reply_header_only(entry, 0, kDnsRcodeServFail);
+            free_slot(fwd, entry);
+            return false;
+        }
+        conn->done += n;
+
+        // First the two-byte length prefix, then the message itself
+        if (conn->buffer.size() == 2 && conn->done == 2) {
+            uint16_t length = dns_read_u16(conn->buffer.data());
+            if (length < 12) {
+                reply_header_only(entry, 0, kDnsRcodeServFail);
+                free_slot(fwd, entry);
+                return false;
+            }
+            conn->buffer.assign(length, 0);
+            conn->done = 0;
+            return true;
+        }
+        if (conn->buffer.size() > 2 && conn->done == conn->buffer.size()) {
+            bool ours = dns_read_u16(conn->buffer.data()) == entry->upstream_id &&
+                        dns_question_matches(entry->query.data(), entry->query_len,
+                                             conn->buffer.data(), conn->buffer.size());
+            if (!ours) {
+                harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_MISMATCHES);
+                reply_header_only(entry, 0, kDnsRcodeServFail);
+            } else {
+                if (fwd->cache) dns_cache_store(fwd->cache, conn->buffer.data(), conn->buffer.size());
+                harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_ANSWERS);
+                if (conn->buffer.size() <= entry->client_udp_limit) {
+                    relay_to_client(entry, conn->buffer.data(), conn->buffer.size());
+                } else {
+                    // Too big for the client's UDP limit; tell it to retry over TCP
+                    reply_header_only(entry, kDnsFlagTC, 0);
+                }
+            }
+            free_slot(fwd, entry);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void expire_queries(DnsForwarder *fwd, int64_t now) {
+    for (uint32_t slot = 0; slot < kInflightSlots && fwd->inflight > 0; slot++) {
+        inflight_entry *entry = &fwd->slots[slot];
+        if (!entry->used || entry->deadline_ms > now) continue;
+
+        if (entry->via_tcp) {
+            for (size_t i = 0; i < fwd->tcp.size(); i++) {
+                if (fwd->tcp[i].slot == slot) {
+                    close(fwd->tcp[i].fd);
+                    fwd->tcp[i] = std::move(fwd->tcp.back());
+                    fwd->tcp.pop_back();
+                    break;
+                }
+            }
+        } else if (entry->attempts < fwd->upstreams.size()) {
+            // Try the next upstream with the same ID
+            entry->upstream_index = (entry->upstream_index + 1) % fwd->upstreams.size();
+            entry->attempts++;
+            harpy_metrics_add(HarpyCounter::DNS_UPSTREAM_RETRIES);
+            harpy_trace_instant("dns", "upstream_retry");
+            if (send_udp(fwd, entry)) continue;
+        }
+
+        reply_header_only(entry, 0, kDnsRcodeServFail);
+        free_slot(fwd, entry);
+    }
+}
+
+std::vector<std::string> dns_forwarder_default_upstreams() {
+    return {"8.8.8.8", "1.1.1.1"};
+}
+
+DnsForwarder *dns_forwarder_create(const std::vector<std::string>& upstreams) {
+    DnsForwarder *fwd = new DnsForwarder();
+    fwd->next_slot = 0;
+    fwd->inflight = 0;
+    fwd->next_expiry_ms = 0;
+    fwd->polled_sockets = 0;
+    fwd->cache = nullptr;
+    fwd->rng.seed(std::random_device()());
+    fwd->random_left = 0;
+
+    for (const auto& spec : upstreams) {
+        if (fwd->upstreams.size() >= kMaxUpstreams) break;
+        dns_upstream upstream;
+        if (!parse_upstream(spec, &upstream.addr)) {
+            LOGE("Ignoring invalid DNS upstream '%s'", spec.c_str());
+            continue;
+        }
+        upstream.first_socket = (uint8_t)fwd->sockets.size();
+        upstream.active_count = 0;
+        for (uint32_t i = 0; i < kSlotsPerUpstream; i++) {
+            fwd->sockets.push_back({-1, (uint8_t)fwd->upstreams.size(), false, 0, 0});
+        }
+        for (uint32_t i = 0; i < kSocketsPerUpstream; i++) {
+            int fd = open_upstream_socket(&upstream.addr);
+            if (fd < 0) {
+                LOGE("Failed to open upstream socket to %s: %s", spec.c_str(), strerror(errno));
+                break;
+            }
+            uint8_t index = (uint8_t)(upstream.first_socket + i);
+            fwd->sockets[index].fd = fd;
+            upstream.active[upstream.active_count++] = index;
+        }
+        if (upstream.active_count == 0) {
+            fwd->sockets.resize(upstream.first_socket);
+            continue;
+        }
+        fwd->upstreams.push_back(upstream);
+        LOGD("DNS upstream %s ready", spec.c_str());
+    }
+
+    if (fwd->upstreams.empty()) {
+        LOGE("No usable DNS upstream");
+        delete fwd;
+        return nullptr;
+    }
+
+    fwd->slots.resize(kInflightSlots);
+    for (auto& entry : fwd->slots) {
+        entry.used = false;
+        entry.via_tcp = false;
+        entry.sockets = 0;
+    }
+    fwd->id_slots.assign(65536, kNoSlot);
+    return fwd;
+}
+
+void dns_forwarder_destroy(DnsForwarder *fwd) {
+    if (!fwd) return;
+    for (auto& sock : fwd->sockets) {
+        if (sock.fd >= 0) close(sock.fd);
+    }
+    for (auto& conn : fwd->tcp) {
+        close(conn.fd);
+    }
+    delete fwd;
+}
+
+void dns_forwarder_set_cache(DnsForwarder *fwd, DnsCache *cache) {
+    fwd->cache = cache;
+}
+
+// Claim a slot and send the query upstream; the caller fills in where the
+// answer goes before anything can be relayed
+static inflight_entry *submit_query(DnsForwarder *fwd, const char *query, size_t query_len,
+                                    uint16_t client_udp_limit) {
+    if (query_len < 12 || query_len > UINT16_MAX) return nullptr;
+    const uint8_t *packet = (const uint8_t *)query;
+    if (dns_read_u16(packet + 2) & kDnsFlagQR) return nullptr;
+    size_t qend = dns_question_end(packet, query_len);
+    if (qend == 0 || fwd->inflight >= kInflightSlots) return nullptr;
+
+    // Rotating cursor keeps the free-slot search short while the table is not full
+    uint32_t slot = fwd->next_slot;
+    while (fwd->slots[slot].used) {
+        slot = (slot + 1) & kSlotMask;
+    }
+    fwd->next_slot = (slot + 1) & kSlotMask;
+
+    inflight_entry *entry = &fwd->slots[slot];
+    entry->used = true;
+    entry->via_tcp = false;
+    entry->client_id = dns_read_u16(packet);
+    uint16_t id;
+    do {
+        id = (uint16_t)random_u32(fwd);
+    } while (fwd->id_slots[id] != kNoSlot);
+    fwd->id_slots[id] = (uint16_t)slot;
+    entry->upstream_id = id;
+    entry->sockets = 0;
+    entry->client_udp_limit = client_udp_limit ? client_udp_limit
+                                               : dns_client_udp_limit(packet, query_len, qend);
+    entry->upstream_index = 0;
+    entry->attempts = 1;
+    entry->reply_sock = -1;
+    entry->reply = nullptr;
+    entry->submitted_ns = harpy_metrics_now_ns();
+    entry->query_len = (uint16_t)query_len;
+    entry->query.assign(packet, packet + query_len);
+    dns_write_u16(entry->query.data(), entry->upstream_id);
+    fwd->inflight++;
+
+    if (!send_udp(fwd, entry)) {
+        free_slot(fwd, entry);
+        return nullptr;
+    }
+    return entry;
+}
+
+bool dns_forwarder_submit(DnsForwarder *fwd, const char *query, size_t query_len,
+                          const struct sockaddr_in *client, int reply_sock) {
+    inflight_entry *entry = submit_query(fwd, query, query_len, 0);
+    if (!entry) return false;
+    entry->reply_sock = reply_sock;
+    entry->client = *client;
+    return true;
+}
+
+bool dns_forwarder_submit_with_reply(DnsForwarder *fwd, const char *query, size_t query_len,
+                                     DnsForwarderReply reply, void *ctx, uint64_t tag) {
+    inflight_entry *entry = submit_query(fwd, query, query_len, UINT16_MAX);
+    if (!entry) return false;
+    entry->reply = reply;
+    entry->reply_ctx = ctx;
+    entry->reply_tag = tag;
+    return true;
+}
+
+int dns_forwarder_fill_pollfds(DnsForwarder *fwd, struct pollfd *fds, int max_fds) {
+    int n = 0;
+    for (const auto& sock : fwd->sockets) {
+        if (sock.fd < 0) continue;
+        if (n >= max_fds) break;
+        fds[n].fd = sock.fd;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+    }
+    fwd->polled_sockets = n;
+    for (const auto& conn : fwd->tcp) {
+        if (n >= max_fds) return n;
+        fds[n].fd = conn.fd;
+        fds[n].events = conn.writing ? POLLOUT : POLLIN;
+        fds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+void dns_forwarder_handle_events(DnsForwarder *fwd, const struct pollfd *fds, int nfds) {
+    // Sockets can be replaced or closed while answers are handled, so each
+    // descriptor is looked up again rather than trusted to its position
+    int index = 0;
+    for (; index < fwd->polled_sockets && index < nfds; index++) {
+        if (!(fds[index].revents & POLLIN)) continue;
+        uint32_t s = 0;
+        while (s < fwd->sockets.size() && fwd->sockets[s].fd != fds[index].fd) s++;
+        if (s == fwd->sockets.size()) continue;
+        const struct sockaddr_in *addr = &fwd->upstreams[fwd->sockets[s].upstream].addr;
+        while (true) {
+            ssize_t n = recv(fwd->sockets[s].fd, fwd->response, sizeof(fwd->response), MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;  // EAGAIN, or an ICMP error surfaced on the connected socket
+            }
+            packet_capture_socket(CaptureDirection::RECEIVED, fwd->sockets[s].fd, fwd->response, (size_t)n, addr);
+            process_udp_answer(fwd, s, fwd->response, (size_t)n);
+        }
+    }
+
+    // TCP entries were written in order; finished ones are swapped out, so
+    // walk the snapshot of descriptors rather than the live vector
+    for (; index < nfds; index++) {
+        if (fds[index].revents == 0) continue;
+        for (size_t i = 0; i < fwd->tcp.size(); i++) {
+            if (fwd->tcp[i].fd != fds[index].fd) continue;
+            if (!process_tcp(fwd, &fwd->tcp[i], fds[index].revents)) {
+                close(fwd->tcp[i].fd);
+                fwd->tcp[i] = std::move(fwd->tcp.back());
+                fwd->tcp.pop_back();
+            }
+            break;
+        }
+    }
+
+    int64_t now = monotonic_ms();
+    if (fwd->inflight > 0 && now >= fwd->next_expiry_ms) {
+        expire_queries(fwd, now);
+        fwd->next_expiry_ms = now + kExpiryIntervalMs;
+    }
+}
+
+int dns_forwarder_poll_timeout(const DnsForwarder *fwd) {
+    return fwd->inflight > 0 ? kExpiryIntervalMs : -1;
+}
+
+size_t dns_forwarder_inflight(const DnsForwarder *fwd) {
+    return fwd->inflight;
+}
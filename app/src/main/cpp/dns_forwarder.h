@@ -0,0 +1,101 @@
+#ifndef DNS_FORWARDER_H
+#define DNS_FORWARDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <netinet/in.h>
+
+/**
+ * Non-blocking upstream DNS forwarder. Queries that no rule answers are
+ * sent upstream with a random ID from a random source port, tracked in a
+ * fixed-size in-flight table, and answers that match the question are
+ * relayed back to the original client. Truncated UDP
+ * answers are retried over TCP. Everything runs on the caller's thread:
+ * the owner polls the descriptors the forwarder exposes and hands the
+ * results back, so thousands of queries can be in flight without extra
+ * threads.
+ */
+struct DnsForwarder;
+struct DnsCache;
+
+/**
+ * Receives the answer for a query submitted with
+ * dns_forwarder_submit_with_reply, already carrying the client's ID. Called
+ * exactly once per query, with SERVFAIL if every upstream failed.
+ */
+typedef void (*DnsForwarderReply)(void *ctx, uint64_t tag, const uint8_t *answer, size_t len);
+
+/**
+ * Upstreams used when none are configured
+ */
+std::vector<std::string> dns_forwarder_default_upstreams();
+
+/**
+ * Create a forwarder
+ * @param upstreams Upstream servers as "ip" or "ip:port" (default port 53);
+ *                  later entries are tried when earlier ones time out
+ * @return The forwarder, or nullptr if no upstream could be set up
+ */
+DnsForwarder *dns_forwarder_create(const std::vector<std::string>& upstreams);
+
+/**
+ * Close all sockets and free the forwarder
+ */
+void dns_forwarder_destroy(DnsForwarder *fwd);
+
+/**
+ * Store every answer relayed from now on in cache (nullptr to stop). The
+ * cache is not owned and must outlive the forwarder.
+ */
+void dns_forwarder_set_cache(DnsForwarder *fwd, DnsCache *cache);
+
+/**
+ * Forward a client query upstream
+ * @param query The query exactly as received from the client
+ * @param query_len Size of the query
+ * @param client Address to relay the answer to
+ * @param reply_sock Socket the answer is sent from
+ * @return false if the packet is not a well-formed query or the in-flight
+ *         table is full
+ */
+bool dns_forwarder_submit(DnsForwarder *fwd, const char *query, size_t query_len,
+                          const struct sockaddr_in *client, int reply_sock);
+
+/**
+ * Forward a query whose answer is delivered to a callback instead of a
+ * UDP socket, e.g. for a client connected over TCP. No UDP size limit
+ * applies to the answer.
+ * @param tag Passed back to reply to identify the client
+ * @return false if the packet is not a well-formed query or the in-flight
+ *         table is full
+ */
+bool dns_forwarder_submit_with_reply(DnsForwarder *fwd, const char *query, size_t query_len,
+                                     DnsForwarderReply reply, void *ctx, uint64_t tag);
+
+/**
+ * Fill pollfds for every descriptor the forwarder is waiting on
+ * @return Number of entries written (at most max_fds)
+ */
+int dns_forwarder_fill_pollfds(DnsForwarder *fwd, struct pollfd *fds, int max_fds);
+
+/**
+ * Process the poll results for the entries written by
+ * dns_forwarder_fill_pollfds and expire queries that timed out
+ */
+void dns_forwarder_handle_events(DnsForwarder *fwd, const struct pollfd *fds, int nfds);
+
+/**
+ * Milliseconds the owner may sleep before the forwarder needs to expire
+ * queries, or -1 when nothing is in flight
+ */
+int dns_forwarder_poll_timeout(const DnsForwarder *fwd);
+
+/**
+ * Number of queries currently awaiting an upstream answer
+ */
+size_t dns_forwarder_inflight(const DnsForwarder *fwd);
+
+#endif // DNS_FORWARDER_H
@@ -1,33 +1,59 @@
 #ifndef DNS_HANDLER_H
 #define DNS_HANDLER_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
+struct DnsRuleSet;
+struct DnsQuery;
+struct DnsBlocklist;
+enum class DnsBlockMode;
+
 /**
  * Structure to represent a DNS spoofing rule
  */
 struct DNSSpoofRule {
     std::string domain;  // Domain to spoof (e.g., "example.com")
-    std::string spoofed_ip;  // IP address to return instead (e.g., "8.8.8.8")
+    std::string spoofed_ip;  // IPv4 or IPv6 address to return instead (e.g., "8.8.8.8")
+    std::string client = "";  // Only for this client IP, CIDR subnet or MAC; empty for everyone
 };
 
 /**
- * Handle incoming DNS query and send spoofed response if it matches our rules
+ * Build a spoofed answer for a query whose first question one of the rules
+ * matches. A, AAAA and ANY questions get the rule's records of that family;
+ * other types get an empty NOERROR. Later questions are answered where a
+ * rule matches them, and an EDNS0 query gets an OPT record back.
  * @param query_buffer Buffer containing the DNS query
- * @param query_size Size of the DNS query
- * @param client_addr Address of the client that sent the query
- * @param client_len Length of client address structure
- * @param sockfd Socket file descriptor to send response
- * @param rule The DNS spoofing rule to apply
- * @return true if a spoofed response was sent, false otherwise
+ * @param query The parsed query, from dns_parse_query
+ * @param client_rules Rules scoped to the querying client, checked first (may be nullptr)
+ * @param rules Rules for every client (may be nullptr)
+ * @param response_packet Buffer for the answer
+ * @param response_cap Largest answer the client accepts; TC is set if it does not fit
+ * @return Size of the answer, or 0 if no rule matches
+ */
+size_t dns_build_spoof_response(
+    const uint8_t* query_buffer, 
+    const DnsQuery* query, 
+    const DnsRuleSet* client_rules, 
+    const DnsRuleSet* rules, 
+    uint8_t* response_packet, 
+    size_t response_cap
+);
+
+/**
+ * Build a sinkhole answer for a query whose first name is on the blocklist
+ * @param blocklist Compiled blocklist (may be nullptr)
+ * @param mode NXDOMAIN, or 0.0.0.0 / :: for A and AAAA queries
+ * @return Size of the answer, or 0 if the name is not blocked
  */
-bool handle_dns_query_with_spoof(
-    char* query_buffer, 
-    ssize_t query_size, 
-    struct sockaddr_in* client_addr, 
-    socklen_t client_len, 
-    int sockfd, 
-    const DNSSpoofRule& rule
+size_t dns_build_block_response(
+    const uint8_t* query_buffer, 
+    const DnsQuery* query, 
+    const DnsBlocklist* blocklist, 
+    DnsBlockMode mode, 
+    uint8_t* response_packet, 
+    size_t response_cap
 );
 
-#endif // DNS_HANDLER_H
\ No newline at end of file
+#endif // DNS_HANDLER_H
@@ -0,0 +1,28 @@
+#ifndef DNS_LOAD_CLIENT_H
+#define DNS_LOAD_CLIENT_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Loopback DNS load generation shared by the benchmarks. Every query asks
+ * for the A record of "host<n>.bench.test", so a "*.bench.test" rule
+ * answers all of them without an upstream.
+ */
+
+/**
+ * Write a query for host<host>.bench.test with the given ID to out, which
+ * must hold 64 bytes. Returns its length.
+ */
+size_t dns_load_build_query(uint8_t *out, uint16_t id, int host);
+
+/**
+ * Keep windows of queries in flight to 127.0.0.1:port from a few sockets,
+ * so batches mix source ports, until the deadline passes. A window whose
+ * replies stop coming is abandoned and sent again. Returns the number of
+ * replies received; run one per client thread.
+ */
+uint64_t dns_load_run(uint16_t port, std::chrono::steady_clock::time_point deadline);
+
+#endif // DNS_LOAD_CLIENT_H
@@ -0,0 +1,305 @@
+#include "dns_policy.h"
+#include "dns_rules.h"
+#include "harpy_log.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_TAG "DNSPolicy"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// The direct-indexed table never covers more than a /16 (128 KB)
+static const uint8_t kMinTablePrefix = 16;
+// Subnet scopes outside the table are expanded into the hash up to this size
+static const uint64_t kMaxHashedSubnetHosts = 4096;
+
+enum class scope_kind { IP, SUBNET, MAC };
+
+struct client_scope {
+    scope_kind kind;
+    uint32_t addr;          // Host byte order, masked for subnets
+    uint8_t prefix;
+    uint8_t mac[6];
+    uint16_t id;            // Index into DnsPolicyIndex::sets
+};
+
+struct DnsPolicyIndex {
+    std::vector<const DnsRuleSet*> sets;    // [0] is global, then one per scope
+    uint32_t table_base;                    // First address of the table, host order
+    std::vector<uint16_t> table;            // Scope id per host offset, 0 for none
+    std::unordered_map<uint32_t, uint16_t> hosts;   // Clients outside the table
+    bool has_mac_scopes;
+    size_t rule_count;
+};
+
+static bool parse_mac(const std::string& text, uint8_t *mac) {
+    unsigned int b[6];
+    char sep[5];
+    char tail;
+    if (sscanf(text.c_str(), "%2x%c%2x%c%2x%c%2x%c%2x%c%2x%c", &b[0], &sep[0], &b[1], &sep[1], &b[2],
+               &sep[2], &b[3], &sep[3], &b[4], &sep[4], &b[5], &tail) != 11) {
+        return false;
+    }
+    for (int i = 0; i < 5; i++) {
+        if (sep[i] != ':' && sep[i] != '-') return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        mac[i] = (uint8_t)b[i];
+    }
+    return true;
+}
+
+static bool parse_scope(const std::string& text, client_scope *scope) {
+    if (parse_mac(text, scope->mac)) {
+        scope->kind = scope_kind::MAC;
+        scope->addr = 0;
+        scope->prefix = 0;
+        return true;
+    }
+
+    std::string host = text;
+    int prefix = 32;
+    size_t slash = text.find('/');
+    if (slash != std::string::npos) {
+        host = text.substr(0, slash);
+        char *end = nullptr;
+        prefix = (int)strtol(text.c_str() + slash + 1, &end, 10);
+        if (slash + 1 == text.size() || *end != '\0' || prefix < 0 || prefix > 32) return false;
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host.c_str(), &addr) != 1) return false;
+
+    uint32_t mask = prefix == 0 ? 0 : ~0u << (32 - prefix);
+    scope->kind = prefix == 32 ? scope_kind::IP : scope_kind::SUBNET;
+    scope->addr = ntohl(addr.s_addr) & mask;
+    scope->prefix = (uint8_t)prefix;
+    return true;
+}
+
+// Canonical form, so "10.0.0.7/24" and "10.0.0.0/24" share one rule index
+static std::string scope_key(const client_scope& scope) {
+    char key[32];
+    if (scope.kind == scope_kind::MAC) {
+        snprintf(key, sizeof(key), "%02x:%02x:%02x:%02x:%02x:%02x", scope.mac[0], scope.mac[1],
+                 scope.mac[2], scope.mac[3], scope.mac[4], scope.mac[5]);
+    } else {
+        snprintf(key, sizeof(key), "%u/%u", scope.addr, scope.prefix);
+    }
+    return key;
+}
+
+bool dns_policy_valid_scope(const std::string& scope) {
+    client_scope parsed;
+    return parse_scope(scope, &parsed);
+}
+
+static void assign_host(DnsPolicyIndex *index, uint32_t host, uint16_t id) {
+    uint32_t offset = host - index->table_base;
+    if (offset < index->table.size()) {
+        index->table[offset] = id;
+    } else {
+        index->hosts[host] = id;
+    }
+}
+
+static void assign_subnet(DnsPolicyIndex *index, const client_scope& scope) {
+    uint64_t first = scope.addr;
+    uint64_t last = first + (1ULL << (32 - scope.prefix)) - 1;
+    uint64_t table_first = index->table_base;
+    uint64_t table_last = table_first + index->table.size() - 1;
+
+    // The part inside the table is a plain fill
+    if (!index->table.empty() && first <= table_last && last >= table_first) {
+        uint64_t from = std::max(first, table_first);
+        uint64_t to = std::min(last, table_last);
+        std::fill(index->table.begin() + (from - table_first), index->table.begin() + (to - table_first) + 1,
+                  scope.id);
+    }
+
+    uint64_t outside = (last - first + 1);
+    if (!index->table.empty() && first <= table_last && last >= table_first) {
+        outside -= std::min(last, table_last) - std::max(first, table_first) + 1;
+    }
+    if (outside == 0) return;
+    if (outside > kMaxHashedSubnetHosts) {
+        LOGE("Ignoring %llu addresses of a /%u scope outside the local subnet",
+             (unsigned long long)outside, scope.prefix);
+        return;
+    }
+    for (uint64_t host = first; host <= last; host++) {
+        if (index->table.empty() || host < table_first || host > table_last) {
+            index->hosts[(uint32_t)host] = scope.id;
+        }
+    }
+}
+
+DnsPolicyIndex *dns_policy_build(const std::vector<DNSSpoofRule>& rules, DnsLocalSubnet subnet,
+                                 const std::vector<DnsArpEntry>& arp) {
+    DnsPolicyIndex *index = new DnsPolicyIndex();
+    index->table_base = 0;
+    index->has_mac_scopes = false;
+    index->rule_count = 0;
+
+    // Group rules by scope; id 0 holds the global rules
+    std::vector<std::vector<DNSSpoofRule>> grouped(1);
+    std::vector<client_scope> scopes;
+    std::map<std::string, uint16_t> ids;
+    for (const auto& rule : rules) {
+        if (rule.client.empty()) {
+            grouped[0].push_back(rule);
+            continue;
+        }
+        client_scope scope;
+        if (!parse_scope(rule.client, &scope)) continue;
+        std::string key = scope_key(scope);
+        auto it = ids.find(key);
+        if (it == ids.end()) {
+            if (grouped.size() > UINT16_MAX) continue;
+            scope.id = (uint16_t)grouped.size();
+            it = ids.emplace(key, scope.id).first;
+            grouped.emplace_back();
+            scopes.push_back(scope);
+        }
+        grouped[it->second].push_back(rule);
+    }
+    for (const auto& group : grouped) {
+        const DnsRuleSet *set = dns_rules_build(group);
+        index->rule_count += set->count;
+        index->sets.push_back(set);
+    }
+    if (scopes.empty()) return index;
+
+    if (subnet.addr != 0) {
+        uint8_t prefix = std::max(subnet.prefix, kMinTablePrefix);
+        uint32_t mask = prefix >= 32 ? ~0u : ~0u << (32 - prefix);
+        index->table_base = ntohl(subnet.addr) & mask;
+        index->table.assign((size_t)1 << (32 - prefix), 0);
+    }
+
+    // Least specific first, so more specific scopes overwrite them
+    std::stable_sort(scopes.begin(), scopes.end(), [](const client_scope& a, const client_scope& b) {
+        auto rank = [](const client_scope& s) {
+            return s.kind == scope_kind::SUBNET ? (int)s.prefix : s.kind == scope_kind::MAC ? 33 : 34;
+        };
+        return rank(a) < rank(b);
+    });
+    for (const auto& scope : scopes) {
+        switch (scope.kind) {
+            case scope_kind::SUBNET:
+                assign_subnet(index, scope);
+                break;
+            case scope_kind::MAC:
+                index->has_mac_scopes = true;
+                for (const auto& entry : arp) {
+                    if (memcmp(entry.mac, scope.mac, 6) == 0) {
+                        assign_host(index, ntohl(entry.addr), scope.id);
+                    }
+                }
+                break;
+            case scope_kind::IP:
+                assign_host(index, scope.addr, scope.id);
+                break;
+        }
+    }
+    LOGD("Built %zu client scopes over a %zu-entry table and %zu hashed hosts",
+         scopes.size(), index->table.size(), index->hosts.size());
+    return index;
+}
+
+void dns_policy_free(const DnsPolicyIndex *index) {
+    if (!index) return;
+    for (const DnsRuleSet *set : index->sets) {
+        dns_rules_free(set);
+    }
+    delete index;
+}
+
+const DnsRuleSet *dns_policy_global_rules(const DnsPolicyIndex *index) {
+    return index ? index->sets[0] : nullptr;
+}
+
+const DnsRuleSet *dns_policy_client_rules(const DnsPolicyIndex *index, uint32_t client_addr) {
+    if (!index || index->sets.size() == 1) return nullptr;
+    uint32_t host = ntohl(client_addr);
+    uint16_t id = 0;
+    uint32_t offset = host - index->table_base;
+    if (offset < index->table.size()) {
+        id = index->table[offset];
+    } else if (!index->hosts.empty()) {
+        auto it = index->hosts.find(host);
+        if (it != index->hosts.end()) id = it->second;
+    }
+    return id ? index->sets[id] : nullptr;
+}
+
+size_t dns_policy_rule_count(const DnsPolicyIndex *index) {
+    return index ? index->rule_count : 0;
+}
+
+bool dns_policy_has_mac_scopes(const DnsPolicyIndex *index) {
+    return index && index->has_mac_scopes;
+}
+
+bool dns_policy_read_arp(std::vector<DnsArpEntry> *entries) {
+    FILE *fp = fopen("/proc/net/arp", "r");
+    if (!fp) {
+        LOGE("Failed to read ARP table: %s", strerror(errno));
+        return false;
+    }
+    char line[256];
+    // Header: IP address, HW type, Flags, HW address, Mask, Device
+    if (!fgets(line, sizeof(line), fp)) {
+        fclose(fp);
+        return true;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char ip[64], mac[64];
+        unsigned int hw_type, flags;
+        if (sscanf(line, "%63s 0x%x 0x%x %63s", ip, &hw_type, &flags, mac) != 4) continue;
+        if (!(flags & 0x2)) continue;   // ATF_COM: resolved entries only
+
+        DnsArpEntry entry{};
+        struct in_addr addr;
+        if (inet_pton(AF_INET, ip, &addr) != 1 || !parse_mac(mac, entry.mac)) continue;
+        entry.addr = addr.s_addr;
+        entries->push_back(entry);
+    }
+    fclose(fp);
+    // The kernel lists entries in hash bucket order, which changes as the
+    // table grows; sort so the same table always reads the same
+    std::sort(entries->begin(), entries->end(), [](const DnsArpEntry& a, const DnsArpEntry& b) {
+        if (a.addr != b.addr) return a.addr < b.addr;
+        return memcmp(a.mac, b.mac, sizeof(a.mac)) < 0;
+    });
+    return true;
+}
+
+DnsLocalSubnet dns_policy_interface_subnet(const char *interface) {
+    DnsLocalSubnet subnet = {0, 0};
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return subnet;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    if (ioctl(sock, SIOCGIFADDR, &ifr) == 0) {
+        uint32_t addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+        if (ioctl(sock, SIOCGIFNETMASK, &ifr) == 0) {
+            uint32_t mask = ntohl(((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr.s_addr);
+            subnet.addr = addr;
+            subnet.prefix = (uint8_t)__builtin_popcount(mask);
+        }
+    }
+    close(sock);
+    return subnet;
+}
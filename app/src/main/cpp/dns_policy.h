@@ -0,0 +1,98 @@
+#ifndef DNS_POLICY_H
+#define DNS_POLICY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "dns_handler.h"
+
+struct DnsRuleSet;
+
+/**
+ * Per-client DNS policies. Rules may be scoped to a client IP, a subnet
+ * in CIDR notation or a MAC address; every distinct scope gets its own
+ * rule index, consulted before the global one. Clients are resolved to a
+ * scope with one array load for hosts on the local subnet (the table is
+ * direct-indexed by host offset) or one hash probe for anything outside
+ * it, so the lookup cost does not depend on how many clients or rules
+ * there are. MAC scopes are resolved to addresses through the kernel's
+ * ARP table when the index is built.
+ *
+ * When a client matches several scopes the most specific wins: its exact
+ * IP, then its MAC, then the longest subnet.
+ */
+struct DnsPolicyIndex;
+
+/**
+ * One complete entry of the kernel ARP table
+ */
+struct DnsArpEntry {
+    uint32_t addr;          // Network byte order
+    uint8_t mac[6];
+};
+
+/**
+ * The local subnet the direct-indexed table covers
+ */
+struct DnsLocalSubnet {
+    uint32_t addr;          // Network byte order, 0 if unknown
+    uint8_t prefix;         // Prefix length; tables are capped at /16
+};
+
+/**
+ * Check that a scope string is a valid IP, CIDR subnet or MAC address
+ */
+bool dns_policy_valid_scope(const std::string& scope);
+
+/**
+ * Build the global and per-client rule indexes
+ * @param rules Every rule; those with an empty client apply to everyone
+ * @param subnet Local subnet for the direct-indexed table
+ * @param arp Current ARP table, used to resolve MAC scopes
+ * @return The index (never nullptr)
+ */
+DnsPolicyIndex *dns_policy_build(const std::vector<DNSSpoofRule>& rules, DnsLocalSubnet subnet,
+                                 const std::vector<DnsArpEntry>& arp);
+
+/**
+ * Free an index and every rule index it owns
+ */
+void dns_policy_free(const DnsPolicyIndex *index);
+
+/**
+ * Rules that apply to every client
+ */
+const DnsRuleSet *dns_policy_global_rules(const DnsPolicyIndex *index);
+
+/**
+ * Rules scoped to a client, checked before the global rules
+ * @param client_addr Client IPv4 address in network byte order
+ * @return The client's rule index, or nullptr if no scope covers it
+ */
+const DnsRuleSet *dns_policy_client_rules(const DnsPolicyIndex *index, uint32_t client_addr);
+
+/**
+ * Total number of compiled rules across every scope
+ */
+size_t dns_policy_rule_count(const DnsPolicyIndex *index);
+
+/**
+ * Whether any rule is scoped to a MAC address, so the index must be
+ * rebuilt when the ARP table changes
+ */
+bool dns_policy_has_mac_scopes(const DnsPolicyIndex *index);
+
+/**
+ * Read the complete entries of /proc/net/arp, sorted by address and MAC
+ * @return false if the table could not be read
+ */
+bool dns_policy_read_arp(std::vector<DnsArpEntry> *entries);
+
+/**
+ * Address and prefix length of an interface
+ * @return The subnet, with addr 0 if the interface has no IPv4 address
+ */
+DnsLocalSubnet dns_policy_interface_subnet(const char *interface);
+
+#endif // DNS_POLICY_H
@@ -0,0 +1,156 @@
+#include "dns_rules.h"
+#include "dns_wire.h"
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <arpa/inet.h>
+
+// FNV-1a over the name, seeded differently for exact and wildcard keys so
+// "example.com" and "*.example.com" never collide on the same hash
+static uint64_t rule_hash(const char *name, size_t len, bool wildcard) {
+    uint64_t hash = wildcard ? 0x84222325cbf29ce4ULL : 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;   // 0 is reserved for empty slots
+}
+
+// TTL handed out with spoofed answers
+static const uint32_t kSpoofTtl = 300;
+
+static std::string normalize_rule_name(const std::string& domain, bool *wildcard) {
+    size_t start = 0;
+    *wildcard = false;
+    if (domain.size() > 2 && domain[0] == '*' && domain[1] == '.') {
+        *wildcard = true;
+        start = 2;
+    }
+    std::string name;
+    name.reserve(domain.size() - start);
+    for (size_t i = start; i < domain.size(); i++) {
+        name += (char)tolower((unsigned char)domain[i]);
+    }
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    return name;
+}
+
+// Index of the slot holding this key, or of the empty slot where it belongs
+static size_t find_slot(const DnsRuleSet *set, uint64_t hash, bool wildcard,
+                        const char *name, size_t len) {
+    size_t mask = set->slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const DnsRuleEntry& entry = set->slots[i];
+        if (entry.hash == 0) return i;
+        if (entry.hash == hash && entry.wildcard == wildcard &&
+            entry.name.size() == len && memcmp(entry.name.data(), name, len) == 0) {
+            return i;
+        }
+    }
+}
+
+DnsRuleSet *dns_rules_build(const std::vector<DNSSpoofRule>& rules) {
+    DnsRuleSet *set = new DnsRuleSet();
+    set->count = 0;
+
+    // Keep the table at most half full so probe chains stay short
+    size_t capacity = 16;
+    while (capacity < rules.size() * 2) capacity <<= 1;
+    set->slots.resize(capacity);
+    for (auto& slot : set->slots) slot.hash = 0;
+
+    for (const auto& rule : rules) {
+        bool wildcard;
+        std::string name = normalize_rule_name(rule.domain, &wildcard);
+        struct in_addr addr4;
+        struct in6_addr addr6;
+        bool is_v4 = inet_pton(AF_INET, rule.spoofed_ip.c_str(), &addr4) == 1;
+        if (name.empty() || (!is_v4 && inet_pton(AF_INET6, rule.spoofed_ip.c_str(), &addr6) != 1)) {
+            continue;
+        }
+
+        uint64_t hash = rule_hash(name.data(), name.size(), wildcard);
+        DnsRuleEntry *entry = &set->slots[find_slot(set, hash, wildcard, name.data(), name.size())];
+        if (entry->hash == 0) {
+            set->count++;
+            entry->hash = hash;
+            entry->wildcard = wildcard;
+            entry->has_a = false;
+            entry->has_aaaa = false;
+            entry->name = name;
+        }
+        if (is_v4) {
+            entry->has_a = true;
+            dns_write_a_record(entry->record_a, &addr4, kSpoofTtl);
+        } else {
+            entry->has_aaaa = true;
+            dns_write_aaaa_record(entry->record_aaaa, &addr6, kSpoofTtl);
+        }
+    }
+    return set;
+}
+
+void dns_rules_free(const DnsRuleSet *set) {
+    delete set;
+}
+
+const DnsRuleEntry *dns_rules_match(const DnsRuleSet *set, const char *name, size_t len) {
+    if (!set || set->count == 0 || len == 0) return nullptr;
+    const DnsRuleEntry *entry = &set->slots[find_slot(set, rule_hash(name, len, false), false, name, len)];
+    if (entry->hash != 0) return entry;
+
+    // Walk parent domains from longest to shortest: for "a.b.example.com"
+    // try "*.b.example.com", then "*.example.com", then "*.com"
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] != '.') continue;
+        const char *suffix = name + i + 1;
+        size_t suffix_len = len - i - 1;
+        entry = &set->slots[find_slot(set, rule_hash(suffix, suffix_len, true), true, suffix, suffix_len)];
+        if (entry->hash != 0) return entry;
+    }
+    return nullptr;
+}
+
+static bool is_address(const std::string& token) {
+    struct in6_addr addr;
+    return inet_pton(AF_INET, token.c_str(), &addr) == 1 ||
+           inet_pton(AF_INET6, token.c_str(), &addr) == 1;
+}
+
+bool dns_rules_parse_file(const char *path, std::vector<DNSSpoofRule> *rules) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.resize(comment);
+
+        std::istringstream tokens(line);
+        std::vector<std::string> words;
+        std::string client;
+        std::string word;
+        while (tokens >> word) {
+            if (word.size() > 1 && word[0] == '@') {
+                client = word.substr(1);
+            } else {
+                words.push_back(word);
+            }
+        }
+        if (words.size() < 2) continue;
+
+        if (is_address(words[0])) {
+            // Hosts style: the address applies to every name on the line
+            for (size_t i = 1; i < words.size(); i++) {
+                rules->push_back({words[i], words[0], client});
+            }
+        } else {
+            rules->push_back({words[0], words[1], client});
+        }
+    }
+    return true;
+}
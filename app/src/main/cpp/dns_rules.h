@@ -0,0 +1,67 @@
+#ifndef DNS_RULES_H
+#define DNS_RULES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "dns_handler.h"
+#include "dns_wire.h"
+
+/**
+ * One compiled DNS rule. Names are stored lowercased without a trailing
+ * dot; a wildcard rule "*.example.com" is stored as "example.com" with
+ * wildcard set and matches any name strictly below it. A name can carry
+ * an IPv4 target, an IPv6 target or both; the answer records are
+ * serialized once here so responses are a copy, not a rebuild.
+ */
+struct DnsRuleEntry {
+    uint64_t hash;           // 0 marks an empty slot
+    bool wildcard;
+    bool has_a;
+    bool has_aaaa;
+    std::string name;
+    uint8_t record_a[kDnsRecordASize];        // Answer RRs pointing at the first question;
+    uint8_t record_aaaa[kDnsRecordAAAASize];  // retargeted for later questions
+};
+
+/**
+ * Immutable rule index. Built off the hot path and published whole, so
+ * readers never need a lock.
+ */
+struct DnsRuleSet {
+    std::vector<DnsRuleEntry> slots;   // Open addressing, power-of-two size
+    size_t count;
+};
+
+/**
+ * Build an index from a rule list. Rules for the same name with an IPv4
+ * and an IPv6 target merge into one entry; otherwise later rules win.
+ * Rules with an unparseable IP are skipped.
+ */
+DnsRuleSet *dns_rules_build(const std::vector<DNSSpoofRule>& rules);
+
+/**
+ * Free an index returned by dns_rules_build
+ */
+void dns_rules_free(const DnsRuleSet *set);
+
+/**
+ * Match a lowercased name against the index. An exact rule wins over a
+ * wildcard; among wildcards the longest suffix wins.
+ * @param name Lowercased name without trailing dot
+ * @param len Length of name
+ * @return The matching rule, or nullptr
+ */
+const DnsRuleEntry *dns_rules_match(const DnsRuleSet *set, const char *name, size_t len);
+
+/**
+ * Read rules from a file, one per line as "domain ip" or hosts-style
+ * "ip domain [domain...]", with IPv4 or IPv6 addresses. A trailing
+ * "@client" token (IP, CIDR subnet or MAC) scopes the line to that client.
+ * Blank lines and '#' comments are skipped.
+ * @return false if the file could not be opened
+ */
+bool dns_rules_parse_file(const char *path, std::vector<DNSSpoofRule> *rules);
+
+#endif // DNS_RULES_H
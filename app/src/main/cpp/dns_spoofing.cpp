@@ -1,7 +1,10 @@
 #include "dns_spoofing.h"
-#include <android/log.h>
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
 #include <cstring>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <thread>
 #include <mutex>
@@ -15,99 +18,576 @@
 #include <sys/ioctl.h>
 #include <netinet/ether.h>
 #include "dns_handler.h"
+#include "dns_rules.h"
+#include "dns_policy.h"
+#include "dns_forwarder.h"
+#include "dns_cache.h"
+#include "dns_wire.h"
+#include "dns_blocklist.h"
+#include "dns_tcp.h"
+#include "reactor.h"
+#include "packet_io.h"
+#include <poll.h>
+#include <chrono>
+#include <time.h>
 
 #define LOG_TAG "DNSSpoofing"
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
 // Global variables for DNS spoofing
+// g_dns_rules is the editable rule list, guarded by g_rules_mutex for writers.
+// Every edit compiles it into a fresh policy index (global and per-client
+// rules) and publishes it through g_policy, which the workers read without
+// taking any lock.
 static std::vector<DNSSpoofRule> g_dns_rules;
 static std::mutex g_rules_mutex;
+static std::atomic<const DnsPolicyIndex*> g_policy(nullptr);
+static DnsLocalSubnet g_local_subnet = {0, 0};     // Guarded by g_rules_mutex
+static uint64_t g_arp_signature = 0;               // ARP table the index was built from
 static std::atomic<bool> g_dns_spoof_active(false);
-static std::thread *g_dns_spoof_thread = nullptr;
-static int g_dns_socket = -1;
-static std::atomic<bool> g_stop_spoofing(false);
+// Mapped blocklist, swapped like the rule index; also guarded by g_rules_mutex
+static std::atomic<const DnsBlocklist*> g_blocklist(nullptr);
+static std::atomic<DnsBlockMode> g_block_mode(DnsBlockMode::NXDOMAIN);
+static std::vector<std::string> g_dns_upstreams = dns_forwarder_default_upstreams();
+static uint16_t g_dns_port = 53;
+static int g_dns_worker_count = 0;
+static std::atomic<DnsQueryCallback> g_query_callback(nullptr);
+// Created on the first start and kept, so figures survive a restart; one
+// shard per UDP worker plus one for the TCP thread
+static std::atomic<DnsAnalytics*> g_analytics(nullptr);
+static DnsReloadStats g_last_reload = {0, 0, 0};
 
-// Main DNS spoofing thread function
-void dns_spoof_thread_func(const std::string& interface) {
-    LOGD("Starting DNS spoofing on interface: %s", interface.c_str());
+// One worker per SO_REUSEPORT socket; the kernel spreads clients across
+// them. Each worker is served by a reactor: worker 0 by the host's when one
+// is set, every other worker by one of its own on its own thread.
+struct dns_worker {
+    int index;
+    int sockfd;                     // -1 when serving the caller's packet I/O
+    PacketIo *io;                   // Over sockfd, or the caller's
+    bool own_io;
+    Reactor *reactor;
+    bool own_reactor;
+    bool attached;
+    std::thread *thread;
+    DnsForwarder *forwarder;
+    ReactorTimer *arp_timer;        // Worker 0 only
+    std::vector<std::string> upstreams;
+    DnsQuery parsed;
+};
+static std::vector<dns_worker*> g_workers;
+static Reactor *g_dns_host_reactor = nullptr;
+static PacketIo *g_dns_packet_io = nullptr;         // Set by the caller instead of the port
+static DnsCache *g_dns_cache = nullptr;
+// DNS-over-TCP shares worker 0's reactor, with its own forwarder
+struct tcp_context;
+static tcp_context *g_tcp = nullptr;
+
+static const int kMaxWorkers = 16;
+// EDNS0 clients may send and accept up to this much over UDP
+static const size_t kMaxDatagram = 4096;
+static const int kTcpBacklog = 64;
+// How long a writer waits for workers to drop a replaced index before
+// leaving it for a later writer to free
+static const int kGracePeriodWaitMs = 500;
+// How often worker 0 re-reads the ARP table while rules are scoped to MACs
+static const int kArpRefreshMs = 30000;
+
+// Quiescent-state reclamation for replaced indexes. Each worker announces
+// the global epoch it observed before reading g_policy/g_blocklist, and
+// kEpochOffline when it returns to its reactor holding no index. An index
+// retired at epoch E is freed once every worker is offline or has announced
+// >= E. The TCP listener takes the slot after the UDP workers.
+static const uint64_t kEpochOffline = UINT64_MAX;
+
+struct alignas(64) worker_epoch {
+    std::atomic<uint64_t> value{kEpochOffline};
+};
+static const int kTcpEpochSlot = kMaxWorkers;
+static worker_epoch g_worker_epochs[kMaxWorkers + 1];
+static std::atomic<uint64_t> g_epoch(1);
+
+struct retired_index {
+    uint64_t epoch;
+    const DnsPolicyIndex *policy;
+    const DnsBlocklist *blocklist;
+};
+static std::vector<retired_index> g_retired;    // Guarded by g_rules_mutex
+
+static int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Queue a replaced index; caller holds g_rules_mutex and has already
+// swapped the new one in
+static void retire_locked(const DnsPolicyIndex *policy, const DnsBlocklist *blocklist) {
+    uint64_t epoch = g_epoch.fetch_add(1) + 1;
+    g_retired.push_back({epoch, policy, blocklist});
+}
+
+// Free every retired index no worker can still hold. With wait set, block
+// up to kGracePeriodWaitMs for busy workers to pass through a quiescent
+// point; workers only announce between batches, so this is short.
+static void reclaim_locked(bool wait) {
+    HarpyTraceScope trace("dns", "grace_period");
+    int64_t deadline = monotonic_us() + (int64_t)kGracePeriodWaitMs * 1000;
+    while (!g_retired.empty()) {
+        uint64_t oldest = kEpochOffline;
+        for (const auto& slot : g_worker_epochs) {
+            uint64_t epoch = slot.value.load();
+            if (epoch < oldest) oldest = epoch;
+        }
+        
+        size_t kept = 0;
+        for (const auto& entry : g_retired) {
+            if (entry.epoch <= oldest) {
+                dns_policy_free(entry.policy);
+                dns_blocklist_close(entry.blocklist);
+            } else {
+                g_retired[kept++] = entry;
+            }
+        }
+        g_retired.resize(kept);
+        
+        if (kept == 0 || !wait || monotonic_us() >= deadline) break;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+// FNV-1a over the address and MAC of each entry, to notice when MAC scopes
+// move; dns_policy_read_arp sorts the table, so its order does not count
+static uint64_t arp_signature(const std::vector<DnsArpEntry>& arp) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const auto& entry : arp) {
+        uint8_t bytes[sizeof(entry.addr) + sizeof(entry.mac)];
+        memcpy(bytes, &entry.addr, sizeof(entry.addr));
+        memcpy(bytes + sizeof(entry.addr), entry.mac, sizeof(entry.mac));
+        for (uint8_t byte : bytes) {
+            hash = (hash ^ byte) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+// Rebuild the index from g_dns_rules and publish it; caller holds g_rules_mutex.
+// The build happens here, off the packet path; workers switch to the new
+// index on their next batch and the old one is freed after a grace period.
+static void publish_rules_locked() {
+    HarpyTraceScope trace("dns", "publish_rules");
+    int64_t start_us = monotonic_us();
+    std::vector<DnsArpEntry> arp;
+    bool scoped = std::any_of(g_dns_rules.begin(), g_dns_rules.end(),
+                              [](const DNSSpoofRule& rule) { return !rule.client.empty(); });
+    if (scoped) {
+        dns_policy_read_arp(&arp);
+    }
+    g_arp_signature = arp_signature(arp);
+    const DnsPolicyIndex *new_policy = dns_policy_build(g_dns_rules, g_local_subnet, arp);
+    int64_t built_us = monotonic_us();
     
-    // Create a UDP socket to listen on port 53 (DNS)
-    g_dns_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if(g_dns_socket < 0) {
+    const DnsPolicyIndex *old_policy = g_policy.exchange(new_policy);
+    if (old_policy) {
+        retire_locked(old_policy, nullptr);
+    }
+    reclaim_locked(true);
+    
+    g_last_reload.rules = dns_policy_rule_count(new_policy);
+    g_last_reload.build_us = built_us - start_us;
+    g_last_reload.swap_us = monotonic_us() - built_us;
+}
+
+// DNS_SPOOFED..DNS_DROPPED follow the order of DnsQueryOutcome
+static_assert((int)HarpyCounter::DNS_DROPPED - (int)HarpyCounter::DNS_SPOOFED == kDnsOutcomeCount - 1,
+              "one counter per query outcome");
+
+// Count the query in the worker's analytics shard and tell the callback.
+// parsed has no questions if the query could not be parsed.
+static void report_query(int shard, DnsQueryOutcome outcome, const DnsQuery *parsed,
+                         const struct sockaddr_in *client, size_t size) {
+    const DnsQuestion *question = parsed->question_count ? &parsed->questions[0] : nullptr;
+    harpy_metrics_add((HarpyCounter)((int)HarpyCounter::DNS_SPOOFED + (int)outcome));
+    harpy_trace_instant("dns", "query", "outcome", (int)outcome);
+    dns_analytics_record(g_analytics.load(std::memory_order_relaxed), shard, client->sin_addr.s_addr,
+                         question ? question->name : nullptr, question ? question->name_len : 0,
+                         question ? question->qtype : 0, outcome);
+    
+    DnsQueryCallback callback = g_query_callback.load(std::memory_order_relaxed);
+    if (callback) {
+        bool named = outcome == DnsQueryOutcome::SPOOFED || outcome == DnsQueryOutcome::BLOCKED;
+        callback(outcome, named && question ? question->name : nullptr, client, size);
+    }
+}
+
+// Rebuild the index if a MAC-scoped client now has a different address.
+// Called from worker 0's reactor between handlers, with every epoch that
+// reactor serves offline, since publishing waits for every worker to pass
+// a quiescent point.
+static void refresh_client_macs() {
+    std::vector<DnsArpEntry> arp;
+    if (!dns_policy_read_arp(&arp)) return;
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+    if (arp_signature(arp) != g_arp_signature) {
+        publish_rules_locked();
+        LOGD("ARP table changed, rebuilt per-client DNS policies");
+    }
+}
+
+// The indexes a worker answers from, loaded once per batch
+struct index_snapshot {
+    const DnsPolicyIndex *policy;
+    const DnsBlocklist *blocklist;
+    DnsBlockMode block_mode;
+};
+
+static index_snapshot load_snapshot() {
+    index_snapshot snapshot;
+    snapshot.policy = g_policy.load(std::memory_order_acquire);
+    snapshot.blocklist = g_blocklist.load(std::memory_order_acquire);
+    snapshot.block_mode = g_block_mode.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+// Answer a query without going upstream: the client's own rules and the
+// global rules first, then the blocklist, then cached upstream answers.
+// Shared by the UDP workers and the TCP listener; out_cap is the largest
+// answer the client accepts.
+static size_t answer_locally(const index_snapshot& snapshot, const struct sockaddr_in *client,
+                             const uint8_t *query, size_t query_size, bool over_tcp, DnsQuery *parsed,
+                             uint8_t *out, size_t out_cap, DnsQueryOutcome *outcome) {
+    size_t answer_size = 0;
+    *outcome = DnsQueryOutcome::SPOOFED;
+    bool ok = dns_parse_query(query, query_size, parsed);
+    if (!ok) {
+        parsed->question_count = 0;
+    } else {
+        size_t limit = over_tcp ? out_cap : std::min(out_cap, (size_t)parsed->udp_size);
+        answer_size = dns_build_spoof_response(query, parsed,
+                                               dns_policy_client_rules(snapshot.policy, client->sin_addr.s_addr),
+                                               dns_policy_global_rules(snapshot.policy), out, limit);
+        if (answer_size == 0 && snapshot.blocklist) {
+            answer_size = dns_build_block_response(query, parsed, snapshot.blocklist, snapshot.block_mode,
+                                                   out, limit);
+            *outcome = DnsQueryOutcome::BLOCKED;
+        }
+    }
+    if (answer_size == 0 && g_dns_cache) {
+        answer_size = dns_cache_lookup(g_dns_cache, query, query_size, over_tcp, out, out_cap);
+        *outcome = DnsQueryOutcome::CACHED;
+    }
+    return answer_size;
+}
+
+static int open_worker_socket(uint16_t port) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (sockfd < 0) {
         LOGE("Failed to create DNS spoofing UDP socket: %s", strerror(errno));
-        return;
+        return -1;
     }
     
-    // Set socket options
+    // Every worker binds the same port; SO_REUSEPORT load-balances between them
     int opt = 1;
-    setsockopt(g_dns_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(g_dns_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        LOGE("SO_REUSEPORT not available: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
     
-    // Configure the socket to bind to DNS port
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(53);  // DNS port
+    server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces
     
-    // Bind to the DNS port
-    if(bind(g_dns_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        LOGE("Failed to bind DNS spoofing socket to port 53: %s", strerror(errno));
-        close(g_dns_socket);
-        g_dns_socket = -1;
-        return;
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        LOGE("Failed to bind DNS spoofing socket to port %u: %s", port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Upstream answer for a query that came in over packet I/O without a
+// socket; the tag carries the client's address and port
+static void relay_packet_answer(void *ctx, uint64_t tag, const uint8_t *answer, size_t len) {
+    dns_worker *worker = (dns_worker*)ctx;
+    struct sockaddr_in client;
+    memset(&client, 0, sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_addr.s_addr = htonl((uint32_t)(tag >> 16));
+    client.sin_port = htons((uint16_t)tag);
+    packet_io_send(worker->io, answer, len, &client);
+}
+
+static bool forward_query(dns_worker *worker, const Packet *packet) {
+    if (worker->sockfd >= 0) {
+        return dns_forwarder_submit(worker->forwarder, (const char*)packet->data, packet->len, &packet->peer,
+                                    worker->sockfd);
+    }
+    uint64_t tag = ((uint64_t)ntohl(packet->peer.sin_addr.s_addr) << 16) | ntohs(packet->peer.sin_port);
+    return dns_forwarder_submit_with_reply(worker->forwarder, (const char*)packet->data, packet->len,
+                                           relay_packet_answer, worker, tag);
+}
+
+// Answer a batch of queries from the rules, the blocklist or the cache,
+// else forward; the answers go out together once we return
+static void on_query_batch(void *ctx, PacketIo *io, const Packet *batch, int count) {
+    dns_worker *worker = (dns_worker*)ctx;
+    HarpyTraceScope trace("dns", "query_batch");
+    trace.set_arg("queries", count);
+
+    // Hold an index only while answering, so reloads never wait on an idle worker
+    g_worker_epochs[worker->index].value.store(g_epoch.load());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // Match against the current rule snapshot; no lock on the packet path
+    index_snapshot snapshot = load_snapshot();
+    for (int i = 0; i < count; i++) {
+        const struct sockaddr_in *client = &batch[i].peer;
+        size_t query_size = batch[i].len;
+
+        DnsQueryOutcome outcome;
+        int64_t start_ns = harpy_metrics_now_ns();
+        uint8_t *out = packet_io_reply_buffer(io);
+        size_t answer_size = answer_locally(snapshot, client, batch[i].data, query_size, false, &worker->parsed,
+                                            out, kMaxDatagram, &outcome);
+        if (answer_size > 0) {
+            packet_io_queue_reply(io, answer_size, client);
+            harpy_metrics_record(HarpyHistogram::DNS_ANSWER, harpy_metrics_now_ns() - start_ns);
+            report_query(worker->index, outcome, &worker->parsed, client, answer_size);
+        } else if (worker->forwarder && forward_query(worker, &batch[i])) {
+            report_query(worker->index, DnsQueryOutcome::FORWARDED, &worker->parsed, client, query_size);
+        } else {
+            report_query(worker->index, DnsQueryOutcome::DROPPED, &worker->parsed, client, query_size);
+        }
+    }
+
+    g_worker_epochs[worker->index].value.store(kEpochOffline, std::memory_order_release);
+}
+
+// The forwarder's upstream sockets change per query, so it joins the
+// reactor as a poll source
+static int forwarder_fill(void *ctx, struct pollfd *fds, int max_fds) {
+    return dns_forwarder_fill_pollfds((DnsForwarder*)ctx, fds, max_fds);
+}
+
+static int forwarder_timeout(void *ctx) {
+    return dns_forwarder_poll_timeout((DnsForwarder*)ctx);
+}
+
+static void forwarder_handle(void *ctx, const struct pollfd *fds, int nfds) {
+    dns_forwarder_handle_events((DnsForwarder*)ctx, fds, nfds);
+}
+
+static void on_arp_refresh(void * /*ctx*/) {
+    if (dns_policy_has_mac_scopes(g_policy.load(std::memory_order_acquire))) {
+        refresh_client_macs();
+    }
+}
+
+// Run on the worker's reactor thread
+static void attach_worker(void *ctx) {
+    dns_worker *worker = (dns_worker*)ctx;
+    // Queries that no rule answers go upstream instead of being dropped
+    worker->forwarder = dns_forwarder_create(worker->upstreams);
+    if (!worker->forwarder) {
+        LOGE("DNS forwarding disabled, unmatched queries will be dropped");
+    } else {
+        dns_forwarder_set_cache(worker->forwarder, g_dns_cache);
+        reactor_add_poll_source(worker->reactor, {forwarder_fill, forwarder_timeout, forwarder_handle,
+                                                  worker->forwarder});
+    }
+    if (worker->index == 0) {
+        worker->arp_timer = reactor_add_timer(worker->reactor, kArpRefreshMs, on_arp_refresh, worker);
+    }
+    worker->attached = packet_io_start(worker->io, worker->reactor, on_query_batch, worker);
+    if (worker->attached && worker->index == 0) {
+        LOGD("DNS workers using %s packets", packet_io_kind_name(packet_io_kind(worker->io)));
+    }
+}
+
+static void detach_worker(void *ctx) {
+    dns_worker *worker = (dns_worker*)ctx;
+    packet_io_stop(worker->io);
+    reactor_remove_timer(worker->reactor, worker->arp_timer);
+    worker->arp_timer = nullptr;
+    if (worker->forwarder) {
+        reactor_remove_poll_source(worker->reactor, worker->forwarder);
+        dns_forwarder_destroy(worker->forwarder);
+        worker->forwarder = nullptr;
+    }
+}
+
+static void dns_spoof_worker_func(dns_worker *worker) {
+    LOGD("DNS worker %d listening on port %u", worker->index, g_dns_port);
+    reactor_run(worker->reactor);
+    LOGD("DNS worker %d stopped", worker->index);
+}
+
+// State of the TCP listener, handed to the answer and reply callbacks
+struct tcp_context {
+    int listen_fd;
+    Reactor *reactor;
+    std::vector<std::string> upstreams;
+    DnsTcpServer *server;
+    DnsForwarder *forwarder;
+    DnsQuery parsed;
+};
+
+static void relay_tcp_answer(void *ctx, uint64_t tag, const uint8_t *answer, size_t len) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    dns_tcp_server_reply(tcp->server, tag, answer, len);
+}
+
+// Answer locally or forward; a query that cannot be forwarded gets
+// SERVFAIL so the client is never left waiting on the connection
+static size_t answer_tcp_query(void *ctx, uint64_t tag, const uint8_t *query, size_t len,
+                               const struct sockaddr_in *client, uint8_t *out, size_t out_cap) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    HarpyTraceScope trace("dns", "tcp_query");
+    DnsQueryOutcome outcome;
+    int64_t start_ns = harpy_metrics_now_ns();
+    size_t answer_size = answer_locally(load_snapshot(), client, query, len, true, &tcp->parsed,
+                                        out, out_cap, &outcome);
+    if (answer_size > 0) {
+        harpy_metrics_record(HarpyHistogram::DNS_ANSWER, harpy_metrics_now_ns() - start_ns);
+        report_query(kTcpEpochSlot, outcome, &tcp->parsed, client, answer_size);
+        return answer_size;
+    }
+    if (tcp->forwarder && dns_forwarder_submit_with_reply(tcp->forwarder, (const char*)query, len,
+                                                          relay_tcp_answer, tcp, tag)) {
+        report_query(kTcpEpochSlot, DnsQueryOutcome::FORWARDED, &tcp->parsed, client, len);
+        return 0;
     }
     
-    g_stop_spoofing = false;
-    
-    // Buffer for incoming packets
-    unsigned char packet_buffer[512]; // DNS packets are usually smaller
+    report_query(kTcpEpochSlot, DnsQueryOutcome::DROPPED, &tcp->parsed, client, len);
+    DnsResponse resp;
+    if (!dns_parse_query(query, len, &tcp->parsed) ||
+        !dns_response_begin(&resp, query, &tcp->parsed, kDnsRcodeServFail, out, out_cap)) {
+        // Not even a question to echo; a bare header still ends the wait
+        if (out_cap < kDnsHeaderSize) return 0;
+        memcpy(out, query, kDnsHeaderSize);
+        dns_write_u16(out + 2, (uint16_t)(kDnsFlagQR | kDnsFlagRA | kDnsRcodeServFail));
+        memset(out + 4, 0, kDnsHeaderSize - 4);
+        return kDnsHeaderSize;
+    }
+    return dns_response_finish(&resp, &tcp->parsed);
+}
+
+// The listener and its connections come and go behind one descriptor
+// whose timeout follows the oldest connection; like the forwarder it is a
+// poll source
+static int tcp_fill(void *ctx, struct pollfd *fds, int max_fds) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    if (max_fds < 1) return 0;
+    fds[0].fd = dns_tcp_server_fd(tcp->server);
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return 1;
+}
+
+static int tcp_timeout(void *ctx) {
+    return dns_tcp_server_poll_timeout(((tcp_context*)ctx)->server);
+}
+
+// The same answer path as the UDP workers, with pipelined queries and
+// answers relayed back as they arrive
+static void tcp_handle(void *ctx, const struct pollfd * /*fds*/, int /*nfds*/) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    g_worker_epochs[kTcpEpochSlot].value.store(g_epoch.load());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    dns_tcp_server_handle_events(tcp->server);
+    g_worker_epochs[kTcpEpochSlot].value.store(kEpochOffline, std::memory_order_release);
+}
+
+// Run on worker 0's reactor thread; the server owns listen_fd from here on
+static void attach_tcp(void *ctx) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    tcp->server = dns_tcp_server_create(tcp->listen_fd, answer_tcp_query, tcp);
+    if (!tcp->server) return;
+    tcp->forwarder = dns_forwarder_create(tcp->upstreams);
+    if (tcp->forwarder) {
+        dns_forwarder_set_cache(tcp->forwarder, g_dns_cache);
+        reactor_add_poll_source(tcp->reactor, {forwarder_fill, forwarder_timeout, forwarder_handle,
+                                               tcp->forwarder});
+    }
+    reactor_add_poll_source(tcp->reactor, {tcp_fill, tcp_timeout, tcp_handle, tcp});
+    LOGD("DNS TCP listener on port %u", g_dns_port);
+}
+
+static void detach_tcp(void *ctx) {
+    tcp_context *tcp = (tcp_context*)ctx;
+    if (!tcp->server) return;
+    reactor_remove_poll_source(tcp->reactor, tcp);
+    if (tcp->forwarder) {
+        reactor_remove_poll_source(tcp->reactor, tcp->forwarder);
+        dns_forwarder_destroy(tcp->forwarder);
+        tcp->forwarder = nullptr;
+    }
+    dns_tcp_server_destroy(tcp->server);
+    tcp->server = nullptr;
+    LOGD("DNS TCP listener stopped");
+}
+
+static int open_tcp_listener(uint16_t port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sockfd < 0) {
+        LOGE("Failed to create DNS TCP socket: %s", strerror(errno));
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     
-    LOGD("DNS spoofing listening on port 53...");
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
     
-    while(!g_stop_spoofing) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        
-        int packet_size = recvfrom(g_dns_socket, packet_buffer, sizeof(packet_buffer), 0,
-                                   (struct sockaddr*)&client_addr, &addr_len);
-        
-        if(packet_size < 0) {
-            if(errno == EINTR) continue;
-            LOGE("Error receiving DNS packet: %s", strerror(errno));
-            break;
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+        listen(sockfd, kTcpBacklog) < 0) {
+        LOGE("Failed to listen for DNS over TCP on port %u: %s", port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Stop the workers' own reactors, unhook everything from the host's, and
+// close the sockets and the shared state
+static void release_workers() {
+    for (dns_worker *worker : g_workers) {
+        if (worker->own_reactor && worker->reactor) reactor_stop(worker->reactor);
+    }
+    for (dns_worker *worker : g_workers) {
+        if (worker->thread) {
+            worker->thread->join();
+            delete worker->thread;
         }
-        
-        // Check if this is a UDP packet containing DNS data (port 53)
-        // Apply spoofing rules to the packet
-        {
-            std::lock_guard<std::mutex> lock(g_rules_mutex);
-            for(const auto& rule : g_dns_rules) {
-                DNSSpoofRule spoof_rule;
-                spoof_rule.domain = rule.domain;
-                spoof_rule.spoofed_ip = rule.spoofed_ip;
-                
-                // Handle the DNS query with spoofing
-                bool response_sent = handle_dns_query_with_spoof(
-                    (char*)packet_buffer, 
-                    packet_size, 
-                    &client_addr, 
-                    addr_len, 
-                    g_dns_socket, 
-                    spoof_rule
-                );
-                
-                if(response_sent) {
-                    break; // Response sent, no need to check other rules
-                }
-            }
+    }
+    if (g_tcp) {
+        if (g_tcp->reactor) {
+            reactor_call(g_tcp->reactor, detach_tcp, g_tcp);
+        } else {
+            close(g_tcp->listen_fd);
         }
+        delete g_tcp;
+        g_tcp = nullptr;
     }
-    
-    close(g_dns_socket);
-    g_dns_socket = -1;
-    LOGD("DNS spoofing thread stopped");
+    for (dns_worker *worker : g_workers) {
+        if (worker->reactor) {
+            reactor_call(worker->reactor, detach_worker, worker);
+            if (worker->own_reactor) reactor_destroy(worker->reactor);
+        }
+        if (worker->own_io) packet_io_close(worker->io);
+        if (worker->sockfd >= 0) close(worker->sockfd);
+        delete worker;
+    }
+    g_workers.clear();
+    dns_cache_destroy(g_dns_cache);
+    g_dns_cache = nullptr;
 }
 
 bool dns_spoof_init() {
@@ -123,22 +603,92 @@ bool dns_start_spoofing(const char *interface, const std::vector<DNSSpoofRule>&
         return false;
     }
     
-    // Apply the rules
+    int worker_count = g_dns_worker_count;
+    if (worker_count <= 0) {
+        worker_count = (int)std::thread::hardware_concurrency();
+        if (worker_count <= 0) worker_count = 1;
+    }
+    if (worker_count > kMaxWorkers) worker_count = kMaxWorkers;
+    if (g_dns_packet_io) worker_count = 1;
+    
+    // Apply the rules; client scopes are laid out over the interface's subnet
+    DnsLocalSubnet subnet = dns_policy_interface_subnet(interface);
+    std::vector<std::string> upstreams;
     {
-        std::lock_guard<std::mutex> lock(g_rules_mutex);
+        HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+        g_local_subnet = subnet;
         g_dns_rules = rules;
+        publish_rules_locked();
+        upstreams = g_dns_upstreams;
+    }
+    
+    // Bind every socket up front so a busy port fails the start, not a worker
+    for (int i = 0; i < worker_count; i++) {
+        dns_worker *worker = new dns_worker();
+        worker->index = i;
+        worker->sockfd = -1;
+        worker->io = g_dns_packet_io;
+        worker->own_io = worker->io == nullptr;
+        if (worker->own_io) {
+            worker->sockfd = open_worker_socket(g_dns_port);
+            if (worker->sockfd >= 0) worker->io = packet_io_open_udp(worker->sockfd, kMaxDatagram, kMaxDatagram);
+        }
+        worker->own_reactor = i > 0 || g_dns_host_reactor == nullptr;
+        worker->reactor = nullptr;
+        worker->attached = false;
+        worker->thread = nullptr;
+        worker->forwarder = nullptr;
+        worker->arp_timer = nullptr;
+        worker->upstreams = upstreams;
+        g_workers.push_back(worker);
+        if (!worker->io) {
+            release_workers();
+            return false;
+        }
+    }
+    g_dns_cache = dns_cache_create(kDnsCacheDefaultBytes);
+    if (!g_analytics.load()) {
+        g_analytics.store(dns_analytics_create(kMaxWorkers + 1));
     }
     
-    // Start the spoofing thread
+    // Hook every socket to its reactor
+    for (dns_worker *worker : g_workers) {
+        worker->reactor = worker->own_reactor ? reactor_create() : g_dns_host_reactor;
+        if (!worker->reactor) {
+            release_workers();
+            return false;
+        }
+        reactor_call(worker->reactor, attach_worker, worker);
+        if (!worker->attached) {
+            release_workers();
+            return false;
+        }
+    }
+    // UDP alone still works, so a taken TCP port is not fatal
+    int listen_fd = g_dns_packet_io ? -1 : open_tcp_listener(g_dns_port);
+    if (listen_fd >= 0) {
+        g_tcp = new tcp_context();
+        g_tcp->listen_fd = listen_fd;
+        g_tcp->reactor = g_workers[0]->reactor;
+        g_tcp->upstreams = upstreams;
+        reactor_call(g_tcp->reactor, attach_tcp, g_tcp);
+    }
+    
+    // Start a thread for every reactor of our own
+    g_dns_spoof_active = true;
     try {
-        g_dns_spoof_thread = new std::thread(dns_spoof_thread_func, std::string(interface));
-        g_dns_spoof_active = true;
-        LOGD("DNS spoofing started successfully");
-        return true;
+        for (dns_worker *worker : g_workers) {
+            if (worker->own_reactor) {
+                worker->thread = new std::thread(dns_spoof_worker_func, worker);
+            }
+        }
     } catch(const std::exception& e) {
         LOGE("Failed to start DNS spoofing thread: %s", e.what());
+        dns_stop_spoofing();
         return false;
     }
+    LOGD("DNS spoofing started with %d workers on port %u", worker_count, g_dns_port);
+    return true;
 }
 
 void dns_stop_spoofing() {
@@ -149,60 +699,148 @@ void dns_stop_spoofing() {
         return;
     }
     
-    g_stop_spoofing = true;
-    
-    if(g_dns_socket >= 0) {
-        close(g_dns_socket);
-        g_dns_socket = -1;
-    }
-    
-    if(g_dns_spoof_thread && g_dns_spoof_thread->joinable()) {
-        g_dns_spoof_thread->join();
-        delete g_dns_spoof_thread;
-        g_dns_spoof_thread = nullptr;
-    }
+    // Every reactor of ours wakes at once and exits
+    release_workers();
     
     g_dns_spoof_active = false;
+
+    // The workers have exited, so retired indexes can no longer be in use
+    {
+        HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+        reclaim_locked(false);
+    }
     LOGD("DNS spoofing stopped");
 }
 
-void dns_add_rule(const char *domain, const char *spoofed_ip) {
+void dns_add_rule(const char *domain, const char *spoofed_ip, const char *client) {
     if(domain && spoofed_ip) {
-        std::lock_guard<std::mutex> lock(g_rules_mutex);
-        // Check if rule already exists
+        std::string scope = client ? client : "";
+        HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+        // Check if rule already exists; a name keeps one IPv4 and one IPv6
+        // target per client scope
+        bool ipv6 = strchr(spoofed_ip, ':') != nullptr;
         for(auto& rule : g_dns_rules) {
-            if(rule.domain == domain) {
+            if(rule.domain == domain && rule.client == scope &&
+               (rule.spoofed_ip.find(':') != std::string::npos) == ipv6) {
                 rule.spoofed_ip = spoofed_ip;
+                publish_rules_locked();
                 LOGD("Updated DNS spoofing rule for %s to %s", domain, spoofed_ip);
                 return;
             }
         }
         // Add new rule
-        g_dns_rules.push_back({domain, spoofed_ip});
-        LOGD("Added DNS spoofing rule: %s -> %s", domain, spoofed_ip);
+        g_dns_rules.push_back({domain, spoofed_ip, scope});
+        publish_rules_locked();
+        LOGD("Added DNS spoofing rule: %s -> %s%s%s", domain, spoofed_ip,
+             scope.empty() ? "" : " for ", scope.c_str());
     }
 }
 
-void dns_remove_rule(const char *domain) {
+void dns_remove_rule(const char *domain, const char *client) {
     if(domain) {
-        std::lock_guard<std::mutex> lock(g_rules_mutex);
+        HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
         g_dns_rules.erase(
             std::remove_if(g_dns_rules.begin(), g_dns_rules.end(),
-                          [domain](const DNSSpoofRule& rule) {
-                              return rule.domain == domain;
+                          [domain, client](const DNSSpoofRule& rule) {
+                              return rule.domain == domain && (!client || rule.client == client);
                           }),
             g_dns_rules.end()
         );
+        publish_rules_locked();
         LOGD("Removed DNS spoofing rule for %s", domain);
     }
 }
 
 void dns_clear_rules() {
-    std::lock_guard<std::mutex> lock(g_rules_mutex);
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
     g_dns_rules.clear();
+    publish_rules_locked();
     LOGD("Cleared all DNS spoofing rules");
 }
 
+void dns_replace_rules(const std::vector<DNSSpoofRule>& rules) {
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+    g_dns_rules = rules;
+    publish_rules_locked();
+    LOGD("Replaced DNS rules: %zu rules, built in %lld us, swapped in %lld us", g_last_reload.rules,
+         (long long)g_last_reload.build_us, (long long)g_last_reload.swap_us);
+}
+
+bool dns_load_rules_file(const char *path) {
+    // Parse outside the lock; only the build and swap exclude other writers
+    std::vector<DNSSpoofRule> rules;
+    if (!dns_rules_parse_file(path, &rules)) {
+        return false;
+    }
+    dns_replace_rules(rules);
+    return true;
+}
+
+DnsReloadStats dns_get_reload_stats() {
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+    return g_last_reload;
+}
+
+void dns_set_upstreams(const std::vector<std::string>& upstreams) {
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+    g_dns_upstreams = upstreams;
+    LOGD("Configured %zu DNS upstreams", upstreams.size());
+}
+
+bool dns_set_blocklist(const char *path, DnsBlockMode mode) {
+    DnsBlocklist *list = nullptr;
+    if (path) {
+        list = dns_blocklist_open(path);
+        if (!list) return false;
+    }
+    
+    HarpyTraceLock lock(g_rules_mutex, "g_rules_mutex");
+    g_block_mode.store(mode, std::memory_order_relaxed);
+    const DnsBlocklist *old_list = g_blocklist.exchange(list);
+    if (old_list) {
+        retire_locked(nullptr, old_list);
+        reclaim_locked(true);
+    }
+    LOGD("DNS blocklist %s (%zu entries)", path ? path : "removed", dns_blocklist_size(list));
+    return true;
+}
+
+void dns_set_listen_port(uint16_t port) {
+    g_dns_port = port;
+}
+
+void dns_set_workers(int count) {
+    g_dns_worker_count = count;
+}
+
+void dns_set_reactor(Reactor *reactor) {
+    g_dns_host_reactor = reactor;
+}
+
+void dns_set_packet_io(PacketIo *io) {
+    g_dns_packet_io = io;
+}
+
+void dns_set_query_callback(DnsQueryCallback callback) {
+    g_query_callback.store(callback);
+}
+
+std::vector<DnsTopEntry> dns_get_top_domains(int minutes, uint32_t client, size_t limit) {
+    return dns_analytics_top_domains(g_analytics.load(), minutes, client, limit);
+}
+
+std::vector<DnsTopEntry> dns_get_top_clients(int minutes, size_t limit) {
+    return dns_analytics_top_clients(g_analytics.load(), minutes, limit);
+}
+
+std::vector<DnsRecentQuery> dns_get_recent_queries(size_t limit) {
+    return dns_analytics_recent(g_analytics.load(), limit);
+}
+
+DnsAnalyticsTotals dns_get_query_totals(int minutes) {
+    return dns_analytics_totals(g_analytics.load(), minutes);
+}
+
 bool dns_is_active() {
     return g_dns_spoof_active.load();
 }
@@ -211,4 +849,5 @@ void dns_spoof_cleanup() {
     LOGD("Cleaning up DNS spoofing operations");
     dns_stop_spoofing();
     dns_clear_rules();
+    dns_analytics_reset(g_analytics.load());
 }
\ No newline at end of file
@@ -1,15 +1,32 @@
 #ifndef DNS_SPOOFING_H
 #define DNS_SPOOFING_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <netinet/in.h>
+#include "dns_handler.h"
+#include "dns_blocklist.h"
+#include "dns_analytics.h"
+
+struct Reactor;
+struct PacketIo;
+
+/**
+ * Called from the worker threads for every query, concurrently
+ * @param domain Query name for SPOOFED/BLOCKED, nullptr otherwise
+ * @param size Answer size for SPOOFED/BLOCKED/CACHED, query size otherwise
+ */
+typedef void (*DnsQueryCallback)(DnsQueryOutcome outcome, const char *domain,
+                                 const struct sockaddr_in *client, size_t size);
 
 /**
- * Structure to represent a DNS spoofing rule
+ * Timing of the last rule index rebuild
  */
-struct DNSSpoofRule {
-    std::string domain;      // Domain to spoof (e.g., "example.com")
-    std::string spoofed_ip;  // IP address to return instead (e.g., "8.8.8.8")
+struct DnsReloadStats {
+    size_t rules;       // Rules in the published index
+    int64_t build_us;   // Compiling the index, off the packet path
+    int64_t swap_us;    // Publishing it and waiting out the grace period
 };
 
 /**
@@ -18,33 +35,124 @@ struct DNSSpoofRule {
 bool dns_spoof_init();
 
 /**
- * Start DNS spoofing on a specific interface
+ * Start DNS spoofing on a specific interface. Each worker thread owns a
+ * SO_REUSEPORT socket on the listen port and moves packets in batches;
+ * one more thread serves DNS over TCP on the same port if it is free.
  * @param interface The network interface to listen on (e.g., "wlan0")
  * @param rules Vector of DNS spoofing rules to apply
  * @return true if successful, false otherwise
  */
 bool dns_start_spoofing(const char *interface, const std::vector<DNSSpoofRule>& rules);
 
+/**
+ * Set the upstream servers that queries without a matching rule are
+ * forwarded to ("ip" or "ip:port"). Takes effect on the next start.
+ */
+void dns_set_upstreams(const std::vector<std::string>& upstreams);
+
+/**
+ * Sinkhole every name in a compiled blocklist (see dns_blocklist_compile).
+ * May be called while spoofing is active; a nullptr path removes it.
+ * @return false if the index could not be mapped
+ */
+bool dns_set_blocklist(const char *path, DnsBlockMode mode);
+
+/**
+ * UDP port the workers listen on (default 53). Takes effect on the next start.
+ */
+void dns_set_listen_port(uint16_t port);
+
+/**
+ * Number of worker threads, or 0 for one per CPU (default). Takes effect
+ * on the next start.
+ */
+void dns_set_workers(int count);
+
+/**
+ * Serve worker 0 and DNS over TCP from reactor, run by the caller; the
+ * other workers keep a reactor thread each. nullptr (default) gives worker
+ * 0 a thread too. Takes effect on the next start.
+ */
+void dns_set_reactor(Reactor *reactor);
+
+/**
+ * Take queries from io, a DATAGRAMS backend such as a loopback or a
+ * capture replay, instead of the port (nullptr for the port). Runs a single
+ * worker and no TCP listener; forwarded answers go back through io. Stays
+ * owned by the caller. Takes effect on the next start.
+ */
+void dns_set_packet_io(PacketIo *io);
+
+/**
+ * Report every query to callback (nullptr to disable)
+ */
+void dns_set_query_callback(DnsQueryCallback callback);
+
 /**
  * Stop DNS spoofing
  */
 void dns_stop_spoofing();
 
 /**
- * Add a DNS spoofing rule
+ * Add a DNS spoofing rule. The domain may be a wildcard ("*.example.com")
+ * matching every name below it. The IP may be IPv4 or IPv6; a domain keeps
+ * one rule per address family and client scope.
+ * @param client Only answer this client IP, CIDR subnet or MAC address;
+ *               nullptr for every client
  */
-void dns_add_rule(const char *domain, const char *spoofed_ip);
+void dns_add_rule(const char *domain, const char *spoofed_ip, const char *client = nullptr);
 
 /**
  * Remove a DNS spoofing rule
+ * @param client Only remove the rule scoped to this client; nullptr
+ *               removes the domain's rules for every scope
  */
-void dns_remove_rule(const char *domain);
+void dns_remove_rule(const char *domain, const char *client = nullptr);
 
 /**
  * Clear all DNS spoofing rules
  */
 void dns_clear_rules();
 
+/**
+ * Replace the whole rule set at once. Safe while spoofing is active:
+ * workers keep answering from the old index until the new one is
+ * published, so no query is dropped.
+ */
+void dns_replace_rules(const std::vector<DNSSpoofRule>& rules);
+
+/**
+ * Replace the rule set with the rules in a file (see dns_rules_parse_file)
+ * @return false if the file could not be read
+ */
+bool dns_load_rules_file(const char *path);
+
+/**
+ * Build and swap timing of the most recent rule change
+ */
+DnsReloadStats dns_get_reload_stats();
+
+/**
+ * Heaviest query names over the last minutes (see dns_analytics_top_domains)
+ * @param client Only queries from this client (network byte order), or 0 for everyone
+ */
+std::vector<DnsTopEntry> dns_get_top_domains(int minutes, uint32_t client, size_t limit);
+
+/**
+ * Clients sending the most queries over the last minutes
+ */
+std::vector<DnsTopEntry> dns_get_top_clients(int minutes, size_t limit);
+
+/**
+ * Most recent queries, newest first
+ */
+std::vector<DnsRecentQuery> dns_get_recent_queries(size_t limit);
+
+/**
+ * Exact query and outcome counts over the last minutes
+ */
+DnsAnalyticsTotals dns_get_query_totals(int minutes);
+
 /**
  * Check if DNS spoofing is currently active
  */
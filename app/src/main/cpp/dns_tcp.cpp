@@ -0,0 +1,321 @@
+#include "dns_tcp.h"
+#include "dns_wire.h"
+#include "harpy_log.h"
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define LOG_TAG "DNSTcp"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+static const size_t kMaxClients = 256;
+static const int kIdleTimeoutMs = 10000;
+// Queries answered per connection before its replies have been written out;
+// a client pipelining faster than it reads stops being read
+static const size_t kMaxPendingQueries = 64;
+static const size_t kMaxQueuedOutput = 256 * 1024;
+static const size_t kReadChunk = 4096;
+static const size_t kMaxMessage = 65535;
+static const int kEventsPerWakeup = 64;
+static const uint64_t kListenTag = 0;   // epoll key of the listening socket
+
+struct tcp_client {
+    int fd;
+    uint64_t id;
+    struct sockaddr_in addr;
+    std::vector<uint8_t> in;        // Bytes read but not yet parsed into queries
+    std::vector<uint8_t> out;       // Length-prefixed answers not yet written
+    size_t out_done;
+    size_t pending;                 // Queries whose answer has not been queued yet
+    uint32_t events;                // Current epoll interest
+    bool eof;                       // Client closed its side; answer what is left, then close
+    int64_t last_active_ms;
+};
+
+struct DnsTcpServer {
+    int listen_fd;
+    int epoll_fd;
+    DnsTcpAnswerFn answer;
+    void *ctx;
+    uint64_t next_id;
+    std::unordered_map<uint64_t, tcp_client*> clients;
+    uint8_t response[kMaxMessage];
+};
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void close_client(DnsTcpServer *server, tcp_client *client) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+    close(client->fd);
+    server->clients.erase(client->id);
+    delete client;
+}
+
+static size_t queued_output(const tcp_client *client) {
+    return client->out.size() - client->out_done;
+}
+
+// Read while there is room for more answers, write while there are answers
+static void update_interest(DnsTcpServer *server, tcp_client *client) {
+    uint32_t events = 0;
+    if (!client->eof && client->pending < kMaxPendingQueries && queued_output(client) < kMaxQueuedOutput) {
+        events |= EPOLLIN;
+    }
+    if (queued_output(client) > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == client->events) return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = client->id;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->events = events;
+}
+
+static bool finished(const tcp_client *client) {
+    return client->eof && client->pending == 0 && queued_output(client) == 0;
+}
+
+static void queue_answer(tcp_client *client, const uint8_t *answer, size_t len) {
+    if (client->out_done == client->out.size()) {
+        client->out.clear();
+        client->out_done = 0;
+    }
+    size_t pos = client->out.size();
+    client->out.resize(pos + 2 + len);
+    dns_write_u16(client->out.data() + pos, (uint16_t)len);
+    memcpy(client->out.data() + pos + 2, answer, len);
+}
+
+// Write as much queued output as the socket takes; false on a dead connection
+static bool flush_output(tcp_client *client) {
+    while (queued_output(client) > 0) {
+        ssize_t n = send(client->fd, client->out.data() + client->out_done, queued_output(client),
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client->out_done += n;
+    }
+    return true;
+}
+
+// Hand every complete query in the input buffer to the answer callback;
+// false if the client sent something that is not DNS
+static bool process_queries(DnsTcpServer *server, tcp_client *client) {
+    size_t pos = 0;
+    while (client->pending < kMaxPendingQueries && queued_output(client) < kMaxQueuedOutput &&
+           client->in.size() - pos >= 2) {
+        size_t len = dns_read_u16(client->in.data() + pos);
+        if (len < kDnsHeaderSize) return false;
+        if (client->in.size() - pos - 2 < len) break;
+
+        const uint8_t *query = client->in.data() + pos + 2;
+        pos += 2 + len;
+        client->pending++;
+        size_t answer_len = server->answer(server->ctx, client->id, query, len, &client->addr,
+                                           server->response, sizeof(server->response));
+        if (answer_len > 0) {
+            client->pending--;
+            queue_answer(client, server->response, answer_len);
+        }
+    }
+    client->in.erase(client->in.begin(), client->in.begin() + pos);
+    return true;
+}
+
+static void accept_clients(DnsTcpServer *server, int64_t now) {
+    while (true) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(server->listen_fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("Failed to accept DNS TCP client: %s", strerror(errno));
+            }
+            return;
+        }
+        if (server->clients.size() >= kMaxClients) {
+            close(fd);
+            continue;
+        }
+
+        tcp_client *client = new tcp_client();
+        client->fd = fd;
+        client->id = server->next_id++;
+        client->addr = addr;
+        client->out_done = 0;
+        client->pending = 0;
+        client->events = EPOLLIN;
+        client->eof = false;
+        client->last_active_ms = now;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = client->id;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            delete client;
+            continue;
+        }
+        server->clients[client->id] = client;
+    }
+}
+
+// Read what arrived and answer it; false once the connection is finished
+static bool read_client(DnsTcpServer *server, tcp_client *client) {
+    while (client->events & EPOLLIN) {
+        size_t pos = client->in.size();
+        if (pos >= 2 + kMaxMessage) return false;
+        client->in.resize(pos + kReadChunk);
+        ssize_t n = recv(client->fd, client->in.data() + pos, kReadChunk, MSG_DONTWAIT);
+        client->in.resize(pos + (n > 0 ? n : 0));
+        if (n == 0) {
+            // Half-close: finish answering what was already sent
+            client->eof = true;
+            return process_queries(server, client);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (!process_queries(server, client)) return false;
+        update_interest(server, client);
+        if ((size_t)n < kReadChunk) break;
+    }
+    return true;
+}
+
+static void expire_idle(DnsTcpServer *server, int64_t now) {
+    std::vector<tcp_client*> idle;
+    for (const auto& entry : server->clients) {
+        tcp_client *client = entry.second;
+        if (client->pending == 0 && now - client->last_active_ms >= kIdleTimeoutMs) {
+            idle.push_back(client);
+        }
+    }
+    for (tcp_client *client : idle) {
+        close_client(server, client);
+    }
+}
+
+DnsTcpServer *dns_tcp_server_create(int listen_fd, DnsTcpAnswerFn answer, void *ctx) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOGE("Failed to create DNS TCP epoll: %s", strerror(errno));
+        close(listen_fd);
+        return nullptr;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = kListenTag;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        LOGE("Failed to watch DNS TCP listener: %s", strerror(errno));
+        close(epoll_fd);
+        close(listen_fd);
+        return nullptr;
+    }
+
+    DnsTcpServer *server = new DnsTcpServer();
+    server->listen_fd = listen_fd;
+    server->epoll_fd = epoll_fd;
+    server->answer = answer;
+    server->ctx = ctx;
+    server->next_id = kListenTag + 1;
+    return server;
+}
+
+void dns_tcp_server_destroy(DnsTcpServer *server) {
+    if (!server) return;
+    for (const auto& entry : server->clients) {
+        close(entry.second->fd);
+        delete entry.second;
+    }
+    close(server->epoll_fd);
+    close(server->listen_fd);
+    delete server;
+}
+
+int dns_tcp_server_fd(const DnsTcpServer *server) {
+    return server->epoll_fd;
+}
+
+void dns_tcp_server_handle_events(DnsTcpServer *server) {
+    struct epoll_event events[kEventsPerWakeup];
+    int64_t now = monotonic_ms();
+    int n = epoll_wait(server->epoll_fd, events, kEventsPerWakeup, 0);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 == kListenTag) {
+            accept_clients(server, now);
+            continue;
+        }
+        // An earlier event in this batch may have closed the client
+        auto it = server->clients.find(events[i].data.u64);
+        if (it == server->clients.end()) continue;
+        tcp_client *client = it->second;
+        client->last_active_ms = now;
+
+        // A hangup after the client's own close would otherwise fire forever
+        bool alive = !(events[i].events & EPOLLERR) && !(client->eof && (events[i].events & EPOLLHUP));
+        if (alive && (events[i].events & (EPOLLIN | EPOLLHUP))) {
+            alive = read_client(server, client);
+        }
+        if (alive && (events[i].events & EPOLLOUT)) {
+            alive = flush_output(client);
+            // Output drained below the cap; parse queries that were held back
+            if (alive) alive = process_queries(server, client);
+        }
+        if (alive) alive = flush_output(client) && !finished(client);
+        if (!alive) {
+            close_client(server, client);
+            continue;
+        }
+        update_interest(server, client);
+    }
+    expire_idle(server, now);
+}
+
+int dns_tcp_server_poll_timeout(const DnsTcpServer *server) {
+    int64_t earliest = -1;
+    for (const auto& entry : server->clients) {
+        const tcp_client *client = entry.second;
+        if (client->pending > 0) continue;
+        int64_t deadline = client->last_active_ms + kIdleTimeoutMs;
+        if (earliest < 0 || deadline < earliest) earliest = deadline;
+    }
+    if (earliest < 0) return -1;
+    int64_t wait = earliest - monotonic_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+void dns_tcp_server_reply(DnsTcpServer *server, uint64_t tag, const uint8_t *answer, size_t len) {
+    auto it = server->clients.find(tag);
+    if (it == server->clients.end()) return;
+    tcp_client *client = it->second;
+    if (client->pending > 0) client->pending--;
+    client->last_active_ms = monotonic_ms();
+    queue_answer(client, answer, len);
+    if (!flush_output(client) || finished(client)) {
+        close_client(server, client);
+        return;
+    }
+    update_interest(server, client);
+}
+
+size_t dns_tcp_server_clients(const DnsTcpServer *server) {
+    return server->clients.size();
+}
@@ -0,0 +1,69 @@
+#ifndef DNS_TCP_H
+#define DNS_TCP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+
+/**
+ * DNS-over-TCP listener (RFC 7766). Accepts clients on a listening socket
+ * and reads length-prefixed queries, several of which may be pipelined on
+ * one connection. Each query is handed to an answer callback; answers may
+ * come back immediately or later through dns_tcp_server_reply, in any
+ * order. Connections idle for longer than the timeout are closed.
+ * Everything runs on the owner's thread: it polls the single descriptor
+ * returned by dns_tcp_server_fd and calls dns_tcp_server_handle_events
+ * when it is readable.
+ */
+struct DnsTcpServer;
+
+/**
+ * Answer a query received over TCP
+ * @param tag Identifies the connection; pass it to dns_tcp_server_reply
+ *            to answer later
+ * @param out Buffer for an immediate answer
+ * @param out_cap Size of out
+ * @return Size of the answer written to out, or 0 if it will be sent later
+ */
+typedef size_t (*DnsTcpAnswerFn)(void *ctx, uint64_t tag, const uint8_t *query, size_t len,
+                                  const struct sockaddr_in *client, uint8_t *out, size_t out_cap);
+
+/**
+ * Create a server on a bound, listening, non-blocking socket. The socket
+ * is owned by the server from now on, even if creation fails.
+ * @return The server, or nullptr if epoll is unavailable
+ */
+DnsTcpServer *dns_tcp_server_create(int listen_fd, DnsTcpAnswerFn answer, void *ctx);
+
+/**
+ * Close every connection and the listening socket and free the server
+ */
+void dns_tcp_server_destroy(DnsTcpServer *server);
+
+/**
+ * Descriptor to poll for POLLIN; readable whenever the server has work
+ */
+int dns_tcp_server_fd(const DnsTcpServer *server);
+
+/**
+ * Accept clients, read queries, flush pending answers and close idle
+ * connections. Never blocks.
+ */
+void dns_tcp_server_handle_events(DnsTcpServer *server);
+
+/**
+ * Milliseconds until the next idle connection must be closed, or -1
+ */
+int dns_tcp_server_poll_timeout(const DnsTcpServer *server);
+
+/**
+ * Queue a deferred answer. Dropped silently if the client has gone away.
+ */
+void dns_tcp_server_reply(DnsTcpServer *server, uint64_t tag, const uint8_t *answer, size_t len);
+
+/**
+ * Number of connected clients
+ */
+size_t dns_tcp_server_clients(const DnsTcpServer *server);
+
+#endif // DNS_TCP_H
@@ -0,0 +1,210 @@
+#include "dns_wire.h"
+#include <cstring>
+
+static inline uint8_t ascii_lower(uint8_t c) {
+    return (uint8_t)(c - 'A') < 26 ? (uint8_t)(c | 0x20) : c;
+}
+
+size_t dns_skip_name(const uint8_t *packet, size_t len, size_t pos) {
+    while (pos < len) {
+        uint8_t label = packet[pos];
+        if (label == 0) {
+            return pos + 1;
+        }
+        if ((label & 0xC0) == 0xC0) {
+            return pos + 2 <= len ? pos + 2 : 0;
+        }
+        if (label & 0xC0) {
+            return 0;   // Reserved label types
+        }
+        pos += label + 1;
+    }
+    return 0;
+}
+
+size_t dns_question_end(const uint8_t *packet, size_t len) {
+    if (len < kDnsHeaderSize) return 0;
+    size_t pos = dns_skip_name(packet, len, kDnsHeaderSize);
+    if (pos == 0 || pos + 4 > len) return 0;
+    return pos + 4;   // QTYPE + QCLASS
+}
+
+bool dns_question_matches(const uint8_t *query, size_t query_len, const uint8_t *answer, size_t answer_len) {
+    if (query_len < kDnsHeaderSize || answer_len < kDnsHeaderSize) return false;
+    if (dns_read_u16(query + 4) != 1 || dns_read_u16(answer + 4) != 1) return false;
+    // The question comes first in both, so neither name can be compressed
+    size_t pos = kDnsHeaderSize;
+    while (true) {
+        if (pos >= query_len || pos >= answer_len) return false;
+        uint8_t label = query[pos];
+        if (label != answer[pos] || (label & 0xC0)) return false;
+        pos++;
+        if (label == 0) break;
+        if (pos + label > query_len || pos + label > answer_len) return false;
+        for (size_t end = pos + label; pos < end; pos++) {
+            if (ascii_lower(query[pos]) != ascii_lower(answer[pos])) return false;
+        }
+    }
+    // QTYPE and QCLASS
+    return pos + 4 <= query_len && pos + 4 <= answer_len && memcmp(query + pos, answer + pos, 4) == 0;
+}
+
+uint16_t dns_client_udp_limit(const uint8_t *query, size_t len, size_t qend) {
+    // OPT is the only additional record a stub sends: root name, TYPE 41,
+    // and the payload size in the CLASS field
+    if (dns_read_u16(query + 10) == 0 || qend + 11 > len) return 512;
+    const uint8_t *opt = query + qend;
+    if (opt[0] != 0 || dns_read_u16(opt + 1) != kDnsTypeOPT) return 512;
+    uint16_t size = dns_read_u16(opt + 3);
+    return size > 512 ? size : 512;
+}
+
+// Copy one question name starting at pos into question; returns the offset
+// just past it or 0. Queries never compress questions, so there are no
+// pointers to follow: one forward pass with a bounds check per label.
+static size_t parse_question_name(const uint8_t *packet, size_t len, size_t pos,
+                                  DnsQuestion *question) {
+    size_t out = 0;
+    while (true) {
+        if (pos >= len) return 0;
+        uint8_t label = packet[pos++];
+        if (label == 0) break;
+        if (label & 0xC0) return 0;
+        if (pos + label > len) return 0;
+        if (out + (out ? 1 : 0) + label > kDnsMaxNameLen) return 0;
+        if (out) question->name[out++] = '.';
+        for (uint8_t i = 0; i < label; i++) {
+            uint8_t c = packet[pos + i];
+            if (c == '.') return 0;
+            question->name[out++] = (char)((uint8_t)(c - 'A') < 26 ? (c | 0x20) : c);
+        }
+        pos += label;
+    }
+    question->name[out] = '\0';
+    question->name_len = out;
+    return pos;
+}
+
+bool dns_parse_query(const uint8_t *packet, size_t len, DnsQuery *query) {
+    if (len < kDnsHeaderSize) return false;
+    query->id = dns_read_u16(packet);
+    query->flags = dns_read_u16(packet + 2);
+    query->question_count = dns_read_u16(packet + 4);
+    if ((query->flags & kDnsFlagQR) || query->question_count == 0 ||
+        query->question_count > kDnsMaxQuestions) {
+        return false;
+    }
+
+    size_t pos = kDnsHeaderSize;
+    for (uint16_t i = 0; i < query->question_count; i++) {
+        DnsQuestion *question = &query->questions[i];
+        question->name_offset = (uint16_t)pos;
+        pos = parse_question_name(packet, len, pos, question);
+        if (pos == 0 || pos + 4 > len) return false;
+        question->qtype = dns_read_u16(packet + pos);
+        question->qclass = dns_read_u16(packet + pos + 2);
+        pos += 4;
+        question->qend = pos;
+    }
+    query->questions_end = pos;
+
+    // Look for OPT among the remaining records (normally the only one)
+    query->has_opt = false;
+    query->edns_version = 0;
+    query->dnssec_ok = false;
+    query->udp_size = 512;
+    uint32_t records = (uint32_t)dns_read_u16(packet + 6) + dns_read_u16(packet + 8) +
+                       dns_read_u16(packet + 10);
+    for (uint32_t i = 0; i < records; i++) {
+        size_t name_start = pos;
+        pos = dns_skip_name(packet, len, pos);
+        if (pos == 0 || pos + 10 > len) break;
+        uint16_t rdlen = dns_read_u16(packet + pos + 8);
+        if (dns_read_u16(packet + pos) == kDnsTypeOPT && packet[name_start] == 0 && !query->has_opt) {
+            uint16_t size = dns_read_u16(packet + pos + 2);
+            query->has_opt = true;
+            query->udp_size = size > 512 ? size : 512;
+            query->edns_version = packet[pos + 5];
+            query->dnssec_ok = (packet[pos + 6] & 0x80) != 0;
+        }
+        pos += 10 + rdlen;
+    }
+    return true;
+}
+
+static const size_t kOptRecordSize = 11;
+
+bool dns_response_begin(DnsResponse *resp, const uint8_t *query, const DnsQuery *parsed,
+                        uint16_t rcode, uint8_t *out, size_t cap) {
+    resp->out = out;
+    resp->cap = parsed->has_opt ? (cap > kOptRecordSize ? cap - kOptRecordSize : 0) : cap;
+    resp->len = parsed->questions_end;
+    resp->answers = 0;
+    resp->truncated = false;
+    resp->bad_version = parsed->has_opt && parsed->edns_version != 0;
+    if (resp->len > resp->cap) return false;
+
+    memcpy(out, query, parsed->questions_end);
+    if (resp->bad_version) rcode = kDnsRcodeBadVers;
+    // Keep the opcode and RD bit; the low four rcode bits live in the header
+    uint16_t flags = (uint16_t)((parsed->flags & 0x7900) | kDnsFlagQR | kDnsFlagRA | (rcode & kDnsRcodeMask));
+    dns_write_u16(out + 2, flags);
+    return true;
+}
+
+void dns_response_add(DnsResponse *resp, const uint8_t *record, size_t record_len,
+                      uint16_t name_offset) {
+    if (resp->bad_version) return;
+    if (resp->truncated || resp->len + record_len > resp->cap) {
+        resp->truncated = true;
+        return;
+    }
+    uint8_t *dst = resp->out + resp->len;
+    memcpy(dst, record, record_len);
+    dns_write_u16(dst, (uint16_t)(0xC000 | name_offset));
+    resp->len += record_len;
+    resp->answers++;
+}
+
+size_t dns_response_finish(DnsResponse *resp, const DnsQuery *parsed) {
+    uint8_t *out = resp->out;
+    if (resp->truncated) {
+        dns_write_u16(out + 2, dns_read_u16(out + 2) | kDnsFlagTC);
+    }
+    dns_write_u16(out + 6, resp->answers);
+    dns_write_u16(out + 8, 0);
+    dns_write_u16(out + 10, parsed->has_opt ? 1 : 0);
+
+    if (parsed->has_opt) {
+        // Root name, TYPE OPT, our payload size, extended rcode/version/DO, no options
+        uint8_t *opt = out + resp->len;
+        opt[0] = 0;
+        dns_write_u16(opt + 1, kDnsTypeOPT);
+        dns_write_u16(opt + 3, kDnsEdnsPayloadSize);
+        opt[5] = resp->bad_version ? (uint8_t)(kDnsRcodeBadVers >> 4) : 0;
+        opt[6] = 0;
+        opt[7] = parsed->dnssec_ok ? 0x80 : 0;
+        opt[8] = 0;
+        dns_write_u16(opt + 9, 0);
+        resp->len += kOptRecordSize;
+    }
+    return resp->len;
+}
+
+void dns_write_a_record(uint8_t *record, const void *addr, uint32_t ttl) {
+    dns_write_u16(record, 0xC000 | kDnsHeaderSize);
+    dns_write_u16(record + 2, kDnsTypeA);
+    dns_write_u16(record + 4, kDnsClassIN);
+    dns_write_u32(record + 6, ttl);
+    dns_write_u16(record + 10, 4);
+    memcpy(record + 12, addr, 4);
+}
+
+void dns_write_aaaa_record(uint8_t *record, const void *addr, uint32_t ttl) {
+    dns_write_u16(record, 0xC000 | kDnsHeaderSize);
+    dns_write_u16(record + 2, kDnsTypeAAAA);
+    dns_write_u16(record + 4, kDnsClassIN);
+    dns_write_u32(record + 6, ttl);
+    dns_write_u16(record + 10, 16);
+    memcpy(record + 12, addr, 16);
+}
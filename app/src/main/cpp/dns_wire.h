@@ -0,0 +1,168 @@
+#ifndef DNS_WIRE_H
+#define DNS_WIRE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Fixed DNS header size and flag bits (RFC 1035 section 4.1.1)
+static const size_t kDnsHeaderSize = 12;
+static const uint16_t kDnsFlagQR = 0x8000;
+static const uint16_t kDnsFlagTC = 0x0200;
+static const uint16_t kDnsFlagRD = 0x0100;
+static const uint16_t kDnsFlagRA = 0x0080;
+static const uint16_t kDnsRcodeMask = 0x000F;
+static const uint16_t kDnsRcodeNoError = 0;
+static const uint16_t kDnsRcodeServFail = 2;
+static const uint16_t kDnsRcodeNxDomain = 3;
+
+// Longest name in dotted form, without the trailing dot (RFC 1035 2.3.4)
+static const size_t kDnsMaxNameLen = 253;
+
+static const uint16_t kDnsRcodeBadVers = 16;      // Extended rcode, carried in OPT
+
+static const uint16_t kDnsTypeA = 1;
+static const uint16_t kDnsTypeSOA = 6;
+static const uint16_t kDnsTypeAAAA = 28;
+static const uint16_t kDnsTypeOPT = 41;
+static const uint16_t kDnsTypeANY = 255;
+static const uint16_t kDnsClassIN = 1;
+static const uint16_t kDnsClassANY = 255;
+
+// UDP payload size advertised in our OPT records (DNS flag day 2020)
+static const uint16_t kDnsEdnsPayloadSize = 1232;
+
+inline uint16_t dns_read_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+inline uint32_t dns_read_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void dns_write_u16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)(value & 0xff);
+}
+
+inline void dns_write_u32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)(value & 0xff);
+}
+
+/**
+ * Skip a possibly compressed name starting at pos
+ * @return Offset just past the name, or 0 if it runs off the packet
+ */
+size_t dns_skip_name(const uint8_t *packet, size_t len, size_t pos);
+
+/**
+ * Offset just past the first question, or 0 if the packet is malformed
+ */
+size_t dns_question_end(const uint8_t *packet, size_t len);
+
+/**
+ * Whether answer's first question has the same name (ignoring case), type
+ * and class as query's
+ */
+bool dns_question_matches(const uint8_t *query, size_t query_len, const uint8_t *answer, size_t answer_len);
+
+/**
+ * Largest UDP answer the client accepts: its EDNS0 OPT payload size, or 512
+ * @param qend Offset returned by dns_question_end
+ */
+uint16_t dns_client_udp_limit(const uint8_t *query, size_t len, size_t qend);
+
+/**
+ * One question of a query, validated in place. The name is copied out
+ * lowercased and dotted so it can be used directly as a lookup key.
+ */
+struct DnsQuestion {
+    uint16_t qtype;
+    uint16_t qclass;
+    uint16_t name_offset;               // Where the name starts, for compression pointers
+    size_t qend;                        // Offset just past QTYPE/QCLASS
+    size_t name_len;
+    char name[kDnsMaxNameLen + 1];      // No trailing dot, NUL terminated
+};
+
+// Questions answered in one query; QDCOUNT above this is left to upstreams
+static const size_t kDnsMaxQuestions = 4;
+
+/**
+ * A parsed query: header fields, every question and the client's EDNS0
+ * OPT record if it sent one
+ */
+struct DnsQuery {
+    uint16_t id;
+    uint16_t flags;
+    uint16_t question_count;
+    size_t questions_end;               // Offset just past the last question
+    bool has_opt;
+    uint8_t edns_version;
+    bool dnssec_ok;                     // DO bit, echoed back
+    uint16_t udp_size;                  // Largest UDP answer accepted, 512 without OPT
+    DnsQuestion questions[kDnsMaxQuestions];
+};
+
+/**
+ * Parse and validate a query without allocating. Rejects responses,
+ * packets without a question or with more than kDnsMaxQuestions,
+ * compression pointers in questions, over-long names and labels
+ * containing dots.
+ * @return true if query was filled in
+ */
+bool dns_parse_query(const uint8_t *packet, size_t len, DnsQuery *query);
+
+/**
+ * An answer being assembled in a caller-owned buffer
+ */
+struct DnsResponse {
+    uint8_t *out;
+    size_t cap;
+    size_t len;
+    uint16_t answers;
+    bool truncated;                     // A record did not fit; TC is set
+    bool bad_version;                   // Unsupported EDNS version, answered BADVERS
+};
+
+/**
+ * Start an answer: the header and every question are copied from the
+ * query. Room for the OPT record is reserved when the query had one.
+ * @param cap Size of out, already limited to what the client accepts
+ * @return false if not even the questions fit
+ */
+bool dns_response_begin(DnsResponse *resp, const uint8_t *query, const DnsQuery *parsed,
+                        uint16_t rcode, uint8_t *out, size_t cap);
+
+/**
+ * Append a pre-serialized record whose name is a compression pointer,
+ * retargeted at name_offset. Sets truncated instead if it does not fit.
+ */
+void dns_response_add(DnsResponse *resp, const uint8_t *record, size_t record_len,
+                      uint16_t name_offset);
+
+/**
+ * Write the counts, echo OPT if the query had one and set TC if needed
+ * @return Size of the finished answer
+ */
+size_t dns_response_finish(DnsResponse *resp, const DnsQuery *parsed);
+
+// Pre-serialized answer records: name pointer, type, class IN, TTL, rdlength, rdata
+static const size_t kDnsRecordASize = 16;
+static const size_t kDnsRecordAAAASize = 28;
+
+/**
+ * Serialize an A record pointing at the first question
+ * @param addr IPv4 address in network byte order
+ */
+void dns_write_a_record(uint8_t *record, const void *addr, uint32_t ttl);
+
+/**
+ * Serialize an AAAA record pointing at the first question
+ * @param addr 16-byte IPv6 address
+ */
+void dns_write_aaaa_record(uint8_t *record, const void *addr, uint32_t ttl);
+
+#endif // DNS_WIRE_H
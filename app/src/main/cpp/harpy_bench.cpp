@@ -0,0 +1,289 @@
+// Host microbenchmarks for the per-packet builders and parsers.
+//
+// Times the scan sweep frame, a full ARP reply batch, MAC parsing and
+// formatting, DNS query decode, rule lookup, answer encode and
+// spoofed/blocked answer crafting, and DHCP message parsing and reply
+// crafting. Every case reports nanoseconds and heap allocations per
+// operation; allocations are counted by replacing the global operator new.
+//
+// Usage: harpy_bench [iterations] [filter]
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "arp_frame.h"
+#include "arp_operations.h"
+#include "dhcp_spoofing.h"
+#include "dhcp_wire.h"
+#include "dns_blocklist.h"
+#include "dns_handler.h"
+#include "dns_rules.h"
+#include "dns_wire.h"
+
+static const int kQueryCount = 1024;
+static const int kRuleCount = 1000;
+static const int kClientCount = 256;
+
+static std::atomic<uint64_t> g_allocations(0);
+
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static const char *g_filter = nullptr;
+
+template <typename Fn>
+static void run(const char *label, long iterations, Fn fn) {
+    if (g_filter && !strstr(label, g_filter)) return;
+    size_t sink = 0;
+    for (long i = 0; i < iterations / 100 + 1; i++) {
+        sink += fn((int)(i & (kQueryCount - 1)));
+    }
+    uint64_t allocs = g_allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        sink += fn((int)(i & (kQueryCount - 1)));
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    allocs = g_allocations.load(std::memory_order_relaxed) - allocs;
+    printf("%-22s %8.1f ns/op %8.2f allocs/op  (%zu)\n",
+           label, elapsed / iterations, (double)allocs / iterations, sink);
+}
+
+static size_t build_query(uint8_t *out, const std::string& name, uint16_t type) {
+    memset(out, 0, kDnsHeaderSize);
+    dns_write_u16(out, 0x1234);
+    dns_write_u16(out + 2, kDnsFlagRD);
+    dns_write_u16(out + 4, 1);
+    size_t pos = kDnsHeaderSize;
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos) dot = name.size();
+        out[pos++] = (uint8_t)(dot - start);
+        for (size_t i = start; i < dot; i++) {
+            // Mixed case, as resolvers using 0x20 randomization send it
+            out[pos++] = (uint8_t)((i & 1) ? toupper(name[i]) : name[i]);
+        }
+        start = dot + 1;
+    }
+    out[pos++] = 0;
+    dns_write_u16(out + pos, type);
+    dns_write_u16(out + pos + 2, 1);
+    return pos + 4;
+}
+
+// A broadcast DISCOVER or a REQUEST for a given address
+static size_t build_dhcp_message(uint8_t *out, int client, uint8_t type) {
+    memset(out, 0, kDhcpMinPacketSize);
+    out[0] = kDhcpOpRequest;
+    out[1] = 1;     // Ethernet
+    out[2] = 6;
+    uint32_t xid = 0x48000000u | (uint32_t)client;
+    memcpy(out + 4, &xid, 4);
+    out[10] = (uint8_t)(kDhcpFlagBroadcast >> 8);
+    const uint8_t mac[6] = {0x02, 0x48, 0x50, 0x00, (uint8_t)(client >> 8), (uint8_t)client};
+    memcpy(out + 28, mac, 6);
+    uint32_t cookie = htonl(kDhcpMagicCookie);
+    memcpy(out + kDhcpHeaderSize, &cookie, 4);
+
+    uint8_t *opts = out + kDhcpOptionsOffset;
+    size_t pos = 0;
+    opts[pos++] = kDhcpOptMessageType;
+    opts[pos++] = 1;
+    opts[pos++] = type;
+    if (type == kDhcpRequest) {
+        uint32_t requested = htonl(0x0a000064u + (uint32_t)client);
+        opts[pos++] = kDhcpOptRequestedIp;
+        opts[pos++] = 4;
+        memcpy(opts + pos, &requested, 4);
+        pos += 4;
+    }
+    opts[pos++] = kDhcpOptClientId;
+    opts[pos++] = 7;
+    opts[pos++] = 1;
+    memcpy(opts + pos, mac, 6);
+    pos += 6;
+    const uint8_t params[] = {kDhcpOptParamList, 4, kDhcpOptSubnetMask, kDhcpOptRouter,
+                              kDhcpOptDnsServer, kDhcpOptLeaseTime};
+    memcpy(opts + pos, params, sizeof(params));
+    pos += sizeof(params);
+    opts[pos] = kDhcpOptEnd;
+    return kDhcpMinPacketSize;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+    if (iterations <= 0) iterations = 5000000;
+    g_filter = argc > 2 ? argv[2] : nullptr;
+
+    // Scan and ARP frames
+    static const uint8_t kOurMac[6] = {0x02, 0x48, 0x41, 0x52, 0x50, 0x59};
+    static const uint8_t kZeroMac[6] = {0};
+    uint32_t our_ip = htonl(0x0a000002);
+    ArpFrame sweep = kArpRequestTemplate;
+    arp_frame_patch(&sweep, kOurMac, our_ip, kZeroMac, 0);
+    memset(sweep.eth_dst, 0xff, sizeof(sweep.eth_dst));
+    static ArpSendBatch batch;
+
+    run("scan_frame", iterations, [&](int q) {
+        uint32_t target_ip = htonl(0x0a000000u | (uint32_t)(q & 0xff));
+        memcpy(sweep.tpa, &target_ip, 4);
+        return (size_t)sweep.tpa[3];
+    });
+    run("arp_batch_64", iterations / 64, [&](int q) {
+        arp_batch_init(&batch, 2);
+        uint32_t gateway_ip = htonl(0x0a000001);
+        for (int i = 0; i < kArpBatchMax; i++) {
+            uint32_t target_ip = htonl(0x0a000000u | (uint32_t)((q + i) & 0xff));
+            arp_batch_add_reply(&batch, kOurMac, gateway_ip, kOurMac, target_ip);
+        }
+        return (size_t)batch.count;
+    });
+
+    // MAC parse and format
+    std::vector<std::string> mac_strings;
+    for (int i = 0; i < kQueryCount; i++) {
+        char buf[18];
+        snprintf(buf, sizeof(buf), "%02x:%02X:%02x:%02x:%02x:%02x", 0x02, i & 0xff, 0x5a, i >> 8, 0xc3, i & 0x0f);
+        mac_strings.push_back(buf);
+    }
+    uint8_t mac[6];
+    run("mac_parse", iterations, [&](int q) {
+        return arp_parse_mac(mac_strings[q].c_str(), mac) ? (size_t)mac[1] : 0;
+    });
+    run("mac_format", iterations, [&](int q) {
+        uint8_t m[6] = {0x02, (uint8_t)q, 0x5a, (uint8_t)(q >> 8), 0xc3, (uint8_t)(q & 0x0f)};
+        return mac_to_string(m).size();
+    });
+
+    // DNS: exact hits, wildcard hits and misses against a 1000-rule index
+    std::vector<DNSSpoofRule> rule_list;
+    for (int i = 0; i < kRuleCount; i++) {
+        rule_list.push_back({"tracker" + std::to_string(i) + ".ads.example.com", "10.0.0.1"});
+    }
+    rule_list.push_back({"*.cdn.example.net", "10.0.0.2"});
+    DnsRuleSet *rules = dns_rules_build(rule_list);
+
+    static uint8_t queries[kQueryCount][300];
+    static size_t sizes[kQueryCount];
+    for (int i = 0; i < kQueryCount; i++) {
+        std::string name;
+        switch (i % 4) {
+            case 0:
+            case 2:
+                name = "tracker" + std::to_string(i % kRuleCount) + ".ads.example.com";
+                break;
+            case 1:
+                name = "img" + std::to_string(i) + ".cdn.example.net";
+                break;
+            default:
+                name = "www" + std::to_string(i) + ".unmatched.example.org";
+                break;
+        }
+        sizes[i] = build_query(queries[i], name, kDnsTypeA);
+    }
+
+    DnsQuery query;
+    uint8_t response[512];
+    uint8_t record[kDnsRecordASize];
+    uint32_t answer_ip = htonl(0x0a000001);
+
+    run("dns_decode", iterations, [&](int q) {
+        return dns_parse_query(queries[q], sizes[q], &query) ? query.questions[0].name_len : 0;
+    });
+    dns_parse_query(queries[0], sizes[0], &query);
+    run("dns_encode", iterations, [&](int q) {
+        DnsResponse resp;
+        if (!dns_response_begin(&resp, queries[0], &query, 0, response, sizeof(response))) return (size_t)0;
+        dns_write_a_record(record, &answer_ip, 60 + (uint32_t)(q & 1));
+        dns_response_add(&resp, record, sizeof(record), kDnsHeaderSize);
+        return dns_response_finish(&resp, &query);
+    });
+    run("dns_match", iterations, [&](int q) {
+        if (!dns_parse_query(queries[q], sizes[q], &query)) return (size_t)0;
+        const DnsQuestion *question = &query.questions[0];
+        return dns_rules_match(rules, question->name, question->name_len) ? (size_t)1 : (size_t)0;
+    });
+    run("dns_craft", iterations, [&](int q) {
+        if (!dns_parse_query(queries[q], sizes[q], &query)) return (size_t)0;
+        return dns_build_spoof_response(queries[q], &query, nullptr, rules, response, sizeof(response));
+    });
+
+    // The same names as a compiled blocklist, answered with NXDOMAIN
+    char list_path[] = "/tmp/harpy_bench_XXXXXX";
+    int list_fd = mkstemp(list_path);
+    if (list_fd >= 0) {
+        std::string index_path = std::string(list_path) + ".idx";
+        FILE *list = fdopen(list_fd, "w");
+        for (int i = 0; i < kRuleCount; i++) {
+            fprintf(list, "0.0.0.0 tracker%d.ads.example.com\n", i);
+        }
+        fclose(list);
+        DnsBlocklist *blocklist = nullptr;
+        if (dns_blocklist_compile({list_path}, index_path.c_str(), nullptr)) {
+            blocklist = dns_blocklist_open(index_path.c_str());
+        }
+        if (blocklist) {
+            run("dns_block", iterations, [&](int q) {
+                if (!dns_parse_query(queries[q], sizes[q], &query)) return (size_t)0;
+                return dns_build_block_response(queries[q], &query, blocklist, DnsBlockMode::NXDOMAIN,
+                                                response, sizeof(response));
+            });
+            dns_blocklist_close(blocklist);
+        }
+        unlink(index_path.c_str());
+        unlink(list_path);
+    }
+    dns_rules_free(rules);
+
+    // DHCP: DISCOVERs and REQUESTs from distinct clients
+    static uint8_t messages[kClientCount][kDhcpMinPacketSize];
+    for (int i = 0; i < kClientCount; i++) {
+        build_dhcp_message(messages[i], i, (i & 1) ? kDhcpRequest : kDhcpDiscover);
+    }
+    DhcpOptionsTemplate tpl;
+    dhcp_build_options_template(&tpl, htonl(0x0a000001), htonl(0xffffff00), htonl(0x0a000001),
+                                htonl(0x0a000001), 3600);
+    DhcpMessage msg;
+    uint8_t reply[576];
+
+    run("dhcp_parse", iterations, [&](int q) {
+        return dhcp_parse_message(messages[q & (kClientCount - 1)], kDhcpMinPacketSize, &msg) ? (size_t)msg.type : 0;
+    });
+    run("dhcp_craft", iterations, [&](int q) {
+        if (!dhcp_parse_message(messages[q & (kClientCount - 1)], kDhcpMinPacketSize, &msg)) return (size_t)0;
+        uint8_t type = msg.type == kDhcpDiscover ? kDhcpOffer : kDhcpAck;
+        return dhcp_build_reply(&msg, type, htonl(0x0a000064u + (uint32_t)(q & 0xff)), &tpl, reply, sizeof(reply));
+    });
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include "harpy_log.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <time.h>
+
+#define LOG_TAG "HarpyLog"
+
+#ifdef HARPY_HOST_BUILD
+
+static int g_min_priority = -1;         // Read from the environment on first use
+static std::mutex g_log_mutex;          // Keeps lines from different threads whole
+
+static int priority_from_env() {
+    static const struct {
+        const char *name;
+        int priority;
+    } kLevels[] = {
+        {"verbose", ANDROID_LOG_VERBOSE},
+        {"debug", ANDROID_LOG_DEBUG},
+        {"info", ANDROID_LOG_INFO},
+        {"warn", ANDROID_LOG_WARN},
+        {"error", ANDROID_LOG_ERROR},
+        {"silent", ANDROID_LOG_SILENT},
+    };
+    const char *level = getenv("HARPY_LOG_LEVEL");
+    if (level) {
+        for (const auto& entry : kLevels) {
+            if (strcasecmp(level, entry.name) == 0) return entry.priority;
+        }
+    }
+    return ANDROID_LOG_INFO;
+}
+
+static char priority_letter(int prio) {
+    switch (prio) {
+        case ANDROID_LOG_VERBOSE: return 'V';
+        case ANDROID_LOG_DEBUG: return 'D';
+        case ANDROID_LOG_INFO: return 'I';
+        case ANDROID_LOG_WARN: return 'W';
+        case ANDROID_LOG_ERROR: return 'E';
+        case ANDROID_LOG_FATAL: return 'F';
+    }
+    return '?';
+}
+
+extern "C" int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    if (g_min_priority < 0) g_min_priority = priority_from_env();
+    if (prio < g_min_priority) return 0;
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%c/%s: ", priority_letter(prio), tag ? tag : "");
+    int written = vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return written;
+}
+
+#endif
+
+// Event records per thread; a power of two
+static const uint32_t kRingSize = 1024;
+static const size_t kMaxEventString = 255;
+static const int kDrainIntervalMs = 10;
+static const size_t kMaxLine = 512;
+
+struct event_record {
+    HarpyEventSite *site;
+    int64_t time_ns;
+    uint64_t args[4];
+    uint32_t suppressed;
+    uint16_t str_len;
+    char str[kMaxEventString + 1];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// the drain mutex)
+struct event_ring {
+    alignas(64) std::atomic<uint32_t> head{0};     // Next record the thread writes
+    alignas(64) std::atomic<uint32_t> tail{0};     // Next record the drainer reads
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false};               // The thread has exited
+    event_record records[kRingSize];
+};
+
+struct event_log {
+    std::mutex rings_mutex;
+    std::vector<event_ring*> rings;
+    std::mutex drain_mutex;
+    std::mutex stdout_mutex;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread drainer;
+};
+
+// Never freed: threads can still exit and retire their rings after the
+// statics are gone
+static event_log& events() {
+    static event_log *log = new event_log();
+    return *log;
+}
+
+struct ring_owner {
+    event_ring *ring = nullptr;
+
+    ~ring_owner() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+static thread_local ring_owner t_ring;
+static std::once_flag g_drainer_once;
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Append to a line, keeping it terminated when it overflows
+static void append(char *line, size_t *len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void append(char *line, size_t *len, const char *fmt, ...) {
+    if (*len >= kMaxLine - 1) return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line + *len, kMaxLine - *len, fmt, args);
+    va_end(args);
+    if (n > 0) *len = std::min(*len + (size_t)n, kMaxLine - 1);
+}
+
+static size_t format_record(const event_record& record, char *line) {
+    size_t len = 0;
+    line[0] = '\0';
+    int next_arg = 0;
+    for (const char *p = record.site->format; *p; p++) {
+        if (*p != '%' || !p[1]) {
+            append(line, &len, "%c", *p);
+            continue;
+        }
+        char directive = *++p;
+        if (directive == '%') {
+            append(line, &len, "%%");
+            continue;
+        }
+        if (directive == 's') {
+            append(line, &len, "%.*s", (int)record.str_len, record.str);
+            continue;
+        }
+        uint64_t arg = next_arg < 4 ? record.args[next_arg++] : 0;
+        switch (directive) {
+            case 'd':
+                append(line, &len, "%lld", (long long)arg);
+                break;
+            case 'u':
+                append(line, &len, "%llu", (unsigned long long)arg);
+                break;
+            case 'x':
+                append(line, &len, "%llx", (unsigned long long)arg);
+                break;
+            case 'I': {
+                uint32_t addr = (uint32_t)arg;
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+                append(line, &len, "%s", ip);
+                break;
+            }
+            case 'M':
+                append(line, &len, "%02x:%02x:%02x:%02x:%02x:%02x",
+                       (unsigned)(arg >> 40) & 0xff, (unsigned)(arg >> 32) & 0xff, (unsigned)(arg >> 24) & 0xff,
+                       (unsigned)(arg >> 16) & 0xff, (unsigned)(arg >> 8) & 0xff, (unsigned)arg & 0xff);
+                break;
+            default:
+                append(line, &len, "%%%c", directive);
+                break;
+        }
+    }
+    if (record.suppressed) {
+        append(line, &len, " (%u more suppressed)", record.suppressed);
+    }
+    return len;
+}
+
+// Format everything in one ring; call with the drain mutex held
+static bool drain_ring(event_ring *ring) {
+    bool wrote_stdout = false;
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    char line[kMaxLine];
+    for (; tail != head; tail++) {
+        const event_record& record = ring->records[tail & (kRingSize - 1)];
+        size_t len = format_record(record, line);
+        if (record.site->sink == HarpyEventSink::STDOUT) {
+            line[len++] = '\n';
+            fwrite(line, 1, len, stdout);
+            wrote_stdout = true;
+        } else {
+            __android_log_print(record.site->prio, record.site->tag, "%s", line);
+        }
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+        __android_log_print(ANDROID_LOG_WARN, LOG_TAG, "Event ring full, dropped %llu events",
+                            (unsigned long long)dropped);
+    }
+    return wrote_stdout;
+}
+
+static void drain_all() {
+    event_log& log = events();
+    std::lock_guard<std::mutex> drain(log.drain_mutex);
+    std::vector<event_ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(log.rings_mutex);
+        rings = log.rings;
+    }
+
+    bool wrote_stdout = false;
+    {
+        std::lock_guard<std::mutex> out(log.stdout_mutex);
+        for (event_ring *ring : rings) {
+            // Retired before draining, so nothing can follow what we read
+            bool retired = ring->retired.load(std::memory_order_acquire);
+            wrote_stdout |= drain_ring(ring);
+            if (retired) {
+                std::lock_guard<std::mutex> lock(log.rings_mutex);
+                for (size_t i = 0; i < log.rings.size(); i++) {
+                    if (log.rings[i] == ring) {
+                        log.rings[i] = log.rings.back();
+                        log.rings.pop_back();
+                        break;
+                    }
+                }
+                delete ring;
+            }
+        }
+        if (wrote_stdout) fflush(stdout);
+    }
+}
+
+static void run_drainer() {
+    event_log& log = events();
+    std::unique_lock<std::mutex> lock(log.wake_mutex);
+    while (!log.stopping) {
+        log.wake.wait_for(lock, std::chrono::milliseconds(kDrainIntervalMs));
+        lock.unlock();
+        drain_all();
+        lock.lock();
+    }
+}
+
+// Last events of a process that exits normally
+static void stop_drainer() {
+    event_log& log = events();
+    {
+        std::lock_guard<std::mutex> lock(log.wake_mutex);
+        log.stopping = true;
+    }
+    log.wake.notify_one();
+    if (log.drainer.joinable()) log.drainer.join();
+    drain_all();
+}
+
+static event_ring *thread_ring() {
+    if (t_ring.ring) return t_ring.ring;
+    event_ring *ring = new event_ring();
+    event_log& log = events();
+    {
+        std::lock_guard<std::mutex> lock(log.rings_mutex);
+        log.rings.push_back(ring);
+    }
+    std::call_once(g_drainer_once, [&log] {
+        log.drainer = std::thread(run_drainer);
+        atexit(stop_drainer);
+    });
+    t_ring.ring = ring;
+    return ring;
+}
+
+void harpy_event_write(HarpyEventSite *site, const char *str, size_t str_len,
+                       uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3) {
+    int64_t now = monotonic_ns();
+    if (site->max_per_second) {
+        int64_t second = now / 1000000000LL;
+        if (site->window.load(std::memory_order_relaxed) != second) {
+            site->window.store(second, std::memory_order_relaxed);
+            site->count.store(0, std::memory_order_relaxed);
+        }
+        if (site->count.fetch_add(1, std::memory_order_relaxed) >= site->max_per_second) {
+            site->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    event_ring *ring = thread_ring();
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == kRingSize) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event_record& record = ring->records[head & (kRingSize - 1)];
+    record.site = site;
+    record.time_ns = now;
+    record.args[0] = a0;
+    record.args[1] = a1;
+    record.args[2] = a2;
+    record.args[3] = a3;
+    record.suppressed = site->suppressed.load(std::memory_order_relaxed)
+        ? site->suppressed.exchange(0, std::memory_order_relaxed) : 0;
+    record.str_len = (uint16_t)(str ? std::min(str_len, kMaxEventString) : 0);
+    if (record.str_len) memcpy(record.str, str, record.str_len);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void harpy_event_flush() {
+    drain_all();
+}
+
+std::mutex& harpy_event_stdout_mutex() {
+    return events().stdout_mutex;
+}
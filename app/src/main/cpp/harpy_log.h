@@ -0,0 +1,146 @@
+#ifndef HARPY_LOG_H
+#define HARPY_LOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+/**
+ * Logging backend of the native code. On a device this is Android's
+ * liblog. A host build (HARPY_HOST_BUILD) gets the same
+ * __android_log_print entry point from harpy_log.cpp, writing to stderr,
+ * so every LOG_TAG/LOGD call site compiles unchanged on a Linux
+ * workstation.
+ */
+#ifdef HARPY_HOST_BUILD
+
+enum android_LogPriority {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT
+};
+
+/**
+ * Print "<level>/<tag>: <message>" to stderr if prio is at or above the
+ * level in HARPY_LOG_LEVEL (verbose, debug, info, warn, error or silent;
+ * default info)
+ */
+extern "C" int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#else
+#include <android/log.h>
+#endif
+
+/**
+ * Lowest priority compiled in, set by CMake from HARPY_LOG_MIN_LEVEL.
+ * Messages and events below it cost nothing: their arguments are not
+ * even evaluated.
+ */
+#ifndef HARPY_LOG_MIN_PRIORITY
+#define HARPY_LOG_MIN_PRIORITY ANDROID_LOG_VERBOSE
+#endif
+
+/**
+ * What each file's LOGD/LOGI/LOGE expand to
+ */
+#define HARPY_LOG(prio, tag, ...) \
+    do { \
+        if ((prio) >= HARPY_LOG_MIN_PRIORITY) __android_log_print((prio), (tag), __VA_ARGS__); \
+    } while (0)
+
+/**
+ * Where the records of an event site end up once the drainer formats them
+ */
+enum class HarpyEventSink : uint8_t {
+    LOG,        // __android_log_print with the site's priority and tag
+    STDOUT      // A line on stdout; as lossy as any event, so never a protocol line
+};
+
+/**
+ * One HARPY_EVENT call site. The format takes up to four integer
+ * arguments and the event's string:
+ *   %d %u %x   signed, unsigned and hex integers
+ *   %I         IPv4 address in network byte order
+ *   %M         MAC address packed by harpy_event_mac
+ *   %s         the string, copied into the record (at most 255 bytes)
+ *   %%         a percent sign
+ */
+struct HarpyEventSite {
+    const char *tag;
+    int prio;
+    HarpyEventSink sink;
+    const char *format;
+    uint32_t max_per_second;                    // 0 keeps every event
+    std::atomic<int64_t> window{0};             // Second the count is for
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};        // Over the limit since the last kept event
+};
+
+/**
+ * Copy an event into the calling thread's ring without formatting it or
+ * taking a lock. A background thread formats and writes it within a few
+ * milliseconds. Events over the site's rate are counted, and the count is
+ * appended to the next one kept; events that find the ring full are
+ * dropped and reported by the drainer.
+ */
+void harpy_event_write(HarpyEventSite *site, const char *str, size_t str_len,
+                       uint64_t a0 = 0, uint64_t a1 = 0, uint64_t a2 = 0, uint64_t a3 = 0);
+
+/**
+ * Pack a 6-byte MAC address for a %M argument
+ */
+inline uint64_t harpy_event_mac(const uint8_t *mac) {
+    uint64_t packed = 0;
+    for (int i = 0; i < 6; i++) packed = (packed << 8) | mac[i];
+    return packed;
+}
+
+/**
+ * Format and write every event recorded so far, on the calling thread
+ */
+void harpy_event_flush();
+
+/**
+ * Held by the drainer while it writes STDOUT events; take it around any
+ * other multi-part write to stdout to keep lines whole
+ */
+std::mutex& harpy_event_stdout_mutex();
+
+/**
+ * Record an event from a static call site in the including file's LOG_TAG.
+ * STDOUT events are never compiled out.
+ * @param per_second Events kept per second at this call site, 0 for all
+ */
+#define HARPY_EVENT_TO(sink, prio, per_second, format, str, str_len, ...) \
+    do { \
+        if ((sink) == HarpyEventSink::STDOUT || (prio) >= HARPY_LOG_MIN_PRIORITY) { \
+            static HarpyEventSite harpy_event_site_ = {LOG_TAG, (prio), (sink), (format), (per_second)}; \
+            harpy_event_write(&harpy_event_site_, (str), (str_len), ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define HARPY_EVENT(prio, per_second, format, ...) \
+    HARPY_EVENT_TO(HarpyEventSink::LOG, prio, per_second, format, nullptr, 0, ##__VA_ARGS__)
+
+/**
+ * An event whose %s is a NUL-terminated string, e.g. strerror(errno)
+ */
+#define HARPY_EVENT_STR(prio, per_second, format, str, ...) \
+    do { \
+        if ((prio) >= HARPY_LOG_MIN_PRIORITY) { \
+            const char *harpy_event_str_ = (str); \
+            HARPY_EVENT_TO(HarpyEventSink::LOG, prio, per_second, format, harpy_event_str_, \
+                           strlen(harpy_event_str_), ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif // HARPY_LOG_H
@@ -0,0 +1,202 @@
+#include "harpy_metrics.h"
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <time.h>
+
+thread_local HarpyMetricsBlock *t_harpy_metrics = nullptr;
+
+// Blocks of live threads, and what exited threads left behind
+struct metrics_registry {
+    std::mutex mutex;
+    std::vector<HarpyMetricsBlock*> blocks;
+    HarpyMetricsBlock retired;
+};
+
+// Never freed: threads can still exit and fold their blocks in after the
+// statics are gone
+static metrics_registry& registry() {
+    static metrics_registry *metrics = new metrics_registry();
+    return *metrics;
+}
+
+static void clear_block(HarpyMetricsBlock *block) {
+    for (auto& counter : block->counters) counter.store(0, std::memory_order_relaxed);
+    for (size_t h = 0; h < kHarpyHistogramCount; h++) {
+        for (auto& bucket : block->buckets[h]) bucket.store(0, std::memory_order_relaxed);
+        block->sum_ns[h].store(0, std::memory_order_relaxed);
+        block->max_ns[h].store(0, std::memory_order_relaxed);
+    }
+}
+
+// Add from into into; call with the registry mutex held
+static void fold_block(HarpyMetricsBlock *into, const HarpyMetricsBlock *from) {
+    for (size_t i = 0; i < kHarpyCounterCount; i++) {
+        harpy_metrics_bump(into->counters[i], from->counters[i].load(std::memory_order_relaxed));
+    }
+    for (size_t h = 0; h < kHarpyHistogramCount; h++) {
+        for (size_t b = 0; b < kHarpyHistogramBuckets; b++) {
+            uint64_t count = from->buckets[h][b].load(std::memory_order_relaxed);
+            if (count) harpy_metrics_bump(into->buckets[h][b], count);
+        }
+        harpy_metrics_bump(into->sum_ns[h], from->sum_ns[h].load(std::memory_order_relaxed));
+        uint64_t max = from->max_ns[h].load(std::memory_order_relaxed);
+        if (max > into->max_ns[h].load(std::memory_order_relaxed)) {
+            into->max_ns[h].store(max, std::memory_order_relaxed);
+        }
+    }
+}
+
+struct block_owner {
+    HarpyMetricsBlock *block = nullptr;
+
+    ~block_owner() {
+        if (!block) return;
+        metrics_registry& metrics = registry();
+        std::lock_guard<std::mutex> lock(metrics.mutex);
+        fold_block(&metrics.retired, block);
+        metrics.blocks.erase(std::find(metrics.blocks.begin(), metrics.blocks.end(), block));
+        t_harpy_metrics = nullptr;
+        delete block;
+    }
+};
+
+static thread_local block_owner t_block_owner;
+
+HarpyMetricsBlock *harpy_metrics_thread_block() {
+    HarpyMetricsBlock *block = new HarpyMetricsBlock();
+    clear_block(block);
+    metrics_registry& metrics = registry();
+    {
+        std::lock_guard<std::mutex> lock(metrics.mutex);
+        metrics.blocks.push_back(block);
+    }
+    t_block_owner.block = block;
+    t_harpy_metrics = block;
+    return block;
+}
+
+int64_t harpy_metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Middle of a bucket's range, which is what a percentile in it reports
+static uint64_t bucket_value(size_t bucket) {
+    if (bucket < (1u << kHarpyHistogramSubBits)) return bucket;
+    int shift = (int)(bucket >> kHarpyHistogramSubBits) - 1;
+    uint64_t lower = (uint64_t)((1u << kHarpyHistogramSubBits) | (bucket & ((1u << kHarpyHistogramSubBits) - 1)))
+                     << shift;
+    return lower + ((1ULL << shift) >> 1);
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < kHarpyHistogramBuckets; b++) {
+        seen += buckets[b];
+        if (seen > rank) return std::min(bucket_value(b), max);
+    }
+    return max;
+}
+
+HarpyMetricsSnapshot harpy_metrics_snapshot() {
+    // Summed into a private block so the percentiles see one consistent total
+    HarpyMetricsBlock *total = new HarpyMetricsBlock();
+    clear_block(total);
+    metrics_registry& metrics = registry();
+    {
+        std::lock_guard<std::mutex> lock(metrics.mutex);
+        fold_block(total, &metrics.retired);
+        for (const HarpyMetricsBlock *block : metrics.blocks) fold_block(total, block);
+    }
+
+    HarpyMetricsSnapshot snapshot;
+    for (size_t i = 0; i < kHarpyCounterCount; i++) {
+        snapshot.counters[i] = total->counters[i].load(std::memory_order_relaxed);
+    }
+    uint64_t buckets[kHarpyHistogramBuckets];
+    for (size_t h = 0; h < kHarpyHistogramCount; h++) {
+        HarpyLatencySummary *summary = &snapshot.latencies[h];
+        summary->count = 0;
+        for (size_t b = 0; b < kHarpyHistogramBuckets; b++) {
+            buckets[b] = total->buckets[h][b].load(std::memory_order_relaxed);
+            summary->count += buckets[b];
+        }
+        summary->max_ns = total->max_ns[h].load(std::memory_order_relaxed);
+        if (summary->count == 0) {
+            summary->mean_ns = summary->p50_ns = summary->p90_ns = summary->p99_ns = summary->p999_ns = 0;
+            continue;
+        }
+        summary->mean_ns = total->sum_ns[h].load(std::memory_order_relaxed) / summary->count;
+        summary->p50_ns = percentile(buckets, summary->count, summary->max_ns, 0.5);
+        summary->p90_ns = percentile(buckets, summary->count, summary->max_ns, 0.9);
+        summary->p99_ns = percentile(buckets, summary->count, summary->max_ns, 0.99);
+        summary->p999_ns = percentile(buckets, summary->count, summary->max_ns, 0.999);
+    }
+    delete total;
+    return snapshot;
+}
+
+uint64_t harpy_metrics_counter(HarpyCounter counter) {
+    metrics_registry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    uint64_t value = metrics.retired.counters[(size_t)counter].load(std::memory_order_relaxed);
+    for (const HarpyMetricsBlock *block : metrics.blocks) {
+        value += block->counters[(size_t)counter].load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
+const char *harpy_counter_name(HarpyCounter counter) {
+    switch (counter) {
+        case HarpyCounter::PACKETS_RECEIVED: return "packets_received";
+        case HarpyCounter::PACKETS_SENT: return "packets_sent";
+        case HarpyCounter::PACKET_SEND_ERRORS: return "packet_send_errors";
+        case HarpyCounter::IO_RECEIVED: return "io_received";
+        case HarpyCounter::IO_SENT: return "io_sent";
+        case HarpyCounter::IO_SEND_ERRORS: return "io_send_errors";
+        case HarpyCounter::IO_SEND_DROPS: return "io_send_drops";
+        case HarpyCounter::IO_SYSCALLS: return "io_syscalls";
+        case HarpyCounter::SCAN_REQUESTS: return "scan_requests";
+        case HarpyCounter::SCAN_SEND_ERRORS: return "scan_send_errors";
+        case HarpyCounter::SCAN_REPLIES: return "scan_replies";
+        case HarpyCounter::SCAN_DEVICES: return "scan_devices";
+        case HarpyCounter::ARP_FRAMES_SENT: return "arp_frames_sent";
+        case HarpyCounter::ARP_SEND_ERRORS: return "arp_send_errors";
+        case HarpyCounter::DNS_SPOOFED: return "dns_spoofed";
+        case HarpyCounter::DNS_BLOCKED: return "dns_blocked";
+        case HarpyCounter::DNS_CACHED: return "dns_cached";
+        case HarpyCounter::DNS_FORWARDED: return "dns_forwarded";
+        case HarpyCounter::DNS_DROPPED: return "dns_dropped";
+        case HarpyCounter::DNS_UPSTREAM_ANSWERS: return "dns_upstream_answers";
+        case HarpyCounter::DNS_UPSTREAM_RETRIES: return "dns_upstream_retries";
+        case HarpyCounter::DNS_UPSTREAM_FAILURES: return "dns_upstream_failures";
+        case HarpyCounter::DNS_UPSTREAM_SEND_ERRORS: return "dns_upstream_send_errors";
+        case HarpyCounter::DNS_UPSTREAM_MISMATCHES: return "dns_upstream_mismatches";
+        case HarpyCounter::DNS_TCP_FALLBACKS: return "dns_tcp_fallbacks";
+        case HarpyCounter::DHCP_MESSAGES: return "dhcp_messages";
+        case HarpyCounter::DHCP_IGNORED: return "dhcp_ignored";
+        case HarpyCounter::DHCP_OFFERS: return "dhcp_offers";
+        case HarpyCounter::DHCP_ACKS: return "dhcp_acks";
+        case HarpyCounter::DHCP_NAKS: return "dhcp_naks";
+        case HarpyCounter::DHCP_DECLINES: return "dhcp_declines";
+        case HarpyCounter::DHCP_POOL_EXHAUSTED: return "dhcp_pool_exhausted";
+        case HarpyCounter::COUNT: break;
+    }
+    return "unknown";
+}
+
+const char *harpy_histogram_name(HarpyHistogram histogram) {
+    switch (histogram) {
+        case HarpyHistogram::SCAN_REPLY: return "scan_reply";
+        case HarpyHistogram::ARP_SEND_ROUND: return "arp_send_round";
+        case HarpyHistogram::DNS_ANSWER: return "dns_answer";
+        case HarpyHistogram::DNS_UPSTREAM: return "dns_upstream";
+        case HarpyHistogram::DHCP_ANSWER: return "dhcp_answer";
+        case HarpyHistogram::COUNT: break;
+    }
+    return "unknown";
+}
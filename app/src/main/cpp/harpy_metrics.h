@@ -0,0 +1,152 @@
+#ifndef HARPY_METRICS_H
+#define HARPY_METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Event counts of the packet engines. Each thread adds to its own
+ * cache-line aligned block without atomic read-modify-writes; snapshots
+ * sum the blocks.
+ */
+enum class HarpyCounter : uint16_t {
+    PACKETS_RECEIVED,       // Every PacketIo backend
+    PACKETS_SENT,
+    PACKET_SEND_ERRORS,
+    IO_RECEIVED,            // Datagram sockets served by io_backend
+    IO_SENT,
+    IO_SEND_ERRORS,
+    IO_SEND_DROPS,          // Replies dropped while the send buffer was full
+    IO_SYSCALLS,
+    SCAN_REQUESTS,
+    SCAN_SEND_ERRORS,
+    SCAN_REPLIES,
+    SCAN_DEVICES,
+    ARP_FRAMES_SENT,        // Spoofing rounds and single frames
+    ARP_SEND_ERRORS,
+    DNS_SPOOFED,
+    DNS_BLOCKED,
+    DNS_CACHED,
+    DNS_FORWARDED,
+    DNS_DROPPED,
+    DNS_UPSTREAM_ANSWERS,
+    DNS_UPSTREAM_RETRIES,
+    DNS_UPSTREAM_FAILURES,  // Answered with SERVFAIL
+    DNS_UPSTREAM_SEND_ERRORS,
+    DNS_UPSTREAM_MISMATCHES, // Answers whose ID, socket or question is not a query of ours
+    DNS_TCP_FALLBACKS,
+    DHCP_MESSAGES,
+    DHCP_IGNORED,           // Unparsable, not ours, or no reply due
+    DHCP_OFFERS,
+    DHCP_ACKS,
+    DHCP_NAKS,
+    DHCP_DECLINES,
+    DHCP_POOL_EXHAUSTED,
+    COUNT
+};
+
+/**
+ * Latencies kept as log-linear histograms of nanoseconds, 16 buckets per
+ * power of two, so every percentile is within about 6%
+ */
+enum class HarpyHistogram : uint8_t {
+    SCAN_REPLY,             // Request sent to first reply of that round
+    ARP_SEND_ROUND,         // Handing one spoofing round to the kernel
+    DNS_ANSWER,             // Query parsed and answered locally
+    DNS_UPSTREAM,           // Forwarded query to relayed answer
+    DHCP_ANSWER,            // Message parsed and reply built
+    COUNT
+};
+
+static const size_t kHarpyCounterCount = (size_t)HarpyCounter::COUNT;
+static const size_t kHarpyHistogramCount = (size_t)HarpyHistogram::COUNT;
+static const int kHarpyHistogramSubBits = 4;
+// Up to 2^40 ns (18 minutes); longer values count in the last bucket
+static const size_t kHarpyHistogramBuckets = (40 - kHarpyHistogramSubBits + 1) << kHarpyHistogramSubBits;
+
+struct alignas(64) HarpyMetricsBlock {
+    std::atomic<uint64_t> counters[kHarpyCounterCount];
+    std::atomic<uint64_t> buckets[kHarpyHistogramCount][kHarpyHistogramBuckets];
+    std::atomic<uint64_t> sum_ns[kHarpyHistogramCount];
+    std::atomic<uint64_t> max_ns[kHarpyHistogramCount];
+};
+
+extern thread_local HarpyMetricsBlock *t_harpy_metrics;
+
+/**
+ * The calling thread's block, registered on first use and folded into
+ * the totals when the thread exits
+ */
+HarpyMetricsBlock *harpy_metrics_thread_block();
+
+inline HarpyMetricsBlock *harpy_metrics_block() {
+    HarpyMetricsBlock *block = t_harpy_metrics;
+    return block ? block : harpy_metrics_thread_block();
+}
+
+// Only the owning thread writes a block, so a plain load and store is enough
+inline void harpy_metrics_bump(std::atomic<uint64_t>& value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void harpy_metrics_add(HarpyCounter counter, uint64_t n = 1) {
+    harpy_metrics_bump(harpy_metrics_block()->counters[(size_t)counter], n);
+}
+
+inline size_t harpy_histogram_bucket(uint64_t ns) {
+    if (ns < (1u << kHarpyHistogramSubBits)) return (size_t)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    size_t bucket = ((size_t)(exponent - kHarpyHistogramSubBits + 1) << kHarpyHistogramSubBits) |
+                    (size_t)((ns >> (exponent - kHarpyHistogramSubBits)) & ((1u << kHarpyHistogramSubBits) - 1));
+    return bucket < kHarpyHistogramBuckets ? bucket : kHarpyHistogramBuckets - 1;
+}
+
+inline void harpy_metrics_record(HarpyHistogram histogram, uint64_t ns) {
+    HarpyMetricsBlock *block = harpy_metrics_block();
+    size_t h = (size_t)histogram;
+    harpy_metrics_bump(block->buckets[h][harpy_histogram_bucket(ns)], 1);
+    harpy_metrics_bump(block->sum_ns[h], ns);
+    if (ns > block->max_ns[h].load(std::memory_order_relaxed)) {
+        block->max_ns[h].store(ns, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds, for timing what goes into a histogram
+ */
+int64_t harpy_metrics_now_ns();
+
+struct HarpyLatencySummary {
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+struct HarpyMetricsSnapshot {
+    uint64_t counters[kHarpyCounterCount];
+    HarpyLatencySummary latencies[kHarpyHistogramCount];
+};
+
+/**
+ * Totals since the process started, summed over every thread that ever
+ * recorded. Takes a lock and walks every block, so keep it off the packet path.
+ */
+HarpyMetricsSnapshot harpy_metrics_snapshot();
+
+/**
+ * Current value of one counter across threads; same cost as a snapshot
+ */
+uint64_t harpy_metrics_counter(HarpyCounter counter);
+
+/**
+ * snake_case names used by the helper's STATS report and the JNI call
+ */
+const char *harpy_counter_name(HarpyCounter counter);
+const char *harpy_histogram_name(HarpyHistogram histogram);
+
+#endif // HARPY_METRICS_H
@@ -1,5 +1,5 @@
 #include <jni.h>
-#include <android/log.h>
+#include "harpy_log.h"
 #include <string>
 #include <cstring>
 #include <vector>
@@ -9,9 +9,9 @@
 #include "dhcp_spoofing.h"
 
 #define LOG_TAG "HarpyNative"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGI(...) HARPY_LOG(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 
 // Global state
 static bool g_initialized = false;
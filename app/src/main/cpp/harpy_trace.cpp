@@ -0,0 +1,192 @@
+#include "harpy_trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> g_harpy_trace_enabled{false};
+
+// Records per thread; a power of two. 48 bytes each, allocated the first
+// time a thread records.
+static const uint64_t kTraceRingSize = 8192;
+static const size_t kThreadNameLen = 16;
+static const size_t kExportBuffer = 1 << 16;
+
+struct trace_record {
+    const char *category;
+    const char *name;
+    const char *arg_name;   // nullptr for no argument
+    int64_t start_ns;
+    int64_t dur_ns;         // -1 for an instant event
+    int64_t arg;
+};
+
+// Written only by its thread; the exporter copies it and then discards
+// whatever the thread may have overwritten meanwhile
+struct trace_ring {
+    std::atomic<uint64_t> head{0};      // Records ever written
+    std::atomic<bool> retired{false};   // The thread has exited
+    long tid;
+    char thread_name[kThreadNameLen];
+    trace_record records[kTraceRingSize];
+};
+
+struct trace_registry {
+    std::mutex mutex;
+    std::vector<trace_ring*> rings;
+    int64_t epoch_ns = 0;               // Last harpy_trace_start
+};
+
+// Never freed: threads can still exit and retire their rings after the
+// statics are gone
+static trace_registry& registry() {
+    static trace_registry *traces = new trace_registry();
+    return *traces;
+}
+
+struct ring_owner {
+    trace_ring *ring = nullptr;
+
+    ~ring_owner() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+static thread_local ring_owner t_trace_ring;
+
+static trace_ring *thread_ring() {
+    if (t_trace_ring.ring) return t_trace_ring.ring;
+    trace_ring *ring = new trace_ring();
+    ring->tid = (long)syscall(SYS_gettid);
+    if (pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name)) != 0) {
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "thread-%ld", ring->tid);
+    }
+    trace_registry& traces = registry();
+    {
+        std::lock_guard<std::mutex> lock(traces.mutex);
+        traces.rings.push_back(ring);
+    }
+    t_trace_ring.ring = ring;
+    return ring;
+}
+
+static void record(const char *category, const char *name, int64_t start_ns, int64_t dur_ns,
+                   const char *arg_name, int64_t arg) {
+    trace_ring *ring = thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    trace_record& entry = ring->records[head & (kTraceRingSize - 1)];
+    entry.category = category;
+    entry.name = name;
+    entry.arg_name = arg_name;
+    entry.start_ns = start_ns;
+    entry.dur_ns = dur_ns;
+    entry.arg = arg;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void harpy_trace_record_span(const char *category, const char *name, int64_t start_ns,
+                             const char *arg_name, int64_t arg) {
+    record(category, name, start_ns, harpy_metrics_now_ns() - start_ns, arg_name, arg);
+}
+
+void harpy_trace_record_instant(const char *category, const char *name, const char *arg_name, int64_t arg) {
+    record(category, name, harpy_metrics_now_ns(), -1, arg_name, arg);
+}
+
+void harpy_trace_start() {
+    trace_registry& traces = registry();
+    std::lock_guard<std::mutex> lock(traces.mutex);
+    // Rings of exited threads only matter to the previous trace
+    std::vector<trace_ring*> live;
+    for (trace_ring *ring : traces.rings) {
+        if (ring->retired.load(std::memory_order_acquire)) {
+            delete ring;
+        } else {
+            live.push_back(ring);
+        }
+    }
+    traces.rings.swap(live);
+    traces.epoch_ns = harpy_metrics_now_ns();
+    g_harpy_trace_enabled.store(true, std::memory_order_relaxed);
+}
+
+void harpy_trace_stop() {
+    g_harpy_trace_enabled.store(false, std::memory_order_relaxed);
+}
+
+// Records of one ring that are complete and not overwritten
+static void copy_ring(const trace_ring *ring, std::vector<trace_record> *out) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = head > kTraceRingSize ? head - kTraceRingSize : 0;
+    size_t base = out->size();
+    for (uint64_t i = first; i < head; i++) {
+        out->push_back(ring->records[i & (kTraceRingSize - 1)]);
+    }
+    // The slot the thread is writing now belongs to the oldest record we
+    // copied, and anything it published since replaced more of them
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = ring->head.load(std::memory_order_relaxed);
+    uint64_t valid = now + 1 > kTraceRingSize ? now + 1 - kTraceRingSize : 0;
+    if (valid > first) {
+        size_t stale = (size_t)std::min(valid - first, head - first);
+        out->erase(out->begin() + base, out->begin() + base + stale);
+    }
+}
+
+// Microseconds since the trace started, as Chrome expects
+static void print_us(FILE *file, int64_t ns) {
+    if (ns < 0) ns = 0;
+    fprintf(file, "%lld.%03lld", (long long)(ns / 1000), (long long)(ns % 1000));
+}
+
+static void print_thread_name(FILE *file, int pid, const trace_ring *ring) {
+    fprintf(file, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"", pid, ring->tid);
+    for (const char *c = ring->thread_name; *c; c++) {
+        if (*c != '"' && *c != '\\' && (unsigned char)*c >= 0x20) fputc(*c, file);
+    }
+    fputs("\"}}", file);
+}
+
+long harpy_trace_export(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) return -1;
+    setvbuf(file, nullptr, _IOFBF, kExportBuffer);
+    int pid = (int)getpid();
+
+    trace_registry& traces = registry();
+    std::lock_guard<std::mutex> lock(traces.mutex);
+    long written = 0;
+    std::vector<trace_record> records;
+    records.reserve(kTraceRingSize);
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+    bool first = true;
+    for (const trace_ring *ring : traces.rings) {
+        records.clear();
+        copy_ring(ring, &records);
+        if (!first) fputs(",\n", file);
+        first = false;
+        print_thread_name(file, pid, ring);
+        for (const trace_record& entry : records) {
+            if (entry.start_ns < traces.epoch_ns) continue;
+            fprintf(file, ",\n{\"ph\":\"%s\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,\"ts\":",
+                    entry.dur_ns < 0 ? "i" : "X", entry.category, entry.name, pid, ring->tid);
+            print_us(file, entry.start_ns - traces.epoch_ns);
+            if (entry.dur_ns < 0) {
+                fputs(",\"s\":\"t\"", file);
+            } else {
+                fputs(",\"dur\":", file);
+                print_us(file, entry.dur_ns);
+            }
+            if (entry.arg_name) {
+                fprintf(file, ",\"args\":{\"%s\":%lld}", entry.arg_name, (long long)entry.arg);
+            }
+            fputc('}', file);
+            written++;
+        }
+    }
+    fputs("\n]}\n", file);
+    if (fclose(file) != 0) return -1;
+    return written;
+}
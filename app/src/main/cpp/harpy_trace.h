@@ -0,0 +1,129 @@
+#ifndef HARPY_TRACE_H
+#define HARPY_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include "harpy_metrics.h"
+
+/**
+ * Timeline tracing of the packet engines. Spans and instant events go
+ * into a ring per thread, oldest overwritten first, and are exported as
+ * Chrome trace JSON (chrome://tracing, ui.perfetto.dev). While tracing is
+ * off every call site costs one relaxed load; builds with
+ * HARPY_TRACE_DISABLED compile the call sites out entirely.
+ *
+ * Names, categories and argument names must be string literals or
+ * otherwise outlive the trace: only the pointers are recorded.
+ */
+extern std::atomic<bool> g_harpy_trace_enabled;
+
+inline bool harpy_trace_on() {
+#ifdef HARPY_TRACE_DISABLED
+    return false;
+#else
+    return g_harpy_trace_enabled.load(std::memory_order_relaxed);
+#endif
+}
+
+/**
+ * Record a span from start_ns (harpy_metrics_now_ns) to now, for spans
+ * that end in a different callback than they start
+ */
+void harpy_trace_record_span(const char *category, const char *name, int64_t start_ns,
+                             const char *arg_name = nullptr, int64_t arg = 0);
+
+void harpy_trace_record_instant(const char *category, const char *name,
+                                const char *arg_name = nullptr, int64_t arg = 0);
+
+inline void harpy_trace_span(const char *category, const char *name, int64_t start_ns,
+                             const char *arg_name = nullptr, int64_t arg = 0) {
+    if (harpy_trace_on() && start_ns) harpy_trace_record_span(category, name, start_ns, arg_name, arg);
+}
+
+inline void harpy_trace_instant(const char *category, const char *name,
+                                const char *arg_name = nullptr, int64_t arg = 0) {
+    if (harpy_trace_on()) harpy_trace_record_instant(category, name, arg_name, arg);
+}
+
+/**
+ * Start time for harpy_trace_span, or 0 while tracing is off
+ */
+inline int64_t harpy_trace_begin() {
+    return harpy_trace_on() ? harpy_metrics_now_ns() : 0;
+}
+
+/**
+ * A span over the enclosing scope
+ */
+class HarpyTraceScope {
+public:
+    HarpyTraceScope(const char *category, const char *name)
+        : category_(category), name_(name), start_ns_(harpy_trace_begin()) {}
+
+    ~HarpyTraceScope() {
+        harpy_trace_span(category_, name_, start_ns_, arg_name_, arg_);
+    }
+
+    void set_arg(const char *arg_name, int64_t arg) {
+        arg_name_ = arg_name;
+        arg_ = arg;
+    }
+
+    HarpyTraceScope(const HarpyTraceScope&) = delete;
+    HarpyTraceScope& operator=(const HarpyTraceScope&) = delete;
+
+private:
+    const char *category_;
+    const char *name_;
+    int64_t start_ns_;
+    const char *arg_name_ = nullptr;
+    int64_t arg_ = 0;
+};
+
+/**
+ * std::lock_guard that records a "lock" span named after the mutex when
+ * the lock had to wait. An uncontended lock records nothing.
+ */
+class HarpyTraceLock {
+public:
+    HarpyTraceLock(std::mutex& mutex, const char *name) : mutex_(mutex) {
+        if (!harpy_trace_on()) {
+            mutex_.lock();
+        } else if (!mutex_.try_lock()) {
+            int64_t start_ns = harpy_metrics_now_ns();
+            mutex_.lock();
+            harpy_trace_record_span("lock", name, start_ns);
+        }
+    }
+
+    ~HarpyTraceLock() {
+        mutex_.unlock();
+    }
+
+    HarpyTraceLock(const HarpyTraceLock&) = delete;
+    HarpyTraceLock& operator=(const HarpyTraceLock&) = delete;
+
+private:
+    std::mutex& mutex_;
+};
+
+/**
+ * Forget what was recorded and start recording
+ */
+void harpy_trace_start();
+
+/**
+ * Stop recording; what was recorded can still be exported
+ */
+void harpy_trace_stop();
+
+/**
+ * Write the events recorded since harpy_trace_start, on every thread
+ * including ones that have exited, as Chrome trace JSON. Threads that
+ * recorded more than their ring holds keep only their latest events.
+ * @return Number of events written, or -1 if path cannot be written
+ */
+long harpy_trace_export(const char *path);
+
+#endif // HARPY_TRACE_H
@@ -0,0 +1,886 @@
+#include "io_backend.h"
+#include "reactor.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "packet_capture.h"
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_TAG "IoBackend"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Raw syscalls: libc wrappers and liburing are not available on Android.
+// The numbers are the same on every architecture.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+// Newer than some NDK kernel headers
+#ifndef IORING_RECV_MULTISHOT
+#define IORING_RECV_MULTISHOT (1U << 1)
+#endif
+#ifndef IORING_CQE_F_BUFFER
+#define IORING_CQE_F_BUFFER (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+#ifndef IORING_CQE_BUFFER_SHIFT
+#define IORING_CQE_BUFFER_SHIFT 16
+#endif
+#ifndef IORING_SETUP_COOP_TASKRUN
+#define IORING_SETUP_COOP_TASKRUN (1U << 8)
+#endif
+#ifndef IORING_CQ_EVENTFD_DISABLED
+#define IORING_CQ_EVENTFD_DISABLED (1U << 0)
+#endif
+#ifndef IOSQE_BUFFER_SELECT
+#define IOSQE_BUFFER_SELECT (1U << 5)
+#endif
+static const unsigned kRegisterPbufRing = 22;       // IORING_REGISTER_PBUF_RING, Linux 5.19
+
+// Provided buffer ring layout (struct io_uring_buf / io_uring_buf_reg);
+// the ring tail overlays the reserved field of the first entry
+struct uring_buf {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t bid;
+    uint16_t resv;
+};
+struct uring_buf_reg {
+    uint64_t ring_addr;
+    uint32_t ring_entries;
+    uint16_t bgid;
+    uint16_t flags;
+    uint64_t resv[3];
+};
+// Header the kernel writes before every multishot recvmsg payload
+struct uring_recvmsg_out {
+    uint32_t namelen;
+    uint32_t controllen;
+    uint32_t payloadlen;
+    uint32_t flags;
+};
+
+// Datagrams per handler call, and batches handled per wakeup before
+// returning to the reactor
+static const int kBatchSize = 32;
+static const int kMaxBatchesPerWakeup = 4;
+
+static const unsigned kUringEntries = 256;
+static const unsigned kUringBuffers = 256;          // Provided receive buffers, a power of two
+static const int kUringTxSlots = kMaxBatchesPerWakeup * kBatchSize;   // Replies in flight
+static const uint16_t kBufferGroup = 0;
+static const uint64_t kRecvTag = UINT64_MAX;        // user_data of the multishot receive
+static const uint64_t kPreparedTag = UINT64_MAX - 1;
+static const uint64_t kCancelTag = UINT64_MAX - 2;
+// Room in each provided buffer ahead of the payload
+static const size_t kRecvHeaderSize = sizeof(uring_recvmsg_out) + sizeof(struct sockaddr_in);
+
+static std::atomic<IoBackend> g_backend(IoBackend::SYSCALLS);
+static std::atomic<int> g_uring_supported(-1);       // -1 until probed
+
+struct uring_state {
+    int ring_fd;
+    int event_fd;               // Signalled on every completion, watched by the reactor
+
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail;     // Entries filled but not yet published
+    unsigned to_submit;
+
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned *cq_flags;         // nullptr before Linux 5.8
+    struct io_uring_cqe *cqes;
+
+    uring_buf *buf_ring;
+    size_t buf_ring_size;
+    uint16_t buf_tail;
+    uint8_t *bufs;
+    size_t buf_size;
+
+    struct msghdr recv_msg;     // Only msg_namelen and msg_controllen are read
+    bool recv_armed;
+    bool recv_seen;             // Some receive completed, so multishot works here
+
+    int free_slots[kUringTxSlots];
+    int free_count;
+    int prepared_inflight;
+    int prepared_sent;
+};
+
+struct IoSocket {
+    Reactor *reactor;
+    int fd;
+    size_t max_datagram;
+    size_t max_reply;
+    IoBatchHandler handler;
+    void *ctx;
+    IoBackend backend;
+    struct sockaddr_in local;   // Bound address, for packet capture
+
+    // Replies: kBatchSize slots under SYSCALLS, kUringTxSlots under IO_URING
+    uint8_t *tx;
+    struct sockaddr_in *tx_dests;
+    struct iovec *tx_iovs;
+    struct mmsghdr *tx_msgs;
+    int tx_count;               // Queued by the current batch (SYSCALLS)
+    int tx_sent;                // Of those, already sent; the rest wait for EPOLLOUT
+    bool tx_blocked;            // Watching EPOLLOUT instead of EPOLLIN until they are sent
+    int tx_current;             // Slot handed out by io_reply_buffer
+    uint8_t *overflow;          // Reply buffer when every slot is in flight (IO_URING)
+
+    // SYSCALLS receive buffers
+    uint8_t *rx;
+    struct sockaddr_in rx_addrs[kBatchSize];
+    struct iovec rx_iovs[kBatchSize];
+    struct mmsghdr rx_msgs[kBatchSize];
+
+    IoDatagram batch[kBatchSize];
+    uring_state *uring;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    harpy_metrics_add(HarpyCounter::IO_SYSCALLS);
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+void io_set_backend(IoBackend backend) {
+    g_backend.store(backend);
+}
+
+const char *io_backend_name(IoBackend backend) {
+    return backend == IoBackend::IO_URING ? "io_uring" : "syscalls";
+}
+
+IoStats io_get_stats() {
+    HarpyMetricsSnapshot metrics = harpy_metrics_snapshot();
+    IoStats stats;
+    stats.received = metrics.counters[(size_t)HarpyCounter::IO_RECEIVED];
+    stats.sent = metrics.counters[(size_t)HarpyCounter::IO_SENT];
+    stats.send_errors = metrics.counters[(size_t)HarpyCounter::IO_SEND_ERRORS];
+    stats.syscalls = metrics.counters[(size_t)HarpyCounter::IO_SYSCALLS];
+    return stats;
+}
+
+IoBackend io_socket_backend(const IoSocket *io) {
+    return io->backend;
+}
+
+// Hand a received batch to the owner
+static void deliver(IoSocket *io, int count) {
+    harpy_metrics_add(HarpyCounter::IO_RECEIVED, count);
+    if (packet_capture_on()) {
+        for (int i = 0; i < count; i++) {
+            packet_capture_record_datagram(CaptureDirection::RECEIVED, io->batch[i].data, io->batch[i].len,
+                                           &io->local, &io->batch[i].from);
+        }
+    }
+    io->handler(io->ctx, io, io->batch, count);
+}
+
+// ---- SYSCALLS ----
+
+// Send queued replies. A full send buffer parks the rest until the socket
+// is writable, and reception pauses meanwhile, so the reactor never waits
+// here. Sockets without a handler are not on the reactor and drop the rest.
+static void flush_syscalls(IoSocket *io) {
+    while (io->tx_sent < io->tx_count) {
+        harpy_metrics_add(HarpyCounter::IO_SYSCALLS);
+        int n = sendmmsg(io->fd, io->tx_msgs + io->tx_sent, io->tx_count - io->tx_sent, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!io->tx_blocked && io->handler && reactor_modify_fd(io->reactor, io->fd, EPOLLOUT)) {
+                    io->tx_blocked = true;
+                }
+                if (io->tx_blocked) return;
+                harpy_metrics_add(HarpyCounter::IO_SEND_DROPS, io->tx_count - io->tx_sent);
+                break;
+            }
+            // Skip the datagram the kernel refused and carry on with the rest
+            HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "Failed to send reply on socket %d: %s", strerror(errno), io->fd);
+            harpy_metrics_add(HarpyCounter::IO_SEND_ERRORS);
+            io->tx_sent++;
+            continue;
+        }
+        harpy_metrics_add(HarpyCounter::IO_SENT, n);
+        io->tx_sent += n;
+    }
+    io->tx_count = 0;
+    io->tx_sent = 0;
+    if (io->tx_blocked && reactor_modify_fd(io->reactor, io->fd, EPOLLIN)) {
+        io->tx_blocked = false;
+    }
+}
+
+static void on_socket_readable(void *ctx, uint32_t /*events*/) {
+    IoSocket *io = (IoSocket*)ctx;
+    if (io->tx_blocked) {
+        flush_syscalls(io);
+        if (io->tx_blocked) return;
+    }
+    for (int round = 0; round < kMaxBatchesPerWakeup; round++) {
+        for (int i = 0; i < kBatchSize; i++) {
+            memset(&io->rx_msgs[i].msg_hdr, 0, sizeof(io->rx_msgs[i].msg_hdr));
+            io->rx_msgs[i].msg_hdr.msg_name = &io->rx_addrs[i];
+            io->rx_msgs[i].msg_hdr.msg_namelen = sizeof(io->rx_addrs[i]);
+            io->rx_msgs[i].msg_hdr.msg_iov = &io->rx_iovs[i];
+            io->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        harpy_metrics_add(HarpyCounter::IO_SYSCALLS);
+        int received = recvmmsg(io->fd, io->rx_msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+        if (received <= 0) {
+            if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOGE("Error receiving on socket %d, no longer serving it: %s", io->fd, strerror(errno));
+                reactor_remove_fd(io->reactor, io->fd);
+            }
+            return;
+        }
+
+        int count = 0;
+        for (int i = 0; i < received; i++) {
+            if (io->rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            io->batch[count].data = (const uint8_t*)io->rx_iovs[i].iov_base;
+            io->batch[count].len = io->rx_msgs[i].msg_len;
+            io->batch[count].from = io->rx_addrs[i];
+            count++;
+        }
+        if (count > 0) deliver(io, count);
+        flush_syscalls(io);
+
+        if (received < kBatchSize || io->tx_blocked) return;  // Socket drained, or replies backed up
+    }
+}
+
+// ---- IO_URING ----
+
+static void uring_unmap(uring_state *ring) {
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_size);
+    if (ring->bufs) munmap(ring->bufs, kUringBuffers * ring->buf_size);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->event_fd >= 0) close(ring->event_fd);
+    if (ring->ring_fd >= 0) close(ring->ring_fd);
+    delete ring;
+}
+
+// Map the rings of a new io_uring instance; nullptr if the kernel refuses
+static uring_state *uring_create(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are reaped on our own schedule, so the kernel need not
+    // interrupt the thread to run their task work (Linux 5.19)
+    params.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+    int ring_fd = uring_setup(entries, &params);
+    if (ring_fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CLAMP;
+        ring_fd = uring_setup(entries, &params);
+    }
+    if (ring_fd < 0) return nullptr;
+
+    uring_state *ring = new uring_state();
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = ring_fd;
+    ring->event_fd = -1;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_size > ring->sq_size) {
+        ring->sq_size = ring->cq_size;
+    }
+    void *sq = mmap(nullptr, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        uring_unmap(ring);
+        return nullptr;
+    }
+    ring->sq_ptr = sq;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = sq;
+    } else {
+        void *cq = mmap(nullptr, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            uring_unmap(ring);
+            return nullptr;
+        }
+        ring->cq_ptr = cq;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_unmap(ring);
+        return nullptr;
+    }
+    ring->sqes = (struct io_uring_sqe*)sqes;
+
+    uint8_t *sq_base = (uint8_t*)ring->sq_ptr;
+    ring->sq_head = (unsigned*)(sq_base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq_base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq_base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq_base + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    uint8_t *cq_base = (uint8_t*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq_base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq_base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq_base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq_base + params.cq_off.cqes);
+    if (params.cq_off.flags) ring->cq_flags = (unsigned*)(cq_base + params.cq_off.flags);
+    return ring;
+}
+
+// Next free submission entry, zeroed; nullptr if the queue is full
+static struct io_uring_sqe *uring_get_sqe(uring_state *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head > ring->sq_mask) return nullptr;
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// Publish queued entries and enter the kernel once, optionally waiting
+static int uring_submit(uring_state *ring, unsigned wait_for) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (ring->to_submit == 0 && wait_for == 0) return 0;
+    int ret;
+    do {
+        ret = uring_enter(ring->ring_fd, ring->to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret >= 0) {
+        ring->to_submit -= (unsigned)ret > ring->to_submit ? ring->to_submit : (unsigned)ret;
+    }
+    return ret;
+}
+
+// Hand buffer bid back to the kernel
+static void uring_recycle(uring_state *ring, uint16_t bid) {
+    uring_buf *buf = &ring->buf_ring[ring->buf_tail & (kUringBuffers - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+    buf->len = (uint32_t)ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static void uring_publish_buffers(uring_state *ring) {
+    if (!ring->buf_ring) return;    // Send-only
+    // The tail lives in the reserved field of the first entry
+    __atomic_store_n(&ring->buf_ring[0].resv, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Provided buffers the multishot receive picks from
+static bool uring_setup_buffers(uring_state *ring, size_t max_datagram) {
+    ring->buf_ring_size = kUringBuffers * sizeof(uring_buf);
+    void *mem = mmap(nullptr, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        ring->buf_ring = nullptr;
+        return false;
+    }
+    ring->buf_ring = (uring_buf*)mem;
+
+    uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = kUringBuffers;
+    reg.bgid = kBufferGroup;
+    if (uring_register(ring->ring_fd, kRegisterPbufRing, &reg, 1) < 0) return false;
+
+    // One spare byte shows a datagram longer than max_datagram as
+    // truncated; buffers stay cache line aligned for the header
+    ring->buf_size = (kRecvHeaderSize + max_datagram + 1 + 63) & ~(size_t)63;
+    void *bufs = mmap(nullptr, kUringBuffers * ring->buf_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) return false;
+    ring->bufs = (uint8_t*)bufs;
+    for (unsigned i = 0; i < kUringBuffers; i++) {
+        uring_recycle(ring, (uint16_t)i);
+    }
+    uring_publish_buffers(ring);
+    return true;
+}
+
+bool io_uring_supported() {
+    int cached = g_uring_supported.load();
+    if (cached >= 0) return cached == 1;
+
+    bool supported = false;
+    uring_state *ring = uring_create(8);
+    if (!ring) {
+        LOGD("io_uring unavailable: %s", strerror(errno));
+    } else {
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, probe_size);
+        if (uring_register(ring->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_RECVMSG &&
+            (probe->ops[IORING_OP_RECVMSG].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED)) {
+            // Provided buffer rings arrived with 5.19, multishot recvmsg with
+            // 6.0; the latter is caught on the first completion
+            supported = uring_setup_buffers(ring, 64);
+            if (!supported) LOGD("io_uring lacks provided buffer rings: %s", strerror(errno));
+        }
+        free(probe);
+        uring_unmap(ring);
+    }
+    g_uring_supported.store(supported ? 1 : 0);
+    return supported;
+}
+
+static void uring_arm_recv(IoSocket *io) {
+    uring_state *ring = io->uring;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return;     // Retried after the next submit
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = kRecvTag;
+    ring->recv_armed = true;
+}
+
+static void switch_to_syscalls(IoSocket *io);
+
+// Give every reaped completion its due; receives are handed to the
+// handler a batch at a time and their buffers recycled after it returns
+static void uring_reap(IoSocket *io) {
+    uring_state *ring = io->uring;
+    uint16_t bids[kBatchSize];
+    int count = 0;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        head++;
+
+        if (cqe->user_data == kRecvTag) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) ring->recv_armed = false;
+            if (cqe->res < 0) {
+                if (cqe->res == -EINVAL && !ring->recv_seen) {
+                    // Multishot recvmsg needs Linux 6.0
+                    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+                    switch_to_syscalls(io);
+                    return;
+                }
+                if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+                    HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "io_uring receive on socket %d failed: %s",
+                                    strerror(-cqe->res), io->fd);
+                }
+                continue;   // Re-armed below once buffers are back
+            }
+            ring->recv_seen = true;
+            if (!(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+            uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            const uint8_t *buf = ring->bufs + (size_t)bid * ring->buf_size;
+            const uring_recvmsg_out *out = (const uring_recvmsg_out*)buf;
+            size_t available = (size_t)cqe->res - kRecvHeaderSize;
+            if ((out->flags & MSG_TRUNC) || out->payloadlen > available || out->payloadlen > io->max_datagram ||
+                out->namelen < sizeof(struct sockaddr_in) || !io->handler) {
+                uring_recycle(ring, bid);
+                continue;
+            }
+            bids[count] = bid;
+            io->batch[count].data = buf + kRecvHeaderSize;
+            io->batch[count].len = out->payloadlen;
+            memcpy(&io->batch[count].from, buf + sizeof(*out), sizeof(struct sockaddr_in));
+            if (++count == kBatchSize) {
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+                deliver(io, count);
+                for (int i = 0; i < count; i++) uring_recycle(ring, bids[i]);
+                uring_publish_buffers(ring);
+                count = 0;
+                // Send this batch's replies before their slots are needed again
+                if (ring->to_submit > 0) uring_submit(ring, 0);
+            }
+        } else if (cqe->user_data == kCancelTag) {
+            continue;
+        } else {
+            if (cqe->res < 0) {
+                HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "io_uring send on socket %d failed: %s",
+                                strerror(-cqe->res), io->fd);
+                harpy_metrics_add(HarpyCounter::IO_SEND_ERRORS);
+            } else {
+                harpy_metrics_add(HarpyCounter::IO_SENT);
+            }
+            if (cqe->user_data == kPreparedTag) {
+                ring->prepared_inflight--;
+                if (cqe->res >= 0) ring->prepared_sent++;
+            } else {
+                ring->free_slots[ring->free_count++] = (int)cqe->user_data;
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (count > 0) {
+        deliver(io, count);
+        for (int i = 0; i < count; i++) uring_recycle(ring, bids[i]);
+    }
+    uring_publish_buffers(ring);
+}
+
+static bool uring_cq_empty(uring_state *ring) {
+    return *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+// Completions we reap ourselves need not wake the reactor again
+static void uring_set_notify(uring_state *ring, bool enabled) {
+    if (!ring->cq_flags) return;
+    unsigned flags = __atomic_load_n(ring->cq_flags, __ATOMIC_RELAXED);
+    flags = enabled ? (flags & ~IORING_CQ_EVENTFD_DISABLED) : (flags | IORING_CQ_EVENTFD_DISABLED);
+    __atomic_store_n(ring->cq_flags, flags, __ATOMIC_RELEASE);
+}
+
+static void on_uring_completion(void *ctx, uint32_t /*events*/) {
+    IoSocket *io = (IoSocket*)ctx;
+    uring_state *ring = io->uring;
+    uint64_t signalled;
+    if (read(ring->event_fd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) {
+        LOGE("io_uring eventfd read failed: %s", strerror(errno));
+    }
+
+    uring_set_notify(ring, false);
+    for (int round = 0; round < kMaxBatchesPerWakeup; round++) {
+        uring_reap(io);
+        if (io->uring != ring) return;      // Fell back to syscalls
+        if (!ring->recv_armed && io->handler) uring_arm_recv(io);
+        // Replies and the re-armed receive go in with one enter; UDP sends
+        // usually complete inside it and are reaped next round
+        if (ring->to_submit == 0) break;
+        if (uring_submit(ring, 0) < 0) {
+            LOGE("io_uring submit failed on socket %d: %s", io->fd, strerror(errno));
+            break;
+        }
+    }
+    uring_set_notify(ring, true);
+    // Anything completed while notifications were off is picked up now
+    if (!uring_cq_empty(ring)) {
+        uint64_t one = 1;
+        if (write(ring->event_fd, &one, sizeof(one)) < 0) {
+            LOGE("io_uring eventfd write failed: %s", strerror(errno));
+        }
+    }
+}
+
+// Wait for the receive and every send to finish so no buffer is written
+// or read after it is freed
+static void uring_drain(IoSocket *io) {
+    uring_state *ring = io->uring;
+    IoBatchHandler handler = io->handler;
+    io->handler = nullptr;      // Datagrams still in the ring are dropped
+    bool cancel_queued = false;
+    for (int attempt = 0; attempt < 8; attempt++) {
+        bool sends_pending = ring->free_count != kUringTxSlots || ring->prepared_inflight != 0;
+        if (!ring->recv_armed && !sends_pending) break;
+        if (ring->recv_armed && !cancel_queued) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = kRecvTag;
+                sqe->user_data = kCancelTag;
+                cancel_queued = true;
+            }
+        }
+        // The multishot receive only ends once cancelled. With the queue
+        // too full for the cancel, submit what is queued to make room and
+        // wait only if sends are still to complete.
+        if (uring_submit(ring, cancel_queued || sends_pending ? 1 : 0) < 0) break;
+        uring_reap(io);
+    }
+    io->handler = handler;
+}
+
+static void uring_destroy(IoSocket *io) {
+    uring_state *ring = io->uring;
+    reactor_remove_fd(io->reactor, ring->event_fd);
+    uring_drain(io);
+    uring_unmap(ring);
+    io->uring = nullptr;
+}
+
+static bool attach_uring(IoSocket *io) {
+    uring_state *ring = uring_create(kUringEntries);
+    if (!ring) return false;
+    io->uring = ring;
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0 ||
+        uring_register(ring->ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0 ||
+        (io->handler && !uring_setup_buffers(ring, io->max_datagram)) ||
+        !reactor_add_fd(io->reactor, ring->event_fd, EPOLLIN, on_uring_completion, io)) {
+        uring_unmap(ring);
+        io->uring = nullptr;
+        return false;
+    }
+    ring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    ring->free_count = 0;
+    for (int i = kUringTxSlots - 1; i >= 0; i--) {
+        ring->free_slots[ring->free_count++] = i;
+    }
+    if (io->handler) {
+        uring_arm_recv(io);
+        if (uring_submit(ring, 0) < 0) {
+            reactor_remove_fd(io->reactor, ring->event_fd);
+            uring_unmap(ring);
+            io->uring = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---- Common ----
+
+static void free_slots(IoSocket *io) {
+    delete[] io->tx;
+    delete[] io->tx_dests;
+    delete[] io->tx_iovs;
+    delete[] io->tx_msgs;
+    delete[] io->rx;
+    delete[] io->overflow;
+    io->tx = nullptr;
+    io->tx_dests = nullptr;
+    io->tx_iovs = nullptr;
+    io->tx_msgs = nullptr;
+    io->rx = nullptr;
+    io->overflow = nullptr;
+}
+
+// Reply slots and, for SYSCALLS, receive buffers of the chosen backend
+static void alloc_slots(IoSocket *io) {
+    int slots = io->backend == IoBackend::IO_URING ? kUringTxSlots : kBatchSize;
+    io->tx = new uint8_t[slots * io->max_reply];
+    io->tx_dests = new struct sockaddr_in[slots];
+    io->tx_iovs = new struct iovec[slots];
+    io->tx_msgs = new struct mmsghdr[slots];
+    for (int i = 0; i < slots; i++) {
+        io->tx_iovs[i].iov_base = io->tx + (size_t)i * io->max_reply;
+        memset(&io->tx_msgs[i], 0, sizeof(io->tx_msgs[i]));
+        io->tx_msgs[i].msg_hdr.msg_name = &io->tx_dests[i];
+        io->tx_msgs[i].msg_hdr.msg_namelen = sizeof(io->tx_dests[i]);
+        io->tx_msgs[i].msg_hdr.msg_iov = &io->tx_iovs[i];
+        io->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    io->overflow = new uint8_t[io->max_reply];
+    if (io->backend == IoBackend::SYSCALLS && io->handler) {
+        io->rx = new uint8_t[kBatchSize * io->max_datagram];
+        for (int i = 0; i < kBatchSize; i++) {
+            io->rx_iovs[i].iov_base = io->rx + (size_t)i * io->max_datagram;
+            io->rx_iovs[i].iov_len = io->max_datagram;
+        }
+    }
+    io->tx_count = 0;
+    io->tx_sent = 0;
+    io->tx_blocked = false;
+    io->tx_current = -1;
+}
+
+static bool attach_syscalls(IoSocket *io) {
+    io->backend = IoBackend::SYSCALLS;
+    alloc_slots(io);
+    return !io->handler || reactor_add_fd(io->reactor, io->fd, EPOLLIN, on_socket_readable, io);
+}
+
+// Called from a completion handler when multishot receive turns out to be unsupported
+static void switch_to_syscalls(IoSocket *io) {
+    LOGD("Multishot receive unsupported, socket %d falls back to syscalls", io->fd);
+    uring_destroy(io);
+    free_slots(io);
+    if (!attach_syscalls(io)) {
+        LOGE("Socket %d could not fall back to syscalls, no longer serving it", io->fd);
+    }
+}
+
+IoSocket *io_socket_attach(Reactor *reactor, int fd, size_t max_datagram, size_t max_reply,
+                           IoBatchHandler handler, void *ctx) {
+    IoSocket *io = new IoSocket();
+    io->reactor = reactor;
+    io->fd = fd;
+    io->max_datagram = max_datagram;
+    io->max_reply = max_reply;
+    io->handler = handler;
+    io->ctx = ctx;
+    io->uring = nullptr;
+    io->tx = nullptr;
+    io->tx_dests = nullptr;
+    io->tx_iovs = nullptr;
+    io->tx_msgs = nullptr;
+    io->rx = nullptr;
+    io->overflow = nullptr;
+    socklen_t local_len = sizeof(io->local);
+    if (getsockname(fd, (struct sockaddr*)&io->local, &local_len) < 0 || io->local.sin_family != AF_INET) {
+        memset(&io->local, 0, sizeof(io->local));
+    }
+
+    if (g_backend.load() == IoBackend::IO_URING && io_uring_supported()) {
+        io->backend = IoBackend::IO_URING;
+        alloc_slots(io);
+        if (attach_uring(io)) return io;
+        LOGD("io_uring setup failed on socket %d, using syscalls: %s", fd, strerror(errno));
+        free_slots(io);
+    }
+    if (attach_syscalls(io)) return io;
+    free_slots(io);
+    delete io;
+    return nullptr;
+}
+
+void io_socket_detach(IoSocket *io) {
+    if (!io) return;
+    if (io->uring) {
+        uring_destroy(io);
+    } else if (io->handler) {
+        reactor_remove_fd(io->reactor, io->fd);
+    }
+    free_slots(io);
+    delete io;
+}
+
+uint8_t *io_reply_buffer(IoSocket *io) {
+    if (io->backend == IoBackend::SYSCALLS) {
+        if (io->tx_count == kBatchSize) flush_syscalls(io);
+        if (io->tx_count == kBatchSize) {
+            // Still backed up; this reply is dropped
+            io->tx_current = -1;
+            return io->overflow;
+        }
+        io->tx_current = io->tx_count;
+        return io->tx + (size_t)io->tx_current * io->max_reply;
+    }
+    uring_state *ring = io->uring;
+    if (ring->free_count == 0) {
+        io->tx_current = -1;
+        return io->overflow;
+    }
+    io->tx_current = ring->free_slots[ring->free_count - 1];
+    return io->tx + (size_t)io->tx_current * io->max_reply;
+}
+
+void io_queue_reply(IoSocket *io, size_t len, const struct sockaddr_in *dest) {
+    if (io->backend == IoBackend::SYSCALLS && io->tx_current < 0) {
+        harpy_metrics_add(HarpyCounter::IO_SEND_DROPS);
+        return;
+    }
+    if (packet_capture_on()) {
+        const uint8_t *data = io->tx_current >= 0 ? io->tx + (size_t)io->tx_current * io->max_reply : io->overflow;
+        packet_capture_record_datagram(CaptureDirection::SENT, data, len, &io->local, dest);
+    }
+    if (io->backend == IoBackend::SYSCALLS) {
+        int slot = io->tx_current;
+        io->tx_dests[slot] = *dest;
+        io->tx_iovs[slot].iov_len = len;
+        io->tx_count++;
+        return;
+    }
+
+    uring_state *ring = io->uring;
+    struct io_uring_sqe *sqe = io->tx_current >= 0 ? uring_get_sqe(ring) : nullptr;
+    if (!sqe) {
+        // Every slot or queue entry is busy; this one goes out directly
+        const uint8_t *data = io->tx_current >= 0 ? io->tx + (size_t)io->tx_current * io->max_reply
+                                                  : io->overflow;
+        harpy_metrics_add(HarpyCounter::IO_SYSCALLS);
+        if (sendto(io->fd, data, len, MSG_DONTWAIT, (const struct sockaddr*)dest, sizeof(*dest)) < 0) {
+            harpy_metrics_add(HarpyCounter::IO_SEND_ERRORS);
+        } else {
+            harpy_metrics_add(HarpyCounter::IO_SENT);
+        }
+        return;
+    }
+    int slot = io->tx_current;
+    ring->free_count--;
+    io->tx_dests[slot] = *dest;
+    io->tx_iovs[slot].iov_len = len;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&io->tx_msgs[slot].msg_hdr;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)slot;
+}
+
+int io_send_prepared(IoSocket *io, struct mmsghdr *msgs, int count) {
+    packet_capture_messages(CaptureDirection::SENT, msgs, count, &io->local);
+    if (io->backend == IoBackend::SYSCALLS) {
+        int sent = 0;
+        while (sent < count) {
+            harpy_metrics_add(HarpyCounter::IO_SYSCALLS);
+            int n = sendmmsg(io->fd, msgs + sent, count - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "sendmmsg failed after %d/%d messages: %s", strerror(errno),
+                                sent, count);
+                harpy_metrics_add(HarpyCounter::IO_SEND_ERRORS, count - sent);
+                break;
+            }
+            harpy_metrics_add(HarpyCounter::IO_SENT, n);
+            sent += n;
+        }
+        return sent;
+    }
+
+    // One enter submits the whole batch and waits for it, so the result
+    // is known before returning
+    uring_state *ring = io->uring;
+    ring->prepared_sent = 0;
+    int queued = 0;
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = io->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->user_data = kPreparedTag;
+        queued++;
+    }
+    ring->prepared_inflight += queued;
+    if (uring_submit(ring, (unsigned)queued) < 0) {
+        LOGE("io_uring submit failed: %s", strerror(errno));
+    }
+    uring_reap(io);
+    return ring->prepared_sent;
+}
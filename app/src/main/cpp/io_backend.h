@@ -0,0 +1,110 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+struct Reactor;
+
+/**
+ * Batched datagram I/O for a socket served by a reactor. The engines hand
+ * over the socket and a batch handler; the backend receives, calls the
+ * handler once per batch and sends the replies it queued in one go.
+ *
+ * SYSCALLS drains the socket with recvmmsg and replies with sendmmsg when
+ * epoll reports it readable. IO_URING keeps one multishot receive armed
+ * per socket with a provided buffer ring, so a busy socket costs one
+ * io_uring_enter per batch for both directions. It is tried only when
+ * preferred, and any socket falls back to SYSCALLS where io_uring is
+ * missing, too old or blocked by seccomp.
+ */
+enum class IoBackend {
+    SYSCALLS,
+    IO_URING
+};
+
+struct IoSocket;
+
+/**
+ * A received datagram; data is valid until the handler returns
+ */
+struct IoDatagram {
+    const uint8_t *data;
+    size_t len;
+    struct sockaddr_in from;
+};
+
+/**
+ * Called on the reactor thread with up to a batch of datagrams. Replies
+ * queued with io_queue_reply go out when it returns.
+ */
+typedef void (*IoBatchHandler)(void *ctx, IoSocket *io, const IoDatagram *batch, int count);
+
+/**
+ * Totals across every socket since start, for benchmarks and stats
+ */
+struct IoStats {
+    uint64_t received;      // Datagrams handed to handlers
+    uint64_t sent;          // Datagrams the kernel accepted
+    uint64_t send_errors;   // Datagrams dropped on a send error
+    uint64_t syscalls;      // recvmmsg, sendmmsg and io_uring_enter calls
+};
+
+/**
+ * Backend new sockets try first (default SYSCALLS)
+ */
+void io_set_backend(IoBackend backend);
+
+/**
+ * Whether this kernel lets us use the io_uring backend, probed once
+ */
+bool io_uring_supported();
+
+/**
+ * Serve fd from reactor. Must be called on the reactor's thread or while
+ * it is not running, like reactor_add_fd.
+ * @param fd Datagram or packet socket; stays owned by the caller
+ * @param max_datagram Largest datagram received; longer ones are dropped
+ * @param max_reply Largest reply queued with io_queue_reply
+ * @param handler nullptr for a send-only socket
+ * @return nullptr if the socket could not be registered
+ */
+IoSocket *io_socket_attach(Reactor *reactor, int fd, size_t max_datagram, size_t max_reply,
+                           IoBatchHandler handler, void *ctx);
+
+/**
+ * Stop serving the socket and free the backend state; fd stays open.
+ * Same thread rules as io_socket_attach.
+ */
+void io_socket_detach(IoSocket *io);
+
+/**
+ * Backend actually serving the socket
+ */
+IoBackend io_socket_backend(const IoSocket *io);
+
+/**
+ * Buffer of max_reply bytes to build the next reply in
+ */
+uint8_t *io_reply_buffer(IoSocket *io);
+
+/**
+ * Queue the reply built in the last io_reply_buffer for dest
+ */
+void io_queue_reply(IoSocket *io, size_t len, const struct sockaddr_in *dest);
+
+/**
+ * Send prepared messages, such as a raw frame batch, with one submission.
+ * msgs and the buffers they point at must stay valid until the next call
+ * or io_socket_detach.
+ * @return Number of messages the kernel accepted
+ */
+int io_send_prepared(IoSocket *io, struct mmsghdr *msgs, int count);
+
+IoStats io_get_stats();
+
+const char *io_backend_name(IoBackend backend);
+
+#endif // IO_BACKEND_H
@@ -0,0 +1,146 @@
+// Syscall and CPU cost of the datagram backends.
+//
+// Serves loopback DNS queries with one worker, first over recvmmsg/sendmmsg
+// and then over io_uring, and prints queries per second, server CPU time
+// and backend syscalls per thousand queries. A second pass sends prepared
+// batches the way the ARP loops do, to a UDP sink so it runs without root.
+// The io_uring rows are skipped where the kernel does not allow it.
+//
+// Usage: harpy_io_bench [seconds] [port]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "dns_load_client.h"
+#include "dns_spoofing.h"
+#include "io_backend.h"
+#include "reactor.h"
+
+static const int kSendBatch = 64;           // Frames per prepared send, as kArpBatchMax
+static const size_t kFrameSize = 42;        // An Ethernet ARP frame
+
+static double cpu_seconds(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Drive the server until the deadline; the thread's own CPU time is
+// reported so it can be taken out of the process total
+static void client_thread(uint16_t port, std::chrono::steady_clock::time_point deadline,
+                          uint64_t *answered, double *client_cpu) {
+    *answered = dns_load_run(port, deadline);
+    *client_cpu = cpu_seconds(RUSAGE_THREAD);
+}
+
+static bool serve_round(IoBackend backend, int seconds, uint16_t port) {
+    io_set_backend(backend);
+    dns_set_listen_port(port);
+    dns_set_workers(1);
+    dns_set_upstreams({"127.0.0.1:9"});
+    if (!dns_start_spoofing("lo", {{"*.bench.test", "10.0.0.1"}})) {
+        fprintf(stderr, "Failed to start DNS engine on port %u\n", port);
+        return false;
+    }
+
+    IoStats before = io_get_stats();
+    double cpu_before = cpu_seconds(RUSAGE_SELF);
+    uint64_t answered = 0;
+    double client_cpu = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::thread client(client_thread, port, deadline, &answered, &client_cpu);
+    client.join();
+    double server_cpu = cpu_seconds(RUSAGE_SELF) - cpu_before - client_cpu;
+    IoStats after = io_get_stats();
+    dns_stop_spoofing();
+
+    double thousands = answered / 1000.0;
+    printf("%-10s %-6s %12.0f %14.1f %14.1f\n", io_backend_name(backend), "serve", (double)answered / seconds,
+           thousands > 0 ? server_cpu * 1e3 / thousands : 0.0,
+           thousands > 0 ? (after.syscalls - before.syscalls) / thousands : 0.0);
+    fflush(stdout);
+    return true;
+}
+
+// Prepared batches through one send-only socket, as the ARP loops send
+static bool send_round(IoBackend backend, int seconds, uint16_t port) {
+    int sink = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink < 0 || sock < 0 || bind(sink, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to open the send sink on port %u\n", port);
+        return false;
+    }
+
+    static uint8_t frames[kSendBatch][kFrameSize];
+    static struct iovec iovs[kSendBatch];
+    static struct mmsghdr msgs[kSendBatch];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < kSendBatch; i++) {
+        iovs[i].iov_base = frames[i];
+        iovs[i].iov_len = kFrameSize;
+        msgs[i].msg_hdr.msg_name = &addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    io_set_backend(backend);
+    Reactor *reactor = reactor_create();
+    IoSocket *io = reactor ? io_socket_attach(reactor, sock, 0, 0, nullptr, nullptr) : nullptr;
+    if (!io) {
+        fprintf(stderr, "Failed to attach the send socket\n");
+        return false;
+    }
+
+    IoStats before = io_get_stats();
+    double cpu_before = cpu_seconds(RUSAGE_SELF);
+    uint64_t sent = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < deadline) {
+        // The sink is never read; loopback drops what does not fit
+        sent += io_send_prepared(io, msgs, kSendBatch);
+    }
+    double cpu = cpu_seconds(RUSAGE_SELF) - cpu_before;
+    IoStats after = io_get_stats();
+
+    io_socket_detach(io);
+    reactor_destroy(reactor);
+    close(sock);
+    close(sink);
+
+    double thousands = sent / 1000.0;
+    printf("%-10s %-6s %12.0f %14.1f %14.1f\n", io_backend_name(backend), "send", (double)sent / seconds,
+           thousands > 0 ? cpu * 1e3 / thousands : 0.0,
+           thousands > 0 ? (after.syscalls - before.syscalls) / thousands : 0.0);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    uint16_t port = (uint16_t)(argc > 2 ? atoi(argv[2]) : 15353);
+    if (seconds <= 0) seconds = 3;
+
+    bool uring = io_uring_supported();
+    if (!uring) printf("io_uring unavailable, measuring syscalls only\n");
+
+    printf("%-10s %-6s %12s %14s %14s\n", "backend", "path", "msgs/s", "cpu ms/1k", "syscalls/1k");
+    if (!serve_round(IoBackend::SYSCALLS, seconds, port)) return 1;
+    if (uring && !serve_round(IoBackend::IO_URING, seconds, port)) return 1;
+    if (!send_round(IoBackend::SYSCALLS, seconds, port)) return 1;
+    if (uring && !send_round(IoBackend::IO_URING, seconds, port)) return 1;
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include "lan_sim.h"
+#include "arp_frame.h"
+#include "packet_io.h"
+#include "reactor.h"
+#include "harpy_log.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <arpa/inet.h>
+
+#define LOG_TAG "LanSim"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGI(...) HARPY_LOG(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+// Delayed replies go out from a timer, so latency resolves to about this
+static const int kTickMs = 1;
+// Replies held back at once; more count as rate limited
+static const size_t kMaxPending = 1 << 16;
+// Depth of the token bucket, in milliseconds of the rate
+static const int kBurstMs = 10;
+
+struct pending_reply {
+    int64_t due_us;
+    ArpFrame frame;
+
+    bool operator>(const pending_reply& other) const { return due_us > other.due_us; }
+};
+
+struct LanSim {
+    LanSimConfig config;
+    uint32_t first;             // Host byte order
+    uint32_t last;
+    PacketIo *io;
+    Reactor *reactor;
+    ReactorTimer *timer;
+    uint64_t rng;
+    double tokens;
+    int64_t refill_us;
+    std::priority_queue<pending_reply, std::vector<pending_reply>, std::greater<pending_reply>> pending;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> unknown;
+    std::atomic<uint64_t> lost;
+    std::atomic<uint64_t> rate_limited;
+    std::atomic<uint64_t> replies;
+};
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool is_usable(uint32_t ip) {
+    uint32_t octet = ip & 0xff;
+    return octet != 0 && octet != 255;
+}
+
+// xorshift64*: cheap, and reproducible from the seed
+static uint64_t next_random(LanSim *sim) {
+    uint64_t x = sim->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sim->rng = x;
+    return x * 2685821657736338717ULL;
+}
+
+static int64_t reply_delay_us(LanSim *sim) {
+    int64_t delay = sim->config.latency_us;
+    if (sim->config.jitter_us > 0) {
+        uint64_t span = 2 * (uint64_t)sim->config.jitter_us + 1;
+        delay += (int64_t)(next_random(sim) % span) - sim->config.jitter_us;
+    }
+    return std::max<int64_t>(delay, 0);
+}
+
+static bool take_token(LanSim *sim, int64_t now) {
+    if (sim->config.rate_pps == 0) return true;
+    double rate = sim->config.rate_pps;
+    double burst = std::max(1.0, rate * kBurstMs / 1000.0);
+    sim->tokens = std::min(burst, sim->tokens + (double)(now - sim->refill_us) * rate / 1e6);
+    sim->refill_us = now;
+    if (sim->tokens < 1.0) return false;
+    sim->tokens -= 1.0;
+    return true;
+}
+
+static void on_request(void *ctx, PacketIo *io, const Packet *batch, int count) {
+    LanSim *sim = (LanSim*)ctx;
+    int64_t now = now_us();
+    for (int i = 0; i < count; i++) {
+        if (batch[i].len < sizeof(ArpFrame)) continue;
+        const ArpFrame *request = (const ArpFrame *)batch[i].data;
+        // Our own replies come back on a raw socket too
+        if (request->eth_type[0] != 0x08 || request->eth_type[1] != 0x06) continue;
+        if (request->oper[0] != 0 || request->oper[1] != 1) continue;
+        sim->requests.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t target, requester;
+        memcpy(&target, request->tpa, 4);
+        memcpy(&requester, request->spa, 4);
+        uint32_t host = ntohl(target);
+        if (host < sim->first || host > sim->last || !is_usable(host)) {
+            sim->unknown.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (sim->config.loss > 0 && (double)(next_random(sim) >> 11) * 0x1.0p-53 < sim->config.loss) {
+            sim->lost.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        const uint8_t host_mac[6] = {0x02, 0x4c, request->tpa[0], request->tpa[1], request->tpa[2], request->tpa[3]};
+        pending_reply reply;
+        reply.frame = kArpReplyTemplate;
+        arp_frame_patch(&reply.frame, host_mac, target, request->sha, requester);
+
+        int64_t delay = reply_delay_us(sim);
+        if (delay == 0) {
+            if (!take_token(sim, now)) {
+                sim->rate_limited.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            memcpy(packet_io_reply_buffer(io), &reply.frame, sizeof(reply.frame));
+            packet_io_queue_reply(io, sizeof(reply.frame), nullptr);
+            sim->replies.fetch_add(1, std::memory_order_relaxed);
+        } else if (sim->pending.size() >= kMaxPending) {
+            sim->rate_limited.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            reply.due_us = now + delay;
+            sim->pending.push(reply);
+        }
+    }
+}
+
+// Send the delayed replies that are due
+static void on_tick(void *ctx) {
+    LanSim *sim = (LanSim*)ctx;
+    int64_t now = now_us();
+    while (!sim->pending.empty() && sim->pending.top().due_us <= now) {
+        const pending_reply& reply = sim->pending.top();
+        if (!take_token(sim, now)) {
+            sim->rate_limited.fetch_add(1, std::memory_order_relaxed);
+        } else if (packet_io_send(sim->io, (const uint8_t *)&reply.frame, sizeof(reply.frame), nullptr)) {
+            sim->replies.fetch_add(1, std::memory_order_relaxed);
+        }
+        sim->pending.pop();
+    }
+}
+
+LanSim *lan_sim_create(const LanSimConfig& config) {
+    if (config.hosts == 0) {
+        LOGE("Simulated LAN needs at least one host");
+        return nullptr;
+    }
+    uint64_t ip = ntohl(config.first_ip);
+    while (ip <= 0xffffffffULL && !is_usable((uint32_t)ip)) ip++;
+    uint64_t first = ip;
+    uint64_t last = ip;
+    for (uint32_t n = 0; n < config.hosts; n++) {
+        while (ip <= 0xffffffffULL && !is_usable((uint32_t)ip)) ip++;
+        if (ip > 0xffffffffULL) {
+            LOGE("%u simulated hosts do not fit above the first address", config.hosts);
+            return nullptr;
+        }
+        last = ip++;
+    }
+
+    LanSim *sim = new LanSim();
+    sim->config = config;
+    sim->first = (uint32_t)first;
+    sim->last = (uint32_t)last;
+    sim->io = nullptr;
+    sim->reactor = nullptr;
+    sim->timer = nullptr;
+    sim->rng = config.seed ? config.seed : 0x9e3779b97f4a7c15ULL;
+    sim->tokens = 0;
+    sim->refill_us = now_us();
+    sim->requests = 0;
+    sim->unknown = 0;
+    sim->lost = 0;
+    sim->rate_limited = 0;
+    sim->replies = 0;
+    return sim;
+}
+
+bool lan_sim_start(LanSim *sim, PacketIo *io, Reactor *reactor) {
+    sim->io = io;
+    sim->reactor = reactor;
+    sim->tokens = 0;
+    sim->refill_us = now_us();
+    if (!packet_io_start(io, reactor, on_request, sim)) return false;
+    sim->timer = reactor_add_timer(reactor, kTickMs, on_tick, sim);
+    if (!sim->timer) {
+        packet_io_stop(io);
+        return false;
+    }
+    LOGI("Simulating %u hosts: latency %dus, jitter %dus, loss %.3f, rate %u/s",
+         sim->config.hosts, sim->config.latency_us, sim->config.jitter_us, sim->config.loss,
+         sim->config.rate_pps);
+    return true;
+}
+
+void lan_sim_stop(LanSim *sim) {
+    if (!sim->io) return;
+    reactor_remove_timer(sim->reactor, sim->timer);
+    packet_io_stop(sim->io);
+    sim->timer = nullptr;
+    sim->io = nullptr;
+    sim->pending = {};
+}
+
+void lan_sim_destroy(LanSim *sim) {
+    if (!sim) return;
+    lan_sim_stop(sim);
+    delete sim;
+}
+
+LanSimStats lan_sim_stats(const LanSim *sim) {
+    LanSimStats stats;
+    stats.requests = sim->requests.load(std::memory_order_relaxed);
+    stats.unknown = sim->unknown.load(std::memory_order_relaxed);
+    stats.lost = sim->lost.load(std::memory_order_relaxed);
+    stats.rate_limited = sim->rate_limited.load(std::memory_order_relaxed);
+    stats.replies = sim->replies.load(std::memory_order_relaxed);
+    return stats;
+}
+
+uint32_t lan_sim_last_ip(const LanSim *sim) {
+    return htonl(sim->last);
+}
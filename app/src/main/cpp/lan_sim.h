@@ -0,0 +1,69 @@
+#ifndef LAN_SIM_H
+#define LAN_SIM_H
+
+#include <cstdint>
+
+struct Reactor;
+struct PacketIo;
+
+/**
+ * A simulated LAN for benchmarking the scanner: a population of virtual
+ * hosts that answer ARP requests for their address, each with its own
+ * locally administered MAC derived from the address. Hosts take
+ * consecutive addresses from first_ip, skipping those ending in .0 and
+ * .255, so a population of thousands spans many /24s of a /16.
+ *
+ * Replies are delayed by latency plus or minus a uniform jitter, dropped
+ * with probability loss, and limited to rate_pps by a token bucket, as a
+ * congested link or a host's ARP rate limit would.
+ */
+struct LanSimConfig {
+    uint32_t first_ip;          // Network byte order
+    uint32_t hosts;
+    int latency_us;
+    int jitter_us;
+    double loss;                // 0..1
+    uint32_t rate_pps;          // 0 for no limit
+    uint64_t seed;              // Same seed, same losses and jitter
+};
+
+struct LanSimStats {
+    uint64_t requests;          // ARP requests seen
+    uint64_t unknown;           // For an address outside the population
+    uint64_t lost;              // Dropped by the loss probability
+    uint64_t rate_limited;      // Over the rate limit, or too many replies pending
+    uint64_t replies;           // Sent
+};
+
+struct LanSim;
+
+/**
+ * @return nullptr if the population does not fit in the IPv4 space
+ */
+LanSim *lan_sim_create(const LanSimConfig& config);
+
+/**
+ * Answer requests arriving on io, a FRAMES backend: the far end of a veth
+ * pair, or a loopback wired to the scanner's. Same thread rules as
+ * packet_io_start.
+ */
+bool lan_sim_start(LanSim *sim, PacketIo *io, Reactor *reactor);
+
+/**
+ * Stop answering; replies still pending are dropped
+ */
+void lan_sim_stop(LanSim *sim);
+
+void lan_sim_destroy(LanSim *sim);
+
+/**
+ * Counters so far; any thread
+ */
+LanSimStats lan_sim_stats(const LanSim *sim);
+
+/**
+ * Address of the last host, network byte order
+ */
+uint32_t lan_sim_last_ip(const LanSim *sim);
+
+#endif // LAN_SIM_H
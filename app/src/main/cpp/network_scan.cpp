@@ -1,29 +1,31 @@
 #include "network_scan.h"
-#include <android/log.h>
+#include "arp_frame.h"
+#include "reactor.h"
+#include "packet_io.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
 #include <iostream>
 #include <cstring>
 #include <vector>
 #include <chrono>
-#include <thread>
 #include <mutex>
+#include <atomic>
 #include <set>
 #include <map>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <linux/if_packet.h>
 #include <net/if.h>
 #include <netinet/if_ether.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <poll.h>
 
 #define LOG_TAG "NetworkScan"
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGI(...) HARPY_LOG(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 
 // ARP packet structure for sending and receiving
 struct arp_packet {
@@ -34,45 +36,62 @@ struct arp_packet {
 static std::mutex g_devices_mutex;
 static std::vector<std::string> g_discovered_devices;
 static std::map<std::string, int> g_ip_response_count; // Track response reliability
-static bool g_stop_capture = false;
+static std::atomic<bool> g_stop_capture(false);
+// Reactor of the scan in progress, so cleanup can end it at once; guarded by g_devices_mutex
+static Reactor *g_scan_reactor = nullptr;
+static PacketIo *g_scan_packet_io = nullptr;    // Set by the caller instead of a raw socket
+static NetworkScanObserver g_scan_observer = nullptr;
+static void *g_scan_observer_ctx = nullptr;
+
+// Sweep pacing: each tick sends a few requests, and every rest_every
+// requests the sweep pauses so replies and other traffic get through
+struct sweep_pacing {
+    int tick_ms;
+    int per_tick;
+    int rest_every;
+    int rest_ms;
+};
+static const sweep_pacing kFastSweep = {1, 2, 50, 10};         // Pass 1
+static const sweep_pacing kThoroughSweep = {3, 2, 32, 20};     // Later passes: slower, more reliable
+static const int kMaxSendErrors = 10;
+// Ethernet frames captured whole
+static const size_t kScanSnapLen = 1500;
+
+// One scan, driven by timers on the calling thread's reactor: sweep passes
+// separated by waits, with replies captured throughout
+struct scan_state {
+    PacketIo *io;
+    Reactor *reactor;
+    ReactorTimer *timer;
+    ArpFrame sweep_pkt;
+    uint32_t base_host;
+    int pass;
+    int last_pass;
+    int wait_ms[3];         // After each pass
+    int next_host;          // 1..254
+    int sent_count;
+    int error_count;
+    int64_t sent_ns[256];   // Last request to each host not yet answered, 0 for none
+    int64_t pass_trace_ns;  // Trace start of the sweep in progress
+    int64_t pause_trace_ns; // Trace start of the pacing rest or reply wait in progress
+    NetworkScanObserver observer;
+    void *observer_ctx;
+};
 
 bool network_scan_init() {
     LOGD("Initializing network scan operations with manual raw sockets");
     return true;
 }
 
-// Thread function to capture ARP replies with improved filtering
-void capture_responses(int sock, const char* interface) {
-    LOGD("Started ARP capture thread on %s", interface);
-    
-    unsigned char buffer[1500];
-    struct sockaddr_ll sll;
-    socklen_t sll_len = sizeof(sll);
-    
-    // Use poll for better timeout handling
-    struct pollfd pfd;
-    pfd.fd = sock;
-    pfd.events = POLLIN;
-
-    while (!g_stop_capture) {
-        int ret = poll(&pfd, 1, 100); // 100ms timeout
-        if (ret < 0) {
-            if (errno == EINTR) continue;
-            LOGE("poll error: %s", strerror(errno));
-            break;
-        }
-        if (ret == 0) continue; // Timeout, check stop flag
-        
-        ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr*)&sll, &sll_len);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
-            LOGE("recvfrom error: %s", strerror(errno));
-            break;
-        }
+// Capture ARP replies with improved filtering
+static void on_arp_reply(void *ctx, PacketIo * /*io*/, const Packet *batch, int count) {
+    scan_state *scan = (scan_state*)ctx;
+    HarpyTraceScope trace("scan", "capture");
+    trace.set_arg("frames", count);
+    for (int p = 0; p < count && !g_stop_capture.load(std::memory_order_relaxed); p++) {
+        if (batch[p].len < sizeof(struct arp_packet)) continue;
 
-        if (n < (ssize_t)sizeof(struct arp_packet)) continue;
-
-        struct arp_packet *pkt = (struct arp_packet *)buffer;
+        const struct arp_packet *pkt = (const struct arp_packet *)batch[p].data;
         
         // Validate Ethernet frame
         if (ntohs(pkt->eth.h_proto) != ETH_P_ARP) continue;
@@ -93,6 +112,14 @@ void capture_responses(int sock, const char* interface) {
         uint32_t ip_val;
         memcpy(&ip_val, pkt->arp.arp_spa, 4);
         if (ip_val == 0 || ip_val == 0xFFFFFFFF) continue;
+        harpy_metrics_add(HarpyCounter::SCAN_REPLIES);
+        if ((ntohl(ip_val) & 0xFFFFFF00u) == scan->base_host) {
+            int64_t *sent_ns = &scan->sent_ns[ntohl(ip_val) & 0xff];
+            if (*sent_ns) {
+                harpy_metrics_record(HarpyHistogram::SCAN_REPLY, harpy_metrics_now_ns() - *sent_ns);
+                *sent_ns = 0;
+            }
+        }
         
         char mac[18];
         snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
@@ -109,29 +136,119 @@ void capture_responses(int sock, const char* interface) {
         }
         if (!valid_mac) continue;
         
-        std::lock_guard<std::mutex> lock(g_devices_mutex);
-        std::string ip_str(ip);
-        
-        // Track response count for reliability
-        g_ip_response_count[ip_str]++;
-        
-        // Only add device if we haven't seen it yet
         bool already_added = false;
-        for (const auto& dev : g_discovered_devices) {
-            if (dev.find(ip_str) == 0) {
-                already_added = true;
-                break;
+        {
+            HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
+            std::string ip_str(ip);
+
+            // Track response count for reliability
+            g_ip_response_count[ip_str]++;
+
+            // Only add device if we haven't seen it yet
+            for (const auto& dev : g_discovered_devices) {
+                if (dev.find(ip_str) == 0) {
+                    already_added = true;
+                    break;
+                }
+            }
+
+            if (!already_added) {
+                char result[64];
+                snprintf(result, sizeof(result), "%s|%s", ip, mac);
+                g_discovered_devices.push_back(std::string(result));
+                harpy_metrics_add(HarpyCounter::SCAN_DEVICES);
+                HARPY_EVENT(ANDROID_LOG_INFO, 0, "Found device: %I (%M)", ip_val, harpy_event_mac(pkt->arp.arp_sha));
             }
         }
-        
-        if (!already_added) {
-            char result[64];
-            snprintf(result, sizeof(result), "%s|%s", ip, mac);
-            g_discovered_devices.push_back(std::string(result));
-            LOGI("Found device: %s (%s)", ip, mac);
+        if (!already_added && scan->observer) {
+            scan->observer(scan->observer_ctx, ip, mac);
+        }
+    }
+}
+
+static void start_sweep(scan_state *scan, int pass);
+static void on_sweep_tick(void *ctx);
+
+// Replace the scan's timer with one for its next step
+static void schedule(scan_state *scan, int interval_ms, ReactorTimerHandler handler) {
+    reactor_remove_timer(scan->reactor, scan->timer);
+    scan->timer = reactor_add_timer(scan->reactor, interval_ms, handler, scan);
+    if (!scan->timer) {
+        reactor_stop(scan->reactor);
+    }
+}
+
+static void on_wait_done(void *ctx) {
+    scan_state *scan = (scan_state*)ctx;
+    harpy_trace_span("scan", "reply_wait", scan->pause_trace_ns, "pass", scan->pass);
+    if (scan->pass >= scan->last_pass) {
+        reactor_stop(scan->reactor);
+        return;
+    }
+    if (scan->pass == 2) {
+        LOGD("Running targeted pass 3 for non-responders");
+    }
+    start_sweep(scan, scan->pass + 1);
+}
+
+static void end_sweep(scan_state *scan) {
+    LOGD("Sweep pass %d complete: sent %d packets, %d errors",
+         scan->pass, scan->sent_count, scan->error_count);
+    harpy_trace_span("scan", "sweep", scan->pass_trace_ns, "pass", scan->pass);
+    scan->pause_trace_ns = harpy_trace_begin();
+    int wait_ms = scan->wait_ms[scan->pass - 1];
+    LOGD("Waiting %dms after pass %d", wait_ms, scan->pass);
+    schedule(scan, wait_ms, on_wait_done);
+}
+
+static void on_rest_done(void *ctx) {
+    scan_state *scan = (scan_state*)ctx;
+    harpy_trace_span("scan", "pacing_rest", scan->pause_trace_ns);
+    schedule(scan, (scan->pass == 1 ? kFastSweep : kThoroughSweep).tick_ms, on_sweep_tick);
+}
+
+// Send the next few requests of the sweep
+static void on_sweep_tick(void *ctx) {
+    scan_state *scan = (scan_state*)ctx;
+    const sweep_pacing& pacing = scan->pass == 1 ? kFastSweep : kThoroughSweep;
+    HarpyTraceScope trace("scan", "sweep_tick");
+    trace.set_arg("next_host", scan->next_host);
+
+    for (int burst = 0; burst < pacing.per_tick && scan->next_host < 255; burst++) {
+        int host = scan->next_host++;
+        uint32_t target_ip = htonl(scan->base_host | (uint32_t)host);
+        memcpy(scan->sweep_pkt.tpa, &target_ip, 4);
+        if (!packet_io_send(scan->io, (const uint8_t *)&scan->sweep_pkt, sizeof(scan->sweep_pkt), nullptr)) {
+            harpy_metrics_add(HarpyCounter::SCAN_SEND_ERRORS);
+            if (++scan->error_count > kMaxSendErrors) {
+                LOGE("Too many send errors, aborting sweep");
+                end_sweep(scan);
+                return;
+            }
+            break; // Back off until the next tick
+        }
+        scan->sent_count++;
+        scan->sent_ns[host] = harpy_metrics_now_ns();
+        harpy_metrics_add(HarpyCounter::SCAN_REQUESTS);
+        if (host % pacing.rest_every == 0 && scan->next_host < 255) {
+            scan->pause_trace_ns = harpy_trace_begin();
+            schedule(scan, pacing.rest_ms, on_rest_done);
+            return;
         }
     }
-    LOGD("ARP capture thread stopped");
+    if (scan->next_host >= 255) {
+        end_sweep(scan);
+    }
+}
+
+static void start_sweep(scan_state *scan, int pass) {
+    LOGD("Sweep pass %d starting", pass);
+    scan->pass = pass;
+    scan->pass_trace_ns = harpy_trace_begin();
+    scan->next_host = 1;
+    scan->sent_count = 0;
+    scan->error_count = 0;
+    schedule(scan, (pass == 1 ? kFastSweep : kThoroughSweep).tick_ms, on_sweep_tick);
 }
 
 static bool get_interface_info(const char *interface, unsigned char *mac, char *ip) {
@@ -162,9 +279,10 @@ std::vector<std::string> network_scan(const char *interface,
                                       int timeout_seconds) {
     LOGI("Starting network scan: interface=%s, subnet=%s, timeout=%ds", 
          interface, subnet, timeout_seconds);
+    HarpyTraceScope trace("scan", "network_scan");
     
     {
-        std::lock_guard<std::mutex> lock(g_devices_mutex);
+        HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
         g_discovered_devices.clear();
         g_ip_response_count.clear();
         g_stop_capture = false;
@@ -174,54 +292,21 @@ std::vector<std::string> network_scan(const char *interface,
     if (timeout_seconds < 2) timeout_seconds = 2;
     if (timeout_seconds > 60) timeout_seconds = 60;
 
-    // Open raw socket for both sending and receiving
-    int sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
-    if (sock < 0) {
-        LOGE("Failed to create raw socket: %s (errno=%d). Root/CAP_NET_RAW required.", 
-             strerror(errno), errno);
-        return {};
-    }
-
-    // Set socket buffer sizes for better performance
-    int bufsize = 262144; // 256KB
-    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
-    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
-
-    // Set non-blocking for poll-based receiving
-    int flags = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-
-    // Bind to interface
-    struct sockaddr_ll sll;
-    memset(&sll, 0, sizeof(sll));
-    sll.sll_family = AF_PACKET;
-    sll.sll_ifindex = if_nametoindex(interface);
-    sll.sll_protocol = htons(ETH_P_ARP);
-    
-    if (sll.sll_ifindex == 0) {
-        LOGE("Interface %s not found", interface);
-        close(sock);
-        return {};
+    // Raw socket for both sending and receiving, unless the caller gave us packet I/O
+    PacketIo *own_io = nullptr;
+    PacketIo *io = g_scan_packet_io;
+    if (!io) {
+        own_io = packet_io_open_af_packet(interface, ETH_P_ARP, kScanSnapLen, nullptr);
+        if (!own_io) return {};
+        io = own_io;
     }
-    
-    if (bind(sock, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
-        LOGE("Failed to bind raw socket: %s", strerror(errno));
-        close(sock);
-        return {};
-    }
-    LOGD("Raw socket bound to %s (ifindex=%d)", interface, sll.sll_ifindex);
-
-    // Start capture thread
-    std::thread capture_thread(capture_responses, sock, interface);
 
     // Get our interface info
     unsigned char our_mac[ETH_ALEN];
     char our_ip[16];
     if (!get_interface_info(interface, our_mac, our_ip)) {
         LOGE("Failed to get interface info");
-        g_stop_capture = true;
-        capture_thread.join();
-        close(sock);
+        packet_io_close(own_io);
         return {};
     }
     LOGD("Interface info: IP=%s, MAC=%02x:%02x:%02x:%02x:%02x:%02x",
@@ -240,71 +325,31 @@ std::vector<std::string> network_scan(const char *interface,
 
     LOGI("Scanning subnet: %s.1-254", subnet_prefix);
     
-    // Build ARP request template
-    struct arp_packet sweep_pkt;
-    memset(&sweep_pkt, 0, sizeof(sweep_pkt));
-    memset(sweep_pkt.eth.h_dest, 0xff, ETH_ALEN);
-    memcpy(sweep_pkt.eth.h_source, our_mac, ETH_ALEN);
-    sweep_pkt.eth.h_proto = htons(ETH_P_ARP);
-    
-    sweep_pkt.arp.ea_hdr.ar_hrd = htons(ARPHRD_ETHER);
-    sweep_pkt.arp.ea_hdr.ar_pro = htons(ETH_P_IP);
-    sweep_pkt.arp.ea_hdr.ar_hln = ETH_ALEN;
-    sweep_pkt.arp.ea_hdr.ar_pln = 4;
-    sweep_pkt.arp.ea_hdr.ar_op = htons(ARPOP_REQUEST);
-    memcpy(sweep_pkt.arp.arp_sha, our_mac, ETH_ALEN);
-    inet_aton(our_ip, (struct in_addr *)sweep_pkt.arp.arp_spa);
-    memset(sweep_pkt.arp.arp_tha, 0, ETH_ALEN);
-
-    struct sockaddr_ll dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sll_family = AF_PACKET;
-    dest_addr.sll_ifindex = sll.sll_ifindex;
-    dest_addr.sll_halen = ETH_ALEN;
-    memset(dest_addr.sll_addr, 0xff, ETH_ALEN);
-
-    // Adaptive sweep function with error handling
-    auto run_sweep = [&](int pass) -> int {
-        LOGD("Sweep pass %d starting", pass);
-        int sent_count = 0;
-        int error_count = 0;
-        
-        for (int i = 1; i < 255; i++) {
-            char target_ip[16];
-            snprintf(target_ip, sizeof(target_ip), "%s.%d", subnet_prefix, i);
-            inet_aton(target_ip, (struct in_addr *)sweep_pkt.arp.arp_tpa);
-            
-            ssize_t sent = sendto(sock, &sweep_pkt, sizeof(sweep_pkt), 0, 
-                                 (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-            if (sent < 0) {
-                error_count++;
-                if (error_count > 10) {
-                    LOGE("Too many send errors, aborting sweep");
-                    return sent_count;
-                }
-                usleep(5000); // Back off on errors
-            } else {
-                sent_count++;
-            }
-            
-            // Adaptive pacing based on pass
-            if (pass == 1) {
-                // First pass: faster sweep
-                if (i % 50 == 0) usleep(10000); // 10ms every 50 packets
-                else usleep(500); // 0.5ms between packets
-            } else {
-                // Second pass: slower, more reliable
-                if (i % 32 == 0) usleep(20000); // 20ms every 32 packets
-                else usleep(1500); // 1.5ms between packets
-            }
-        }
-        
-        LOGD("Sweep pass %d complete: sent %d packets, %d errors", 
-             pass, sent_count, error_count);
-        return sent_count;
-    };
+    // Build ARP request from the compile-time template; only the target
+    // address changes between sends
+    char base_ip[20];
+    snprintf(base_ip, sizeof(base_ip), "%s.0", subnet_prefix);
+    struct in_addr base_addr, our_addr;
+    if (inet_aton(base_ip, &base_addr) == 0 || inet_aton(our_ip, &our_addr) == 0) {
+        LOGE("Invalid subnet %s", subnet);
+        packet_io_close(own_io);
+        return {};
+    }
+
+    scan_state scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.io = io;
+    scan.observer = g_scan_observer;
+    scan.observer_ctx = g_scan_observer_ctx;
+    scan.base_host = ntohl(base_addr.s_addr) & 0xFFFFFF00u;
+
+    static const uint8_t kZeroMac[ETH_ALEN] = {0};
+    scan.sweep_pkt = kArpRequestTemplate;
+    arp_frame_patch(&scan.sweep_pkt, our_mac, our_addr.s_addr, kZeroMac, 0);
+    memset(scan.sweep_pkt.eth_dst, 0xff, ETH_ALEN);
 
-    // Execute multi-pass scan
+    // Multi-pass scan: a fast sweep, a thorough one, and for longer
+    // timeouts a third for non-responders, each followed by a wait
     int total_timeout = timeout_seconds;
     int pass1_wait = total_timeout / 3;
     int pass2_wait = total_timeout / 3;
@@ -314,34 +359,39 @@ std::vector<std::string> network_scan(const char *interface,
     if (pass2_wait < 1) pass2_wait = 1;
     if (final_wait < 1) final_wait = 1;
 
-    // Pass 1: Fast sweep
-    run_sweep(1);
-    LOGD("Waiting %ds after pass 1", pass1_wait);
-    sleep(pass1_wait);
+    scan.last_pass = timeout_seconds >= 10 ? 3 : 2;
+    scan.wait_ms[0] = pass1_wait * 1000;
+    scan.wait_ms[1] = scan.last_pass == 2 ? (pass2_wait + final_wait) * 1000 : pass2_wait * 1000;
+    scan.wait_ms[2] = final_wait * 1000;
 
-    // Pass 2: Thorough sweep
-    run_sweep(2);
-    LOGD("Waiting %ds after pass 2", pass2_wait);
-    sleep(pass2_wait);
-
-    // Optional Pass 3 for longer timeouts: Target non-responders
-    if (timeout_seconds >= 10) {
-        LOGD("Running targeted pass 3 for non-responders");
-        run_sweep(3);
-        LOGD("Final wait %ds", final_wait);
-        sleep(final_wait);
-    } else {
-        sleep(final_wait);
+    // Sweeps, waits and capture all run on this thread until the last
+    // wait ends or network_scan_cleanup stops the reactor
+    Reactor *reactor = reactor_create();
+    if (!reactor) {
+        packet_io_close(own_io);
+        return {};
     }
-
-    // Stop capture and cleanup
-    g_stop_capture = true;
-    if (capture_thread.joinable()) capture_thread.join();
-    close(sock);
+    {
+        HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
+        g_scan_reactor = reactor;
+        if (g_stop_capture) reactor_stop(reactor);  // Cleaned up while setting up
+    }
+    scan.reactor = reactor;
+    if (packet_io_start(io, reactor, on_arp_reply, &scan)) {
+        start_sweep(&scan, 1);
+        reactor_run(reactor);
+        packet_io_stop(io);
+    }
+    {
+        HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
+        g_scan_reactor = nullptr;
+    }
+    reactor_destroy(reactor);
+    packet_io_close(own_io);
 
     std::vector<std::string> results;
     {
-        std::lock_guard<std::mutex> lock(g_devices_mutex);
+        HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
         results = g_discovered_devices;
         
         // Log response statistics
@@ -354,6 +404,19 @@ std::vector<std::string> network_scan(const char *interface,
     return results;
 }
 
+void network_scan_set_packet_io(PacketIo *io) {
+    g_scan_packet_io = io;
+}
+
+void network_scan_set_observer(NetworkScanObserver observer, void *ctx) {
+    g_scan_observer = observer;
+    g_scan_observer_ctx = ctx;
+}
+
 void network_scan_cleanup() {
+    HarpyTraceLock lock(g_devices_mutex, "g_devices_mutex");
     g_stop_capture = true;
+    if (g_scan_reactor) {
+        reactor_stop(g_scan_reactor);
+    }
 }
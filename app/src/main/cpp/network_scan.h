@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 
+struct PacketIo;
+
 /**
  * Initialize network scan operations
  */
@@ -16,6 +18,27 @@ std::vector<std::string> network_scan(const char *interface,
                                       const char *subnet,
                                       int timeout_seconds);
 
+/**
+ * Sweep and capture through io, a FRAMES backend such as a loopback
+ * answered by a simulated LAN, instead of a raw socket on the interface
+ * (nullptr for the socket). The interface still gives our own addresses.
+ * Stays owned by the caller. Takes effect on the next scan.
+ */
+void network_scan_set_packet_io(PacketIo *io);
+
+/**
+ * Called on the scanning thread the first time each device answers
+ * @param ip Dotted quad
+ * @param mac Lowercase aa:bb:cc:dd:ee:ff
+ */
+typedef void (*NetworkScanObserver)(void *ctx, const char *ip, const char *mac);
+
+/**
+ * Report devices as they are found, e.g. to time how complete a scan is
+ * (nullptr for none). Takes effect on the next scan.
+ */
+void network_scan_set_observer(NetworkScanObserver observer, void *ctx);
+
 /**
  * Cleanup network scan operations
  */
@@ -0,0 +1,170 @@
+// End-to-end scanner benchmark against a simulated LAN.
+//
+// Scans every /24 holding a population of virtual hosts, one network_scan
+// call per /24 as the app does, and reports how complete the scan is
+// against time: the cumulative share of hosts found at regular steps, and
+// when 50, 90, 99 and 100% were reached.
+//
+// By default the simulated LAN runs in-process, wired to the scanner by a
+// pair of loopback backends, so no privileges are needed and the latency,
+// jitter, loss and rate limit arguments configure it. Given an interface,
+// the scanner sweeps it with a raw socket instead, and harpy_lan_sim
+// answers on the far side of a veth pair, configured on its own command
+// line:
+//
+//   ip netns add lan && ip link add veth0 type veth peer name veth1
+//   ip link set veth1 netns lan
+//   ip addr add 10.77.0.1/16 dev veth0 && ip link set veth0 up
+//   ip netns exec lan ip link set veth1 up
+//   ip netns exec lan harpy_lan_sim veth1 10.77.1.1 5000 2 1 0.5 20000 &
+//   harpy_scan_bench 5000 2 0 0 0 0 veth0 10.77.1.1
+//
+// Usage: harpy_scan_bench [hosts] [timeout_s] [latency_ms] [jitter_ms] [loss_pct] [rate_pps] [interface first_ip]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include "harpy_metrics.h"
+#include "lan_sim.h"
+#include "network_scan.h"
+#include "packet_io.h"
+#include "reactor.h"
+
+static const size_t kMaxPacket = 1500;
+static const int kTimelineSteps = 20;
+
+// Two loopback backends handing each other what they send
+struct loopback_wire {
+    PacketIo *scanner;
+    PacketIo *lan;
+};
+
+static void to_lan(void *ctx, PacketIo * /*io*/, const Packet *batch, int count) {
+    loopback_wire *wire = (loopback_wire*)ctx;
+    for (int i = 0; i < count; i++) packet_io_inject(wire->lan, batch[i].data, batch[i].len, nullptr);
+}
+
+static void to_scanner(void *ctx, PacketIo * /*io*/, const Packet *batch, int count) {
+    loopback_wire *wire = (loopback_wire*)ctx;
+    for (int i = 0; i < count; i++) packet_io_inject(wire->scanner, batch[i].data, batch[i].len, nullptr);
+}
+
+struct scan_timeline {
+    std::chrono::steady_clock::time_point start;
+    std::vector<double> found_s;    // When each host was first found
+    std::set<std::string> seen;     // Late replies can reach the scan of the next /24
+};
+
+static void on_found(void *ctx, const char *ip, const char * /*mac*/) {
+    scan_timeline *timeline = (scan_timeline*)ctx;
+    if (!timeline->seen.insert(ip).second) return;
+    timeline->found_s.push_back(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - timeline->start).count());
+}
+
+static void print_milestone(const scan_timeline& timeline, uint32_t hosts, int percent) {
+    size_t needed = ((size_t)hosts * percent + 99) / 100;
+    if (needed == 0 || timeline.found_s.size() < needed) {
+        printf("  %3d%%  not reached\n", percent);
+    } else {
+        printf("  %3d%%  %8.2f s\n", percent, timeline.found_s[needed - 1]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t hosts = (uint32_t)(argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000);
+    int timeout = argc > 2 ? atoi(argv[2]) : 2;
+    LanSimConfig config;
+    config.hosts = hosts ? hosts : 1000;
+    config.latency_us = (int)(argc > 3 ? atof(argv[3]) * 1000 : 0);
+    config.jitter_us = (int)(argc > 4 ? atof(argv[4]) * 1000 : 0);
+    config.loss = argc > 5 ? atof(argv[5]) / 100.0 : 0;
+    config.rate_pps = (uint32_t)(argc > 6 ? strtoul(argv[6], nullptr, 10) : 0);
+    config.seed = 1;
+    const char *interface = argc > 8 ? argv[7] : nullptr;
+    struct in_addr first;
+    inet_aton(interface ? argv[8] : "10.77.1.1", &first);
+    config.first_ip = first.s_addr;
+
+    // Also gives the /24s the population spans when the LAN is elsewhere
+    LanSim *sim = lan_sim_create(config);
+    if (!sim) return 1;
+    uint32_t first_block = ntohl(config.first_ip) >> 8;
+    uint32_t last_block = ntohl(lan_sim_last_ip(sim)) >> 8;
+
+    loopback_wire wire = {nullptr, nullptr};
+    Reactor *lan_reactor = nullptr;
+    std::thread lan_thread;
+    if (!interface) {
+        wire.scanner = packet_io_open_loopback(PacketLayer::FRAMES, kMaxPacket, to_lan, &wire);
+        wire.lan = packet_io_open_loopback(PacketLayer::FRAMES, kMaxPacket, to_scanner, &wire);
+        lan_reactor = reactor_create();
+        if (!wire.scanner || !wire.lan || !lan_reactor || !lan_sim_start(sim, wire.lan, lan_reactor)) {
+            fprintf(stderr, "Failed to start the simulated LAN\n");
+            return 1;
+        }
+        lan_thread = std::thread(reactor_run, lan_reactor);
+        network_scan_set_packet_io(wire.scanner);
+        interface = "lo";
+    }
+
+    printf("Scanning %u hosts in %u /24s, %d s each, on %s\n", config.hosts,
+           last_block - first_block + 1, timeout, wire.scanner ? "a loopback LAN" : interface);
+    scan_timeline timeline;
+    network_scan_set_observer(on_found, &timeline);
+    timeline.start = std::chrono::steady_clock::now();
+    for (uint32_t block = first_block; block <= last_block; block++) {
+        uint32_t base = htonl(block << 8);
+        char subnet[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &base, subnet, sizeof(subnet));
+        network_scan(interface, subnet, timeout);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeline.start).count();
+    network_scan_set_observer(nullptr, nullptr);
+    network_scan_set_packet_io(nullptr);
+
+    if (lan_reactor) {
+        reactor_stop(lan_reactor);
+        lan_thread.join();
+        lan_sim_stop(sim);
+        reactor_destroy(lan_reactor);
+    }
+
+    printf("%10s %10s %8s\n", "time_s", "found", "percent");
+    for (int step = 1; step <= kTimelineSteps; step++) {
+        double t = elapsed * step / kTimelineSteps;
+        size_t found = std::upper_bound(timeline.found_s.begin(), timeline.found_s.end(), t) - timeline.found_s.begin();
+        printf("%10.2f %10zu %7.1f%%\n", t, found, 100.0 * found / config.hosts);
+    }
+    printf("Time to find:\n");
+    print_milestone(timeline, config.hosts, 50);
+    print_milestone(timeline, config.hosts, 90);
+    print_milestone(timeline, config.hosts, 99);
+    print_milestone(timeline, config.hosts, 100);
+    printf("Found %zu of %u hosts in %.2f s\n", timeline.found_s.size(), config.hosts, elapsed);
+    HarpyLatencySummary reply = harpy_metrics_snapshot().latencies[(size_t)HarpyHistogram::SCAN_REPLY];
+    printf("Reply latency over %llu replies: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           (unsigned long long)reply.count, reply.p50_ns / 1e6, reply.p99_ns / 1e6, reply.max_ns / 1e6);
+
+    if (wire.scanner) {
+        LanSimStats stats = lan_sim_stats(sim);
+        PacketIoStats scanner = packet_io_stats(wire.scanner);
+        printf("Scanner sent %llu requests, received %llu replies\n",
+               (unsigned long long)scanner.sent, (unsigned long long)scanner.received);
+        printf("LAN saw %llu requests: %llu replies, %llu lost, %llu rate limited, %llu unknown\n",
+               (unsigned long long)stats.requests, (unsigned long long)stats.replies,
+               (unsigned long long)stats.lost, (unsigned long long)stats.rate_limited,
+               (unsigned long long)stats.unknown);
+        packet_io_close(wire.scanner);
+        packet_io_close(wire.lan);
+    }
+    lan_sim_destroy(sim);
+    return 0;
+}
@@ -0,0 +1,566 @@
+#include "packet_capture.h"
+#include "harpy_log.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/if_packet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_TAG "PacketCapture"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+std::atomic<bool> g_packet_capture_enabled{false};
+
+// pcapng blocks (https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html),
+// written in host byte order as the section header allows
+static const uint32_t kSectionHeaderBlock = 0x0A0D0D0A;
+static const uint32_t kByteOrderMagic = 0x1A2B3C4D;
+static const uint32_t kInterfaceBlock = 1;
+static const uint32_t kEnhancedPacketBlock = 6;
+static const uint16_t kLinktypeEthernet = 1;
+static const uint16_t kOptionEpbFlags = 2;
+static const uint32_t kFlagsInbound = 1;
+static const uint32_t kFlagsOutbound = 2;
+// Type, length, interface, timestamp, captured and original length; the
+// flags option and end of options; the trailing length
+static const size_t kEpbOverhead = 28 + 12 + 4;
+static const size_t kSectionHeaderSize = 28;
+static const size_t kInterfaceBlockSize = 20;
+
+static const size_t kMinSnaplen = 64;
+static const size_t kMaxSnaplen = 65535;
+static const size_t kMinBlocksPerRing = 64;
+// Ethernet, IPv4 and UDP headers put in front of a datagram
+static const size_t kDatagramHeaderSize = 14 + 20 + 8;
+static const size_t kMaxGather = 2048;
+
+static const uint16_t kEthertypeIpv4 = 0x0800;
+static const uint16_t kEthertypeArp = 0x0806;
+static const uint16_t kEthertypeVlan = 0x8100;
+
+// One filter primitive; a packet is kept when every term matches
+enum class filter_kind {
+    ARP,
+    IP,
+    UDP,
+    TCP,
+    ICMP,
+    HOST,
+    PORT
+};
+
+struct filter_term {
+    filter_kind kind;
+    bool negate;
+    uint32_t value;     // HOST: address in network order; PORT: host order
+};
+
+// What the filter looks at, taken from a frame or a datagram's addresses
+struct packet_summary {
+    uint16_t ethertype;
+    uint8_t protocol;   // IPv4 protocol, 0 for none
+    uint32_t src;       // IPv4 or ARP sender and target addresses, network order
+    uint32_t dst;
+    bool has_ports;
+    uint16_t sport;
+    uint16_t dport;
+};
+
+// Enhanced Packet Blocks back to back from tail. Once the writer wraps,
+// the blocks run from tail to end and continue from the start to head;
+// the writer drops whole blocks at tail to make room.
+struct capture_ring {
+    std::mutex mutex;                   // Writer and dump; uncontended otherwise
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t end = 0;
+    bool wrapped = false;
+    uint64_t captured = 0;
+    uint64_t overwritten = 0;
+    std::atomic<bool> retired{false};   // The thread has exited
+};
+
+// Configuration is changed with every ring locked, so a writer holding
+// its own ring's lock sees it consistent
+struct capture_registry {
+    std::mutex mutex;
+    std::vector<capture_ring*> rings;
+    size_t ring_bytes = kCaptureDefaultRingBytes;
+    size_t snaplen = kCaptureDefaultSnaplen;
+    std::vector<filter_term> filter;
+    std::vector<uint8_t> header;        // Section header and interface blocks of every dump
+};
+
+// Never freed: threads can still exit and retire their rings after the
+// statics are gone
+static capture_registry& registry() {
+    static capture_registry *captures = new capture_registry();
+    return *captures;
+}
+
+struct ring_owner {
+    capture_ring *ring = nullptr;
+
+    ~ring_owner() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+static thread_local ring_owner t_capture_ring;
+
+static size_t pad4(size_t len) {
+    return (len + 3) & ~(size_t)3;
+}
+
+static void put32(uint8_t *out, uint32_t value) {
+    memcpy(out, &value, 4);
+}
+
+static uint32_t get32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return value;
+}
+
+// Resize and empty a ring; call with its lock held
+static void reset_ring(capture_ring *ring, size_t size) {
+    if (ring->size != size) {
+        delete[] ring->data;
+        ring->data = new uint8_t[size];
+        ring->size = size;
+    }
+    ring->head = ring->tail = ring->end = 0;
+    ring->wrapped = false;
+    ring->captured = ring->overwritten = 0;
+}
+
+static capture_ring *thread_ring() {
+    if (t_capture_ring.ring) return t_capture_ring.ring;
+    capture_ring *ring = new capture_ring();
+    capture_registry& captures = registry();
+    {
+        std::lock_guard<std::mutex> lock(captures.mutex);
+        reset_ring(ring, captures.ring_bytes);
+        captures.rings.push_back(ring);
+    }
+    t_capture_ring.ring = ring;
+    return ring;
+}
+
+// Room for a block of len bytes at head, dropping the oldest blocks as
+// needed; call with the ring's lock held
+static uint8_t *reserve(capture_ring *ring, size_t len) {
+    while (true) {
+        if (!ring->wrapped) {
+            if (ring->head + len <= ring->size) return ring->data + ring->head;
+            ring->end = ring->head;
+            ring->head = 0;
+            ring->wrapped = true;
+        }
+        while (ring->head + len > ring->tail) {
+            if (ring->tail >= ring->end) {
+                // Everything before the wrap is gone
+                ring->tail = 0;
+                ring->wrapped = false;
+                break;
+            }
+            ring->tail += get32(ring->data + ring->tail + 4);
+            ring->overwritten++;
+        }
+        if (ring->wrapped) return ring->data + ring->head;
+    }
+}
+
+static bool term_matches(const filter_term& term, const packet_summary& packet) {
+    bool ip = packet.ethertype == kEthertypeIpv4;
+    switch (term.kind) {
+        case filter_kind::ARP: return packet.ethertype == kEthertypeArp;
+        case filter_kind::IP: return ip;
+        case filter_kind::UDP: return ip && packet.protocol == IPPROTO_UDP;
+        case filter_kind::TCP: return ip && packet.protocol == IPPROTO_TCP;
+        case filter_kind::ICMP: return ip && packet.protocol == IPPROTO_ICMP;
+        case filter_kind::HOST:
+            return (ip || packet.ethertype == kEthertypeArp) && (packet.src == term.value || packet.dst == term.value);
+        case filter_kind::PORT:
+            return packet.has_ports && (packet.sport == term.value || packet.dport == term.value);
+    }
+    return false;
+}
+
+static bool filter_matches(const std::vector<filter_term>& filter, const packet_summary& packet) {
+    for (const filter_term& term : filter) {
+        if (term_matches(term, packet) == term.negate) return false;
+    }
+    return true;
+}
+
+static void summarize_frame(const uint8_t *frame, size_t len, packet_summary *packet) {
+    memset(packet, 0, sizeof(*packet));
+    if (len < 14) return;
+    size_t offset = 14;
+    uint16_t ethertype = (uint16_t)(frame[12] << 8 | frame[13]);
+    if (ethertype == kEthertypeVlan && len >= 18) {
+        ethertype = (uint16_t)(frame[16] << 8 | frame[17]);
+        offset = 18;
+    }
+    packet->ethertype = ethertype;
+    const uint8_t *l3 = frame + offset;
+    size_t l3_len = len - offset;
+    if (ethertype == kEthertypeArp && l3_len >= 28) {
+        memcpy(&packet->src, l3 + 14, 4);
+        memcpy(&packet->dst, l3 + 24, 4);
+    } else if (ethertype == kEthertypeIpv4 && l3_len >= 20) {
+        size_t ihl = (size_t)(l3[0] & 0x0f) * 4;
+        packet->protocol = l3[9];
+        memcpy(&packet->src, l3 + 12, 4);
+        memcpy(&packet->dst, l3 + 16, 4);
+        if ((packet->protocol == IPPROTO_UDP || packet->protocol == IPPROTO_TCP) && l3_len >= ihl + 4) {
+            packet->has_ports = true;
+            packet->sport = (uint16_t)(l3[ihl] << 8 | l3[ihl + 1]);
+            packet->dport = (uint16_t)(l3[ihl + 2] << 8 | l3[ihl + 3]);
+        }
+    }
+}
+
+// Append one block to the calling thread's ring: prefix (a built header,
+// or nothing) followed by data
+static void record_packet(CaptureDirection direction, const packet_summary& summary,
+                          const uint8_t *prefix, size_t prefix_len, const uint8_t *data, size_t len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+
+    capture_ring *ring = thread_ring();
+    capture_registry& captures = registry();
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    if (!captures.filter.empty() && !filter_matches(captures.filter, summary)) return;
+
+    size_t original = prefix_len + len;
+    size_t captured = std::min(original, captures.snaplen);
+    size_t block_len = kEpbOverhead + pad4(captured);
+    uint8_t *out = reserve(ring, block_len);
+    put32(out, kEnhancedPacketBlock);
+    put32(out + 4, (uint32_t)block_len);
+    put32(out + 8, 0);                              // Interface
+    put32(out + 12, (uint32_t)(now_us >> 32));
+    put32(out + 16, (uint32_t)now_us);
+    put32(out + 20, (uint32_t)captured);
+    put32(out + 24, (uint32_t)original);
+    uint8_t *body = out + 28;
+    size_t from_prefix = std::min(prefix_len, captured);
+    memcpy(body, prefix, from_prefix);
+    memcpy(body + from_prefix, data, captured - from_prefix);
+    memset(body + captured, 0, pad4(captured) - captured);
+    uint8_t *options = body + pad4(captured);
+    uint16_t option[2] = {kOptionEpbFlags, 4};
+    memcpy(options, option, 4);
+    put32(options + 4, direction == CaptureDirection::RECEIVED ? kFlagsInbound : kFlagsOutbound);
+    put32(options + 8, 0);                          // End of options
+    put32(options + 12, (uint32_t)block_len);
+
+    ring->head += block_len;
+    ring->captured++;
+}
+
+void packet_capture_record_frame(CaptureDirection direction, const uint8_t *frame, size_t len) {
+    packet_summary summary;
+    summarize_frame(frame, len, &summary);
+    record_packet(direction, summary, nullptr, 0, frame, len);
+}
+
+static uint16_t ipv4_checksum(const uint8_t *header, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+void packet_capture_record_datagram(CaptureDirection direction, const uint8_t *payload, size_t len,
+                                    const struct sockaddr_in *local, const struct sockaddr_in *peer) {
+    static const struct sockaddr_in kUnknown = {};
+    const struct sockaddr_in *src = direction == CaptureDirection::RECEIVED ? peer : local;
+    const struct sockaddr_in *dst = direction == CaptureDirection::RECEIVED ? local : peer;
+    if (!src) src = &kUnknown;
+    if (!dst) dst = &kUnknown;
+
+    // Ethernet, IPv4 and UDP headers between the socket and its peer
+    uint8_t header[kDatagramHeaderSize];
+    memset(header, 0, 12);
+    header[12] = kEthertypeIpv4 >> 8;
+    header[13] = kEthertypeIpv4 & 0xff;
+    uint8_t *ip = header + 14;
+    size_t ip_len = 20 + 8 + len;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[2] = (uint8_t)(ip_len >> 8);
+    ip[3] = (uint8_t)ip_len;
+    ip[6] = 0x40;           // Don't fragment
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, &src->sin_addr.s_addr, 4);
+    memcpy(ip + 16, &dst->sin_addr.s_addr, 4);
+    uint16_t checksum = ipv4_checksum(ip, 20);
+    ip[10] = (uint8_t)(checksum >> 8);
+    ip[11] = (uint8_t)checksum;
+    uint8_t *udp = ip + 20;
+    memcpy(udp, &src->sin_port, 2);
+    memcpy(udp + 2, &dst->sin_port, 2);
+    udp[4] = (uint8_t)((8 + len) >> 8);
+    udp[5] = (uint8_t)(8 + len);
+    udp[6] = 0;             // No checksum
+    udp[7] = 0;
+
+    packet_summary summary;
+    memset(&summary, 0, sizeof(summary));
+    summary.ethertype = kEthertypeIpv4;
+    summary.protocol = IPPROTO_UDP;
+    summary.src = src->sin_addr.s_addr;
+    summary.dst = dst->sin_addr.s_addr;
+    summary.has_ports = true;
+    summary.sport = ntohs(src->sin_port);
+    summary.dport = ntohs(dst->sin_port);
+    record_packet(direction, summary, header, sizeof(header), payload, len);
+}
+
+void packet_capture_record_messages(CaptureDirection direction, const struct mmsghdr *msgs, int count,
+                                    const struct sockaddr_in *local) {
+    uint8_t gathered[kMaxGather];
+    for (int i = 0; i < count; i++) {
+        const struct msghdr& msg = msgs[i].msg_hdr;
+        if (!msg.msg_name || msg.msg_iovlen == 0) continue;
+        const uint8_t *data = (const uint8_t*)msg.msg_iov[0].iov_base;
+        size_t len = msg.msg_iov[0].iov_len;
+        if (msg.msg_iovlen > 1) {
+            len = 0;
+            for (size_t v = 0; v < msg.msg_iovlen && len < sizeof(gathered); v++) {
+                size_t take = std::min(msg.msg_iov[v].iov_len, sizeof(gathered) - len);
+                memcpy(gathered + len, msg.msg_iov[v].iov_base, take);
+                len += take;
+            }
+            data = gathered;
+        }
+        sa_family_t family = ((const struct sockaddr*)msg.msg_name)->sa_family;
+        if (family == AF_PACKET) {
+            packet_capture_record_frame(direction, data, len);
+        } else if (family == AF_INET) {
+            packet_capture_record_datagram(direction, data, len, local, (const struct sockaddr_in*)msg.msg_name);
+        }
+    }
+}
+
+void packet_capture_record_socket(CaptureDirection direction, int fd, const uint8_t *payload, size_t len,
+                                  const struct sockaddr_in *peer) {
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    if (getsockname(fd, (struct sockaddr*)&local, &local_len) < 0 || local.sin_family != AF_INET) {
+        memset(&local, 0, sizeof(local));
+    }
+    packet_capture_record_datagram(direction, payload, len, &local, peer);
+}
+
+static bool parse_filter(const std::string& text, std::vector<filter_term> *terms) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t start = text.find_first_not_of(" \t", pos);
+        if (start == std::string::npos) break;
+        size_t end = text.find_first_of(" \t", start);
+        if (end == std::string::npos) end = text.size();
+        words.push_back(text.substr(start, end - start));
+        pos = end;
+    }
+
+    terms->clear();
+    for (size_t i = 0; i < words.size(); i++) {
+        if (!terms->empty()) {
+            if (words[i] != "and" || ++i == words.size()) return false;
+        }
+        filter_term term = {filter_kind::IP, false, 0};
+        if (words[i] == "not") {
+            term.negate = true;
+            if (++i == words.size()) return false;
+        }
+        const std::string& primitive = words[i];
+        if (primitive == "arp") {
+            term.kind = filter_kind::ARP;
+        } else if (primitive == "ip") {
+            term.kind = filter_kind::IP;
+        } else if (primitive == "udp") {
+            term.kind = filter_kind::UDP;
+        } else if (primitive == "tcp") {
+            term.kind = filter_kind::TCP;
+        } else if (primitive == "icmp") {
+            term.kind = filter_kind::ICMP;
+        } else if (primitive == "host" && i + 1 < words.size()) {
+            struct in_addr addr;
+            if (inet_pton(AF_INET, words[++i].c_str(), &addr) != 1) return false;
+            term.kind = filter_kind::HOST;
+            term.value = addr.s_addr;
+        } else if (primitive == "port" && i + 1 < words.size()) {
+            char *end = nullptr;
+            unsigned long port = strtoul(words[++i].c_str(), &end, 10);
+            if (*end != '\0' || port > 65535) return false;
+            term.kind = filter_kind::PORT;
+            term.value = (uint32_t)port;
+        } else {
+            return false;
+        }
+        terms->push_back(term);
+    }
+    return true;
+}
+
+// Section header and one Ethernet interface, written ahead of the rings
+static void build_header(capture_registry *captures) {
+    captures->header.assign(kSectionHeaderSize + kInterfaceBlockSize, 0);
+    uint8_t *shb = captures->header.data();
+    put32(shb, kSectionHeaderBlock);
+    put32(shb + 4, kSectionHeaderSize);
+    put32(shb + 8, kByteOrderMagic);
+    uint16_t version[2] = {1, 0};
+    memcpy(shb + 12, version, 4);
+    int64_t section_length = -1;                    // Not given
+    memcpy(shb + 16, &section_length, 8);
+    put32(shb + 24, kSectionHeaderSize);
+
+    uint8_t *idb = shb + kSectionHeaderSize;
+    put32(idb, kInterfaceBlock);
+    put32(idb + 4, kInterfaceBlockSize);
+    uint16_t link[2] = {kLinktypeEthernet, 0};
+    memcpy(idb + 8, link, 4);
+    put32(idb + 12, (uint32_t)captures->snaplen);
+    put32(idb + 16, kInterfaceBlockSize);
+}
+
+bool packet_capture_start(const PacketCaptureConfig& config) {
+    std::vector<filter_term> filter;
+    if (!parse_filter(config.filter, &filter)) {
+        LOGE("Invalid capture filter: %s", config.filter.c_str());
+        return false;
+    }
+    size_t snaplen = std::max(kMinSnaplen, std::min(config.snaplen, kMaxSnaplen));
+    size_t ring_bytes = std::max(config.ring_bytes, kMinBlocksPerRing * (kEpbOverhead + pad4(snaplen)));
+
+    capture_registry& captures = registry();
+    std::lock_guard<std::mutex> lock(captures.mutex);
+    std::vector<capture_ring*> live;
+    for (capture_ring *ring : captures.rings) {
+        if (ring->retired.load(std::memory_order_acquire)) {
+            delete[] ring->data;
+            delete ring;
+        } else {
+            live.push_back(ring);
+        }
+    }
+    captures.rings.swap(live);
+    for (capture_ring *ring : captures.rings) ring->mutex.lock();
+    captures.snaplen = snaplen;
+    captures.ring_bytes = ring_bytes;
+    captures.filter.swap(filter);
+    for (capture_ring *ring : captures.rings) {
+        reset_ring(ring, ring_bytes);
+        ring->mutex.unlock();
+    }
+    build_header(&captures);
+    g_packet_capture_enabled.store(true, std::memory_order_relaxed);
+    LOGD("Capturing %zu bytes per packet into %zu byte rings", snaplen, ring_bytes);
+    return true;
+}
+
+void packet_capture_stop() {
+    g_packet_capture_enabled.store(false, std::memory_order_relaxed);
+}
+
+// Write every iovec, resuming after short writes
+static bool writev_all(int fd, struct iovec *iovs, size_t count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iovs, (int)std::min(count, (size_t)IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (count > 0 && (size_t)n >= iovs->iov_len) {
+            n -= (ssize_t)iovs->iov_len;
+            iovs++;
+            count--;
+        }
+        if (count > 0) {
+            iovs->iov_base = (uint8_t*)iovs->iov_base + n;
+            iovs->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+static long count_blocks(const std::vector<uint8_t>& blocks) {
+    long count = 0;
+    for (size_t offset = 0; offset < blocks.size(); offset += get32(blocks.data() + offset + 4)) {
+        count++;
+    }
+    return count;
+}
+
+long packet_capture_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGE("Cannot write capture to %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    capture_registry& captures = registry();
+    std::lock_guard<std::mutex> lock(captures.mutex);
+    if (captures.header.empty()) build_header(&captures);
+
+    // Copied out so no packet thread waits on the file
+    std::vector<std::vector<uint8_t>> snapshots(captures.rings.size());
+    for (size_t r = 0; r < captures.rings.size(); r++) {
+        capture_ring *ring = captures.rings[r];
+        std::lock_guard<std::mutex> ring_lock(ring->mutex);
+        std::vector<uint8_t>& snapshot = snapshots[r];
+        if (ring->wrapped) {
+            snapshot.assign(ring->data + ring->tail, ring->data + ring->end);
+            snapshot.insert(snapshot.end(), ring->data, ring->data + ring->head);
+        } else {
+            snapshot.assign(ring->data + ring->tail, ring->data + ring->head);
+        }
+    }
+
+    std::vector<struct iovec> iovs;
+    iovs.push_back({captures.header.data(), captures.header.size()});
+    long packets = 0;
+    for (std::vector<uint8_t>& snapshot : snapshots) {
+        if (snapshot.empty()) continue;
+        iovs.push_back({snapshot.data(), snapshot.size()});
+        packets += count_blocks(snapshot);
+    }
+    bool ok = writev_all(fd, iovs.data(), iovs.size());
+    if (close(fd) < 0) ok = false;
+    if (!ok) {
+        LOGE("Failed to write capture to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return packets;
+}
+
+void packet_capture_counts(uint64_t *captured, uint64_t *overwritten) {
+    *captured = 0;
+    *overwritten = 0;
+    capture_registry& captures = registry();
+    std::lock_guard<std::mutex> lock(captures.mutex);
+    for (capture_ring *ring : captures.rings) {
+        std::lock_guard<std::mutex> ring_lock(ring->mutex);
+        *captured += ring->captured;
+        *overwritten += ring->overwritten;
+    }
+}
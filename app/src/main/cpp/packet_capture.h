@@ -0,0 +1,112 @@
+#ifndef PACKET_CAPTURE_H
+#define PACKET_CAPTURE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <netinet/in.h>
+
+struct mmsghdr;
+
+/**
+ * Flight recorder of the packets the native layer sends and receives on
+ * its own raw and UDP sockets, for field diagnostics without tcpdump.
+ * Each thread appends to a ring of preformatted pcapng Enhanced Packet
+ * Blocks, oldest overwritten first, so memory stays at ring_bytes per
+ * thread that has captured. A dump copies the rings and writes them as
+ * one pcapng file with writev, packets in per-thread order.
+ *
+ * Everything is recorded as Ethernet. UDP sockets carry no link or IP
+ * header, so their datagrams get Ethernet, IPv4 and UDP headers built
+ * from the socket's addresses, as a PCAP backend records replies.
+ *
+ * While capture is off every hook costs one relaxed load.
+ */
+enum class CaptureDirection : uint8_t {
+    RECEIVED,
+    SENT
+};
+
+static const size_t kCaptureDefaultRingBytes = 1 << 20;
+static const size_t kCaptureDefaultSnaplen = 512;
+
+struct PacketCaptureConfig {
+    size_t ring_bytes;          // Per capturing thread
+    size_t snaplen;             // Bytes kept of each packet, link or IP header included
+    std::string filter;         // See packet_capture_start; empty keeps everything
+};
+
+extern std::atomic<bool> g_packet_capture_enabled;
+
+inline bool packet_capture_on() {
+    return g_packet_capture_enabled.load(std::memory_order_relaxed);
+}
+
+void packet_capture_record_frame(CaptureDirection direction, const uint8_t *frame, size_t len);
+void packet_capture_record_datagram(CaptureDirection direction, const uint8_t *payload, size_t len,
+                                    const struct sockaddr_in *local, const struct sockaddr_in *peer);
+void packet_capture_record_messages(CaptureDirection direction, const struct mmsghdr *msgs, int count,
+                                    const struct sockaddr_in *local);
+void packet_capture_record_socket(CaptureDirection direction, int fd, const uint8_t *payload, size_t len,
+                                  const struct sockaddr_in *peer);
+
+/**
+ * An Ethernet frame from or to a raw socket
+ */
+inline void packet_capture_frame(CaptureDirection direction, const uint8_t *frame, size_t len) {
+    if (packet_capture_on()) packet_capture_record_frame(direction, frame, len);
+}
+
+/**
+ * A UDP payload between our socket at local and peer
+ */
+inline void packet_capture_datagram(CaptureDirection direction, const uint8_t *payload, size_t len,
+                                    const struct sockaddr_in *local, const struct sockaddr_in *peer) {
+    if (packet_capture_on()) packet_capture_record_datagram(direction, payload, len, local, peer);
+}
+
+/**
+ * Messages of a sendmmsg batch: frames when msg_name is a sockaddr_ll,
+ * else datagrams from local to msg_name
+ */
+inline void packet_capture_messages(CaptureDirection direction, const struct mmsghdr *msgs, int count,
+                                    const struct sockaddr_in *local) {
+    if (packet_capture_on()) packet_capture_record_messages(direction, msgs, count, local);
+}
+
+/**
+ * A UDP payload on fd, whose local address is looked up only while
+ * capturing. For sockets outside the batched paths.
+ */
+inline void packet_capture_socket(CaptureDirection direction, int fd, const uint8_t *payload, size_t len,
+                                  const struct sockaddr_in *peer) {
+    if (packet_capture_on()) packet_capture_record_socket(direction, fd, payload, len, peer);
+}
+
+/**
+ * Drop what was captured and start capturing. The filter takes
+ * pcap-filter primitives joined by "and", each optionally preceded by
+ * "not": arp, ip, udp, tcp, icmp, host <ipv4>, port <n>, for example
+ * "udp and port 53 and not host 192.168.1.1".
+ * @return false if the filter cannot be parsed; capture is unchanged
+ */
+bool packet_capture_start(const PacketCaptureConfig& config);
+
+/**
+ * Stop capturing; what was captured can still be dumped
+ */
+void packet_capture_stop();
+
+/**
+ * Write every ring as a pcapng file
+ * @return Number of packets written, or -1 if path cannot be written
+ */
+long packet_capture_dump(const char *path);
+
+/**
+ * Packets captured and packets overwritten since the last start
+ */
+void packet_capture_counts(uint64_t *captured, uint64_t *overwritten);
+
+#endif // PACKET_CAPTURE_H
@@ -0,0 +1,988 @@
+#include "packet_io.h"
+#include "io_backend.h"
+#include "reactor.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "packet_capture.h"
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <netinet/if_ether.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define LOG_TAG "PacketIo"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Packets per handler call, and batches handled per wakeup before
+// returning to the reactor
+static const int kBatchSize = 32;
+static const int kMaxBatchesPerWakeup = 4;
+// Raw socket buffers with room for a sweep's worth of replies
+static const int kLinkSocketBuffer = 256 * 1024;
+
+// TPACKET_V3 ring: the kernel fills whole blocks and only wakes us when a
+// block is full or has been open for kRingBlockTimeoutMs, so an idle LAN
+// costs at most one wakeup per second instead of one per packet
+static const unsigned kRingBlockSize = 1 << 14;
+static const unsigned kRingBlockCount = 4;
+static const unsigned kRingBlockTimeoutMs = 1000;
+static const unsigned kRingMinFrameSize = 128;
+
+// pcap file format (https://www.tcpdump.org/manpages/pcap-savefile.5.html)
+static const uint32_t kPcapMagicUs = 0xa1b2c3d4;
+static const uint32_t kPcapMagicNs = 0xa1b23c4d;
+static const uint32_t kLinktypeEthernet = 1;
+static const uint32_t kLinktypeRaw = 101;
+static const uint32_t kLinktypeIpv4 = 228;
+static const size_t kPcapHeaderSize = 24;
+static const size_t kPcapRecordHeaderSize = 16;
+static const uint32_t kPcapRecordSnaplen = 65535;
+// Ethernet, IPv4 and UDP headers put in front of a recorded datagram
+static const size_t kDatagramFrameOverhead = 14 + 20 + 8;
+
+struct packet_io_ops {
+    bool (*start)(PacketIo *io);
+    void (*stop)(PacketIo *io);
+    void (*destroy)(PacketIo *io);
+    uint8_t *(*reply_buffer)(PacketIo *io);
+    void (*queue_reply)(PacketIo *io, size_t len, const struct sockaddr_in *dest);
+    bool (*send)(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest);
+};
+
+// Common to every backend; each backend's state derives from it
+struct PacketIo {
+    const packet_io_ops *ops;
+    PacketIoKind kind;
+    PacketLayer layer;
+    int fd;                     // -1 for the in-memory backends
+    size_t max_packet;
+    Reactor *reactor;           // Set while started
+    PacketHandler handler;
+    void *ctx;
+    PacketIoEndHandler on_end;
+    void *end_ctx;
+    bool ended;
+    PacketIoStats stats;
+    Packet batch[kBatchSize];
+};
+
+static void init_io(PacketIo *io, const packet_io_ops *ops, PacketIoKind kind, PacketLayer layer,
+                    int fd, size_t max_packet) {
+    io->ops = ops;
+    io->kind = kind;
+    io->layer = layer;
+    io->fd = fd;
+    io->max_packet = max_packet;
+    io->reactor = nullptr;
+    io->handler = nullptr;
+    io->ctx = nullptr;
+    io->on_end = nullptr;
+    io->end_ctx = nullptr;
+    io->ended = false;
+    memset(&io->stats, 0, sizeof(io->stats));
+}
+
+// Per-backend stats, and the process-wide counters every backend adds to
+static void count_received(PacketIo *io, int n) {
+    io->stats.received += n;
+    harpy_metrics_add(HarpyCounter::PACKETS_RECEIVED, n);
+}
+
+static void count_sent(PacketIo *io, int n) {
+    io->stats.sent += n;
+    harpy_metrics_add(HarpyCounter::PACKETS_SENT, n);
+}
+
+static void count_send_errors(PacketIo *io, int n) {
+    io->stats.send_errors += n;
+    harpy_metrics_add(HarpyCounter::PACKET_SEND_ERRORS, n);
+}
+
+// No more packets will come; tell the owner once
+static void end_of_packets(PacketIo *io) {
+    if (io->ended) return;
+    io->ended = true;
+    if (io->on_end) io->on_end(io->end_ctx);
+}
+
+static void deliver(PacketIo *io, int count) {
+    count_received(io, count);
+    // Datagrams are captured by the socket backend, replayed and
+    // loopback packets never touched a socket
+    if (packet_capture_on() && (io->kind == PacketIoKind::RAW || io->kind == PacketIoKind::RAW_RING)) {
+        for (int i = 0; i < count; i++) {
+            packet_capture_record_frame(CaptureDirection::RECEIVED, io->batch[i].data, io->batch[i].len);
+        }
+    }
+    io->handler(io->ctx, io, io->batch, count);
+}
+
+static int64_t realtime_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void signal_eventfd(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        LOGE("Failed to signal eventfd: %s", strerror(errno));
+    }
+}
+
+static void drain_eventfd(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOGE("Failed to read eventfd: %s", strerror(errno));
+    }
+}
+
+// AF_PACKET and TPACKET_RING
+
+struct link_io : PacketIo {
+    int ifindex;
+    uint8_t *rx;                // recvmmsg buffers, kBatchSize frames of max_packet
+    struct iovec rx_iovs[kBatchSize];
+    struct mmsghdr rx_msgs[kBatchSize];
+    uint8_t *ring;              // TPACKET_RING only
+    unsigned ring_block;        // Next ring block the kernel hands us
+    size_t ring_size;
+    uint8_t *tx;
+    struct sockaddr_ll tx_addrs[kBatchSize];
+    struct iovec tx_iovs[kBatchSize];
+    struct mmsghdr tx_msgs[kBatchSize];
+    int tx_count;
+};
+
+static void link_address(const link_io *link, const uint8_t *frame, struct sockaddr_ll *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sll_family = AF_PACKET;
+    addr->sll_ifindex = link->ifindex;
+    addr->sll_halen = ETH_ALEN;
+    memcpy(addr->sll_addr, frame, ETH_ALEN);  // Ethernet destination
+}
+
+static void flush_frames(link_io *link) {
+    packet_capture_messages(CaptureDirection::SENT, link->tx_msgs, link->tx_count, nullptr);
+    int sent = 0;
+    while (sent < link->tx_count) {
+        int n = sendmmsg(link->fd, link->tx_msgs + sent, link->tx_count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            HARPY_EVENT_STR(ANDROID_LOG_ERROR, 10, "sendmmsg failed after %d/%d frames: %s", strerror(errno),
+                            sent, link->tx_count);
+            count_send_errors(link, link->tx_count - sent);
+            break;
+        }
+        count_sent(link, n);
+        sent += n;
+    }
+    link->tx_count = 0;
+}
+
+static void fail_link(link_io *link, const char *what) {
+    LOGE("%s on raw socket %d, no longer receiving: %s", what, link->fd, strerror(errno));
+    reactor_remove_fd(link->reactor, link->fd);
+    end_of_packets(link);
+}
+
+static void on_link_readable(void *ctx, uint32_t /*events*/) {
+    link_io *link = (link_io*)ctx;
+    for (int round = 0; round < kMaxBatchesPerWakeup; round++) {
+        for (int i = 0; i < kBatchSize; i++) {
+            memset(&link->rx_msgs[i].msg_hdr, 0, sizeof(link->rx_msgs[i].msg_hdr));
+            link->rx_msgs[i].msg_hdr.msg_iov = &link->rx_iovs[i];
+            link->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(link->fd, link->rx_msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) fail_link(link, "recvmmsg error");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            link->batch[i].data = (const uint8_t*)link->rx_iovs[i].iov_base;
+            link->batch[i].len = link->rx_msgs[i].msg_len < link->max_packet ? link->rx_msgs[i].msg_len
+                                                                              : link->max_packet;
+            memset(&link->batch[i].peer, 0, sizeof(link->batch[i].peer));
+            link->batch[i].timestamp_us = 0;
+        }
+        if (n > 0) deliver(link, n);
+        flush_frames(link);
+        if (n < kBatchSize) return;     // Drained
+    }
+}
+
+// Hand every block the kernel has filled to the handler, a batch at a time
+static void on_ring_readable(void *ctx, uint32_t /*events*/) {
+    link_io *link = (link_io*)ctx;
+    while (true) {
+        struct tpacket_block_desc *block =
+            (struct tpacket_block_desc *)(link->ring + link->ring_block * kRingBlockSize);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            return;
+        }
+
+        uint32_t num_pkts = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr *hdr =
+            (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+        int count = 0;
+        for (uint32_t i = 0; i < num_pkts; i++) {
+            Packet *packet = &link->batch[count++];
+            packet->data = (uint8_t *)hdr + hdr->tp_mac;
+            packet->len = hdr->tp_snaplen < link->max_packet ? hdr->tp_snaplen : link->max_packet;
+            memset(&packet->peer, 0, sizeof(packet->peer));
+            packet->timestamp_us = (int64_t)hdr->tp_sec * 1000000 + hdr->tp_nsec / 1000;
+            if (count == kBatchSize) {
+                deliver(link, count);
+                count = 0;
+            }
+            hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+        }
+        if (count > 0) deliver(link, count);
+        flush_frames(link);
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        link->ring_block = (link->ring_block + 1) % kRingBlockCount;
+    }
+}
+
+static bool setup_ring(link_io *link) {
+    int version = TPACKET_V3;
+    if (setsockopt(link->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        return false;
+    }
+
+    unsigned frame_size = kRingMinFrameSize;
+    while (frame_size < TPACKET_ALIGN(TPACKET3_HDRLEN + link->max_packet) && frame_size < kRingBlockSize) {
+        frame_size *= 2;
+    }
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = kRingBlockSize;
+    req.tp_block_nr = kRingBlockCount;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = (kRingBlockSize * kRingBlockCount) / frame_size;
+    req.tp_retire_blk_tov = kRingBlockTimeoutMs;
+    if (setsockopt(link->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        return false;
+    }
+
+    link->ring_size = kRingBlockSize * kRingBlockCount;
+    void *ring = mmap(nullptr, link->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, link->fd, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    link->ring = (uint8_t *)ring;
+    link->ring_block = 0;
+    return true;
+}
+
+static bool link_start(PacketIo *io) {
+    link_io *link = static_cast<link_io*>(io);
+    return reactor_add_fd(io->reactor, io->fd, EPOLLIN, link->ring ? on_ring_readable : on_link_readable, link);
+}
+
+static void link_stop(PacketIo *io) {
+    reactor_remove_fd(io->reactor, io->fd);
+}
+
+static void link_destroy(PacketIo *io) {
+    link_io *link = static_cast<link_io*>(io);
+    if (link->ring) munmap(link->ring, link->ring_size);
+    close(link->fd);
+    delete[] link->rx;
+    delete[] link->tx;
+    delete link;
+}
+
+static uint8_t *link_reply_buffer(PacketIo *io) {
+    link_io *link = static_cast<link_io*>(io);
+    if (link->tx_count == kBatchSize) flush_frames(link);
+    return link->tx + (size_t)link->tx_count * io->max_packet;
+}
+
+static void link_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in * /*dest*/) {
+    link_io *link = static_cast<link_io*>(io);
+    int i = link->tx_count++;
+    link->tx_iovs[i].iov_len = len;
+    link_address(link, (const uint8_t *)link->tx_iovs[i].iov_base, &link->tx_addrs[i]);
+}
+
+static bool link_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in * /*dest*/) {
+    link_io *link = static_cast<link_io*>(io);
+    struct sockaddr_ll addr;
+    link_address(link, data, &addr);
+    packet_capture_frame(CaptureDirection::SENT, data, len);
+    if (sendto(io->fd, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        count_send_errors(io, 1);
+        return false;
+    }
+    count_sent(io, 1);
+    return true;
+}
+
+static const packet_io_ops kLinkOps = {
+    link_start, link_stop, link_destroy, link_reply_buffer, link_queue_reply, link_send
+};
+
+static PacketIo *open_link(PacketIoKind kind, const char *interface, uint16_t protocol, size_t snaplen,
+                           const struct sock_fprog *filter) {
+    int ifindex = if_nametoindex(interface);
+    if (ifindex == 0) {
+        LOGE("Interface %s not found", interface);
+        return nullptr;
+    }
+
+    // Protocol 0 receives nothing until bind, so the filter is in place first
+    int sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOGE("Failed to create raw socket: %s (errno=%d). Root/CAP_NET_RAW required.",
+             strerror(errno), errno);
+        return nullptr;
+    }
+    if (filter && setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(*filter)) < 0) {
+        LOGE("Failed to attach packet filter: %s", strerror(errno));
+        close(sock);
+        return nullptr;
+    }
+    int bufsize = kLinkSocketBuffer;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    link_io *link = new link_io();
+    init_io(link, &kLinkOps, kind, PacketLayer::FRAMES, sock, snaplen);
+    link->ifindex = ifindex;
+    link->ring = nullptr;
+    link->tx_count = 0;
+    if (kind == PacketIoKind::RAW_RING && !setup_ring(link)) {
+        LOGD("TPACKET_V3 ring unavailable: %s", strerror(errno));
+        link_destroy(link);
+        return nullptr;
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(protocol);
+    sll.sll_ifindex = ifindex;
+    if (bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        LOGE("Failed to bind raw socket to %s: %s", interface, strerror(errno));
+        link_destroy(link);
+        return nullptr;
+    }
+
+    if (!link->ring) {
+        link->rx = new uint8_t[kBatchSize * snaplen];
+        for (int i = 0; i < kBatchSize; i++) {
+            link->rx_iovs[i].iov_base = link->rx + (size_t)i * snaplen;
+            link->rx_iovs[i].iov_len = snaplen;
+        }
+    }
+    link->tx = new uint8_t[kBatchSize * snaplen];
+    memset(link->tx_msgs, 0, sizeof(link->tx_msgs));
+    for (int i = 0; i < kBatchSize; i++) {
+        link->tx_iovs[i].iov_base = link->tx + (size_t)i * snaplen;
+        link->tx_msgs[i].msg_hdr.msg_name = &link->tx_addrs[i];
+        link->tx_msgs[i].msg_hdr.msg_namelen = sizeof(link->tx_addrs[i]);
+        link->tx_msgs[i].msg_hdr.msg_iov = &link->tx_iovs[i];
+        link->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    LOGD("Raw socket bound to %s (ifindex=%d, %s)", interface, ifindex,
+         link->ring ? "TPACKET_V3 ring" : "recvmmsg");
+    return link;
+}
+
+PacketIo *packet_io_open_af_packet(const char *interface, uint16_t protocol, size_t snaplen,
+                                   const struct sock_fprog *filter) {
+    return open_link(PacketIoKind::RAW, interface, protocol, snaplen, filter);
+}
+
+PacketIo *packet_io_open_tpacket_ring(const char *interface, uint16_t protocol, size_t snaplen,
+                                      const struct sock_fprog *filter) {
+    return open_link(PacketIoKind::RAW_RING, interface, protocol, snaplen, filter);
+}
+
+// UDP
+
+struct udp_io : PacketIo {
+    size_t max_reply;
+    IoSocket *sock;
+};
+
+static void on_udp_batch(void *ctx, IoSocket * /*sock*/, const IoDatagram *batch, int count) {
+    udp_io *udp = (udp_io*)ctx;
+    for (int i = 0; i < count; i++) {
+        udp->batch[i].data = batch[i].data;
+        udp->batch[i].len = batch[i].len;
+        udp->batch[i].peer = batch[i].from;
+        udp->batch[i].timestamp_us = 0;
+    }
+    deliver(udp, count);
+}
+
+static bool udp_start(PacketIo *io) {
+    udp_io *udp = static_cast<udp_io*>(io);
+    udp->sock = io_socket_attach(io->reactor, io->fd, io->max_packet, udp->max_reply, on_udp_batch, udp);
+    if (!udp->sock) return false;
+    LOGD("UDP socket %d served with %s I/O", io->fd, io_backend_name(io_socket_backend(udp->sock)));
+    return true;
+}
+
+static void udp_stop(PacketIo *io) {
+    udp_io *udp = static_cast<udp_io*>(io);
+    io_socket_detach(udp->sock);
+    udp->sock = nullptr;
+}
+
+static void udp_destroy(PacketIo *io) {
+    delete static_cast<udp_io*>(io);
+}
+
+static uint8_t *udp_reply_buffer(PacketIo *io) {
+    return io_reply_buffer(static_cast<udp_io*>(io)->sock);
+}
+
+static void udp_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in *dest) {
+    io_queue_reply(static_cast<udp_io*>(io)->sock, len, dest);
+    count_sent(io, 1);
+}
+
+static bool udp_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest) {
+    packet_capture_socket(CaptureDirection::SENT, io->fd, data, len, dest);
+    if (sendto(io->fd, data, len, MSG_DONTWAIT, (const struct sockaddr *)dest, sizeof(*dest)) < 0) {
+        count_send_errors(io, 1);
+        return false;
+    }
+    count_sent(io, 1);
+    return true;
+}
+
+static const packet_io_ops kUdpOps = {
+    udp_start, udp_stop, udp_destroy, udp_reply_buffer, udp_queue_reply, udp_send
+};
+
+PacketIo *packet_io_open_udp(int fd, size_t max_datagram, size_t max_reply) {
+    udp_io *udp = new udp_io();
+    init_io(udp, &kUdpOps, PacketIoKind::UDP, PacketLayer::DATAGRAMS, fd, max_datagram);
+    udp->max_reply = max_reply;
+    udp->sock = nullptr;
+    return udp;
+}
+
+// LOOPBACK
+
+struct queued_packet {
+    size_t offset;              // Into the queue's data
+    size_t len;
+    struct sockaddr_in peer;
+};
+
+struct loopback_io : PacketIo {
+    PacketHandler on_sent;
+    void *sent_ctx;
+    int event_fd;
+    std::mutex mutex;           // Guards the pending queue
+    std::vector<uint8_t> pending_data;
+    std::vector<queued_packet> pending;
+    bool wake_pending;
+    std::vector<uint8_t> data;  // Being delivered; reactor thread only
+    std::vector<queued_packet> packets;
+    size_t next;
+    uint8_t *tx;
+};
+
+static void on_loopback_ready(void *ctx, uint32_t /*events*/) {
+    loopback_io *loop = (loopback_io*)ctx;
+    drain_eventfd(loop->event_fd);
+
+    for (int round = 0; round < kMaxBatchesPerWakeup; round++) {
+        if (loop->next == loop->packets.size()) {
+            loop->packets.clear();
+            loop->data.clear();
+            loop->next = 0;
+            std::lock_guard<std::mutex> lock(loop->mutex);
+            loop->packets.swap(loop->pending);
+            loop->data.swap(loop->pending_data);
+            loop->wake_pending = false;
+            if (loop->packets.empty()) return;
+        }
+        int count = 0;
+        while (count < kBatchSize && loop->next < loop->packets.size()) {
+            const queued_packet& queued = loop->packets[loop->next++];
+            Packet *packet = &loop->batch[count++];
+            packet->data = loop->data.data() + queued.offset;
+            packet->len = queued.len;
+            packet->peer = queued.peer;
+            packet->timestamp_us = 0;
+        }
+        deliver(loop, count);
+    }
+    // More are queued; let other sources have a turn first
+    signal_eventfd(loop->event_fd);
+}
+
+static bool loopback_start(PacketIo *io) {
+    loopback_io *loop = static_cast<loopback_io*>(io);
+    if (!reactor_add_fd(io->reactor, loop->event_fd, EPOLLIN, on_loopback_ready, loop)) return false;
+    signal_eventfd(loop->event_fd);     // Packets injected before the start
+    return true;
+}
+
+static void loopback_stop(PacketIo *io) {
+    reactor_remove_fd(io->reactor, static_cast<loopback_io*>(io)->event_fd);
+}
+
+static void loopback_destroy(PacketIo *io) {
+    loopback_io *loop = static_cast<loopback_io*>(io);
+    close(loop->event_fd);
+    delete[] loop->tx;
+    delete loop;
+}
+
+static uint8_t *loopback_reply_buffer(PacketIo *io) {
+    return static_cast<loopback_io*>(io)->tx;
+}
+
+static bool loopback_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest) {
+    loopback_io *loop = static_cast<loopback_io*>(io);
+    Packet packet;
+    packet.data = data;
+    packet.len = len;
+    if (dest) {
+        packet.peer = *dest;
+    } else {
+        memset(&packet.peer, 0, sizeof(packet.peer));
+    }
+    packet.timestamp_us = 0;
+    count_sent(io, 1);
+    if (loop->on_sent) loop->on_sent(loop->sent_ctx, io, &packet, 1);
+    return true;
+}
+
+static void loopback_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in *dest) {
+    loopback_send(io, static_cast<loopback_io*>(io)->tx, len, dest);
+}
+
+static const packet_io_ops kLoopbackOps = {
+    loopback_start, loopback_stop, loopback_destroy, loopback_reply_buffer, loopback_queue_reply, loopback_send
+};
+
+PacketIo *packet_io_open_loopback(PacketLayer layer, size_t max_packet, PacketHandler on_sent, void *ctx) {
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        LOGE("Failed to create loopback eventfd: %s", strerror(errno));
+        return nullptr;
+    }
+    loopback_io *loop = new loopback_io();
+    init_io(loop, &kLoopbackOps, PacketIoKind::LOOPBACK, layer, -1, max_packet);
+    loop->on_sent = on_sent;
+    loop->sent_ctx = ctx;
+    loop->event_fd = event_fd;
+    loop->wake_pending = false;
+    loop->next = 0;
+    loop->tx = new uint8_t[max_packet];
+    return loop;
+}
+
+bool packet_io_inject(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *from) {
+    if (io->kind != PacketIoKind::LOOPBACK || len > io->max_packet) return false;
+    loopback_io *loop = static_cast<loopback_io*>(io);
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        queued_packet queued;
+        queued.offset = loop->pending_data.size();
+        queued.len = len;
+        if (from) {
+            queued.peer = *from;
+        } else {
+            memset(&queued.peer, 0, sizeof(queued.peer));
+        }
+        loop->pending_data.insert(loop->pending_data.end(), data, data + len);
+        loop->pending.push_back(queued);
+        wake = !loop->wake_pending;
+        loop->wake_pending = true;
+    }
+    if (wake) signal_eventfd(loop->event_fd);
+    return true;
+}
+
+// PCAP
+
+struct pcap_record {
+    size_t offset;              // Into the file
+    size_t len;
+    int64_t timestamp_us;
+    struct sockaddr_in peer;    // DATAGRAMS: source of the captured packet
+    struct sockaddr_in local;   // DATAGRAMS: its destination
+};
+
+struct pcap_io : PacketIo {
+    std::vector<uint8_t> file;
+    std::vector<pcap_record> records;
+    size_t next;
+    int loops_left;
+    int event_fd;
+    FILE *record;
+    struct sockaddr_in local;   // Source of recorded replies: where the capture was sent
+    uint8_t *tx;
+    uint8_t *frame;             // A recorded datagram with its headers
+};
+
+static uint16_t read_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_u32(const uint8_t *p, bool swapped) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t ipv4_checksum(const uint8_t *header, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += read_be16(header + i);
+    }
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Find the UDP payload of an IPv4 packet; false for anything else
+static bool decode_ipv4_udp(const uint8_t *ip, size_t len, pcap_record *record, size_t base) {
+    if (len < 20 || (ip[0] >> 4) != 4) return false;
+    size_t ihl = (size_t)(ip[0] & 0x0f) * 4;
+    if (ihl < 20 || len < ihl + 8 || ip[9] != IPPROTO_UDP) return false;
+    if (read_be16(ip + 6) & 0x3fff) return false;     // Fragments
+    const uint8_t *udp = ip + ihl;
+    size_t udp_len = read_be16(udp + 4);
+    if (udp_len < 8 || ihl + udp_len > len) return false;
+
+    memset(&record->peer, 0, sizeof(record->peer));
+    record->peer.sin_family = AF_INET;
+    memcpy(&record->peer.sin_addr.s_addr, ip + 12, 4);
+    memcpy(&record->peer.sin_port, udp, 2);
+    memset(&record->local, 0, sizeof(record->local));
+    record->local.sin_family = AF_INET;
+    memcpy(&record->local.sin_addr.s_addr, ip + 16, 4);
+    memcpy(&record->local.sin_port, udp + 2, 2);
+    record->offset = base + ihl + 8;
+    record->len = udp_len - 8;
+    return true;
+}
+
+// Index every packet the layer can deliver
+static bool index_capture(pcap_io *pcap, const char *path) {
+    const std::vector<uint8_t>& file = pcap->file;
+    if (file.size() < kPcapHeaderSize) {
+        LOGE("%s is not a pcap file", path);
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, file.data(), 4);
+    bool swapped = magic == __builtin_bswap32(kPcapMagicUs) || magic == __builtin_bswap32(kPcapMagicNs);
+    uint32_t host_magic = swapped ? __builtin_bswap32(magic) : magic;
+    if (host_magic != kPcapMagicUs && host_magic != kPcapMagicNs) {
+        LOGE("%s is not a pcap file (pcapng is not supported)", path);
+        return false;
+    }
+    bool nanoseconds = host_magic == kPcapMagicNs;
+    uint32_t linktype = read_u32(file.data() + 20, swapped) & 0xffff;
+    bool ethernet = linktype == kLinktypeEthernet;
+    if (!ethernet && linktype != kLinktypeRaw && linktype != kLinktypeIpv4) {
+        LOGE("%s has unsupported link type %u", path, linktype);
+        return false;
+    }
+    if (!ethernet && pcap->layer == PacketLayer::FRAMES) {
+        LOGE("%s holds IP packets, not Ethernet frames", path);
+        return false;
+    }
+
+    size_t pos = kPcapHeaderSize;
+    while (pos + kPcapRecordHeaderSize <= file.size()) {
+        const uint8_t *header = file.data() + pos;
+        uint32_t seconds = read_u32(header, swapped);
+        uint32_t fraction = read_u32(header + 4, swapped);
+        size_t caplen = read_u32(header + 8, swapped);
+        size_t base = pos + kPcapRecordHeaderSize;
+        if (base + caplen > file.size()) break;     // Cut short while capturing
+        pos = base + caplen;
+
+        pcap_record record;
+        record.timestamp_us = (int64_t)seconds * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+        if (pcap->layer == PacketLayer::FRAMES) {
+            record.offset = base;
+            record.len = caplen;
+            memset(&record.peer, 0, sizeof(record.peer));
+            memset(&record.local, 0, sizeof(record.local));
+        } else {
+            const uint8_t *ip = file.data() + base;
+            size_t ip_len = caplen;
+            if (ethernet) {
+                if (caplen < 14) continue;
+                size_t header_len = 14;
+                uint16_t ethertype = read_be16(ip + 12);
+                if (ethertype == ETH_P_8021Q && caplen >= 18) {
+                    ethertype = read_be16(ip + 16);
+                    header_len = 18;
+                }
+                if (ethertype != ETH_P_IP) continue;
+                ip += header_len;
+                ip_len -= header_len;
+                base += header_len;
+            }
+            if (!decode_ipv4_udp(ip, ip_len, &record, base)) continue;
+        }
+        if (record.len > pcap->max_packet) continue;
+        pcap->records.push_back(record);
+    }
+    return true;
+}
+
+static bool write_all(FILE *out, const void *data, size_t len) {
+    return fwrite(data, 1, len, out) == len;
+}
+
+static void record_packet(pcap_io *pcap, const uint8_t *data, size_t len, const struct sockaddr_in *dest) {
+    const uint8_t *frame = data;
+    size_t frame_len = len;
+    if (pcap->layer == PacketLayer::DATAGRAMS) {
+        // Ethernet, IPv4 and UDP headers from where the capture was sent to dest
+        uint8_t *out = pcap->frame;
+        memset(out, 0, 12);
+        out[12] = 0x08;
+        out[13] = 0x00;
+        uint8_t *ip = out + 14;
+        size_t ip_len = 20 + 8 + len;
+        memset(ip, 0, 20);
+        ip[0] = 0x45;
+        ip[2] = (uint8_t)(ip_len >> 8);
+        ip[3] = (uint8_t)ip_len;
+        ip[6] = 0x40;           // Don't fragment
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(ip + 12, &pcap->local.sin_addr.s_addr, 4);
+        memcpy(ip + 16, &dest->sin_addr.s_addr, 4);
+        uint16_t checksum = ipv4_checksum(ip, 20);
+        ip[10] = (uint8_t)(checksum >> 8);
+        ip[11] = (uint8_t)checksum;
+        uint8_t *udp = ip + 20;
+        memcpy(udp, &pcap->local.sin_port, 2);
+        memcpy(udp + 2, &dest->sin_port, 2);
+        udp[4] = (uint8_t)((8 + len) >> 8);
+        udp[5] = (uint8_t)(8 + len);
+        udp[6] = 0;             // No checksum
+        udp[7] = 0;
+        memcpy(udp + 8, data, len);
+        frame = out;
+        frame_len = kDatagramFrameOverhead + len;
+    }
+
+    int64_t now = realtime_us();
+    uint32_t header[4] = {(uint32_t)(now / 1000000), (uint32_t)(now % 1000000),
+                          (uint32_t)frame_len, (uint32_t)frame_len};
+    if (!write_all(pcap->record, header, sizeof(header)) || !write_all(pcap->record, frame, frame_len)) {
+        LOGE("Failed to record packet: %s", strerror(errno));
+    }
+}
+
+static void on_pcap_ready(void *ctx, uint32_t /*events*/) {
+    pcap_io *pcap = (pcap_io*)ctx;
+    drain_eventfd(pcap->event_fd);
+
+    for (int round = 0; round < kMaxBatchesPerWakeup; round++) {
+        if (pcap->next == pcap->records.size()) {
+            if (pcap->records.empty() || --pcap->loops_left <= 0) {
+                end_of_packets(pcap);
+                return;
+            }
+            pcap->next = 0;
+        }
+        int count = 0;
+        while (count < kBatchSize && pcap->next < pcap->records.size()) {
+            const pcap_record& record = pcap->records[pcap->next++];
+            Packet *packet = &pcap->batch[count++];
+            packet->data = pcap->file.data() + record.offset;
+            packet->len = record.len;
+            packet->peer = record.peer;
+            packet->timestamp_us = record.timestamp_us;
+            pcap->local = record.local;
+        }
+        deliver(pcap, count);
+    }
+    // Come back for the rest once other sources have had a turn
+    signal_eventfd(pcap->event_fd);
+}
+
+static bool pcap_start(PacketIo *io) {
+    pcap_io *pcap = static_cast<pcap_io*>(io);
+    if (!reactor_add_fd(io->reactor, pcap->event_fd, EPOLLIN, on_pcap_ready, pcap)) return false;
+    signal_eventfd(pcap->event_fd);
+    return true;
+}
+
+static void pcap_stop(PacketIo *io) {
+    reactor_remove_fd(io->reactor, static_cast<pcap_io*>(io)->event_fd);
+}
+
+static void pcap_destroy(PacketIo *io) {
+    pcap_io *pcap = static_cast<pcap_io*>(io);
+    if (pcap->record) fclose(pcap->record);
+    if (pcap->event_fd >= 0) close(pcap->event_fd);
+    delete[] pcap->tx;
+    delete[] pcap->frame;
+    delete pcap;
+}
+
+static uint8_t *pcap_reply_buffer(PacketIo *io) {
+    return static_cast<pcap_io*>(io)->tx;
+}
+
+static bool pcap_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest) {
+    pcap_io *pcap = static_cast<pcap_io*>(io);
+    if (len > io->max_packet || (io->layer == PacketLayer::DATAGRAMS && !dest)) {
+        count_send_errors(io, 1);
+        return false;
+    }
+    if (pcap->record) record_packet(pcap, data, len, dest);
+    count_sent(io, 1);
+    return true;
+}
+
+static void pcap_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in *dest) {
+    pcap_send(io, static_cast<pcap_io*>(io)->tx, len, dest);
+}
+
+static const packet_io_ops kPcapOps = {
+    pcap_start, pcap_stop, pcap_destroy, pcap_reply_buffer, pcap_queue_reply, pcap_send
+};
+
+static bool read_file(const char *path, std::vector<uint8_t> *out) {
+    FILE *in = fopen(path, "rb");
+    if (!in) return false;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        out->insert(out->end(), chunk, chunk + n);
+    }
+    bool ok = !ferror(in);
+    fclose(in);
+    return ok;
+}
+
+PacketIo *packet_io_open_pcap(const char *replay_path, const char *record_path, PacketLayer layer,
+                              size_t max_packet, int loops) {
+    pcap_io *pcap = new pcap_io();
+    init_io(pcap, &kPcapOps, PacketIoKind::PCAP, layer, -1, max_packet);
+    pcap->next = 0;
+    pcap->loops_left = loops > 0 ? loops : 1;
+    pcap->record = nullptr;
+    memset(&pcap->local, 0, sizeof(pcap->local));
+    pcap->tx = new uint8_t[max_packet];
+    pcap->frame = new uint8_t[kDatagramFrameOverhead + max_packet];
+    pcap->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (!read_file(replay_path, &pcap->file)) {
+        LOGE("Failed to read capture %s: %s", replay_path, strerror(errno));
+        pcap_destroy(pcap);
+        return nullptr;
+    }
+    if (pcap->event_fd < 0 || !index_capture(pcap, replay_path)) {
+        pcap_destroy(pcap);
+        return nullptr;
+    }
+    if (record_path) {
+        pcap->record = fopen(record_path, "wb");
+        uint32_t header[6] = {kPcapMagicUs, 2 | (4u << 16), 0, 0, kPcapRecordSnaplen, kLinktypeEthernet};
+        if (!pcap->record || !write_all(pcap->record, header, sizeof(header))) {
+            LOGE("Failed to create capture %s: %s", record_path, strerror(errno));
+            pcap_destroy(pcap);
+            return nullptr;
+        }
+    }
+    LOGD("Replaying %zu packets from %s %d time(s)", pcap->records.size(), replay_path, pcap->loops_left);
+    return pcap;
+}
+
+// Common
+
+bool packet_io_start(PacketIo *io, Reactor *reactor, PacketHandler handler, void *ctx) {
+    io->reactor = reactor;
+    io->handler = handler;
+    io->ctx = ctx;
+    if (!io->ops->start(io)) {
+        io->reactor = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void packet_io_stop(PacketIo *io) {
+    if (!io->reactor) return;
+    io->ops->stop(io);
+    io->reactor = nullptr;
+}
+
+void packet_io_close(PacketIo *io) {
+    if (!io) return;
+    packet_io_stop(io);
+    io->ops->destroy(io);
+}
+
+uint8_t *packet_io_reply_buffer(PacketIo *io) {
+    return io->ops->reply_buffer(io);
+}
+
+void packet_io_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in *dest) {
+    io->ops->queue_reply(io, len, dest);
+}
+
+bool packet_io_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest) {
+    return io->ops->send(io, data, len, dest);
+}
+
+void packet_io_set_end_handler(PacketIo *io, PacketIoEndHandler handler, void *ctx) {
+    io->on_end = handler;
+    io->end_ctx = ctx;
+}
+
+PacketIoKind packet_io_kind(const PacketIo *io) {
+    return io->kind;
+}
+
+PacketLayer packet_io_layer(const PacketIo *io) {
+    return io->layer;
+}
+
+int packet_io_fd(const PacketIo *io) {
+    return io->fd;
+}
+
+PacketIoStats packet_io_stats(const PacketIo *io) {
+    return io->stats;
+}
+
+const char *packet_io_kind_name(PacketIoKind kind) {
+    switch (kind) {
+        case PacketIoKind::RAW: return "af_packet";
+        case PacketIoKind::RAW_RING: return "tpacket_ring";
+        case PacketIoKind::UDP: return "udp";
+        case PacketIoKind::LOOPBACK: return "loopback";
+        case PacketIoKind::PCAP: return "pcap";
+    }
+    return "unknown";
+}
@@ -0,0 +1,163 @@
+#ifndef PACKET_IO_H
+#define PACKET_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+
+struct Reactor;
+struct sock_fprog;
+
+/**
+ * Where an engine's packets come from and where its replies go. The ARP
+ * scanner and monitor, the DNS workers and the DHCP server only see
+ * batches of packets and a way to answer them, so the same engine code
+ * runs on a raw interface, a UDP port, in memory or against a capture.
+ *
+ * RAW (AF_PACKET) and RAW_RING (TPACKET_V3) carry the Ethernet frames of
+ * one interface and need CAP_NET_RAW. UDP serves a bound socket through
+ * the io_backend (recvmmsg or io_uring). LOOPBACK and PCAP need no privileges: the first
+ * delivers packets injected by the caller and hands every reply to a
+ * callback, the second replays a capture file as fast as the engine takes
+ * it and can record the replies to another.
+ */
+enum class PacketIoKind {
+    RAW,
+    RAW_RING,
+    UDP,
+    LOOPBACK,
+    PCAP
+};
+
+/**
+ * What a backend carries: whole Ethernet frames, or UDP payloads with the
+ * peer's address
+ */
+enum class PacketLayer {
+    FRAMES,
+    DATAGRAMS
+};
+
+struct PacketIo;
+
+/**
+ * A received packet; data is valid until the handler returns
+ */
+struct Packet {
+    const uint8_t *data;
+    size_t len;
+    struct sockaddr_in peer;    // DATAGRAMS: the sender
+    int64_t timestamp_us;       // Capture time where the backend has one, else 0
+};
+
+/**
+ * Called on the reactor thread with up to a batch of packets. Replies
+ * queued with packet_io_queue_reply go out when it returns.
+ */
+typedef void (*PacketHandler)(void *ctx, PacketIo *io, const Packet *batch, int count);
+
+/**
+ * Called once when no more packets will arrive: a replay has ended or the
+ * socket failed
+ */
+typedef void (*PacketIoEndHandler)(void *ctx);
+
+struct PacketIoStats {
+    uint64_t received;
+    uint64_t sent;
+    uint64_t send_errors;
+};
+
+/**
+ * Frames of one interface, read with recvmmsg
+ * @param protocol Ethertype received, host order
+ * @param snaplen Bytes kept of each frame, and the largest frame sent
+ * @param filter Attached before the socket is bound, or nullptr
+ * @return nullptr without CAP_NET_RAW or if the interface does not exist
+ */
+PacketIo *packet_io_open_af_packet(const char *interface, uint16_t protocol, size_t snaplen,
+                                   const struct sock_fprog *filter);
+
+/**
+ * Like packet_io_open_af_packet, read from a TPACKET_V3 ring: the kernel
+ * fills whole blocks and wakes us when one is full or a second old
+ * @return nullptr also when the kernel has no ring support
+ */
+PacketIo *packet_io_open_tpacket_ring(const char *interface, uint16_t protocol, size_t snaplen,
+                                      const struct sock_fprog *filter);
+
+/**
+ * Datagrams of a bound UDP socket
+ * @param fd Stays owned by the caller
+ */
+PacketIo *packet_io_open_udp(int fd, size_t max_datagram, size_t max_reply);
+
+/**
+ * Packets handed in with packet_io_inject; every reply and send goes to
+ * on_sent, on the reactor thread
+ */
+PacketIo *packet_io_open_loopback(PacketLayer layer, size_t max_packet, PacketHandler on_sent, void *ctx);
+
+/**
+ * Replay a pcap file (Ethernet or raw IPv4) loops times. For DATAGRAMS only
+ * IPv4/UDP packets are delivered, stripped to their payload.
+ * @param record_path pcap file the replies are written to, or nullptr
+ * @return nullptr if a file cannot be read or written
+ */
+PacketIo *packet_io_open_pcap(const char *replay_path, const char *record_path, PacketLayer layer,
+                              size_t max_packet, int loops);
+
+/**
+ * Start delivering packets to handler. Must be called on the reactor's
+ * thread or while it is not running, like reactor_add_fd.
+ */
+bool packet_io_start(PacketIo *io, Reactor *reactor, PacketHandler handler, void *ctx);
+
+/**
+ * Stop delivering packets; same thread rules as packet_io_start
+ */
+void packet_io_stop(PacketIo *io);
+
+/**
+ * Stop if needed and free the backend
+ */
+void packet_io_close(PacketIo *io);
+
+/**
+ * Buffer to build the next reply in, valid inside the handler
+ */
+uint8_t *packet_io_reply_buffer(PacketIo *io);
+
+/**
+ * Queue the reply built in the last packet_io_reply_buffer
+ * @param dest DATAGRAMS: where it goes; ignored for frames
+ */
+void packet_io_queue_reply(PacketIo *io, size_t len, const struct sockaddr_in *dest);
+
+/**
+ * Send one packet at once, outside the handler's batch
+ */
+bool packet_io_send(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *dest);
+
+/**
+ * Queue a packet for a LOOPBACK backend to deliver; any thread
+ * @param from DATAGRAMS: the sender
+ */
+bool packet_io_inject(PacketIo *io, const uint8_t *data, size_t len, const struct sockaddr_in *from);
+
+void packet_io_set_end_handler(PacketIo *io, PacketIoEndHandler handler, void *ctx);
+
+PacketIoKind packet_io_kind(const PacketIo *io);
+
+PacketLayer packet_io_layer(const PacketIo *io);
+
+/**
+ * Socket behind the backend, or -1 for the in-memory ones
+ */
+int packet_io_fd(const PacketIo *io);
+
+PacketIoStats packet_io_stats(const PacketIo *io);
+
+const char *packet_io_kind_name(PacketIoKind kind);
+
+#endif // PACKET_IO_H
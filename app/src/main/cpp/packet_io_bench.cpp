@@ -0,0 +1,266 @@
+// Engine throughput without root, sockets or a network.
+//
+// Replays a capture of DNS queries and one of DHCP DISCOVERs through the
+// PCAP packet backend as fast as the engines take them, on a reactor run by
+// this thread, and prints packets, replies, packets per second and ns per
+// packet. The captures are synthesized (10000 queries from 250 clients,
+// 10000 DISCOVERs from distinct MACs) unless a capture of real queries is
+// given for the DNS row. A last row runs a network scan against a loopback
+// backend answered by a simulated LAN and reports the devices found.
+//
+// Usage: harpy_packet_bench [capture.pcap] [loops]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "arp_frame.h"
+#include "dhcp_spoofing.h"
+#include "dhcp_wire.h"
+#include "dns_load_client.h"
+#include "dns_spoofing.h"
+#include "network_scan.h"
+#include "packet_io.h"
+#include "reactor.h"
+
+static const int kSynthesizedPackets = 10000;
+static const int kDefaultLoops = 100;
+static const size_t kMaxPacket = 4096;
+static const int kLanHostEvery = 3;         // Every third address of the simulated LAN answers
+
+static double elapsed_seconds(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static std::string temp_path(const char *name) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || access(dir, W_OK) != 0) dir = access("/data/local/tmp", W_OK) == 0 ? "/data/local/tmp" : "/tmp";
+    return std::string(dir) + "/" + name;
+}
+
+// Ethernet/IPv4/UDP frames in a classic pcap file
+struct capture_writer {
+    FILE *out;
+    uint32_t count;
+};
+
+static bool capture_open(capture_writer *writer, const std::string& path) {
+    writer->out = fopen(path.c_str(), "wb");
+    writer->count = 0;
+    if (!writer->out) return false;
+    const uint32_t header[6] = {0xa1b2c3d4, 2 | (4u << 16), 0, 0, 65535, 1};
+    return fwrite(header, sizeof(header), 1, writer->out) == 1;
+}
+
+static void capture_udp(capture_writer *writer, uint32_t src_ip, uint16_t src_port, uint32_t dst_ip,
+                        uint16_t dst_port, const uint8_t *payload, size_t len) {
+    uint8_t frame[14 + 20 + 8 + kMaxPacket];
+    memset(frame, 0, 42);
+    memset(frame, 0xff, 6);
+    frame[12] = 0x08;
+    uint8_t *ip = frame + 14;
+    size_t ip_len = 20 + 8 + len;
+    ip[0] = 0x45;
+    ip[2] = (uint8_t)(ip_len >> 8);
+    ip[3] = (uint8_t)ip_len;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, &src_ip, 4);
+    memcpy(ip + 16, &dst_ip, 4);
+    uint8_t *udp = ip + 20;
+    udp[0] = (uint8_t)(src_port >> 8);
+    udp[1] = (uint8_t)src_port;
+    udp[2] = (uint8_t)(dst_port >> 8);
+    udp[3] = (uint8_t)dst_port;
+    udp[4] = (uint8_t)((8 + len) >> 8);
+    udp[5] = (uint8_t)(8 + len);
+    memcpy(udp + 8, payload, len);
+
+    uint32_t frame_len = (uint32_t)(14 + ip_len);
+    uint32_t record[4] = {writer->count / 1000, (writer->count % 1000) * 1000, frame_len, frame_len};
+    fwrite(record, sizeof(record), 1, writer->out);
+    fwrite(frame, frame_len, 1, writer->out);
+    writer->count++;
+}
+
+static bool capture_close(capture_writer *writer) {
+    return fclose(writer->out) == 0;
+}
+
+static bool write_dns_capture(const std::string& path) {
+    capture_writer writer;
+    if (!capture_open(&writer, path)) return false;
+    uint8_t query[64];
+    for (int i = 0; i < kSynthesizedPackets; i++) {
+        size_t len = dns_load_build_query(query, (uint16_t)i, i % 1000);
+        uint32_t client = htonl(0x0a000000u | (uint32_t)(2 + i % 250));
+        capture_udp(&writer, client, (uint16_t)(20000 + i % 4), htonl(0x0a000001), 53, query, len);
+    }
+    return capture_close(&writer);
+}
+
+static bool write_dhcp_capture(const std::string& path) {
+    capture_writer writer;
+    if (!capture_open(&writer, path)) return false;
+    uint8_t discover[kDhcpMinPacketSize];
+    for (int i = 0; i < kSynthesizedPackets; i++) {
+        memset(discover, 0, sizeof(discover));
+        discover[0] = kDhcpOpRequest;
+        discover[1] = 1;    // Ethernet
+        discover[2] = 6;
+        uint32_t xid = (uint32_t)i;
+        memcpy(discover + 4, &xid, 4);
+        const uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, (uint8_t)(i >> 8), (uint8_t)i};
+        memcpy(discover + 28, mac, 6);
+        uint32_t cookie = htonl(kDhcpMagicCookie);
+        memcpy(discover + kDhcpHeaderSize, &cookie, 4);
+        uint8_t *opts = discover + kDhcpOptionsOffset;
+        opts[0] = kDhcpOptMessageType;
+        opts[1] = 1;
+        opts[2] = kDhcpDiscover;
+        opts[3] = kDhcpOptEnd;
+        capture_udp(&writer, 0, kDhcpClientPort, INADDR_BROADCAST, kDhcpServerPort, discover, sizeof(discover));
+    }
+    return capture_close(&writer);
+}
+
+static void stop_reactor(void *ctx) {
+    reactor_stop((Reactor*)ctx);
+}
+
+static void print_row(const char *engine, const PacketIoStats& stats, double seconds) {
+    printf("%-6s %12llu %12llu %12.0f %12.1f\n", engine, (unsigned long long)stats.received,
+           (unsigned long long)stats.sent, seconds > 0 ? stats.received / seconds : 0.0,
+           stats.received > 0 ? seconds * 1e9 / stats.received : 0.0);
+    fflush(stdout);
+}
+
+static bool replay_dns(const std::string& capture, int loops) {
+    Reactor *reactor = reactor_create();
+    PacketIo *io = packet_io_open_pcap(capture.c_str(), nullptr, PacketLayer::DATAGRAMS, kMaxPacket, loops);
+    if (!reactor || !io) {
+        fprintf(stderr, "Failed to open %s\n", capture.c_str());
+        return false;
+    }
+    packet_io_set_end_handler(io, stop_reactor, reactor);
+    dns_set_reactor(reactor);
+    dns_set_packet_io(io);
+    dns_set_upstreams({"127.0.0.1:9"});
+    if (!dns_start_spoofing("lo", {{"*.bench.test", "10.0.0.1"}})) {
+        fprintf(stderr, "Failed to start DNS engine\n");
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    reactor_run(reactor);
+    double seconds = elapsed_seconds(start);
+    PacketIoStats stats = packet_io_stats(io);
+
+    dns_stop_spoofing();
+    dns_set_packet_io(nullptr);
+    dns_set_reactor(nullptr);
+    packet_io_close(io);
+    reactor_destroy(reactor);
+    print_row("dns", stats, seconds);
+    return true;
+}
+
+static bool replay_dhcp(const std::string& capture, int loops) {
+    Reactor *reactor = reactor_create();
+    PacketIo *io = packet_io_open_pcap(capture.c_str(), nullptr, PacketLayer::DATAGRAMS, kMaxPacket, loops);
+    if (!reactor || !io) {
+        fprintf(stderr, "Failed to open %s\n", capture.c_str());
+        return false;
+    }
+    packet_io_set_end_handler(io, stop_reactor, reactor);
+    dhcp_set_reactor(reactor);
+    dhcp_set_packet_io(io);
+    DHCPPoolConfig pool;
+    pool.first_ip = "10.1.0.1";
+    pool.last_ip = "10.1.255.254";
+    pool.gateway_ip = "10.1.0.1";
+    pool.subnet_mask = "255.255.0.0";
+    pool.dns_server = "10.1.0.1";
+    if (!dhcp_set_pool(pool) || !dhcp_start_spoofing("lo", {})) {
+        fprintf(stderr, "Failed to start DHCP engine\n");
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    reactor_run(reactor);
+    double seconds = elapsed_seconds(start);
+    PacketIoStats stats = packet_io_stats(io);
+
+    dhcp_stop_spoofing();
+    dhcp_set_packet_io(nullptr);
+    dhcp_set_reactor(nullptr);
+    packet_io_close(io);
+    reactor_destroy(reactor);
+    print_row("dhcp", stats, seconds);
+    return true;
+}
+
+// The simulated LAN: every kLanHostEvery-th address answers a sweep request
+static void answer_arp(void * /*ctx*/, PacketIo *io, const Packet *batch, int count) {
+    for (int i = 0; i < count; i++) {
+        if (batch[i].len < sizeof(ArpFrame)) continue;
+        const ArpFrame *request = (const ArpFrame *)batch[i].data;
+        if (request->oper[1] != 1 || request->tpa[3] % kLanHostEvery != 0) continue;
+
+        const uint8_t host_mac[6] = {0x02, 0x42, 0x00, 0x00, 0x00, request->tpa[3]};
+        uint32_t host_ip, requester_ip;
+        memcpy(&host_ip, request->tpa, 4);
+        memcpy(&requester_ip, request->spa, 4);
+        ArpFrame reply = kArpReplyTemplate;
+        arp_frame_patch(&reply, host_mac, host_ip, request->sha, requester_ip);
+        packet_io_inject(io, (const uint8_t *)&reply, sizeof(reply), nullptr);
+    }
+}
+
+static bool scan_loopback() {
+    PacketIo *io = packet_io_open_loopback(PacketLayer::FRAMES, kMaxPacket, answer_arp, nullptr);
+    if (!io) return false;
+    network_scan_set_packet_io(io);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> devices = network_scan("lo", "10.9.8.0", 2);
+    double seconds = elapsed_seconds(start);
+    PacketIoStats stats = packet_io_stats(io);
+    network_scan_set_packet_io(nullptr);
+    packet_io_close(io);
+
+    printf("scan   found %zu of %d simulated hosts: %llu requests, %llu replies in %.1f s\n", devices.size(),
+           254 / kLanHostEvery, (unsigned long long)stats.sent, (unsigned long long)stats.received, seconds);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string dns_capture = argc > 1 ? argv[1] : "";
+    int loops = argc > 2 ? atoi(argv[2]) : kDefaultLoops;
+    if (loops <= 0) loops = kDefaultLoops;
+
+    std::string dhcp_capture = temp_path("harpy_bench_dhcp.pcap");
+    bool synthesized = dns_capture.empty();
+    if (synthesized) {
+        dns_capture = temp_path("harpy_bench_dns.pcap");
+        if (!write_dns_capture(dns_capture)) {
+            fprintf(stderr, "Failed to write %s\n", dns_capture.c_str());
+            return 1;
+        }
+    }
+    if (!write_dhcp_capture(dhcp_capture)) {
+        fprintf(stderr, "Failed to write %s\n", dhcp_capture.c_str());
+        return 1;
+    }
+
+    printf("%-6s %12s %12s %12s %12s\n", "engine", "packets", "replies", "packets/s", "ns/packet");
+    bool ok = replay_dns(dns_capture, loops) && replay_dhcp(dhcp_capture, loops) && scan_loopback();
+
+    if (synthesized) unlink(dns_capture.c_str());
+    unlink(dhcp_capture.c_str());
+    return ok ? 0 : 1;
+}
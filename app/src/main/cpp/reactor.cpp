@@ -0,0 +1,331 @@
+#include "reactor.h"
+#include "harpy_log.h"
+#include "harpy_trace.h"
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_TAG "Reactor"
+#define LOGD(...) HARPY_LOG(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) HARPY_LOG(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Events taken from the kernel per epoll_wait
+static const int kMaxEvents = 64;
+// Descriptors all poll sources of one reactor may wait on together
+static const int kMaxPollFds = 256;
+
+// A registered descriptor. Removal only marks it: the current batch of
+// events may still point at it, so it is freed after the batch.
+struct reactor_source {
+    int fd;
+    ReactorFdHandler handler;
+    void *ctx;
+    bool removed;
+};
+
+struct ReactorTimer {
+    int fd;
+    ReactorTimerHandler handler;
+    void *ctx;
+};
+
+struct poll_source_entry {
+    ReactorPollSource source;
+    int first;                  // Slice of Reactor::pollfds filled this wakeup
+    int count;
+    bool removed;
+};
+
+struct pending_task {
+    ReactorTask task;
+    void *ctx;
+    bool done;
+};
+
+struct Reactor {
+    int epoll_fd;
+    int wake_fd;                // eventfd for reactor_stop and reactor_call
+    std::unordered_map<int, reactor_source*> sources;
+    std::vector<reactor_source*> removed;
+    std::vector<poll_source_entry> poll_sources;
+    struct pollfd pollfds[kMaxPollFds + 1];
+    std::atomic<bool> stop_requested;
+
+    // Cross-thread calls, guarded by task_mutex
+    std::mutex task_mutex;
+    std::condition_variable task_done;
+    std::vector<pending_task*> tasks;
+    bool running;
+    std::thread::id thread;
+};
+
+static void run_tasks(Reactor *reactor) {
+    std::vector<pending_task*> tasks;
+    {
+        std::lock_guard<std::mutex> lock(reactor->task_mutex);
+        tasks.swap(reactor->tasks);
+    }
+    if (tasks.empty()) return;
+    for (pending_task *pending : tasks) {
+        pending->task(pending->ctx);
+    }
+    std::lock_guard<std::mutex> lock(reactor->task_mutex);
+    for (pending_task *pending : tasks) {
+        pending->done = true;
+    }
+    reactor->task_done.notify_all();
+}
+
+static void on_wake(void *ctx, uint32_t /*events*/) {
+    Reactor *reactor = (Reactor*)ctx;
+    uint64_t count;
+    while (read(reactor->wake_fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+    run_tasks(reactor);
+}
+
+static void on_timer(void *ctx, uint32_t /*events*/) {
+    ReactorTimer *timer = (ReactorTimer*)ctx;
+    uint64_t expirations;
+    if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    // Last use of timer: the handler may remove it
+    timer->handler(timer->ctx);
+}
+
+Reactor *reactor_create() {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOGE("Failed to create epoll instance: %s", strerror(errno));
+        return nullptr;
+    }
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        LOGE("Failed to create reactor eventfd: %s", strerror(errno));
+        close(epoll_fd);
+        return nullptr;
+    }
+
+    Reactor *reactor = new Reactor();
+    reactor->epoll_fd = epoll_fd;
+    reactor->wake_fd = wake_fd;
+    reactor->stop_requested = false;
+    reactor->running = false;
+    reactor_add_fd(reactor, wake_fd, EPOLLIN, on_wake, reactor);
+    return reactor;
+}
+
+void reactor_destroy(Reactor *reactor) {
+    if (!reactor) return;
+    for (auto& entry : reactor->sources) {
+        if (entry.second->handler == on_timer) {
+            ReactorTimer *timer = (ReactorTimer*)entry.second->ctx;
+            close(timer->fd);
+            delete timer;
+        }
+        delete entry.second;
+    }
+    for (reactor_source *source : reactor->removed) {
+        delete source;
+    }
+    close(reactor->wake_fd);
+    close(reactor->epoll_fd);
+    delete reactor;
+}
+
+bool reactor_add_fd(Reactor *reactor, int fd, uint32_t events, ReactorFdHandler handler, void *ctx) {
+    if (reactor->sources.count(fd)) {
+        LOGE("Descriptor %d is already registered", fd);
+        return false;
+    }
+    reactor_source *source = new reactor_source{fd, handler, ctx, false};
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOGE("Failed to watch descriptor %d: %s", fd, strerror(errno));
+        delete source;
+        return false;
+    }
+    reactor->sources[fd] = source;
+    return true;
+}
+
+bool reactor_modify_fd(Reactor *reactor, int fd, uint32_t events) {
+    auto it = reactor->sources.find(fd);
+    if (it == reactor->sources.end()) return false;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = it->second;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        LOGE("Failed to change events of descriptor %d: %s", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void reactor_remove_fd(Reactor *reactor, int fd) {
+    auto it = reactor->sources.find(fd);
+    if (it == reactor->sources.end()) return;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    it->second->removed = true;
+    reactor->removed.push_back(it->second);
+    reactor->sources.erase(it);
+}
+
+ReactorTimer *reactor_add_timer(Reactor *reactor, int interval_ms, ReactorTimerHandler handler, void *ctx) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Failed to create timerfd: %s", strerror(errno));
+        return nullptr;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    ReactorTimer *timer = new ReactorTimer{fd, handler, ctx};
+    if (timerfd_settime(fd, 0, &spec, nullptr) < 0 || !reactor_add_fd(reactor, fd, EPOLLIN, on_timer, timer)) {
+        LOGE("Failed to arm %d ms timer: %s", interval_ms, strerror(errno));
+        close(fd);
+        delete timer;
+        return nullptr;
+    }
+    return timer;
+}
+
+void reactor_remove_timer(Reactor *reactor, ReactorTimer *timer) {
+    if (!timer) return;
+    reactor_remove_fd(reactor, timer->fd);
+    close(timer->fd);
+    delete timer;
+}
+
+bool reactor_add_poll_source(Reactor *reactor, const ReactorPollSource& source) {
+    reactor->poll_sources.push_back({source, 0, 0, false});
+    return true;
+}
+
+void reactor_remove_poll_source(Reactor *reactor, void *ctx) {
+    // Only marked: the loop may be walking the list right now
+    for (auto& entry : reactor->poll_sources) {
+        if (entry.source.ctx == ctx) entry.removed = true;
+    }
+}
+
+static void compact_poll_sources(Reactor *reactor) {
+    size_t kept = 0;
+    for (size_t i = 0; i < reactor->poll_sources.size(); i++) {
+        if (!reactor->poll_sources[i].removed) {
+            reactor->poll_sources[kept++] = reactor->poll_sources[i];
+        }
+    }
+    reactor->poll_sources.resize(kept);
+}
+
+// Wait on the epoll descriptor and every poll source together with poll(),
+// then collect the epoll events without blocking
+static int wait_with_poll_sources(Reactor *reactor, struct epoll_event *events) {
+    // Drop sources removed by handlers since the last wait before asking them for fds
+    compact_poll_sources(reactor);
+    reactor->pollfds[0].fd = reactor->epoll_fd;
+    reactor->pollfds[0].events = POLLIN;
+    reactor->pollfds[0].revents = 0;
+    int nfds = 1;
+    int timeout = -1;
+    for (auto& entry : reactor->poll_sources) {
+        entry.first = nfds;
+        entry.count = entry.source.fill(entry.source.ctx, reactor->pollfds + nfds, kMaxPollFds + 1 - nfds);
+        nfds += entry.count;
+        int source_timeout = entry.source.timeout(entry.source.ctx);
+        if (source_timeout >= 0 && (timeout < 0 || source_timeout < timeout)) {
+            timeout = source_timeout;
+        }
+    }
+
+    int ret = poll(reactor->pollfds, nfds, timeout);
+    if (ret < 0) return ret;
+    for (size_t i = 0; i < reactor->poll_sources.size(); i++) {
+        poll_source_entry entry = reactor->poll_sources[i];
+        if (entry.removed) continue;
+        entry.source.handle(entry.source.ctx, reactor->pollfds + entry.first, entry.count);
+    }
+    compact_poll_sources(reactor);
+    if (!(reactor->pollfds[0].revents & POLLIN)) return 0;
+    return epoll_wait(reactor->epoll_fd, events, kMaxEvents, 0);
+}
+
+void reactor_run(Reactor *reactor) {
+    {
+        std::lock_guard<std::mutex> lock(reactor->task_mutex);
+        reactor->running = true;
+        reactor->thread = std::this_thread::get_id();
+    }
+
+    struct epoll_event events[kMaxEvents];
+    while (!reactor->stop_requested.load(std::memory_order_acquire)) {
+        int ready = reactor->poll_sources.empty()
+                  ? epoll_wait(reactor->epoll_fd, events, kMaxEvents, -1)
+                  : wait_with_poll_sources(reactor, events);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            LOGE("Reactor wait error: %s", strerror(errno));
+            break;
+        }
+        HarpyTraceScope trace("reactor", "wakeup");
+        trace.set_arg("events", ready);
+        for (int i = 0; i < ready; i++) {
+            reactor_source *source = (reactor_source*)events[i].data.ptr;
+            if (!source->removed) {
+                source->handler(source->ctx, events[i].events);
+            }
+        }
+        for (reactor_source *source : reactor->removed) {
+            delete source;
+        }
+        reactor->removed.clear();
+    }
+
+    // Calls queued while the loop was stopping still run, so no caller is
+    // left waiting
+    {
+        std::lock_guard<std::mutex> lock(reactor->task_mutex);
+        reactor->running = false;
+    }
+    run_tasks(reactor);
+    reactor->stop_requested = false;
+}
+
+void reactor_stop(Reactor *reactor) {
+    reactor->stop_requested.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    if (write(reactor->wake_fd, &one, sizeof(one)) < 0) {
+        LOGE("Failed to wake reactor: %s", strerror(errno));
+    }
+}
+
+void reactor_call(Reactor *reactor, ReactorTask task, void *ctx) {
+    pending_task pending = {task, ctx, false};
+    {
+        std::unique_lock<std::mutex> lock(reactor->task_mutex);
+        if (reactor->running && reactor->thread != std::this_thread::get_id()) {
+            reactor->tasks.push_back(&pending);
+            uint64_t one = 1;
+            if (write(reactor->wake_fd, &one, sizeof(one)) < 0) {
+                LOGE("Failed to wake reactor: %s", strerror(errno));
+            }
+            reactor->task_done.wait(lock, [&pending] { return pending.done; });
+            return;
+        }
+    }
+    task(ctx);
+}
@@ -0,0 +1,104 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstdint>
+#include <poll.h>
+
+/**
+ * Single-threaded event loop over epoll. Sockets, timers (timerfd) and
+ * cross-thread wakeups (eventfd) are all descriptors with a handler, so
+ * one thread can serve every engine: the DNS and DHCP sockets, scan
+ * capture, ARP refresh timers and the root helper's control input.
+ * Engines that scale across cores run one reactor per worker thread.
+ *
+ * Descriptors and timers are registered and removed on the reactor's own
+ * thread, or from any thread while it is not running; other threads go
+ * through reactor_call. reactor_stop may be called from anywhere and wakes
+ * the loop at once. Handlers must not block.
+ */
+struct Reactor;
+struct ReactorTimer;
+
+/**
+ * Readiness handler; events is the epoll mask (EPOLLIN, EPOLLERR, ...)
+ */
+typedef void (*ReactorFdHandler)(void *ctx, uint32_t events);
+typedef void (*ReactorTimerHandler)(void *ctx);
+typedef void (*ReactorTask)(void *ctx);
+
+/**
+ * An owner whose descriptors change from one wakeup to the next, such as
+ * the DNS forwarder with its short-lived TCP connections. Before every
+ * wait the reactor collects its pollfds and timeout; after the wait it
+ * hands the results back, whether or not any fired.
+ */
+struct ReactorPollSource {
+    int (*fill)(void *ctx, struct pollfd *fds, int max_fds);
+    int (*timeout)(void *ctx);                  // Milliseconds, or -1 for none
+    void (*handle)(void *ctx, const struct pollfd *fds, int nfds);
+    void *ctx;                                  // Also identifies the source
+};
+
+/**
+ * @return The reactor, or nullptr if epoll or eventfd is unavailable
+ */
+Reactor *reactor_create();
+
+/**
+ * Free the reactor and its timers. Registered descriptors stay open; they
+ * belong to whoever added them. Must not be running.
+ */
+void reactor_destroy(Reactor *reactor);
+
+/**
+ * Call handler whenever fd is ready for events (level triggered)
+ */
+bool reactor_add_fd(Reactor *reactor, int fd, uint32_t events, ReactorFdHandler handler, void *ctx);
+
+/**
+ * Change the events fd is watched for, keeping its handler
+ */
+bool reactor_modify_fd(Reactor *reactor, int fd, uint32_t events);
+
+/**
+ * Stop watching fd. Safe from any handler, including fd's own.
+ */
+void reactor_remove_fd(Reactor *reactor, int fd);
+
+/**
+ * Call handler every interval_ms, first after one interval. Expirations
+ * missed while the loop was busy are coalesced into one call.
+ * @return The timer, or nullptr if no timerfd could be created
+ */
+ReactorTimer *reactor_add_timer(Reactor *reactor, int interval_ms, ReactorTimerHandler handler, void *ctx);
+
+/**
+ * Cancel and free a timer. Safe from any handler, including its own.
+ */
+void reactor_remove_timer(Reactor *reactor, ReactorTimer *timer);
+
+bool reactor_add_poll_source(Reactor *reactor, const ReactorPollSource& source);
+
+/**
+ * Remove the poll source registered with ctx
+ */
+void reactor_remove_poll_source(Reactor *reactor, void *ctx);
+
+/**
+ * Dispatch events on the calling thread until reactor_stop
+ */
+void reactor_run(Reactor *reactor);
+
+/**
+ * Make reactor_run return after the handler it is in, or as soon as it
+ * starts if it is not running yet. Safe from any thread.
+ */
+void reactor_stop(Reactor *reactor);
+
+/**
+ * Run task on the reactor's thread and wait for it. Runs inline when
+ * called on that thread or while the reactor is not running.
+ */
+void reactor_call(Reactor *reactor, ReactorTask task, void *ctx);
+
+#endif // REACTOR_H
@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -9,17 +10,489 @@
 #include <errno.h>
 #include "network_scan.h"
 #include "arp_operations.h"
-#include "dns_handler.h"
+#include "dns_spoofing.h"
+#include "dns_rules.h"
+#include "dns_policy.h"
+#include <mutex>
 #include "dhcp_spoofing.h"
+#include "arp_monitor.h"
+#include "reactor.h"
+#include "io_backend.h"
+#include "harpy_log.h"
+#include "harpy_metrics.h"
+#include "harpy_trace.h"
+#include "packet_capture.h"
+#include <sys/epoll.h>
+
+#define LOG_TAG "RootHelper"
 
 void print_usage(const char* prog) {
     std::cerr << "Usage: " << prog << " <command> [args...]" << std::endl;
     std::cerr << "Commands:" << std::endl;
     std::cerr << "  scan <interface> <subnet_prefix>    Scan network" << std::endl;
     std::cerr << "  mac <interface> <ip>               Get MAC for IP" << std::endl;
-    std::cerr << "  block <interface> <target_ip> <gateway_ip> <our_mac>" << std::endl;
-    std::cerr << "  dns_spoof <interface> <domain> <spoofed_ip>    DNS spoofing" << std::endl;
-    std::cerr << "  dhcp_spoof <interface> <target_mac> <spoofed_ip> <gateway_ip> [dns_server]    DHCP spoofing" << std::endl;
+    std::cerr << "  block <interface> <target_ip>[,<target_ip>...] <gateway_ip> <our_mac>" << std::endl;
+    std::cerr << "  dns_spoof <interface> <domain> <spoofed_ip> [upstream[,upstream...]] [workers]    DNS spoofing" << std::endl;
+    std::cerr << "  dns_rules <interface> <rules_file> [upstream[,upstream...]] [workers]    DNS spoofing from a rules file" << std::endl;
+    std::cerr << "      (a trailing @<ip|subnet/len|mac> on a rules line scopes it to one client)" << std::endl;
+    std::cerr << "      (dns_spoof, dns_rules and dns_block read ADD/REMOVE/CLEAR/LOAD/BLOCKLIST commands on stdin," << std::endl;
+    std::cerr << "       and TOP <minutes> [client_ip] [n] / CLIENTS <minutes> [n] / RECENT [n] analytics requests)" << std::endl;
+    std::cerr << "      (block, block_all, dhcp_*, monitor and the DNS commands answer STATS on stdin with" << std::endl;
+    std::cerr << "       HARPY_STATS_COUNTER / HARPY_STATS_LATENCY lines ending in HARPY_STATS_END," << std::endl;
+    std::cerr << "       TRACE START / TRACE STOP / TRACE DUMP <file.json> for a Chrome trace, and" << std::endl;
+    std::cerr << "       CAPTURE START [ring_kb] [snaplen] [filter] / CAPTURE STOP / CAPTURE DUMP <file.pcapng>" << std::endl;
+    std::cerr << "       to record the packets they send and receive; filter is e.g. \"udp and port 53\")" << std::endl;
+    std::cerr << "  dns_block <interface> <blocklist.idx> [nxdomain|zero] [upstream[,upstream...]] [workers]    Sinkhole a compiled blocklist" << std::endl;
+    std::cerr << "  blocklist_compile <output.idx> <hosts_or_list_file> [file...]    Build a blocklist index" << std::endl;
+    std::cerr << "  dhcp_spoof <interface> <target_mac>[,<target_mac>...] <spoofed_ip>[,<spoofed_ip>...] <gateway_ip> [dns_server]    DHCP spoofing" << std::endl;
+    std::cerr << "  dhcp_pool <interface> <first_ip>-<last_ip> <gateway_ip> [dns_server] [lease_seconds] [journal] [mac=ip,...]    DHCP lease pool" << std::endl;
+    std::cerr << "  monitor <interface> [gateway_ip]    Passive ARP anomaly monitor" << std::endl;
+    std::cerr << "Environment:" << std::endl;
+    std::cerr << "  HARPY_IO_BACKEND=io_uring    Packet I/O through io_uring where the kernel allows it" << std::endl;
+    std::cerr << "  HARPY_STATS=1    Print the STATS report when a scan finishes" << std::endl;
+    std::cerr << "  HARPY_TRACE=<file.json>    Trace from startup; scan and mac write the trace when done" << std::endl;
+    std::cerr << "  HARPY_CAPTURE=<file.pcapng>    Capture from startup; scan and mac write the capture when done" << std::endl;
+}
+
+// Split a comma-separated argument, skipping empty items
+static std::vector<std::string> split_list(const char* list) {
+    std::vector<std::string> items;
+    std::string text(list);
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) comma = text.size();
+        if (comma > start) items.push_back(text.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return items;
+}
+
+static void format_mac(const uint8_t *mac, char *out, size_t out_len) {
+    snprintf(out, out_len, "%02x:%02x:%02x:%02x:%02x:%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static void print_arp_event(const ArpMonitorEvent& event) {
+    char ip[INET_ADDRSTRLEN];
+    char mac[18];
+    char prev_mac[18];
+    inet_ntop(AF_INET, &event.ip, ip, sizeof(ip));
+    format_mac(event.mac, mac, sizeof(mac));
+    format_mac(event.prev_mac, prev_mac, sizeof(prev_mac));
+
+    std::cout << "ARP_EVENT: " << arp_monitor_event_name(event.type)
+              << " ip=" << ip << " mac=" << mac << " prev_mac=" << prev_mac
+              << " count=" << event.count << std::endl;
+}
+
+// Workers report concurrently. These lines are the app's status protocol,
+// so every one is written whole and in order rather than going through the
+// lossy, rate-limited event log.
+static void print_dns_query(DnsQueryOutcome outcome, const char *domain,
+                            const struct sockaddr_in *client, size_t size) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->sin_addr, client_ip, sizeof(client_ip));
+
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    switch (outcome) {
+        case DnsQueryOutcome::SPOOFED:
+            std::cout << "DNS_SPOOF_MATCH: Query for '" << domain << "' matches rule, sending spoofed response" << std::endl;
+            std::cout << "DNS_SPOOF_RESPONSE_SENT: Sent " << size << " bytes to " << client_ip << std::endl;
+            break;
+        case DnsQueryOutcome::BLOCKED:
+            std::cout << "DNS_QUERY_BLOCKED: '" << domain << "' from " << client_ip << std::endl;
+            break;
+        case DnsQueryOutcome::CACHED:
+            std::cout << "DNS_QUERY_CACHED: From " << client_ip << ", Size: " << size << " bytes" << std::endl;
+            break;
+        case DnsQueryOutcome::FORWARDED:
+            std::cout << "DNS_QUERY_FORWARDED: From " << client_ip << ", Size: " << size << " bytes" << std::endl;
+            break;
+        case DnsQueryOutcome::DROPPED:
+            std::cout << "DNS_QUERY_DROPPED: From " << client_ip << ", Size: " << size << " bytes" << std::endl;
+            break;
+    }
+}
+
+static void print_reload_stats() {
+    DnsReloadStats stats = dns_get_reload_stats();
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    std::cout << "DNS_RULES_RELOADED: rules=" << stats.rules << " build_us=" << stats.build_us
+              << " swap_us=" << stats.swap_us << std::endl;
+}
+
+static std::string format_ipv4(uint32_t addr) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    return ip;
+}
+
+// Answer an analytics request on stdout; every report ends with DNS_STATS_END.
+// Returns false if the line is not one of
+//   TOP <minutes> [client_ip] [limit] | CLIENTS <minutes> [limit] | RECENT [limit]
+static bool print_dns_stats(const std::vector<std::string>& words) {
+    const std::string& op = words[0];
+    if (op != "TOP" && op != "CLIENTS" && op != "RECENT") return false;
+    int minutes = words.size() > 1 ? atoi(words[1].c_str()) : kDnsAnalyticsMaxMinutes;
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    if (op == "TOP") {
+        uint32_t client = 0;
+        size_t limit = 10;
+        for (size_t i = 2; i < words.size(); i++) {
+            struct in_addr addr;
+            if (inet_pton(AF_INET, words[i].c_str(), &addr) == 1) {
+                client = addr.s_addr;
+            } else {
+                limit = (size_t)atoi(words[i].c_str());
+            }
+        }
+        for (const auto& entry : dns_get_top_domains(minutes, client, limit)) {
+            std::cout << "DNS_TOP_DOMAIN: domain=" << entry.domain << " count=" << entry.count
+                      << " error=" << entry.error
+                      << " client=" << (client ? format_ipv4(entry.client) : "*") << std::endl;
+        }
+        DnsAnalyticsTotals totals = dns_get_query_totals(minutes);
+        std::cout << "DNS_QUERY_TOTALS: minutes=" << minutes << " queries=" << totals.queries;
+        for (int i = 0; i < kDnsOutcomeCount; i++) {
+            std::cout << " " << dns_analytics_outcome_name((DnsQueryOutcome)i) << "=" << totals.outcomes[i];
+        }
+        std::cout << std::endl;
+    } else if (op == "CLIENTS") {
+        size_t limit = words.size() > 2 ? (size_t)atoi(words[2].c_str()) : 10;
+        for (const auto& entry : dns_get_top_clients(minutes, limit)) {
+            std::cout << "DNS_TOP_CLIENT: client=" << format_ipv4(entry.client) << " count=" << entry.count
+                      << " error=" << entry.error << std::endl;
+        }
+    } else {
+        size_t limit = words.size() > 1 ? (size_t)atoi(words[1].c_str()) : 20;
+        for (const auto& query : dns_get_recent_queries(limit)) {
+            std::cout << "DNS_RECENT_QUERY: time_ms=" << query.time_ms << " client=" << format_ipv4(query.client)
+                      << " qtype=" << query.qtype << " outcome=" << dns_analytics_outcome_name(query.outcome)
+                      << " domain=" << (query.domain.empty() ? "-" : query.domain) << std::endl;
+        }
+    }
+    std::cout << "DNS_STATS_END: " << op << std::endl;
+    return true;
+}
+
+// Answer a STATS request: every counter and latency histogram of this
+// process since it started, ending with HARPY_STATS_END
+static void print_metrics() {
+    HarpyMetricsSnapshot metrics = harpy_metrics_snapshot();
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    for (size_t i = 0; i < kHarpyCounterCount; i++) {
+        std::cout << "HARPY_STATS_COUNTER: name=" << harpy_counter_name((HarpyCounter)i)
+                  << " value=" << metrics.counters[i] << "\n";
+    }
+    for (size_t i = 0; i < kHarpyHistogramCount; i++) {
+        const HarpyLatencySummary& latency = metrics.latencies[i];
+        std::cout << "HARPY_STATS_LATENCY: name=" << harpy_histogram_name((HarpyHistogram)i)
+                  << " count=" << latency.count << " mean_ns=" << latency.mean_ns
+                  << " p50_ns=" << latency.p50_ns << " p90_ns=" << latency.p90_ns
+                  << " p99_ns=" << latency.p99_ns << " p999_ns=" << latency.p999_ns
+                  << " max_ns=" << latency.max_ns << "\n";
+    }
+    std::cout << "HARPY_STATS_END" << std::endl;
+}
+
+// Whitespace-separated words of a command line
+static std::vector<std::string> split_words(const std::string& line) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        size_t start = line.find_first_not_of(" \t\r", pos);
+        if (start == std::string::npos) break;
+        size_t end = line.find_first_of(" \t\r", start);
+        if (end == std::string::npos) end = line.size();
+        words.push_back(line.substr(start, end - start));
+        pos = end;
+    }
+    return words;
+}
+
+// TRACE START | TRACE STOP | TRACE DUMP <file>; the dump is Chrome trace
+// JSON of what was recorded since the last start
+static bool handle_trace_command(const std::vector<std::string>& words) {
+    if (words.size() == 2 && words[1] == "START") {
+        harpy_trace_start();
+    } else if (words.size() == 2 && words[1] == "STOP") {
+        harpy_trace_stop();
+    } else if (words.size() == 3 && words[1] == "DUMP") {
+        long events = harpy_trace_export(words[2].c_str());
+        if (events < 0) return false;
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "HARPY_TRACE: wrote " << events << " events to " << words[2] << std::endl;
+        return true;
+    } else {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    std::cout << "HARPY_TRACE: " << (harpy_trace_on() ? "started" : "stopped") << std::endl;
+    return true;
+}
+
+// Trace a one-shot command given HARPY_TRACE, written when it finishes
+static void write_env_trace() {
+    const char *path = getenv("HARPY_TRACE");
+    if (path && harpy_trace_export(path) < 0) {
+        std::cerr << "ERROR: Cannot write trace to " << path << std::endl;
+    }
+}
+
+static bool is_number(const std::string& word) {
+    return !word.empty() && word.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// CAPTURE START [ring_kb] [snaplen] [filter...] | CAPTURE STOP |
+// CAPTURE DUMP <file>; the dump is pcapng of what each thread's ring still
+// holds since the last start
+static bool handle_capture_command(const std::vector<std::string>& words) {
+    if (words.size() >= 2 && words[1] == "START") {
+        PacketCaptureConfig config = {kCaptureDefaultRingBytes, kCaptureDefaultSnaplen, ""};
+        size_t i = 2;
+        if (i < words.size() && is_number(words[i])) {
+            config.ring_bytes = strtoul(words[i++].c_str(), nullptr, 10) * 1024;
+        }
+        if (i < words.size() && is_number(words[i])) {
+            config.snaplen = strtoul(words[i++].c_str(), nullptr, 10);
+        }
+        for (; i < words.size(); i++) {
+            if (!config.filter.empty()) config.filter += ' ';
+            config.filter += words[i];
+        }
+        if (!packet_capture_start(config)) return false;
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "HARPY_CAPTURE: started" << std::endl;
+        return true;
+    }
+    if (words.size() == 2 && words[1] == "STOP") {
+        packet_capture_stop();
+        uint64_t captured, overwritten;
+        packet_capture_counts(&captured, &overwritten);
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "HARPY_CAPTURE: stopped after " << captured << " packets (" << overwritten << " overwritten)"
+                  << std::endl;
+        return true;
+    }
+    if (words.size() == 3 && words[1] == "DUMP") {
+        long packets = packet_capture_dump(words[2].c_str());
+        if (packets < 0) return false;
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "HARPY_CAPTURE: wrote " << packets << " packets to " << words[2] << std::endl;
+        return true;
+    }
+    return false;
+}
+
+// Capture a one-shot command given HARPY_CAPTURE, written when it finishes
+static void write_env_capture() {
+    const char *path = getenv("HARPY_CAPTURE");
+    if (path && packet_capture_dump(path) < 0) {
+        std::cerr << "ERROR: Cannot write capture to " << path << std::endl;
+    }
+}
+
+// stdin commands of the engines without their own: STATS, TRACE and CAPTURE
+static void handle_diagnostic_command(const std::string& line) {
+    std::vector<std::string> words = split_words(line);
+    if (words.empty()) return;
+    if (words.size() == 1 && words[0] == "STATS") {
+        print_metrics();
+        return;
+    }
+    if (words[0] == "TRACE" && handle_trace_command(words)) {
+        return;
+    }
+    if (words[0] == "CAPTURE" && handle_capture_command(words)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+    std::cout << "CONTROL_ERROR: " << line << std::endl;
+}
+
+// Apply rule changes written to stdin while the DNS engine keeps serving:
+//   ADD <domain> <ip> [client] | REMOVE <domain> [client] | CLEAR | LOAD <rules_file>
+//   (client is an IP, CIDR subnet or MAC the rule is scoped to)
+//   BLOCKLIST <index_file> [nxdomain|zero] | BLOCKLIST off
+//   TOP / CLIENTS / RECENT analytics requests, see print_dns_stats
+//   STATS, see print_metrics
+//   TRACE, see handle_trace_command
+//   CAPTURE, see handle_capture_command
+static void handle_dns_command(const std::string& line) {
+    std::vector<std::string> words = split_words(line);
+    if (words.empty()) return;
+
+    const std::string& op = words[0];
+    if (print_dns_stats(words)) {
+        return;
+    }
+    if (op == "STATS" && words.size() == 1) {
+        print_metrics();
+        return;
+    }
+    if (op == "TRACE" && handle_trace_command(words)) {
+        return;
+    }
+    if (op == "CAPTURE" && handle_capture_command(words)) {
+        return;
+    }
+    bool ok = true;
+    if (op == "ADD" && (words.size() == 3 || words.size() == 4)) {
+        ok = words.size() == 3 || dns_policy_valid_scope(words[3]);
+        if (ok) dns_add_rule(words[1].c_str(), words[2].c_str(), words.size() == 4 ? words[3].c_str() : nullptr);
+    } else if (op == "REMOVE" && (words.size() == 2 || words.size() == 3)) {
+        dns_remove_rule(words[1].c_str(), words.size() == 3 ? words[2].c_str() : nullptr);
+    } else if (op == "CLEAR" && words.size() == 1) {
+        dns_clear_rules();
+    } else if (op == "LOAD" && words.size() == 2) {
+        ok = dns_load_rules_file(words[1].c_str());
+    } else if (op == "BLOCKLIST" && words.size() >= 2) {
+        DnsBlockMode mode = (words.size() > 2 && words[2] == "zero") ? DnsBlockMode::ZERO_IP
+                                                                     : DnsBlockMode::NXDOMAIN;
+        ok = dns_set_blocklist(words[1] == "off" ? nullptr : words[1].c_str(), mode);
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "DNS_CONTROL_ERROR: " << line << std::endl;
+    } else if (op != "BLOCKLIST") {
+        print_reload_stats();
+    } else {
+        std::lock_guard<std::mutex> lock(harpy_event_stdout_mutex());
+        std::cout << "DNS_BLOCKLIST_UPDATED: " << words[1] << std::endl;
+    }
+}
+
+// Runs one command line read from stdin
+typedef void (*ControlHandler)(const std::string& line);
+
+// stdin bytes not yet ended by a newline
+static std::string g_control_input;
+static ControlHandler g_control_handler = nullptr;
+
+// Read what stdin has and run every complete command line. When stdin
+// closes the engine simply runs until the process is killed.
+static void on_control_input(void *ctx, uint32_t /*events*/) {
+    Reactor *reactor = (Reactor*)ctx;
+    char chunk[4096];
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n > 0) {
+        g_control_input.append(chunk, (size_t)n);
+    } else {
+        g_control_input.push_back('\n');     // The last line may lack its newline
+        reactor_remove_fd(reactor, STDIN_FILENO);
+    }
+
+    size_t start = 0;
+    size_t newline;
+    while ((newline = g_control_input.find('\n', start)) != std::string::npos) {
+        g_control_handler(g_control_input.substr(start, newline - start));
+        start = newline + 1;
+    }
+    g_control_input.erase(0, start);
+}
+
+// Serve from the reactor and take commands from stdin until it stops
+static void serve_control(Reactor *reactor, ControlHandler handler) {
+    g_control_handler = handler;
+    if (!reactor_add_fd(reactor, STDIN_FILENO, EPOLLIN, on_control_input, reactor)) {
+        // A file or /dev/null cannot be watched; read it to the end up front
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            handler(line);
+        }
+    }
+    reactor_run(reactor);
+}
+
+// A spoofing loop driven by a reactor timer
+struct arp_send_loop {
+    Reactor *reactor;
+    int sock;
+    ArpSendBatch *batch;
+    int count;
+    IoSocket *io;           // Send-only; nullptr sends with arp_batch_send
+};
+
+// Hand the prepared batch to the kernel in one submission
+static int send_round(arp_send_loop *loop) {
+    HarpyTraceScope trace("arp", "send_round");
+    trace.set_arg("frames", loop->batch->count);
+    int64_t start_ns = harpy_metrics_now_ns();
+    int sent = loop->io ? io_send_prepared(loop->io, loop->batch->msgs, loop->batch->count)
+                        : arp_batch_send(loop->sock, loop->batch);
+    harpy_metrics_record(HarpyHistogram::ARP_SEND_ROUND, harpy_metrics_now_ns() - start_ns);
+    harpy_metrics_add(HarpyCounter::ARP_FRAMES_SENT, sent > 0 ? sent : 0);
+    harpy_metrics_add(HarpyCounter::ARP_SEND_ERRORS, loop->batch->count - (sent > 0 ? sent : 0));
+    return sent;
+}
+
+// One bidirectional spoofing round per tick
+static void on_block_tick(void *ctx) {
+    arp_send_loop *loop = (arp_send_loop*)ctx;
+    if (send_round(loop) < loop->batch->count) {
+        std::cerr << "ERROR: Failed to send spoof packets" << std::endl;
+    }
+    if (++loop->count % 10 == 0) {
+        std::cout << "DEBUG: Sent " << loop->count * loop->batch->count << " spoofing packets..." << std::endl;
+    }
+}
+
+static void on_block_all_tick(void *ctx) {
+    arp_send_loop *loop = (arp_send_loop*)ctx;
+    if (send_round(loop) < loop->batch->count) {
+        std::cerr << "ERROR: Failed to send broadcast spoof packet" << std::endl;
+    }
+    if (++loop->count % 5 == 0) {
+        std::cout << "DEBUG: Sent " << loop->count << " broadcast spoofing packets..." << std::endl;
+    }
+}
+
+// Five restoration rounds ensure both sides update their cache; the
+// reactor stops one tick after the last
+static const int kUnblockRounds = 5;
+
+static void on_unblock_tick(void *ctx) {
+    arp_send_loop *loop = (arp_send_loop*)ctx;
+    if (loop->count++ < kUnblockRounds) {
+        send_round(loop);
+    } else {
+        reactor_stop(loop->reactor);
+    }
+}
+
+static void on_dhcp_status(void *ctx) {
+    int *counter = (int*)ctx;
+    (*counter)++;
+    DhcpPoolStats stats;
+    if (dhcp_get_pool_stats(&stats)) {
+        std::cout << "DHCP_POOL_STATUS: " << stats.bound << " bound " << stats.offered << " offered "
+                  << stats.free << " free " << stats.declined << " declined "
+                  << stats.reserved << " reserved" << std::endl;
+    } else {
+        std::cout << "DHCP_SPOOF_STATUS: Active - Monitoring for DHCP requests (iteration " << *counter << ")" << std::endl;
+    }
+}
+
+// Events are printed from the reactor; this only notices if capture dies
+// so the app sees the process exit
+static void on_monitor_check(void *ctx) {
+    if (!arp_monitor_is_active()) {
+        reactor_stop((Reactor*)ctx);
+    }
+}
+
+// Every long-running command is served by one reactor on the main thread
+static Reactor *create_main_reactor() {
+    Reactor *reactor = reactor_create();
+    if (!reactor) {
+        std::cerr << "ERROR: Failed to create event loop" << std::endl;
+    }
+    return reactor;
 }
 
 int main(int argc, char* argv[]) {
@@ -30,6 +503,14 @@ int main(int argc, char* argv[]) {
     }
 
     std::string command = argv[1];
+    if (getenv("HARPY_TRACE")) harpy_trace_start();
+    if (getenv("HARPY_CAPTURE")) {
+        packet_capture_start({kCaptureDefaultRingBytes, kCaptureDefaultSnaplen, ""});
+    }
+    const char *io_backend = getenv("HARPY_IO_BACKEND");
+    if (io_backend && strcmp(io_backend, "io_uring") == 0) {
+        io_set_backend(IoBackend::IO_URING);
+    }
 
     if (command == "scan") {
         if (argc < 4) {
@@ -51,6 +532,9 @@ int main(int argc, char* argv[]) {
         for (const auto& dev : devices) {
             std::cout << dev << std::endl;
         }
+        if (getenv("HARPY_STATS")) print_metrics();
+        write_env_trace();
+        write_env_capture();
     } 
     else if (command == "mac") {
         if (argc < 4) {
@@ -63,6 +547,8 @@ int main(int argc, char* argv[]) {
 
         arp_init();
         std::string mac = arp_get_mac(ip, iface);
+        write_env_trace();
+        write_env_capture();
         if (!mac.empty()) {
             std::cout << mac << std::endl;
         } else {
@@ -75,53 +561,88 @@ int main(int argc, char* argv[]) {
             return 1;
         }
         const char* iface = argv[2];
-        const char* target_ip = argv[3];
+        const char* target_list = argv[3];  // One IP or a comma-separated list
         const char* gateway_ip = argv[4];
         const char* our_mac = argv[5];
 
-        std::cout << "DEBUG: Blocking " << target_ip << " using gateway " << gateway_ip << std::endl;
-        
-        // 1. Resolve target MAC
+        std::cout << "DEBUG: Blocking " << target_list << " using gateway " << gateway_ip << std::endl;
+
+        unsigned char our_mac_bin[6];
+        struct in_addr gateway_addr;
+        if (!arp_parse_mac(our_mac, our_mac_bin) || inet_aton(gateway_ip, &gateway_addr) == 0) {
+            std::cerr << "ERROR: Invalid gateway IP or our MAC" << std::endl;
+            return 1;
+        }
+
         arp_init();
-        std::string target_mac = arp_get_mac(target_ip, iface);
-        if (target_mac.empty()) {
-            std::cerr << "ERROR: Could not resolve MAC for target " << target_ip << std::endl;
+        int ifindex;
+        int sock = arp_open_socket(iface, &ifindex);
+        if (sock < 0) {
+            std::cerr << "ERROR: Failed to open raw socket on " << iface << std::endl;
             return 1;
         }
-        std::cout << "DEBUG: Resolved target " << target_ip << " to " << target_mac << std::endl;
 
-        // 2. Resolve gateway MAC (required for bidirectional spoofing)
+        // 1. Resolve gateway MAC (required for bidirectional spoofing)
+        unsigned char gateway_mac_bin[6];
         std::string gateway_mac = arp_get_mac(gateway_ip, iface);
-        if (gateway_mac.empty()) {
+        bool have_gateway = !gateway_mac.empty() && arp_parse_mac(gateway_mac.c_str(), gateway_mac_bin);
+        if (!have_gateway) {
             std::cerr << "WARNING: Could not resolve MAC for gateway " << gateway_ip << ". Blocking might be less effective." << std::endl;
         } else {
-            std::cout << "DEBUG: Resolved gateway icon " << gateway_ip << " to " << gateway_mac << std::endl;
+            std::cout << "DEBUG: Resolved gateway " << gateway_ip << " to " << gateway_mac << std::endl;
         }
 
-        // 3. Continuous bidirectional spoofing loop
-        std::cout << "BLOCK_STARTED: " << target_ip << std::endl;
-        int count = 0;
-        while (true) {
+        // 2. Resolve each target and pre-build its frames once; the loop
+        // below only hands the finished batch to the kernel
+        static ArpSendBatch batch;
+        arp_batch_init(&batch, ifindex);
+        std::vector<std::string> blocked;
+        for (const auto& target_ip : split_list(target_list)) {
+            struct in_addr target_addr;
+            unsigned char target_mac_bin[6];
+            std::string target_mac = arp_get_mac(target_ip.c_str(), iface);
+            if (inet_aton(target_ip.c_str(), &target_addr) == 0 || target_mac.empty() ||
+                !arp_parse_mac(target_mac.c_str(), target_mac_bin)) {
+                std::cerr << "ERROR: Could not resolve MAC for target " << target_ip << std::endl;
+                continue;
+            }
+            std::cout << "DEBUG: Resolved target " << target_ip << " to " << target_mac << std::endl;
+
             // Tell target we are the gateway
             // "Target, the MAC for Gateway is [OurMac]"
-            if (!arp_send_packet(iface, gateway_ip, our_mac, target_ip, target_mac.c_str(), false)) {
-                std::cerr << "ERROR: Failed to send spoof packet to target" << std::endl;
-            }
-            
             // Tell gateway we are the target
             // "Gateway, the MAC for Target is [OurMac]"
-            if (!gateway_mac.empty()) {
-                if (!arp_send_packet(iface, target_ip, our_mac, gateway_ip, gateway_mac.c_str(), false)) {
-                    std::cerr << "ERROR: Failed to send spoof packet to gateway" << std::endl;
-                }
+            bool added = arp_batch_add_reply(&batch, our_mac_bin, gateway_addr.s_addr,
+                                             target_mac_bin, target_addr.s_addr);
+            if (added && have_gateway) {
+                added = arp_batch_add_reply(&batch, our_mac_bin, target_addr.s_addr,
+                                            gateway_mac_bin, gateway_addr.s_addr);
             }
-            
-            if (++count % 10 == 0) {
-                std::cout << "DEBUG: Sent " << count << " spoofing packets..." << std::endl;
+            if (!added) {
+                std::cerr << "WARNING: Too many targets, ignoring " << target_ip << " and later" << std::endl;
+                break;
             }
-            
-            usleep(500000); // 500ms - more aggressive
+            blocked.push_back(target_ip);
+        }
+
+        if (blocked.empty()) {
+            close(sock);
+            return 1;
+        }
+
+        // 3. Continuous bidirectional spoofing, one submission per 500ms tick - more aggressive
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            close(sock);
+            return 1;
         }
+        for (const auto& target_ip : blocked) {
+            std::cout << "BLOCK_STARTED: " << target_ip << std::endl;
+        }
+        arp_send_loop loop = {reactor, sock, &batch, 0, io_socket_attach(reactor, sock, 0, 0, nullptr, nullptr)};
+        on_block_tick(&loop);
+        reactor_add_timer(reactor, 500, on_block_tick, &loop);
+        serve_control(reactor, handle_diagnostic_command);
     }
     else if (command == "unblock") {
         if (argc < 7) {
@@ -136,19 +657,46 @@ int main(int argc, char* argv[]) {
 
         std::cout << "DEBUG: Unblocking " << target_ip << " by restoring Gateway " << gateway_ip << "..." << std::endl;
         
+        unsigned char target_mac_bin[6], gateway_mac_bin[6];
+        struct in_addr target_addr, gateway_addr;
+        if (!arp_parse_mac(target_mac, target_mac_bin) || !arp_parse_mac(gateway_mac, gateway_mac_bin) ||
+            inet_aton(target_ip, &target_addr) == 0 || inet_aton(gateway_ip, &gateway_addr) == 0) {
+            std::cerr << "ERROR: Invalid unblock addresses" << std::endl;
+            return 1;
+        }
+
         arp_init();
-        // Send 5 restoration packets to ensure both sides update their cache
-        for (int i = 0; i < 5; ++i) {
-            // Restore Target's cache: "Gateway has [GatewayMac]"
-            arp_send_packet(iface, gateway_ip, gateway_mac, target_ip, target_mac, false);
-            // Restore Gateway's cache: "Target has [TargetMac]"
-            arp_send_packet(iface, target_ip, target_mac, gateway_ip, gateway_mac, false);
-            usleep(200000); 
+        int ifindex;
+        int sock = arp_open_socket(iface, &ifindex);
+        if (sock < 0) {
+            std::cerr << "ERROR: Failed to open raw socket on " << iface << std::endl;
+            return 1;
         }
+
+        // Restore Target's cache: "Gateway has [GatewayMac]"
+        // Restore Gateway's cache: "Target has [TargetMac]"
+        static ArpSendBatch batch;
+        arp_batch_init(&batch, ifindex);
+        arp_batch_add_reply(&batch, gateway_mac_bin, gateway_addr.s_addr, target_mac_bin, target_addr.s_addr);
+        arp_batch_add_reply(&batch, target_mac_bin, target_addr.s_addr, gateway_mac_bin, gateway_addr.s_addr);
+
+        // Send the restoration rounds 200ms apart
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            close(sock);
+            return 1;
+        }
+        arp_send_loop loop = {reactor, sock, &batch, 0, io_socket_attach(reactor, sock, 0, 0, nullptr, nullptr)};
+        on_unblock_tick(&loop);
+        reactor_add_timer(reactor, 200, on_unblock_tick, &loop);
+        reactor_run(reactor);
+        io_socket_detach(loop.io);
+        reactor_destroy(reactor);
+        close(sock);
         std::cout << "UNBLOCK_FINISHED" << std::endl;
     }
     else if (command == "block_all") {
-        if (argc < 4) {
+        if (argc < 5) {
             print_usage(argv[0]);
             return 1;
         }
@@ -158,140 +706,269 @@ int main(int argc, char* argv[]) {
 
         std::cout << "DEBUG: NUCLEAR OPTION ACTIVATED. Blocking all devices by spoofing Gateway " << gateway_ip << std::endl;
 
+        unsigned char our_mac_bin[6];
+        struct in_addr gateway_addr;
+        if (!arp_parse_mac(our_mac, our_mac_bin) || inet_aton(gateway_ip, &gateway_addr) == 0) {
+            std::cerr << "ERROR: Invalid gateway IP or our MAC" << std::endl;
+            return 1;
+        }
+
         arp_init();
-        std::cout << "BLOCK_ALL_STARTED" << std::endl;
-        int count = 0;
-        while (true) {
-            // Tell EVERYONE (Broadcast) we are the gateway
-            // "Everybody, the MAC for Gateway is [OurMac]"
-            if (!arp_send_packet(iface, gateway_ip, our_mac, "255.255.255.255", "ff:ff:ff:ff:ff:ff", false)) {
-                std::cerr << "ERROR: Failed to send broadcast spoof packet" << std::endl;
-            }
+        int ifindex;
+        int sock = arp_open_socket(iface, &ifindex);
+        if (sock < 0) {
+            std::cerr << "ERROR: Failed to open raw socket on " << iface << std::endl;
+            return 1;
+        }
 
-            if (++count % 5 == 0) {
-                std::cout << "DEBUG: Sent " << count << " broadcast spoofing packets..." << std::endl;
-            }
+        // Tell EVERYONE (Broadcast) we are the gateway
+        // "Everybody, the MAC for Gateway is [OurMac]"
+        static const unsigned char kBroadcastMac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+        static ArpSendBatch batch;
+        arp_batch_init(&batch, ifindex);
+        arp_batch_add_reply(&batch, our_mac_bin, gateway_addr.s_addr, kBroadcastMac, INADDR_BROADCAST);
 
-            usleep(300000); // 300ms - very aggressive for broadcast
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            close(sock);
+            return 1;
         }
+        std::cout << "BLOCK_ALL_STARTED" << std::endl;
+        arp_send_loop loop = {reactor, sock, &batch, 0, io_socket_attach(reactor, sock, 0, 0, nullptr, nullptr)};
+        on_block_all_tick(&loop);
+        reactor_add_timer(reactor, 300, on_block_all_tick, &loop); // 300ms - very aggressive for broadcast
+        serve_control(reactor, handle_diagnostic_command);
     }
-    else if (command == "dhcp_spoof") {
-        if (argc < 6) {
+    else if (command == "dhcp_spoof" || command == "dhcp_pool") {
+        bool pool_mode = command == "dhcp_pool";
+        if (argc < (pool_mode ? 5 : 6)) {
             print_usage(argv[0]);
             return 1;
         }
-        const char* iface [[maybe_unused]] = argv[2];
-        const char* target_mac = argv[3];
-        const char* spoofed_ip = argv[4];
-        const char* gateway_ip [[maybe_unused]] = argv[5];
-        const char* dns_server [[maybe_unused]] = (argc > 6) ? argv[6] : "8.8.8.8";  // Default DNS server
-
-        std::cout << "DEBUG: Starting DHCP spoofing for " << target_mac << " -> " << spoofed_ip << std::endl;
-
-        // Create DHCP spoofing rule
-        DHCPSpoofRule rule;
-        rule.target_mac = std::string(target_mac);
-        rule.spoofed_ip = std::string(spoofed_ip);
-        rule.gateway_ip = std::string(gateway_ip);
-        rule.subnet_mask = "255.255.255.0";  // Default subnet mask
-        rule.dns_server = std::string(dns_server);
-
-        // Create a vector with the rule
+        const char* iface = argv[2];
         std::vector<DHCPSpoofRule> rules;
-        rules.push_back(rule);
-
-        std::cout << "DHCP_SPOOF_STARTED: " << target_mac << " -> " << spoofed_ip << std::endl;
+        DHCPPoolConfig pool;
+
+        if (pool_mode) {
+            // dhcp_pool <interface> <first_ip>-<last_ip> <gateway_ip> [dns_server] [lease_seconds] [journal] [mac=ip,...]
+            std::string range(argv[3]);
+            size_t dash = range.find('-');
+            if (dash == std::string::npos) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            pool.first_ip = range.substr(0, dash);
+            pool.last_ip = range.substr(dash + 1);
+            pool.gateway_ip = argv[4];
+            pool.dns_server = (argc > 5) ? argv[5] : "8.8.8.8";
+            if (argc > 6) pool.lease_seconds = (uint32_t)strtoul(argv[6], nullptr, 10);
+            if (argc > 7) pool.journal_path = argv[7];
+            if (argc > 8) {
+                for (const auto& item : split_list(argv[8])) {
+                    size_t eq = item.find('=');
+                    if (eq == std::string::npos) {
+                        std::cerr << "ERROR: Reservation must be mac=ip: " << item << std::endl;
+                        return 1;
+                    }
+                    rules.push_back({item.substr(0, eq), item.substr(eq + 1), pool.gateway_ip,
+                                     "", pool.dns_server});
+                }
+            }
+            if (!dhcp_set_pool(pool)) {
+                std::cerr << "ERROR: Invalid DHCP pool " << argv[3] << std::endl;
+                return 1;
+            }
+            std::cout << "DEBUG: Starting DHCP pool " << pool.first_ip << " - " << pool.last_ip
+                      << " with " << rules.size() << " reservations" << std::endl;
+        } else {
+            // Comma-separated MACs and IPs pair up one rule per target
+            std::vector<std::string> macs = split_list(argv[3]);
+            std::vector<std::string> ips = split_list(argv[4]);
+            const char* gateway_ip = argv[5];
+            const char* dns_server = (argc > 6) ? argv[6] : "8.8.8.8";  // Default DNS server
+            if (macs.empty() || macs.size() != ips.size()) {
+                std::cerr << "ERROR: Need one spoofed IP per target MAC" << std::endl;
+                return 1;
+            }
+            for (size_t i = 0; i < macs.size(); i++) {
+                rules.push_back({macs[i], ips[i], gateway_ip, "255.255.255.0", dns_server});
+            }
+            std::cout << "DEBUG: Starting DHCP spoofing for " << argv[3] << " -> " << argv[4] << std::endl;
+        }
 
-        // Start DHCP spoofing
+        // Start DHCP spoofing, served from this thread
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            return 1;
+        }
+        dhcp_set_reactor(reactor);
         if (!dhcp_start_spoofing(iface, rules)) {
             std::cerr << "ERROR: Failed to start DHCP spoofing" << std::endl;
             return 1;
         }
+        if (pool_mode) {
+            std::cout << "DHCP_POOL_STARTED: " << pool.first_ip << "-" << pool.last_ip << std::endl;
+        } else {
+            std::cout << "DHCP_SPOOF_STARTED: " << argv[3] << " -> " << argv[4] << std::endl;
+        }
 
+        // Status every 5 seconds
         int counter = 0;
-        while (true) {
-            counter++;
-            std::cout << "DHCP_SPOOF_STATUS: Active - Monitoring for DHCP requests (iteration " << counter << ")" << std::endl;
-            usleep(5000000); // Sleep for 5 seconds
-        }
+        on_dhcp_status(&counter);
+        reactor_add_timer(reactor, 5000, on_dhcp_status, &counter);
+        serve_control(reactor, handle_diagnostic_command);
     }
     else if (command == "dns_spoof") {
-        if (argc < 4) {
+        if (argc < 5) {
             print_usage(argv[0]);
             return 1;
         }
+        const char* iface = argv[2];
         const char* domain = argv[3];
         const char* spoofed_ip = argv[4];
 
         std::cout << "DEBUG: Starting DNS spoofing for " << domain << " -> " << spoofed_ip << std::endl;
 
-        // Create a UDP socket to listen for DNS queries
-        int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if (sockfd < 0) {
-            std::cerr << "ERROR: Failed to create DNS socket: " << strerror(errno) << std::endl;
+        // Queries the rule doesn't answer are forwarded upstream
+        if (argc > 5) {
+            dns_set_upstreams(split_list(argv[5]));
+        }
+        if (argc > 6) {
+            dns_set_workers(atoi(argv[6]));
+        }
+        dns_set_query_callback(print_dns_query);
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
             return 1;
         }
+        dns_set_reactor(reactor);
 
-        // Allow port reuse
-        int opt = 1;
-        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-        // Bind to port 53 (DNS) - this requires root privileges
-        struct sockaddr_in server_addr;
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(53);
-        server_addr.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces
+        // Create DNS spoofing rule; the domain may be a "*.suffix" wildcard
+        std::vector<DNSSpoofRule> rule_list;
+        rule_list.push_back({std::string(domain), std::string(spoofed_ip)});
 
-        if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            std::cerr << "ERROR: Failed to bind to port 53: " << strerror(errno) <<
-                         " (Try running with root privileges)" << std::endl;
-            close(sockfd);
+        // Binding port 53 requires root privileges
+        if (!dns_start_spoofing(iface, rule_list)) {
+            std::cerr << "ERROR: Failed to start DNS spoofing on port 53 (Try running with root privileges)" << std::endl;
             return 1;
         }
 
         std::cout << "DNS_SPOOF_STARTED: " << domain << " -> " << spoofed_ip << std::endl;
+        std::cout << "DNS_SPOOF_LISTENING: Waiting for DNS queries..." << std::endl;
 
-        // Create DNS spoofing rule
-        DNSSpoofRule rule;
-        rule.domain = std::string(domain);
-        rule.spoofed_ip = std::string(spoofed_ip);
+        serve_control(reactor, handle_dns_command);
+    }
+    else if (command == "dns_rules") {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* iface = argv[2];
+        const char* rules_path = argv[3];
+        if (argc > 4) {
+            dns_set_upstreams(split_list(argv[4]));
+        }
+        if (argc > 5) {
+            dns_set_workers(atoi(argv[5]));
+        }
 
-        // Buffer for DNS packets
-        char buffer[512];
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+        std::vector<DNSSpoofRule> rule_list;
+        if (!dns_rules_parse_file(rules_path, &rule_list)) {
+            std::cerr << "ERROR: Failed to read DNS rules from " << rules_path << std::endl;
+            return 1;
+        }
+        dns_set_query_callback(print_dns_query);
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            return 1;
+        }
+        dns_set_reactor(reactor);
 
-        std::cout << "DNS_SPOOF_LISTENING: Waiting for DNS queries..." << std::endl;
+        if (!dns_start_spoofing(iface, rule_list)) {
+            std::cerr << "ERROR: Failed to start DNS spoofing on port 53 (Try running with root privileges)" << std::endl;
+            return 1;
+        }
 
-        while (true) {
-            // Receive DNS query
-            ssize_t bytes_received = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-                                            (struct sockaddr*)&client_addr, &client_len);
+        std::cout << "DNS_SPOOF_STARTED: " << rule_list.size() << " rules from " << rules_path << std::endl;
+        print_reload_stats();
+        serve_control(reactor, handle_dns_command);
+    }
+    else if (command == "dns_block") {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* iface = argv[2];
+        const char* index_path = argv[3];
+        DnsBlockMode mode = (argc > 4 && strcmp(argv[4], "zero") == 0) ? DnsBlockMode::ZERO_IP
+                                                                       : DnsBlockMode::NXDOMAIN;
+        if (argc > 5) {
+            dns_set_upstreams(split_list(argv[5]));
+        }
+        if (argc > 6) {
+            dns_set_workers(atoi(argv[6]));
+        }
 
-            if (bytes_received < 0) {
-                std::cerr << "ERROR: Failed to receive DNS query: " << strerror(errno) << std::endl;
-                continue;
-            }
+        // The index is mapped, not parsed, so this is quick even for 1M names
+        if (!dns_set_blocklist(index_path, mode)) {
+            std::cerr << "ERROR: Failed to load blocklist index " << index_path << std::endl;
+            return 1;
+        }
+        dns_set_query_callback(print_dns_query);
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            return 1;
+        }
+        dns_set_reactor(reactor);
 
-            // Handle the DNS query with spoofing
-            bool response_sent = handle_dns_query_with_spoof(
-                buffer,
-                bytes_received,
-                &client_addr,
-                client_len,
-                sockfd,
-                rule
-            );
-
-            if (!response_sent) {
-                // If we didn't send a spoofed response, just log the query
-                std::string client_ip = inet_ntoa(client_addr.sin_addr);
-                std::cout << "DNS_QUERY_FORWARDED: From " << client_ip << ", Size: " << bytes_received << " bytes" << std::endl;
-            }
+        if (!dns_start_spoofing(iface, std::vector<DNSSpoofRule>())) {
+            std::cerr << "ERROR: Failed to start DNS blocking on port 53 (Try running with root privileges)" << std::endl;
+            return 1;
+        }
+
+        std::cout << "DNS_BLOCK_STARTED: " << index_path << " ("
+                  << (mode == DnsBlockMode::ZERO_IP ? "zero" : "nxdomain") << ")" << std::endl;
+
+        serve_control(reactor, handle_dns_command);
+    }
+    else if (command == "blocklist_compile") {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 1;
         }
+        std::vector<std::string> inputs(argv + 3, argv + argc);
+        size_t count = 0;
+        if (!dns_blocklist_compile(inputs, argv[2], &count)) {
+            std::cerr << "ERROR: Failed to compile blocklist into " << argv[2] << std::endl;
+            return 1;
+        }
+        std::cout << "BLOCKLIST_COMPILED: " << count << " domains -> " << argv[2] << std::endl;
+    }
+    else if (command == "monitor") {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* iface = argv[2];
+        const char* gateway_ip = (argc > 3) ? argv[3] : nullptr;
 
-        close(sockfd);
+        Reactor *reactor = create_main_reactor();
+        if (!reactor) {
+            return 1;
+        }
+        arp_monitor_init();
+        arp_monitor_set_reactor(reactor);
+        if (!arp_monitor_start(iface, gateway_ip, print_arp_event)) {
+            std::cerr << "ERROR: Failed to start ARP monitor on " << iface << std::endl;
+            return 1;
+        }
+        std::cout << "ARP_MONITOR_STARTED: " << iface << std::endl;
+
+        reactor_add_timer(reactor, 5000, on_monitor_check, reactor);
+        serve_control(reactor, handle_diagnostic_command);
+        std::cerr << "ERROR: ARP monitor stopped unexpectedly" << std::endl;
+        arp_monitor_cleanup();
+        return 1;
     }
     else {
         std::cerr << "Unknown command: " << command << std::endl;
@@ -0,0 +1,31 @@
+package com.vishal.harpy.core.utils
+
+/**
+ * A query name ranked by how often the DNS helper was asked for it. Counts
+ * are estimates: never below the true count and at most maxOvercount above.
+ */
+data class DnsTopDomain(
+    val domain: String,
+    val count: Long,
+    val maxOvercount: Long
+)
+
+/**
+ * A client ranked by how many queries it sent the DNS helper
+ */
+data class DnsTopClient(
+    val ipAddress: String,
+    val count: Long,
+    val maxOvercount: Long
+)
+
+/**
+ * One query the DNS helper answered, as reported by its RECENT command
+ */
+data class DnsRecentQuery(
+    val timeMs: Long,
+    val clientIp: String,
+    val domain: String?,    // Null if the query carried no readable name
+    val qtype: Int,
+    val outcome: String     // spoofed, blocked, cached, forwarded or dropped
+)
@@ -0,0 +1,23 @@
+package com.vishal.harpy.core.utils
+
+/**
+ * Counters and latency histograms of one root helper's engines since the
+ * helper started, as reported by its STATS command
+ */
+data class EngineMetrics(
+    val counters: Map<String, Long>,
+    val latencies: Map<String, EngineLatency>
+)
+
+/**
+ * Summary of one latency histogram; an empty histogram reports zeros
+ */
+data class EngineLatency(
+    val count: Long,
+    val meanNs: Long,
+    val p50Ns: Long,
+    val p90Ns: Long,
+    val p99Ns: Long,
+    val p999Ns: Long,
+    val maxNs: Long
+)
@@ -53,8 +53,16 @@ class DhcpRepositoryImpl @Inject constructor(
                 return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("Array sizes mismatch")))
             }
 
-            // Build the command to execute the root helper with DHCP spoofing
-            val command = arrayOf("su", "-c", "$helperPath dhcp_spoof $interfaceName ${targetMacs[0]} ${spoofedIPs[0]} ${gatewayIPs[0]} ${dnsServers[0]}")
+            if (targetMacs.isEmpty()) {
+                LogUtils.e(TAG, "No DHCP spoofing targets given")
+                return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("No targets")))
+            }
+
+            // Build the command to execute the root helper with DHCP spoofing; every target is
+            // passed as comma-separated lists, sharing the first gateway and DNS server
+            val macList = targetMacs.joinToString(",")
+            val ipList = spoofedIPs.joinToString(",")
+            val command = arrayOf("su", "-c", "$helperPath dhcp_spoof $interfaceName $macList $ipList ${gatewayIPs[0]} ${dnsServers[0]}")
 
             LogUtils.d(TAG, "Executing DHCP spoofing command: ${command.joinToString(" ")}")
 
@@ -1,6 +1,11 @@
 package com.vishal.harpy.features.dns.data.repository
 
 import com.vishal.harpy.features.dns.domain.repository.DnsRepository
+import com.vishal.harpy.core.utils.DnsRecentQuery
+import com.vishal.harpy.core.utils.DnsTopClient
+import com.vishal.harpy.core.utils.DnsTopDomain
+import com.vishal.harpy.core.utils.EngineLatency
+import com.vishal.harpy.core.utils.EngineMetrics
 import com.vishal.harpy.core.utils.NetworkResult
 import com.vishal.harpy.core.utils.NetworkError
 import com.vishal.harpy.core.utils.LogUtils
@@ -9,9 +14,13 @@ import com.vishal.harpy.features.network_monitor.domain.usecases.IsDeviceRootedU
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.withContext
 import kotlinx.coroutines.launch
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import javax.inject.Inject
 import android.content.Context
 import java.util.concurrent.ConcurrentHashMap
+import java.util.concurrent.LinkedBlockingQueue
+import java.util.concurrent.TimeUnit
 
 class DnsRepositoryImpl @Inject constructor(
     private val context: Context,
@@ -19,9 +28,17 @@ class DnsRepositoryImpl @Inject constructor(
 ) : DnsRepository {
 
     private val dnsSpoofingProcesses = ConcurrentHashMap<String, Process>()
+
+    // Replies of each helper to requests written to its stdin; the engines
+    // run in the helper, so this is the only place their analytics and
+    // metrics live
+    private val helperReplies = ConcurrentHashMap<String, LinkedBlockingQueue<String>>()
+    private val helperRequestMutex = Mutex()
     
     companion object {
         private const val TAG = "DnsRepositoryImpl"
+        private const val HELPER_REPLY_TIMEOUT_MS = 2000L
+        private val HELPER_REPLY_PREFIXES = listOf("DNS_TOP_", "DNS_RECENT_QUERY:", "DNS_QUERY_TOTALS:", "DNS_STATS_END:", "HARPY_STATS_")
     }
 
     override suspend fun startDNSSpoofing(domain: String, spoofedIP: String, interfaceName: String): NetworkResult<Boolean> = withContext(Dispatchers.IO) {
@@ -50,7 +67,9 @@ class DnsRepositoryImpl @Inject constructor(
             LogUtils.d(TAG, "Executing DNS spoofing command: ${command.joinToString(" ")}")
 
             val process = Runtime.getRuntime().exec(command)
+            val replies = LinkedBlockingQueue<String>()
             dnsSpoofingProcesses[processKey] = process
+            helperReplies[processKey] = replies
 
             // Handle output streams
             val inputStream = process.inputStream
@@ -63,6 +82,10 @@ class DnsRepositoryImpl @Inject constructor(
                     while (process.isAlive) {
                         val line = reader.readLine()
                         if (line != null) {
+                            if (HELPER_REPLY_PREFIXES.any { line.startsWith(it) }) {
+                                replies.offer(line)
+                                continue
+                            }
                             LogUtils.d(TAG, "DNS Spoofing Output: $line")
                             if (line.contains("DNS_SPOOF_STARTED")) {
                                 LogUtils.i(TAG, "DNS spoofing started successfully for $domain -> $spoofedIP")
@@ -125,6 +148,7 @@ class DnsRepositoryImpl @Inject constructor(
             if (process != null && process.isAlive) {
                 process.destroyForcibly()
                 dnsSpoofingProcesses.remove(processKey)
+                helperReplies.remove(processKey)
                 LogUtils.i(TAG, "DNS spoofing stopped for domain: $domain")
                 NetworkResult.success(true)
             } else {
@@ -142,4 +166,120 @@ class DnsRepositoryImpl @Inject constructor(
         val process = dnsSpoofingProcesses[processKey]
         return process != null && process.isAlive
     }
+
+    override suspend fun getTopDomains(domain: String, minutes: Int, clientIP: String?, limit: Int): NetworkResult<List<DnsTopDomain>> = withContext(Dispatchers.IO) {
+        val command = listOfNotNull("TOP", minutes.toString(), clientIP, limit.toString()).joinToString(" ")
+        val lines = requestFromHelper(domain, command, "DNS_STATS_END:")
+            ?: return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("DNS helper for $domain did not answer $command")))
+        NetworkResult.success(lines.filter { it.startsWith("DNS_TOP_DOMAIN:") }.map { line ->
+            val fields = parseFields(line)
+            DnsTopDomain(
+                domain = fields["domain"] ?: "",
+                count = fields["count"]?.toLongOrNull() ?: 0,
+                maxOvercount = fields["error"]?.toLongOrNull() ?: 0
+            )
+        })
+    }
+
+    override suspend fun getTopClients(domain: String, minutes: Int, limit: Int): NetworkResult<List<DnsTopClient>> = withContext(Dispatchers.IO) {
+        val command = "CLIENTS $minutes $limit"
+        val lines = requestFromHelper(domain, command, "DNS_STATS_END:")
+            ?: return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("DNS helper for $domain did not answer $command")))
+        NetworkResult.success(lines.filter { it.startsWith("DNS_TOP_CLIENT:") }.map { line ->
+            val fields = parseFields(line)
+            DnsTopClient(
+                ipAddress = fields["client"] ?: "",
+                count = fields["count"]?.toLongOrNull() ?: 0,
+                maxOvercount = fields["error"]?.toLongOrNull() ?: 0
+            )
+        })
+    }
+
+    override suspend fun getRecentQueries(domain: String, limit: Int): NetworkResult<List<DnsRecentQuery>> = withContext(Dispatchers.IO) {
+        val command = "RECENT $limit"
+        val lines = requestFromHelper(domain, command, "DNS_STATS_END:")
+            ?: return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("DNS helper for $domain did not answer $command")))
+        NetworkResult.success(lines.filter { it.startsWith("DNS_RECENT_QUERY:") }.map { line ->
+            val fields = parseFields(line)
+            DnsRecentQuery(
+                timeMs = fields["time_ms"]?.toLongOrNull() ?: 0,
+                clientIp = fields["client"] ?: "",
+                domain = fields["domain"]?.takeIf { it != "-" },
+                qtype = fields["qtype"]?.toIntOrNull() ?: 0,
+                outcome = fields["outcome"] ?: ""
+            )
+        })
+    }
+
+    override suspend fun getEngineMetrics(domain: String): NetworkResult<EngineMetrics> = withContext(Dispatchers.IO) {
+        val lines = requestFromHelper(domain, "STATS", "HARPY_STATS_END")
+            ?: return@withContext NetworkResult.error(NetworkError.CommandExecutionError(Exception("DNS helper for $domain did not answer STATS")))
+        val counters = mutableMapOf<String, Long>()
+        val latencies = mutableMapOf<String, EngineLatency>()
+        for (line in lines) {
+            val fields = parseFields(line)
+            val name = fields["name"] ?: continue
+            if (line.startsWith("HARPY_STATS_COUNTER:")) {
+                counters[name] = fields["value"]?.toLongOrNull() ?: 0
+            } else if (line.startsWith("HARPY_STATS_LATENCY:")) {
+                latencies[name] = EngineLatency(
+                    count = fields["count"]?.toLongOrNull() ?: 0,
+                    meanNs = fields["mean_ns"]?.toLongOrNull() ?: 0,
+                    p50Ns = fields["p50_ns"]?.toLongOrNull() ?: 0,
+                    p90Ns = fields["p90_ns"]?.toLongOrNull() ?: 0,
+                    p99Ns = fields["p99_ns"]?.toLongOrNull() ?: 0,
+                    p999Ns = fields["p999_ns"]?.toLongOrNull() ?: 0,
+                    maxNs = fields["max_ns"]?.toLongOrNull() ?: 0
+                )
+            }
+        }
+        NetworkResult.success(EngineMetrics(counters, latencies))
+    }
+
+    /**
+     * Write a command to the stdin of the helper spoofing domain and collect
+     * its reply lines up to the one starting with endMarker, which is not
+     * included. Requests are serialized so replies cannot interleave.
+     * @return null if no helper is running or it did not answer in time
+     */
+    private suspend fun requestFromHelper(domain: String, command: String, endMarker: String): List<String>? {
+        val processKey = "dns_$domain"
+        val process = dnsSpoofingProcesses[processKey]
+        val replies = helperReplies[processKey]
+        if (process == null || !process.isAlive || replies == null) {
+            LogUtils.w(TAG, "No active DNS spoofing process found for domain: $domain")
+            return null
+        }
+        return helperRequestMutex.withLock {
+            try {
+                replies.clear()     // Late lines of a request that timed out
+                process.outputStream.write("$command\n".toByteArray())
+                process.outputStream.flush()
+
+                val lines = mutableListOf<String>()
+                val deadline = System.currentTimeMillis() + HELPER_REPLY_TIMEOUT_MS
+                var done = false
+                while (!done) {
+                    val remaining = deadline - System.currentTimeMillis()
+                    val line = if (remaining > 0) replies.poll(remaining, TimeUnit.MILLISECONDS) else null
+                    if (line == null) {
+                        LogUtils.e(TAG, "DNS helper did not answer: $command")
+                        return@withLock null
+                    }
+                    if (line.startsWith(endMarker)) done = true else lines.add(line)
+                }
+                lines
+            } catch (e: Exception) {
+                LogUtils.e(TAG, "Error requesting $command from DNS helper: ${e.message}", e)
+                null
+            }
+        }
+    }
+
+    // Fields of a "NAME: key=value key=value" helper line; values hold no spaces
+    private fun parseFields(line: String): Map<String, String> =
+        line.substringAfter(": ").split(' ').mapNotNull { field ->
+            val eq = field.indexOf('=')
+            if (eq > 0) field.substring(0, eq) to field.substring(eq + 1) else null
+        }.toMap()
 }
@@ -1,9 +1,38 @@
 package com.vishal.harpy.features.dns.domain.repository
 
+import com.vishal.harpy.core.utils.DnsRecentQuery
+import com.vishal.harpy.core.utils.DnsTopClient
+import com.vishal.harpy.core.utils.DnsTopDomain
+import com.vishal.harpy.core.utils.EngineMetrics
 import com.vishal.harpy.core.utils.NetworkResult
 
 interface DnsRepository {
     suspend fun startDNSSpoofing(domain: String, spoofedIP: String, interfaceName: String): NetworkResult<Boolean>
     suspend fun stopDNSSpoofing(domain: String): NetworkResult<Boolean>
     fun isDNSSpoofingActive(domain: String): Boolean
+
+    /**
+     * Heaviest query names seen by the helper spoofing domain
+     * @param minutes Window to rank over, 1 to 60
+     * @param clientIP Only queries from this client, or null for every client
+     */
+    suspend fun getTopDomains(domain: String, minutes: Int, clientIP: String?, limit: Int): NetworkResult<List<DnsTopDomain>>
+
+    /**
+     * Clients sending the most queries to the helper spoofing domain
+     * @param minutes Window to rank over, 1 to 60
+     */
+    suspend fun getTopClients(domain: String, minutes: Int, limit: Int): NetworkResult<List<DnsTopClient>>
+
+    /**
+     * Most recent queries answered by the helper spoofing domain, newest first
+     */
+    suspend fun getRecentQueries(domain: String, limit: Int): NetworkResult<List<DnsRecentQuery>>
+
+    /**
+     * Packet, DNS and I/O counters and latency histograms of the helper
+     * spoofing domain. The engines run in that helper, not in the app, so
+     * the numbers cover that helper process only.
+     */
+    suspend fun getEngineMetrics(domain: String): NetworkResult<EngineMetrics>
 }